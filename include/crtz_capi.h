@@ -0,0 +1,153 @@
+#ifndef CRTZ_CAPI_H
+#define CRTZ_CAPI_H
+
+/*
+  Stable C interface to the CRTZ interpreter (libcrtz.so / crtz.dll).
+  Everything is reached through opaque handles, so C#, Python (ctypes/cffi)
+  and other runtimes can run dialogues in-process.
+
+  Strings handed out as crtz_str are views into interpreter-owned memory:
+  they are not NUL-terminated and stay valid until the next call on the
+  same session (or until the owning handle is freed).
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+  #ifdef CRTZ_BUILD_DLL
+    #define CRTZ_API __declspec(dllexport)
+  #else
+    #define CRTZ_API __declspec(dllimport)
+  #endif
+#else
+  #define CRTZ_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct crtz_engine crtz_engine;
+typedef struct crtz_script crtz_script;
+typedef struct crtz_session crtz_session;
+
+typedef struct {
+    const char* data;
+    size_t len;
+} crtz_str;
+
+typedef enum {
+    CRTZ_RUNNING = 0,
+    CRTZ_WAITING_FOR_CHOICE = 1,
+    CRTZ_FINISHED = 2,
+    CRTZ_SUSPENDED = 3,  /* out of fuel; step again to continue */
+    CRTZ_FAILED = 4      /* a limit was exceeded or the step failed; see crtz_session_error */
+} crtz_status;
+
+/* Per-session budgets; 0 means unlimited */
+typedef struct {
+    unsigned long long fuel;
+    unsigned max_call_depth;
+    size_t max_instances;
+    size_t max_string_bytes;
+} crtz_limits;
+
+/* Argument passed to a host callback: num for ints/booleans, str for string literals */
+typedef struct {
+    long long num;
+    crtz_str str;
+    int is_string;
+} crtz_value;
+
+typedef long long (*crtz_native_fn)(void* user, const crtz_value* args, size_t argc);
+typedef void (*crtz_watch_fn)(void* user, const char* name, const crtz_value* value);
+
+/* ---- Engine ---- */
+CRTZ_API crtz_engine* crtz_engine_new(void);
+CRTZ_API void crtz_engine_free(crtz_engine* engine);
+/* Bindings apply to scripts compiled afterwards. Returns 0 on success. */
+CRTZ_API int crtz_engine_bind(crtz_engine* engine, const char* name, size_t arity, crtz_native_fn fn, void* user);
+/* Limits for sessions created afterwards */
+CRTZ_API void crtz_engine_set_limits(crtz_engine* engine, const crtz_limits* limits);
+/* Crash-safe autosave: journal sessions to path (0 on success, -1 on error),
+   then per session save under id. crtz_session_autosave returns 1 when a
+   saved game was restored, 0 otherwise. */
+CRTZ_API int crtz_engine_enable_journal(crtz_engine* engine, const char* path);
+CRTZ_API int crtz_session_autosave(crtz_session* session, const char* id);
+/* Estimated memory of the engine's live scripts and sessions, by subsystem:
+   the total in bytes, or a table written to path (0 on success, -1 on error) */
+CRTZ_API size_t crtz_engine_memory_bytes(const crtz_engine* engine);
+CRTZ_API int crtz_engine_memory_write(const crtz_engine* engine, const char* path);
+
+/* ---- Script (compiled once, shared by sessions) ---- */
+CRTZ_API crtz_script* crtz_compile(crtz_engine* engine, const char* source, size_t len);
+CRTZ_API crtz_script* crtz_compile_file(crtz_engine* engine, const char* path);
+CRTZ_API int crtz_script_valid(const crtz_script* script);
+CRTZ_API void crtz_script_free(crtz_script* script);
+/* Story graph as Graphviz DOT (json = 0) or JSON, written to path; with a
+   session that called crtz_session_record_graph, annotated with its visits,
+   node times and edge counts. Returns 0 on success, -1 on error. */
+CRTZ_API int crtz_script_write_graph(const crtz_script* script, const crtz_session* stats, const char* path, int json);
+
+/* ---- Session ---- */
+CRTZ_API crtz_session* crtz_session_new(const crtz_script* script, const char* player_name);
+CRTZ_API void crtz_session_free(crtz_session* session);
+
+/* Runs until a choice is needed or the dialogue ends. CRTZ_FAILED for a
+   NULL session, and from then on for a session whose step failed inside
+   the interpreter (crtz_session_error says why). */
+CRTZ_API crtz_status crtz_session_step(crtz_session* session);
+CRTZ_API crtz_status crtz_session_status(const crtz_session* session);
+/* Text written by the last step */
+CRTZ_API crtz_str crtz_session_output(const crtz_session* session);
+CRTZ_API crtz_str crtz_session_node(const crtz_session* session);
+/* Reason for CRTZ_SUSPENDED / CRTZ_FAILED; "no session" for NULL */
+CRTZ_API crtz_str crtz_session_error(const crtz_session* session);
+CRTZ_API void crtz_session_set_limits(crtz_session* session, const crtz_limits* limits);
+/* Translation file ("key<TAB>text" lines or compiled .crtzl); NULL or "" for the
+   script's own text. Returns 0 on success, -1 if it cannot be loaded. */
+CRTZ_API int crtz_session_set_language(crtz_session* session, const char* file);
+/* Seeds rand(), chance() and dice rolls; a seed and the same choices replay a run */
+CRTZ_API void crtz_session_seed(crtz_session* session, uint64_t seed);
+
+CRTZ_API size_t crtz_session_choice_count(const crtz_session* session);
+CRTZ_API int crtz_session_choice_id(const crtz_session* session, size_t index);
+CRTZ_API crtz_str crtz_session_choice_text(const crtz_session* session, size_t index);
+/* Optional: precompute every choice's outcome while the player reads the menu.
+   Call from idle time (any thread, but not concurrently with other calls on
+   this session); the following choose + step then cost almost nothing. */
+CRTZ_API void crtz_session_speculate(crtz_session* session);
+/* Returns 0 on success, -1 for an unknown choice id */
+CRTZ_API int crtz_session_choose(crtz_session* session, int id);
+/* Counts node visits, node time and edges taken (see crtz_script_write_graph) */
+CRTZ_API void crtz_session_record_graph(crtz_session* session, int on);
+
+/* Variables; "inst.field" addresses object fields. Return 0 on success, -1 if missing. */
+CRTZ_API int crtz_session_get_int(const crtz_session* session, const char* name, long long* out);
+CRTZ_API int crtz_session_set_int(crtz_session* session, const char* name, long long value);
+CRTZ_API int crtz_session_get_string(crtz_session* session, const char* name, crtz_str* out);
+CRTZ_API int crtz_session_set_string(crtz_session* session, const char* name, const char* value, size_t len);
+
+/* Calls fn at the end of each step in which the variable changed (once per step).
+   Returns a watch id, or -1 on error. */
+CRTZ_API int crtz_session_watch(crtz_session* session, const char* name, crtz_watch_fn fn, void* user);
+CRTZ_API void crtz_session_unwatch(crtz_session* session, int id);
+
+/* Process-wide metrics (latency percentiles, node/method/choice counts) in
+   Prometheus text format: written to a file, or served over HTTP on a port.
+   Return 0 on success, -1 on error. */
+CRTZ_API int crtz_metrics_write(const char* path);
+CRTZ_API int crtz_metrics_serve(unsigned short port);
+
+/* Sampling CPU profiler over script locations (POSIX): start at hz samples per
+   second of CPU time, stop, then write the report. Return 0 on success, -1 on error. */
+CRTZ_API int crtz_profile_start(unsigned hz);
+CRTZ_API void crtz_profile_stop(void);
+CRTZ_API int crtz_profile_write(const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CRTZ_CAPI_H
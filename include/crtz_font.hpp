@@ -0,0 +1,56 @@
+#ifndef CRTZ_FONT_HPP
+#define CRTZ_FONT_HPP
+
+// Built-in bitmap font and text layout for dialogue drawn in the image
+// window (see ImageDriver::setText).
+//
+// The font is 8x8 pixels per glyph, printable ASCII only. An atlas for a
+// glyph size is the font scaled to that size (nearest pixel, so it stays
+// sharp) with one fully opaque cell for solid fills; the driver turns it
+// into a texture once per size. Layout wraps text at word boundaries and
+// only depends on the text, the size and the width, so it can be cached.
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace CRTZ {
+
+    constexpr int kFontFirst = 32;        // ' '
+    constexpr int kFontGlyphs = 95;       // ' ' .. '~'
+    constexpr int kFontSolid = kFontGlyphs;  // atlas cell that is all ink
+    constexpr int kAtlasColumns = 16;
+    constexpr int kAtlasRows = 6;
+
+    // Rows top to bottom, bit 0 is the leftmost pixel
+    extern const uint8_t kFont8x8[kFontGlyphs][8];
+
+    // kAtlasColumns x kAtlasRows cells of px x px, glyph g in cell
+    // (g % kAtlasColumns, g / kAtlasColumns): white RGBA bytes with the
+    // glyph in alpha
+    struct FontAtlas {
+        int px = 0;
+        int width = 0;
+        int height = 0;
+        std::vector<uint8_t> rgba;
+    };
+    FontAtlas buildFontAtlas(int px);
+
+    struct TextLayout {
+        struct Glyph {
+            int x, y;   // top left, relative to the first line
+            int glyph;  // atlas cell
+        };
+        std::vector<Glyph> glyphs;  // spaces are not drawn
+        int lines = 0;
+        int lineHeight = 0;
+    };
+
+    // UTF-8 text word-wrapped to maxWidth pixels with glyphs of px pixels.
+    // Typographic quotes and dashes become their ASCII forms, other
+    // characters outside ASCII '?'.
+    TextLayout layoutText(std::string_view text, int px, int maxWidth);
+
+} // namespace CRTZ
+
+#endif // CRTZ_FONT_HPP
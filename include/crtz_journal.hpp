@@ -0,0 +1,99 @@
+#ifndef CRTZ_JOURNAL_HPP
+#define CRTZ_JOURNAL_HPP
+
+// Crash-safe autosave: an append-only journal of per-session slot changes.
+//
+// A session's saved state is a set of named slots (key -> value bytes). Each
+// commit appends one record, the slots a step changed, framed with its
+// length and a CRC so a torn tail from a crash is found and cut off on the
+// next open. Sessions commit concurrently: whoever finds no write in flight
+// writes everything queued so far with one write() and one fdatasync(),
+// and every committer in that batch returns together (group commit). When
+// the journal grows past compactBytes, the current state of every session
+// is written to path.snap (via a temporary file and rename) and the journal
+// starts over. Opening replays the snapshot, then the journal. POSIX only.
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace CRTZ {
+
+    struct JournalOptions {
+        size_t compactBytes = size_t(8) << 20;  // journal size that triggers a snapshot
+        unsigned commitDelayMicros = 0;         // a batch waits this long for more committers
+    };
+
+    // Saved slots of one session
+    using JournalImage = std::unordered_map<std::string, std::string>;
+
+    // Slot changes of one session, committed together
+    class JournalRecord {
+    public:
+        void put(std::string_view key, std::string_view value);
+        void erase(std::string_view key);
+        bool empty() const { return ops_.empty(); }
+
+    private:
+        friend class Journal;
+        std::string ops_;
+    };
+
+    class Journal {
+    public:
+        static std::shared_ptr<Journal> open(const std::string& path, const JournalOptions& options = {});
+        ~Journal();
+        Journal(const Journal&) = delete;
+        Journal& operator=(const Journal&) = delete;
+
+        // State of a session as of its last commit; false if there is none
+        bool load(const std::string& id, JournalImage& out) const;
+        // Returns once the record is on disk; false on I/O error (the
+        // journal then refuses further commits)
+        bool commit(const std::string& id, const JournalRecord& record);
+        // Forgets a session, durably
+        bool drop(const std::string& id);
+        // Snapshot now instead of at compactBytes
+        bool compact();
+
+        struct Stats {
+            uint64_t records = 0;
+            uint64_t syncs = 0;        // fdatasync calls, one per batch
+            uint64_t bytes = 0;        // appended to the journal
+            uint64_t compactions = 0;
+            size_t sessions = 0;
+            size_t imageBytes = 0;     // slots held in memory for snapshots
+        };
+        Stats stats() const;
+
+    private:
+        Journal() = default;
+        bool append(const std::string& id, char kind, std::string_view ops);
+        void apply(const std::string& id, char kind, std::string_view ops);
+        bool flush(std::unique_lock<std::mutex>& lock);
+        bool snapshot(std::unique_lock<std::mutex>& lock);
+        bool replay(const std::string& data, size_t& validEnd);
+
+        std::string path_;
+        JournalOptions options_;
+        int fd_ = -1;
+
+        mutable std::mutex mutex_;
+        std::condition_variable flushed_;
+        std::unordered_map<std::string, JournalImage> images_;
+        std::string pending_;         // framed records not yet written
+        uint64_t lastSeq_ = 0;        // of the newest record
+        uint64_t durableSeq_ = 0;     // everything up to here is on disk
+        size_t journalBytes_ = 0;
+        bool flushing_ = false;
+        bool failed_ = false;
+        Stats stats_;
+    };
+
+} // namespace CRTZ
+
+#endif // CRTZ_JOURNAL_HPP
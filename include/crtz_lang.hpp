@@ -1,18 +1,379 @@
 #ifndef CRTZ_LANG_HPP
 #define CRTZ_LANG_HPP
 
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <iosfwd>
+#include <map>
+#include <vector>
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <functional>
 
 // Forward declare Program
 struct Program;
+struct SessionState;
+struct EngineResources;
+struct BatchState;
 
 namespace CRTZ {
 
+    // Value passed between scripts and native (host) functions.
+    // Script ints/booleans travel in num, string literals in str.
+    struct Value {
+        long long num = 0;
+        std::string str;
+        bool isString = false;
+
+        Value() = default;
+        Value(long long n) : num(n) {}
+        Value(std::string s) : str(std::move(s)), isString(true) {}
+    };
+
+    // Type-erased entry point for a bound host function.
+    // fn points at the stored callable, args holds exactly `arity` values.
+    using NativeThunk = Value (*)(void* fn, const Value* args);
+
+    struct NativeBinding {
+        std::string name;
+        size_t arity = 0;
+        NativeThunk thunk = nullptr;
+        std::shared_ptr<void> fn;
+    };
+
+    namespace detail {
+
+        // Signature deduction for function pointers and lambdas/functors
+        template <typename F> struct FnTraits : FnTraits<decltype(&F::operator())> {};
+        template <typename R, typename... A> struct FnTraits<R (*)(A...)> {
+            using Ret = R;
+            using Args = std::tuple<A...>;
+        };
+        template <typename C, typename R, typename... A> struct FnTraits<R (C::*)(A...)> : FnTraits<R (*)(A...)> {};
+        template <typename C, typename R, typename... A> struct FnTraits<R (C::*)(A...) const> : FnTraits<R (*)(A...)> {};
+
+        // Script value -> C++ parameter
+        template <typename T>
+        T argCast(const Value& v) {
+            using D = std::decay_t<T>;
+            if constexpr (std::is_same_v<D, bool>) return v.num != 0;
+            else if constexpr (std::is_arithmetic_v<D>) return static_cast<D>(v.num);
+            else if constexpr (std::is_same_v<D, std::string>) return v.isString ? v.str : std::to_string(v.num);
+            else if constexpr (std::is_same_v<D, std::string_view>) return std::string_view(v.str);
+            else static_assert(std::is_arithmetic_v<D>, "unsupported native argument type");
+        }
+
+        // C++ return value -> script value
+        template <typename R>
+        Value retCast(R&& r) {
+            using D = std::decay_t<R>;
+            if constexpr (std::is_arithmetic_v<D>) return Value(static_cast<long long>(r));
+            else if constexpr (std::is_same_v<D, std::string>) return Value(std::forward<R>(r));
+            else static_assert(std::is_arithmetic_v<D>, "unsupported native return type");
+        }
+
+        template <typename F, typename R, typename... A, size_t... I>
+        Value invoke(F& f, const Value* args, std::tuple<A...>*, std::index_sequence<I...>) {
+            if constexpr (std::is_void_v<R>) {
+                f(argCast<A>(args[I])...);
+                return Value();
+            } else {
+                return retCast(f(argCast<A>(args[I])...));
+            }
+        }
+
+        template <typename F>
+        Value thunk(void* fn, const Value* args) {
+            using Traits = FnTraits<F>;
+            using Args = typename Traits::Args;
+            return invoke<F, typename Traits::Ret>(*static_cast<F*>(fn), args, static_cast<Args*>(nullptr),
+                std::make_index_sequence<std::tuple_size_v<Args>>{});
+        }
+
+        template <typename F>
+        NativeBinding makeBinding(const std::string& name, F fn) {
+            NativeBinding b;
+            b.name = name;
+            b.arity = std::tuple_size_v<typename FnTraits<F>::Args>;
+            b.thunk = &thunk<F>;
+            b.fn = std::shared_ptr<void>(new F(std::move(fn)), [](void* p) { delete static_cast<F*>(p); });
+            return b;
+        }
+
+    } // namespace detail
+
+    // Per-session budgets; 0 means unlimited
+    struct Limits {
+        uint64_t fuel = 0;            // node visits + method calls per step()
+        unsigned maxCallDepth = 256;  // nested method calls
+        size_t maxInstances = 0;      // objects alive at once (including script-level new)
+        size_t maxStringBytes = 0;    // total bytes held in string variables
+    };
+
+    // Estimated memory held by an engine and everything created from it,
+    // by subsystem (see Engine::memoryStats). Bytes are the heap blocks the
+    // containers own, mapped files at their full size, textures as RGBA.
+    struct MemoryStats {
+        struct Category {
+            std::string name;
+            size_t bytes = 0;
+            size_t count = 0;  // scripts, sessions, instances, ... (see README)
+        };
+        std::vector<Category> categories;
+
+        size_t totalBytes() const;
+        // One line per category, then the total
+        void print(std::ostream& out) const;
+    };
+
+    // Traffic through a script's story graph: node visits, time spent in
+    // each node (excluding time waiting for a choice) and how often each
+    // edge was taken, as recorded by sessions (Session::recordGraph)
+    struct GraphStats {
+        struct NodeStats {
+            uint64_t visits = 0;
+            uint64_t nanos = 0;
+        };
+        std::map<std::string, NodeStats> nodes;
+        // (from, to, taken by a choice rather than a goto) -> times taken
+        std::map<std::tuple<std::string, std::string, bool>, uint64_t> edges;
+        uint64_t runs = 0;  // sessions merged in
+
+        void merge(const GraphStats& other);
+    };
+
+    enum class GraphFormat { Dot, Json };
+
+    // A dialogue text found by Script::find
+    struct TextMatch {
+        std::string node;
+        int line = 0;       // where the node is defined
+        std::string part;   // "line", "choice <id>" or "show <n>"
+        std::string text;
+    };
+
+    struct ChoiceInfo {
+        int id = 0;
+        std::string text;
+    };
+
+    // One playthrough of a compiled script. Sessions created from the same
+    // Script share its program and only copy the initial variable state.
+    class Session {
+    public:
+        // Suspended: out of fuel, the next step() continues with a fresh budget.
+        // Failed: a hard limit was hit and the session cannot continue.
+        enum Status { Running, WaitingForChoice, Finished, Suspended, Failed };
+        using Watcher = std::function<void(const std::string& name, const Value& value)>;
+
+        Session(Session&&) noexcept;
+        Session& operator=(Session&&) noexcept;
+        ~Session();
+
+        // Runs until the script needs a choice or the dialogue ends
+        Status step();
+        // Picks one of choices(); returns false for an unknown id
+        bool choose(int id);
+        // Interactive loop: step, prompt on stdin for choices, until finished
+        void run();
+        // Same, reading choice ids from input; stops at end of input
+        void run(std::istream& input);
+        // Same as run(), also showing each step's text in the image window
+        // (over the last displayed picture) and taking choices from number
+        // keys there: typed digits pick a choice as soon as they name exactly
+        // one, Enter confirms. Without a display it is run().
+        void runInWindow(int textSize = 16);
+
+        Status status() const;
+        const std::vector<ChoiceInfo>& choices() const;
+        const std::string& currentNode() const;
+        // Why the session was suspended or failed
+        const std::string& error() const;
+
+        void setLimits(const Limits& limits);
+
+        // Seeds rand(), chance() and dice literals (seed 0 by default). The
+        // same seed and the same choices replay the same run.
+        void seed(uint64_t seed);
+
+        // While waiting for a choice, runs each choice target ahead of time on
+        // a private copy of the session. choose() then adopts the matching
+        // result and the next step() only replays its output. Paths that call
+        // host functions or load/display images are not precomputed. The
+        // session must not be used from another thread meanwhile; run() does
+        // this on a worker thread while it waits for input.
+        void speculate();
+        // Saves this session under id after every step (needs
+        // Engine::enableJournal). Returns true if the journal already held
+        // a game under id and this new session now continues it; step()
+        // then shows the menu it was saved at. Finished games are dropped.
+        bool autosave(const std::string& id);
+
+        // Counts node visits, node time and edges taken from now on (turns
+        // speculation off, so every run is counted once); see Script::writeGraph
+        void recordGraph(bool on);
+        GraphStats graphStats() const;
+
+        // Show the script's text from a translation file ("key<TAB>text"
+        // lines, see Script::writeStrings) or its compiled .crtzl. The file
+        // is compiled and mapped once per engine; lines are only read when
+        // shown. Untranslated text falls back to the script; "" switches back.
+        bool setLanguage(const std::string& file);
+
+        // Script output goes here (std::cout by default)
+        void setOutput(std::ostream* out);
+        // Runtime diagnostics go here (std::cerr by default)
+        void setErrorOutput(std::ostream* err);
+        void setDebug(bool debug);
+
+        // Variables by name; "inst.field" addresses object fields
+        bool getVar(const std::string& name, Value& out) const;
+        bool setVar(const std::string& name, const Value& value);
+
+        // Observe a variable or "inst.field". Writes are flagged as they
+        // happen; at the end of step() each watch whose value changed is
+        // called once with the latest value. Returns an id for unwatch().
+        int watch(const std::string& name, Watcher fn);
+        void unwatch(int id);
+
+    private:
+        friend class Script;
+        explicit Session(std::unique_ptr<SessionState> state);
+        std::unique_ptr<SessionState> state_;
+    };
+
+    // Many copies of one script run side by side for simulation (balancing,
+    // Monte Carlo). Variables are stored as structure-of-arrays in blocks of
+    // 16 lanes and every expression is evaluated once per block for all lanes
+    // at the same node; lanes at different nodes are regrouped. Only scripts
+    // built from int/match variables, set, if/goto, signal and choices can be
+    // batched: text is not produced, and objects or host calls make the batch
+    // invalid.
+    class Batch {
+    public:
+        // Picks a choice id for a lane waiting at a menu
+        using Chooser = std::function<int(size_t lane, const std::vector<ChoiceInfo>& choices)>;
+
+        Batch(Batch&&) noexcept;
+        Batch& operator=(Batch&&) noexcept;
+        ~Batch();
+
+        bool valid() const;
+        size_t lanes() const;
+
+        // Runs every lane until it ends. A lane that visits maxNodeVisits
+        // nodes (0 = unlimited) stops as Suspended.
+        void run(const Chooser& chooser, uint64_t maxNodeVisits = 0);
+
+        // Lane i rolls exactly like a Session seeded with seed + i, so any
+        // lane can be replayed on its own (lanes start from seed 0)
+        void seed(uint64_t seed);
+
+        Session::Status status(size_t lane) const;
+        std::string currentNode(size_t lane) const;
+        bool getVar(size_t lane, const std::string& name, long long& out) const;
+        bool setVar(size_t lane, const std::string& name, long long value);
+
+    private:
+        friend class Script;
+        explicit Batch(std::unique_ptr<BatchState> state);
+        std::unique_ptr<BatchState> state_;
+    };
+
+    // A parsed and linked script, reusable for any number of sessions
+    class Script {
+    public:
+        Session newSession(const std::string& playerName) const;
+        Batch newBatch(size_t lanes) const;
+        bool valid() const;
+
+        // Every translatable text (node lines, choices, show texts) as
+        // "key<TAB>text" lines: the template for a translation file
+        void writeStrings(std::ostream& out) const;
+
+        // Nodes, choice edges and goto edges (if/else, switch cases) as
+        // Graphviz DOT or JSON. With stats, nodes carry visits and time and
+        // edges their traffic: DOT shades nodes by time and draws
+        // never-visited nodes grey.
+        void writeGraph(std::ostream& out, GraphFormat format, const GraphStats* stats = nullptr) const;
+
+        // Node lines, choices and shown text containing the words of text in
+        // a row (ignoring case and punctuation; the last word may be cut
+        // short), looked up in the word index built at compile time
+        std::vector<TextMatch> find(const std::string& text) const;
+
+    private:
+        friend class Engine;
+        std::shared_ptr<const Program> prog_;
+        std::shared_ptr<EngineResources> resources_;
+    };
+
+    // Owns what sessions share: host bindings and the image driver, which is
+    // initialized on first use instead of once per run.
+    class Engine {
+    public:
+        Engine();
+        ~Engine();
+
+        // Expose a host function to scripts, e.g. engine.bind("rollDice", rollDice).
+        // Calls are resolved to the binding when a script is linked, so the
+        // runtime cost is one indirect call plus argument conversion.
+        template <typename F>
+        void bind(const std::string& name, F fn) {
+            addNative(detail::makeBinding(name, std::move(fn)));
+        }
+
+        void addNative(NativeBinding binding);
+
+        // Budgets for sessions created afterwards (Session::setLimits overrides)
+        void setLimits(const Limits& limits);
+
+        // Keep dialogue text of scripts compiled afterwards compressed in
+        // small blocks, decoded on demand (for memory-constrained targets)
+        void setTextCompression(bool on) { compressText_ = on; }
+        // Never bring up SDL: picture commands are skipped quietly (test runs, servers)
+        void setHeadless(bool on);
+        const std::vector<NativeBinding>& natives() const { return natives_; }
+
+        // Publish each session's node, counters and the named variables to a
+        // POSIX shared-memory segment (e.g. "/crtz_state") for external
+        // observers. Affects sessions created afterwards.
+        bool enableStateExport(const std::string& name, unsigned maxSessions = 64,
+            std::vector<std::string> variables = {});
+
+        // Crash-safe autosave for sessions that call Session::autosave: each
+        // step appends only what it changed to the journal at path, and
+        // concurrent sessions share one fdatasync per batch (a batch may wait
+        // commitDelayMicros for company). Past compactBytes the journal is
+        // folded into path.snap. Opening replays both.
+        bool enableJournal(const std::string& path, unsigned commitDelayMicros = 0,
+            size_t compactBytes = size_t(8) << 20);
+
+        // Parse and link once; bindings added later do not affect the result
+        Script compile(const std::string& source) const;
+        Script compileFile(const std::string& filename) const;
+
+        void runSource(const std::string& source, const std::string& playerName, bool debug = false);
+        void runScript(const std::string& filename, const std::string& playerName, bool debug = false);
+
+        // Memory of the live scripts and sessions of this engine. Safe to call
+        // from any thread; a session is measured between steps.
+        MemoryStats memoryStats() const;
+
+    private:
+        std::vector<NativeBinding> natives_;
+        std::shared_ptr<EngineResources> resources_;
+        bool compressText_ = false;
+    };
+
     // Run a .crtz script directly from file
-    void runScript(const std::string& filename, const std::string& playerName);
+    void runScript(const std::string& filename, const std::string& playerName, bool debug = false);
 
     // Run a .crtz script from in-memory string
-    void runSource(const std::string& source, const std::string& playerName);
+    void runSource(const std::string& source, const std::string& playerName, bool debug = false);
 
 } // namespace CRTZ
 
@@ -0,0 +1,111 @@
+#ifndef CRTZ_METRICS_HPP
+#define CRTZ_METRICS_HPP
+
+// Process-wide counters and latency histograms.
+//
+// Each thread records into its own shard with relaxed loads and stores to
+// slots no other thread writes: no locks and no atomic read-modify-write on
+// the hot path. Readers add the shards up. Histograms are HDR-style, 32
+// linear sub-buckets per power of two, so a recorded value is known to
+// within about 3% anywhere in the 64-bit range. A shard outlives its thread
+// and is handed to the next new thread, so nothing recorded is lost.
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace CRTZ {
+
+    constexpr size_t kMetricsMaxCounters = 64;
+    constexpr size_t kMetricsMaxHistograms = 16;
+    constexpr unsigned kHistogramSubBits = 5;
+    constexpr size_t kHistogramBuckets = (64 - kHistogramSubBits + 1) << kHistogramSubBits;
+
+    // Bucket of a value: exact below 32, then 32 per power of two
+    inline size_t histogramBucket(uint64_t v) {
+        if (v < (1u << kHistogramSubBits)) return (size_t)v;
+        unsigned e = 63 - (unsigned)__builtin_clzll(v);
+        unsigned shift = e - kHistogramSubBits;
+        return ((size_t)(shift + 1) << kHistogramSubBits) + ((v >> shift) & ((1u << kHistogramSubBits) - 1));
+    }
+    // Largest value that falls in bucket b
+    uint64_t histogramBucketMax(size_t b);
+
+    // Summed view of one histogram
+    struct HistogramSnapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        std::vector<uint64_t> buckets;
+        // Value at quantile q (0..1), to bucket precision
+        uint64_t quantile(double q) const;
+    };
+
+    struct MetricsShard {
+        struct Histogram {
+            std::atomic<uint64_t> buckets[kHistogramBuckets];
+            std::atomic<uint64_t> sum;
+            std::atomic<uint64_t> max;
+        };
+        std::atomic<uint64_t> counters[kMetricsMaxCounters];
+        std::atomic<Histogram*> histograms[kMetricsMaxHistograms];  // allocated on first record
+    };
+
+    class Metrics {
+    public:
+        static Metrics& global();
+
+        // Registers a metric, or finds the one with that name; -1 when the
+        // registry is full. `scale` converts recorded values to the exported
+        // unit, e.g. 1e-9 for nanoseconds exported as seconds.
+        int counter(const std::string& name, const std::string& help);
+        int histogram(const std::string& name, const std::string& help, double scale = 1.0);
+
+        void add(int counter, uint64_t n = 1) {
+            if (counter < 0) return;
+            std::atomic<uint64_t>& c = shard()->counters[counter];
+            c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        void record(int histogram, uint64_t value);
+
+        uint64_t count(int counter) const;
+        HistogramSnapshot snapshot(int histogram) const;
+
+        // Prometheus text format: counters as counters, histograms as
+        // summaries with p50/p99/p999, _sum and _count
+        void writePrometheus(std::ostream& out) const;
+        // Replaces path atomically (written to path.tmp, then renamed)
+        bool writeFile(const std::string& path) const;
+        // Answers HTTP scrapes on a background thread (POSIX only), on the
+        // loopback interface unless allInterfaces. Once per process; later
+        // calls return true without starting another server.
+        bool serve(uint16_t port, bool allInterfaces = false);
+
+    private:
+        struct Def {
+            std::string name;
+            std::string help;
+            double scale = 1.0;
+        };
+
+        Metrics() = default;
+        MetricsShard* shard() { return local_ ? local_ : attach(); }
+        MetricsShard* attach();
+        int define(std::vector<Def>& defs, size_t limit, const std::string& name, const std::string& help, double scale);
+
+        static thread_local MetricsShard* local_;
+
+        mutable std::mutex mutex_;
+        std::vector<Def> counters_;
+        std::vector<Def> histograms_;
+        std::vector<MetricsShard*> shards_;  // never freed
+        std::vector<MetricsShard*> idle_;    // left by exited threads
+        std::atomic<bool> serving_{ false };
+    };
+
+} // namespace CRTZ
+
+#endif // CRTZ_METRICS_HPP
@@ -0,0 +1,54 @@
+#ifndef CRTZ_PROFILE_HPP
+#define CRTZ_PROFILE_HPP
+
+// Sampling CPU profiler for scripts.
+//
+// The interpreter keeps scriptLocation (a per-thread node / action / method
+// triple of interned ids) up to date with plain stores. While the profiler
+// runs, a SIGPROF timer interrupts whichever thread is using CPU, and the
+// handler counts that thread's current location in a fixed lock-free table:
+// no allocation, no locks, nothing done between samples. report() turns the
+// counts into a table by node and by location. POSIX only.
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+namespace CRTZ {
+
+    // Where this thread is in a script; 0 fields mean "none"
+    struct ScriptLocation {
+        volatile uint32_t node = 0;     // profileId() of the node
+        volatile uint32_t action = 0;   // index into the node's actions
+        volatile uint32_t method = 0;   // profileId() of "Class.method", innermost frame
+    };
+    // Initial-exec, so the SIGPROF handler reads it at a fixed offset from
+    // the thread pointer and never runs lazy TLS allocation
+#if defined(__GNUC__) || defined(__clang__)
+#define CRTZ_TLS_INITIAL_EXEC __attribute__((tls_model("initial-exec")))
+#else
+#define CRTZ_TLS_INITIAL_EXEC
+#endif
+    extern thread_local ScriptLocation scriptLocation CRTZ_TLS_INITIAL_EXEC;
+
+    // Process-wide id for a node or "Class.method" of one script, stable for
+    // the life of the process (0 once kProfileMaxIds names exist). Scripts
+    // sharing a node name get different ids; report() shows "script: name".
+    constexpr uint32_t kProfileMaxIds = 1u << 20;
+    uint32_t profileId(const std::string& script, const std::string& name);
+
+    class Profiler {
+    public:
+        // Samples every 1/hz seconds of process CPU time
+        static bool start(unsigned hz = 100);
+        static void stop();
+        static bool running();
+        // Clears the counts
+        static void reset();
+        // Hottest nodes, then hottest locations (at most `top` rows each)
+        static void report(std::ostream& out, size_t top = 20);
+    };
+
+} // namespace CRTZ
+
+#endif // CRTZ_PROFILE_HPP
@@ -0,0 +1,128 @@
+#ifndef CRTZ_SHM_HPP
+#define CRTZ_SHM_HPP
+
+// Shared-memory export of live session state.
+//
+// The segment is a StateHeader followed by slotCount StateSlots. Each running
+// session owns one slot and is its only writer; observers map the segment
+// read-only and copy a slot under its seqlock (retry while seq is odd or
+// changed during the copy). Reading never blocks the interpreter and needs
+// no syscall once the segment is mapped.
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace CRTZ {
+
+    constexpr uint32_t kStateMagic = 0x5A545243;  // "CRTZ"
+    constexpr uint32_t kStateVersion = 1;
+    constexpr size_t kStateMaxVars = 16;
+
+    struct StateVar {
+        char name[32];
+        int64_t value;
+    };
+
+    struct StateHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slotCount;
+        uint32_t slotSize;
+    };
+
+    struct alignas(64) StateSlot {
+        std::atomic<uint32_t> seq;    // odd while the owner is writing
+        std::atomic<uint32_t> inUse;
+        uint32_t status;              // CRTZ::Session::Status
+        uint32_t varCount;
+        uint64_t steps;
+        uint64_t nodeVisits;
+        uint64_t choices;
+        char player[32];
+        char node[64];
+        StateVar vars[kStateMaxVars];
+    };
+
+    // Plain copy of a slot as seen by a reader
+    struct StateSnapshot {
+        uint32_t status = 0;
+        uint32_t varCount = 0;
+        uint64_t steps = 0;
+        uint64_t nodeVisits = 0;
+        uint64_t choices = 0;
+        char player[32] = {};
+        char node[64] = {};
+        StateVar vars[kStateMaxVars] = {};
+    };
+
+    // Writer side: wrap every update of a slot in beginWrite/endWrite
+    inline void beginWrite(StateSlot& s) {
+        s.seq.store(s.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    inline void endWrite(StateSlot& s) {
+        s.seq.store(s.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Reader side: false if the writer kept the slot busy for every attempt
+    inline bool readSlot(const StateSlot& s, StateSnapshot& out, int attempts = 64) {
+        for (int i = 0; i < attempts; ++i) {
+            uint32_t before = s.seq.load(std::memory_order_acquire);
+            if (before & 1) continue;
+            out.status = s.status;
+            out.varCount = s.varCount < kStateMaxVars ? s.varCount : (uint32_t)kStateMaxVars;
+            out.steps = s.steps;
+            out.nodeVisits = s.nodeVisits;
+            out.choices = s.choices;
+            std::memcpy(out.player, s.player, sizeof(out.player));
+            std::memcpy(out.node, s.node, sizeof(out.node));
+            std::memcpy(out.vars, s.vars, sizeof(out.vars));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.seq.load(std::memory_order_relaxed) == before) return true;
+        }
+        return false;
+    }
+
+    // Copies a string into a fixed field, always NUL-terminated
+    inline void copyField(char* dst, size_t cap, const std::string& src) {
+        size_t n = src.size() < cap - 1 ? src.size() : cap - 1;
+        std::memcpy(dst, src.data(), n);
+        dst[n] = '\0';
+    }
+
+    // A mapped state segment (POSIX shm_open + mmap)
+    class StateSegment {
+    public:
+        ~StateSegment();
+
+        // Creates a new segment such as "/crtz_state"; nullptr on failure,
+        // including when a segment of that name already exists
+        static std::shared_ptr<StateSegment> create(const std::string& name, uint32_t slotCount);
+        // Maps an existing segment read-only for observers; nullptr on failure
+        static std::shared_ptr<StateSegment> open(const std::string& name);
+
+        // Claims a free slot for a session; nullptr when all are taken
+        StateSlot* acquireSlot();
+        void releaseSlot(StateSlot* slot);
+
+        uint32_t slotCount() const { return header_ ? header_->slotCount : 0; }
+        const StateSlot& slot(uint32_t i) const { return slots_[i]; }
+
+    private:
+        StateSegment() = default;
+        std::string name_;
+        bool owner_ = false;
+        void* base_ = nullptr;
+        size_t size_ = 0;
+        StateHeader* header_ = nullptr;
+        StateSlot* slots_ = nullptr;
+    };
+
+} // namespace CRTZ
+
+#endif // CRTZ_SHM_HPP
@@ -0,0 +1,148 @@
+#ifndef CRTZ_TABLE_HPP
+#define CRTZ_TABLE_HPP
+
+// Columnar data tables for scripts: table weapons = load_table("weapons.tsv");
+//
+// A TSV/CSV file (first line = column names) is compiled once into a binary
+// next to it, "<file>.crtzt": a TableHeader, `cols` TableColumn descriptors,
+// then each column as either `rows` int64 values or `rows + 1` uint32 string
+// offsets followed by the string bytes. A column is int when every value in
+// it parses as an integer. Rows are sorted by the "id" column if there is
+// one. The binary is mapped read-only, so the data stays out of the heap and
+// is shared by every session using the table.
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace CRTZ {
+
+    constexpr uint32_t kTableVersion = 1;
+
+    // A read-only file mapped into memory (read into the heap where mmap is
+    // unavailable). Pages are only loaded when touched.
+    class MappedFile {
+    public:
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile();
+
+        bool open(const std::string& path);
+        const char* data() const { return static_cast<const char*>(base_); }
+        size_t size() const { return size_; }
+
+    private:
+        void* base_ = nullptr;
+        size_t size_ = 0;
+        bool mapped_ = false;
+        std::vector<char> heap_;
+    };
+
+    // True when binary is missing or older than source (and source exists)
+    bool needsRebuild(const std::string& source, const std::string& binary);
+
+    struct TableHeader {
+        char magic[8];  // "CRTZTBL1"
+        uint32_t version;
+        uint32_t cols;
+        uint64_t rows;
+    };
+
+    enum TableType : uint32_t { TableInt = 0, TableString = 1 };
+
+    struct TableColumn {
+        char name[48];
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t offset;  // from the start of the file, 8-byte aligned
+        uint64_t size;
+    };
+
+    class Table {
+    public:
+        // Converts a TSV/CSV source into the binary format
+        static bool compile(const std::string& source, const std::string& binary);
+        // Maps source's compiled form, (re)building it when missing or older
+        // than source. Works with only the .crtzt present, too.
+        static std::shared_ptr<Table> load(const std::string& source);
+        static std::shared_ptr<Table> open(const std::string& binary);
+
+        size_t rows() const { return (size_t)header_->rows; }
+        size_t cols() const { return header_->cols; }
+        int column(const std::string& name) const;  // -1 if missing
+        bool isString(int col) const { return columns_[col].type == TableString; }
+
+        int64_t intAt(int col, size_t row) const {
+            return reinterpret_cast<const int64_t*>(file_.data() + columns_[col].offset)[row];
+        }
+        std::string_view stringAt(int col, size_t row) const {
+            const uint32_t* offs = reinterpret_cast<const uint32_t*>(file_.data() + columns_[col].offset);
+            const char* bytes = reinterpret_cast<const char*>(offs + rows() + 1);
+            return std::string_view(bytes + offs[row], offs[row + 1] - offs[row]);
+        }
+
+        // Row for an id: binary search on the id column, or the row number
+        // itself when the table has none. -1 if there is no such row.
+        long long findRow(long long id) const;
+        // Id of a row (its row number when there is no id column)
+        long long rowId(size_t row) const { return idColumn_ >= 0 ? intAt(idColumn_, row) : (long long)row; }
+        size_t mappedBytes() const { return file_.size(); }
+
+    private:
+        Table() = default;
+
+        MappedFile file_;
+        const TableHeader* header_ = nullptr;
+        const TableColumn* columns_ = nullptr;
+        int idColumn_ = -1;
+    };
+
+    // Translated dialogue text for one script, indexed by the script's
+    // string ids. The source has "key<TAB>text" lines (see escape()), keys as
+    // written by Script::writeStrings. It is compiled to "<file>.crtzl": a
+    // StringTableHeader, count + 1 uint32 offsets, then the text bytes. The
+    // fingerprint identifies the script's key list, so the binary is rebuilt
+    // when the script gains or loses strings.
+    struct StringTableHeader {
+        char magic[8];  // "CRTZSTR1"
+        uint32_t version;
+        uint32_t count;
+        uint64_t fingerprint;
+    };
+
+    class StringTable {
+    public:
+        static bool compile(const std::string& source, const std::string& binary,
+            const std::vector<std::string>& keys, uint64_t fingerprint);
+        // Maps the compiled form of source (or source itself if it is a
+        // .crtzl), rebuilding it when stale or built for other keys
+        static std::shared_ptr<StringTable> load(const std::string& source,
+            const std::vector<std::string>& keys, uint64_t fingerprint);
+
+        size_t size() const { return header_->count; }
+        // Empty when the id has no translation
+        std::string_view at(size_t id) const {
+            return std::string_view(bytes_ + offsets_[id], offsets_[id + 1] - offsets_[id]);
+        }
+        size_t mappedBytes() const { return file_.size(); }
+
+        // Text <-> one-line form used in the source: \\, \n and \t
+        static std::string escape(std::string_view text);
+        static std::string unescape(std::string_view text);
+
+    private:
+        StringTable() = default;
+        static std::shared_ptr<StringTable> open(const std::string& binary, uint64_t fingerprint);
+
+        MappedFile file_;
+        const StringTableHeader* header_ = nullptr;
+        const uint32_t* offsets_ = nullptr;
+        const char* bytes_ = nullptr;
+    };
+
+} // namespace CRTZ
+
+#endif // CRTZ_TABLE_HPP
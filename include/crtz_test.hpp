@@ -0,0 +1,39 @@
+#ifndef CRTZ_TEST_HPP
+#define CRTZ_TEST_HPP
+
+// Golden-transcript tests for directories of scripts (crtz test dir/).
+//
+// A test is a script with a transcript next to it: story.crtz, its expected
+// output story.expected and, optionally, the choice ids to make, one per
+// line or space separated, in story.choices. Each test runs headless on its
+// own session with output captured in memory, exactly as the interactive
+// runner would print it with that input. Tests run in parallel; the report
+// lists them in path order with timings and a diff for every failure.
+// Every session runs on a budget, so a script that never stops fails with
+// the reason instead of holding up the run; runtime messages are kept per
+// test and shown with its failure. A test that is meant to stop that way
+// has the reason in story.error ("suspended: ..." or "failed: ...").
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+namespace CRTZ {
+
+    struct TestOptions {
+        unsigned jobs = 0;            // worker threads, 0 for one per core
+        bool update = false;          // (re)write .expected files instead of comparing
+        uint64_t seed = 0;            // every session starts from this seed
+        std::string playerName = "Scott";
+        size_t diffLines = 10;        // lines of each side shown per failure
+        uint64_t fuel = 1000000;      // node visits + method calls per step (Limits::fuel)
+        unsigned maxCallDepth = 256;  // nested method calls (Limits::maxCallDepth)
+    };
+
+    // Runs every test under dir (recursively). Returns the number of failed
+    // tests, or -1 when dir cannot be read.
+    int runTests(const std::string& dir, const TestOptions& options, std::ostream& report);
+
+} // namespace CRTZ
+
+#endif // CRTZ_TEST_HPP
@@ -0,0 +1,71 @@
+#ifndef CRTZ_TEXT_HPP
+#define CRTZ_TEXT_HPP
+
+// Compressed storage for dialogue text.
+//
+// Strings (indexed by string id) are packed in id order into independent
+// blocks of about kTextBlockSize bytes. Each block is LZ-compressed against a
+// dictionary of frequent phrases trained on the whole text, so even small
+// blocks compress well, and the LZ output is Huffman-coded with one table
+// shared by all blocks. Any one block can be decoded on its own; sessions
+// read through a TextCache that keeps the last few decoded blocks.
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace CRTZ {
+
+    constexpr size_t kTextBlockSize = 2048;
+    constexpr size_t kTextDictSize = 16 * 1024;
+
+    class TextStore {
+    public:
+        static TextStore build(const std::vector<std::string_view>& texts);
+
+        size_t size() const { return start_.size(); }
+        size_t blocks() const { return blockStart_.empty() ? 0 : blockStart_.size() - 1; }
+        // Bytes held: dictionary, compressed blocks and the index
+        size_t compressedBytes() const;
+        size_t originalBytes() const { return originalBytes_; }
+
+        void decodeBlock(size_t block, std::string& out) const;
+
+    private:
+        friend class TextCache;
+        static constexpr unsigned kCodeBits = 12;  // longest Huffman code
+
+        size_t blockOf(size_t id) const;
+
+        std::string dict_;
+        std::vector<uint8_t> data_;
+        std::vector<uint32_t> blockStart_;    // into data_, blocks() + 1 entries
+        std::vector<uint32_t> blockSize_;     // decoded size
+        std::vector<uint32_t> blockLz_;       // LZ stream size (Huffman symbols)
+        std::vector<uint32_t> blockFirstId_;  // first string id in each block
+        std::vector<uint32_t> start_;         // string offset within its decoded block
+        std::vector<uint16_t> decode_;        // [next kCodeBits bits] -> symbol << 4 | code length
+        size_t originalBytes_ = 0;
+    };
+
+    // Last few decoded blocks, most recently used first
+    class TextCache {
+    public:
+        // Valid until the next call
+        std::string_view get(const TextStore& store, size_t id);
+        // Bytes held by the decoded blocks
+        size_t bytes() const;
+
+    private:
+        static constexpr size_t kSlots = 4;
+        struct Slot {
+            long long block = -1;
+            std::string text;
+        };
+        Slot slots_[kSlots];
+    };
+
+} // namespace CRTZ
+
+#endif // CRTZ_TEXT_HPP
@@ -5,10 +5,12 @@
 #include "SDL2/SDL_image.h"
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 #include <filesystem>
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 
 struct Picture {
@@ -51,6 +53,28 @@ public:
    
     bool isInitialized() const { return inited_; }
 
+    // Loaded textures and their estimated size (w * h * 4 bytes); safe to
+    // read from any thread
+    size_t textureCount() const { return textureCount_.load(std::memory_order_relaxed); }
+    size_t textureBytes() const { return textureBytes_.load(std::memory_order_relaxed); }
+
+    // Dialogue in the window (visual-novel mode). Text is drawn in a box
+    // along the bottom, over the last displayed picture, with the built-in
+    // bitmap font (crtz_font.hpp). In text mode display()/displayByIndex()
+    // only change that picture and return at once.
+    void setTextMode(bool on);
+    bool textMode() const { return textMode_; }
+    // Glyph height in pixels (16 by default); each size's atlas is built once
+    void setTextSize(int pixels);
+    void setText(std::string_view text);
+    void appendText(std::string_view text);
+    // Draws the window until a key is pressed. Returns its character
+    // ('0'-'9', '\r' for Enter, '\b' for Backspace), 0 for any other key,
+    // -1 when the window is closed or Escape is pressed.
+    int waitForKey();
+    // Draws one frame: the picture, then the text box in one geometry call
+    void present();
+
 
 private:
     bool inited_ = false;
@@ -58,6 +82,29 @@ private:
     SDL_Renderer* renderer_ = nullptr;
     std::vector<Picture> pictures_;
     bool scaleToImage_ = true;
+    std::atomic<size_t> textureCount_{0};
+    std::atomic<size_t> textureBytes_{0};
+
+    void countTexture(const Picture &p, bool added);
+
+    // Text box state. The layout (vertices and indices for the box and every
+    // glyph) is only rebuilt when the text, the size or the window changes.
+    struct Atlas { SDL_Texture* tex = nullptr; int w = 0; int h = 0; };
+    std::unordered_map<int, Atlas> atlases_;  // by glyph size
+    bool textMode_ = false;
+    int textSize_ = 16;
+    std::string text_;
+    bool layoutDirty_ = true;
+    int layoutW_ = 0, layoutH_ = 0;  // window size of the cached layout
+    std::vector<SDL_Vertex> textVertices_;
+    std::vector<int> textIndices_;
+    int background_ = -1;            // picture behind the text
+    bool backgroundOwned_ = false;   // loaded by display(path): released when replaced
+
+    bool ensureWindow(int w, int h, const std::string &title);
+    Atlas* atlasFor(int px);
+    void layoutTextBox(int winW, int winH);
+    void setBackground(int index, bool owned);
 
     static inline bool isImageExtension(const std::string &name) {
         static const std::vector<std::string> exts = { ".png", ".jpg", ".jpeg", ".bmp", ".gif" };
@@ -1,5 +1,6 @@
 // ImageDriver.cpp
 #include "image_driver.hpp"
+#include "crtz_font.hpp"
 
 ImageDriver::ImageDriver() {}
 ImageDriver::~ImageDriver() { shutdown(); }
@@ -24,6 +25,11 @@ bool ImageDriver::init() {
 
 void ImageDriver::shutdown() {
     releaseAll();
+    for (auto &kv : atlases_) {
+        countTexture(Picture{ kv.second.tex, kv.second.w, kv.second.h, "" }, false);
+        SDL_DestroyTexture(kv.second.tex);
+    }
+    atlases_.clear();
     if (renderer_) { SDL_DestroyRenderer(renderer_); renderer_ = nullptr; }
     if (window_) { SDL_DestroyWindow(window_); window_ = nullptr; }
     if (inited_) {
@@ -76,6 +82,7 @@ int ImageDriver::createPictureFromSurface(SDL_Surface* surf, const std::string &
     p.h = h;
     p.path = path;
     pictures_.push_back(p);
+    countTexture(p, true);
     int idx = (int)pictures_.size() - 1;
 
     // if we created temp renderer+window, keep renderer but hide window until display
@@ -134,6 +141,10 @@ std::vector<int> ImageDriver::loadFolder(const std::string &folderPath) {
 bool ImageDriver::display(const std::string &path) {
     int idx = loadImage(path);
     if (idx < 0) return false;
+    if (textMode_) {
+        setBackground(idx, true);
+        return true;
+    }
     bool ok = displayByIndex(idx);
     // release the temporarly loaded picture after display
     releasePicture(idx);
@@ -146,6 +157,10 @@ bool ImageDriver::displayByIndex(int index) {
         return false;
     }
     if (!init()) return false;
+    if (textMode_) {
+        setBackground(index, false);
+        return true;
+    }
 
     Picture &p = pictures_[index];
     // create window (or reuse) sized to image if requested
@@ -201,6 +216,7 @@ bool ImageDriver::displayByIndex(int index) {
 void ImageDriver::releasePicture(int index) {
     if (index < 0 || index >= (int)pictures_.size()) return;
     if (pictures_[index].tex) {
+        countTexture(pictures_[index], false);
         SDL_DestroyTexture(pictures_[index].tex);
         pictures_[index].tex = nullptr;
     }
@@ -212,9 +228,199 @@ void ImageDriver::releasePicture(int index) {
 void ImageDriver::releaseAll() {
     for (auto &p : pictures_) {
         if (p.tex) {
+            countTexture(p, false);
             SDL_DestroyTexture(p.tex);
             p.tex = nullptr;
         }
     }
     pictures_.clear();
+    background_ = -1;
+}
+
+void ImageDriver::countTexture(const Picture &p, bool added) {
+    size_t bytes = (size_t)p.w * (size_t)p.h * 4;  // as RGBA
+    if (added) {
+        textureCount_ += 1;
+        textureBytes_ += bytes;
+    } else {
+        textureCount_ -= 1;
+        textureBytes_ -= bytes;
+    }
+}
+
+// ---- Dialogue text ----
+
+void ImageDriver::setTextMode(bool on) {
+    textMode_ = on;
+    if (!on && window_) SDL_HideWindow(window_);
+}
+
+void ImageDriver::setTextSize(int pixels) {
+    pixels = std::max(8, std::min(pixels, 128));
+    if (pixels != textSize_) layoutDirty_ = true;
+    textSize_ = pixels;
+}
+
+void ImageDriver::setText(std::string_view text) {
+    text_.assign(text.data(), text.size());
+    layoutDirty_ = true;
+}
+
+void ImageDriver::appendText(std::string_view text) {
+    text_.append(text.data(), text.size());
+    layoutDirty_ = true;
+}
+
+void ImageDriver::setBackground(int index, bool owned) {
+    if (background_ >= 0 && backgroundOwned_ && background_ != index) releasePicture(background_);
+    background_ = index;
+    backgroundOwned_ = owned;
+    const Picture &p = pictures_[index];
+    if (scaleToImage_ && p.w > 0 && p.h > 0) ensureWindow(p.w, p.h, "CRTZ: " + p.path);
+}
+
+bool ImageDriver::ensureWindow(int w, int h, const std::string &title) {
+    if (!window_) {
+        window_ = SDL_CreateWindow(title.c_str(), SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, w, h, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+        if (!window_) {
+            std::cerr << "SDL_CreateWindow failed: " << SDL_GetError() << std::endl;
+            return false;
+        }
+    } else {
+        SDL_SetWindowTitle(window_, title.c_str());
+        SDL_SetWindowSize(window_, w, h);
+        SDL_ShowWindow(window_);
+    }
+    if (!renderer_) {
+        renderer_ = SDL_CreateRenderer(window_, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+        if (!renderer_) {
+            std::cerr << "SDL_CreateRenderer failed: " << SDL_GetError() << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+ImageDriver::Atlas* ImageDriver::atlasFor(int px) {
+    auto it = atlases_.find(px);
+    if (it != atlases_.end()) return &it->second;
+    CRTZ::FontAtlas font = CRTZ::buildFontAtlas(px);
+    SDL_Surface* surf = SDL_CreateRGBSurfaceWithFormatFrom(font.rgba.data(), font.width, font.height, 32, font.width * 4, SDL_PIXELFORMAT_RGBA32);
+    if (!surf) {
+        std::cerr << "Font atlas failed: " << SDL_GetError() << std::endl;
+        return nullptr;
+    }
+    SDL_Texture* tex = SDL_CreateTextureFromSurface(renderer_, surf);
+    SDL_FreeSurface(surf);
+    if (!tex) {
+        std::cerr << "Font atlas failed: " << SDL_GetError() << std::endl;
+        return nullptr;
+    }
+    SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+    Atlas &a = atlases_[px];
+    a.tex = tex;
+    a.w = font.width;
+    a.h = font.height;
+    countTexture(Picture{ a.tex, a.w, a.h, "" }, true);
+    return &a;
+}
+
+// One quad per glyph plus one for the box, sharing the atlas (the box uses
+// its solid cell), so the whole text box is a single SDL_RenderGeometry.
+// When the text is taller than half the window, its last lines are shown.
+void ImageDriver::layoutTextBox(int winW, int winH) {
+    layoutDirty_ = false;
+    layoutW_ = winW;
+    layoutH_ = winH;
+    textVertices_.clear();
+    textIndices_.clear();
+    if (text_.empty()) return;
+
+    const int px = textSize_;
+    const int margin = px / 2 + 4, pad = px / 2;
+    const int boxW = std::max(winW - 2 * margin, px + 2 * pad);
+    CRTZ::TextLayout layout = CRTZ::layoutText(text_, px, boxW - 2 * pad);
+    int maxLines = std::max(1, (winH / 2 - 2 * pad) / layout.lineHeight);
+    int first = std::max(0, layout.lines - maxLines);
+    int shown = layout.lines - first;
+    const int boxH = shown * layout.lineHeight + 2 * pad;
+    const float left = (float)margin, top = (float)(winH - margin - boxH);
+
+    const float cellU = 1.0f / CRTZ::kAtlasColumns, cellV = 1.0f / CRTZ::kAtlasRows;
+    auto quad = [&](float x, float y, float w, float h, int glyph, SDL_Color color) {
+        float u = glyph % CRTZ::kAtlasColumns * cellU, v = glyph / CRTZ::kAtlasColumns * cellV;
+        float u2 = u + cellU, v2 = v + cellV;
+        if (glyph == CRTZ::kFontSolid) {
+            // Sample the middle of the solid cell only: no filtering at its edges
+            u = u2 = u + cellU / 2;
+            v = v2 = v + cellV / 2;
+        }
+        int base = (int)textVertices_.size();
+        textVertices_.push_back({ { x, y }, color, { u, v } });
+        textVertices_.push_back({ { x + w, y }, color, { u2, v } });
+        textVertices_.push_back({ { x + w, y + h }, color, { u2, v2 } });
+        textVertices_.push_back({ { x, y + h }, color, { u, v2 } });
+        for (int i : { 0, 1, 2, 0, 2, 3 }) textIndices_.push_back(base + i);
+    };
+
+    textVertices_.reserve((layout.glyphs.size() + 1) * 4);
+    textIndices_.reserve((layout.glyphs.size() + 1) * 6);
+    quad(left, top, (float)boxW, (float)boxH, CRTZ::kFontSolid, SDL_Color{ 0, 0, 0, 200 });
+    const int skip = first * layout.lineHeight;
+    for (auto &g : layout.glyphs) {
+        if (g.y < skip) continue;
+        quad(left + pad + g.x, top + pad + g.y - skip, (float)px, (float)px, g.glyph, SDL_Color{ 255, 255, 255, 255 });
+    }
+}
+
+void ImageDriver::present() {
+    if (!renderer_) return;
+    int w = 0, h = 0;
+    SDL_GetRendererOutputSize(renderer_, &w, &h);
+    SDL_SetRenderDrawColor(renderer_, 0, 0, 0, 255);
+    SDL_RenderClear(renderer_);
+    if (background_ >= 0 && background_ < (int)pictures_.size() && pictures_[background_].tex) {
+        SDL_Rect dst = { 0, 0, w, h };
+        SDL_RenderCopy(renderer_, pictures_[background_].tex, nullptr, &dst);
+    }
+    if (layoutDirty_ || w != layoutW_ || h != layoutH_) layoutTextBox(w, h);
+    Atlas* atlas = textIndices_.empty() ? nullptr : atlasFor(textSize_);
+    if (atlas) {
+        SDL_RenderGeometry(renderer_, atlas->tex, textVertices_.data(), (int)textVertices_.size(),
+                           textIndices_.data(), (int)textIndices_.size());
+    }
+    SDL_RenderPresent(renderer_);
+}
+
+int ImageDriver::waitForKey() {
+    if (!init()) return -1;
+    if (!window_ || !renderer_) {
+        if (!ensureWindow(800, 600, "CRTZ")) return -1;
+    } else {
+        SDL_ShowWindow(window_);
+    }
+
+    // Redraw only when something changed: the first frame, a resize or an expose
+    bool redraw = true;
+    SDL_Event e;
+    while (true) {
+        while (SDL_PollEvent(&e)) {
+            if (e.type == SDL_QUIT) return -1;
+            if (e.type == SDL_WINDOWEVENT) redraw = true;
+            if (e.type != SDL_KEYDOWN) continue;
+            SDL_Keycode k = e.key.keysym.sym;
+            if (k == SDLK_ESCAPE) return -1;
+            if (k >= SDLK_0 && k <= SDLK_9) return '0' + (k - SDLK_0);
+            if (k >= SDLK_KP_1 && k <= SDLK_KP_9) return '1' + (k - SDLK_KP_1);
+            if (k == SDLK_KP_0) return '0';
+            if (k == SDLK_RETURN || k == SDLK_KP_ENTER) return '\r';
+            if (k == SDLK_BACKSPACE) return '\b';
+            return 0;
+        }
+        if (redraw) {
+            present();
+            redraw = false;
+        }
+        SDL_Delay(10);
+    }
 }
@@ -0,0 +1,376 @@
+// crtz_capi.cpp - C ABI over the CRTZ embedding API
+#include "crtz_capi.h"
+#include "crtz_lang.hpp"
+#include "crtz_metrics.hpp"
+#include "crtz_profile.hpp"
+
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// Appends everything written to it into a string the C side can view directly
+class OutputBuffer : public std::streambuf {
+public:
+    std::string text;
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (ch != traits_type::eof()) text.push_back((char)ch);
+        return ch;
+    }
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        text.append(s, (size_t)n);
+        return n;
+    }
+};
+
+struct crtz_engine {
+    CRTZ::Engine engine;
+};
+
+struct crtz_script {
+    CRTZ::Script script;
+};
+
+struct crtz_session {
+    CRTZ::Session session;
+    OutputBuffer buffer;
+    std::ostream out;
+    std::string scratch;  // backing store for crtz_session_get_string views
+    // Set when a step threw: the session's state is unknown, so it stays
+    // failed and is not stepped again
+    bool threw = false;
+    std::string failure;
+
+    explicit crtz_session(CRTZ::Session s) : session(std::move(s)), out(&buffer) {
+        session.setOutput(&out);
+    }
+
+    void fail(const char* what) noexcept {
+        threw = true;
+        try { failure = std::string("internal error: ") + what; }
+        catch (...) { failure.clear(); }
+    }
+};
+
+namespace {
+
+    struct CallbackBinding {
+        crtz_native_fn fn;
+        void* user;
+        size_t arity;
+    };
+
+    CRTZ::Value callbackThunk(void* fn, const CRTZ::Value* args) {
+        const CallbackBinding& cb = *static_cast<CallbackBinding*>(fn);
+        crtz_value small[8];
+        std::vector<crtz_value> large;
+        crtz_value* cargs = small;
+        if (cb.arity > 8) {
+            large.resize(cb.arity);
+            cargs = large.data();
+        }
+        for (size_t i = 0; i < cb.arity; ++i) {
+            cargs[i].num = args[i].num;
+            cargs[i].str = { args[i].str.data(), args[i].str.size() };
+            cargs[i].is_string = args[i].isString ? 1 : 0;
+        }
+        return CRTZ::Value(cb.fn(cb.user, cargs, cb.arity));
+    }
+
+    crtz_str view(const std::string& s) { return { s.data(), s.size() }; }
+
+    const char kNoSession[] = "no session";
+    const char kInternalError[] = "internal error";
+
+    crtz_status toC(CRTZ::Session::Status st) {
+        switch (st) {
+            case CRTZ::Session::WaitingForChoice: return CRTZ_WAITING_FOR_CHOICE;
+            case CRTZ::Session::Finished: return CRTZ_FINISHED;
+            case CRTZ::Session::Suspended: return CRTZ_SUSPENDED;
+            case CRTZ::Session::Failed: return CRTZ_FAILED;
+            default: return CRTZ_RUNNING;
+        }
+    }
+
+    CRTZ::Limits fromC(const crtz_limits& l) {
+        CRTZ::Limits out;
+        out.fuel = l.fuel;
+        out.maxCallDepth = l.max_call_depth;
+        out.maxInstances = l.max_instances;
+        out.maxStringBytes = l.max_string_bytes;
+        return out;
+    }
+
+} // namespace
+
+extern "C" {
+
+// ---- Engine ----
+
+crtz_engine* crtz_engine_new(void) {
+    try { return new crtz_engine(); }
+    catch (...) { return nullptr; }
+}
+
+void crtz_engine_free(crtz_engine* engine) { delete engine; }
+
+int crtz_engine_bind(crtz_engine* engine, const char* name, size_t arity, crtz_native_fn fn, void* user) {
+    if (!engine || !name || !fn) return -1;
+    try {
+        CRTZ::NativeBinding b;
+        b.name = name;
+        b.arity = arity;
+        b.thunk = &callbackThunk;
+        b.fn = std::make_shared<CallbackBinding>(CallbackBinding{ fn, user, arity });
+        engine->engine.addNative(std::move(b));
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+void crtz_engine_set_limits(crtz_engine* engine, const crtz_limits* limits) {
+    if (engine && limits) engine->engine.setLimits(fromC(*limits));
+}
+
+int crtz_engine_enable_journal(crtz_engine* engine, const char* path) {
+    if (!engine || !path) return -1;
+    try { return engine->engine.enableJournal(path) ? 0 : -1; }
+    catch (...) { return -1; }
+}
+
+int crtz_session_autosave(crtz_session* session, const char* id) {
+    if (!session || !id) return -1;
+    try { return session->session.autosave(id) ? 1 : 0; }
+    catch (...) { return -1; }
+}
+
+size_t crtz_engine_memory_bytes(const crtz_engine* engine) {
+    if (!engine) return 0;
+    try { return engine->engine.memoryStats().totalBytes(); }
+    catch (...) { return 0; }
+}
+
+int crtz_engine_memory_write(const crtz_engine* engine, const char* path) {
+    if (!engine || !path) return -1;
+    try {
+        std::ofstream out(path);
+        if (!out) return -1;
+        engine->engine.memoryStats().print(out);
+        return out ? 0 : -1;
+    } catch (...) {
+        return -1;
+    }
+}
+
+// ---- Script ----
+
+crtz_script* crtz_compile(crtz_engine* engine, const char* source, size_t len) {
+    if (!engine || !source) return nullptr;
+    try { return new crtz_script{ engine->engine.compile(std::string(source, len)) }; }
+    catch (...) { return nullptr; }
+}
+
+crtz_script* crtz_compile_file(crtz_engine* engine, const char* path) {
+    if (!engine || !path) return nullptr;
+    try { return new crtz_script{ engine->engine.compileFile(path) }; }
+    catch (...) { return nullptr; }
+}
+
+int crtz_script_valid(const crtz_script* script) { return script && script->script.valid() ? 1 : 0; }
+
+void crtz_script_free(crtz_script* script) { delete script; }
+
+int crtz_script_write_graph(const crtz_script* script, const crtz_session* stats, const char* path, int json) {
+    if (!script || !path) return -1;
+    try {
+        std::ofstream out(path);
+        if (!out) return -1;
+        CRTZ::GraphStats graph;
+        if (stats) graph = stats->session.graphStats();
+        script->script.writeGraph(out, json ? CRTZ::GraphFormat::Json : CRTZ::GraphFormat::Dot, stats ? &graph : nullptr);
+        return out ? 0 : -1;
+    } catch (...) {
+        return -1;
+    }
+}
+
+// ---- Session ----
+
+crtz_session* crtz_session_new(const crtz_script* script, const char* player_name) {
+    if (!script) return nullptr;
+    try { return new crtz_session(script->script.newSession(player_name ? player_name : "")); }
+    catch (...) { return nullptr; }
+}
+
+void crtz_session_free(crtz_session* session) { delete session; }
+
+crtz_status crtz_session_step(crtz_session* session) {
+    if (!session || session->threw) return CRTZ_FAILED;
+    try {
+        session->buffer.text.clear();
+        return toC(session->session.step());
+    } catch (const std::exception& e) {
+        session->fail(e.what());
+    } catch (...) {
+        session->fail("unknown exception");
+    }
+    return CRTZ_FAILED;
+}
+
+crtz_status crtz_session_status(const crtz_session* session) {
+    if (!session || session->threw) return CRTZ_FAILED;
+    return toC(session->session.status());
+}
+
+crtz_str crtz_session_output(const crtz_session* session) {
+    return session ? view(session->buffer.text) : crtz_str{ nullptr, 0 };
+}
+
+crtz_str crtz_session_node(const crtz_session* session) {
+    return session ? view(session->session.currentNode()) : crtz_str{ nullptr, 0 };
+}
+
+crtz_str crtz_session_error(const crtz_session* session) {
+    if (!session) return { kNoSession, sizeof(kNoSession) - 1 };
+    if (session->threw) {
+        if (session->failure.empty()) return { kInternalError, sizeof(kInternalError) - 1 };
+        return view(session->failure);
+    }
+    return view(session->session.error());
+}
+
+void crtz_session_set_limits(crtz_session* session, const crtz_limits* limits) {
+    if (session && limits) session->session.setLimits(fromC(*limits));
+}
+
+int crtz_session_set_language(crtz_session* session, const char* file) {
+    if (!session) return -1;
+    try { return session->session.setLanguage(file ? file : "") ? 0 : -1; }
+    catch (...) { return -1; }
+}
+
+void crtz_session_seed(crtz_session* session, uint64_t seed) {
+    if (session) session->session.seed(seed);
+}
+
+size_t crtz_session_choice_count(const crtz_session* session) {
+    return session ? session->session.choices().size() : 0;
+}
+
+int crtz_session_choice_id(const crtz_session* session, size_t index) {
+    if (!session || index >= session->session.choices().size()) return -1;
+    return session->session.choices()[index].id;
+}
+
+crtz_str crtz_session_choice_text(const crtz_session* session, size_t index) {
+    if (!session || index >= session->session.choices().size()) return { nullptr, 0 };
+    return view(session->session.choices()[index].text);
+}
+
+void crtz_session_speculate(crtz_session* session) {
+    if (!session) return;
+    try { session->session.speculate(); }
+    catch (...) {}
+}
+
+int crtz_session_choose(crtz_session* session, int id) {
+    return session && !session->threw && session->session.choose(id) ? 0 : -1;
+}
+
+void crtz_session_record_graph(crtz_session* session, int on) {
+    if (session) session->session.recordGraph(on != 0);
+}
+
+int crtz_session_get_int(const crtz_session* session, const char* name, long long* out) {
+    if (!session || !name || !out) return -1;
+    try {
+        CRTZ::Value v;
+        if (!session->session.getVar(name, v)) return -1;
+        *out = v.num;
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int crtz_session_set_int(crtz_session* session, const char* name, long long value) {
+    if (!session || !name) return -1;
+    try { return session->session.setVar(name, CRTZ::Value(value)) ? 0 : -1; }
+    catch (...) { return -1; }
+}
+
+int crtz_session_get_string(crtz_session* session, const char* name, crtz_str* out) {
+    if (!session || !name || !out) return -1;
+    try {
+        CRTZ::Value v;
+        if (!session->session.getVar(name, v)) return -1;
+        session->scratch = v.isString ? v.str : std::to_string(v.num);
+        *out = view(session->scratch);
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int crtz_session_set_string(crtz_session* session, const char* name, const char* value, size_t len) {
+    if (!session || !name || (!value && len)) return -1;
+    try { return session->session.setVar(name, CRTZ::Value(std::string(value ? value : "", len))) ? 0 : -1; }
+    catch (...) { return -1; }
+}
+
+int crtz_session_watch(crtz_session* session, const char* name, crtz_watch_fn fn, void* user) {
+    if (!session || !name || !fn) return -1;
+    try {
+        return session->session.watch(name, [fn, user](const std::string& var, const CRTZ::Value& v) {
+            crtz_value cv;
+            cv.num = v.num;
+            cv.str = view(v.str);
+            cv.is_string = v.isString ? 1 : 0;
+            fn(user, var.c_str(), &cv);
+        });
+    } catch (...) {
+        return -1;
+    }
+}
+
+void crtz_session_unwatch(crtz_session* session, int id) {
+    if (session) session->session.unwatch(id);
+}
+
+int crtz_metrics_write(const char* path) {
+    if (!path) return -1;
+    try { return CRTZ::Metrics::global().writeFile(path) ? 0 : -1; }
+    catch (...) { return -1; }
+}
+
+int crtz_metrics_serve(unsigned short port) {
+    try { return CRTZ::Metrics::global().serve(port) ? 0 : -1; }
+    catch (...) { return -1; }
+}
+
+int crtz_profile_start(unsigned hz) {
+    return CRTZ::Profiler::start(hz) ? 0 : -1;
+}
+
+void crtz_profile_stop(void) {
+    CRTZ::Profiler::stop();
+}
+
+int crtz_profile_write(const char* path) {
+    if (!path) return -1;
+    try {
+        std::ofstream out(path);
+        if (!out) return -1;
+        CRTZ::Profiler::report(out);
+        return out ? 0 : -1;
+    } catch (...) {
+        return -1;
+    }
+}
+
+} // extern "C"
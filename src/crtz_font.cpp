@@ -0,0 +1,188 @@
+// crtz_font.cpp - built-in 8x8 bitmap font, glyph atlases and text layout
+#include "crtz_font.hpp"
+
+#include <algorithm>
+
+namespace CRTZ {
+
+    // font8x8_basic by Daniel Hepper (public domain), after the IBM PC BIOS font
+    const uint8_t kFont8x8[kFontGlyphs][8] = {
+        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // ' '
+        { 0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00 },  // !
+        { 0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // "
+        { 0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00 },  // #
+        { 0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00 },  // $
+        { 0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00 },  // %
+        { 0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00 },  // &
+        { 0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '
+        { 0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00 },  // (
+        { 0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00 },  // )
+        { 0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00 },  // *
+        { 0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00 },  // +
+        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06 },  // ,
+        { 0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00 },  // -
+        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00 },  // .
+        { 0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00 },  // /
+        { 0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00 },  // 0
+        { 0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00 },  // 1
+        { 0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00 },  // 2
+        { 0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00 },  // 3
+        { 0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00 },  // 4
+        { 0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00 },  // 5
+        { 0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00 },  // 6
+        { 0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00 },  // 7
+        { 0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00 },  // 8
+        { 0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00 },  // 9
+        { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00 },  // :
+        { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06 },  // ;
+        { 0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00 },  // <
+        { 0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00 },  // =
+        { 0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00 },  // >
+        { 0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00 },  // ?
+        { 0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00 },  // @
+        { 0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00 },  // A
+        { 0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00 },  // B
+        { 0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00 },  // C
+        { 0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00 },  // D
+        { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00 },  // E
+        { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00 },  // F
+        { 0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00 },  // G
+        { 0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00 },  // H
+        { 0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },  // I
+        { 0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00 },  // J
+        { 0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00 },  // K
+        { 0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00 },  // L
+        { 0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00 },  // M
+        { 0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00 },  // N
+        { 0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00 },  // O
+        { 0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00 },  // P
+        { 0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00 },  // Q
+        { 0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00 },  // R
+        { 0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00 },  // S
+        { 0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },  // T
+        { 0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00 },  // U
+        { 0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },  // V
+        { 0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00 },  // W
+        { 0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00 },  // X
+        { 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00 },  // Y
+        { 0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00 },  // Z
+        { 0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00 },  // [
+        { 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00 },  // backslash
+        { 0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00 },  // ]
+        { 0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00 },  // ^
+        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF },  // _
+        { 0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00 },  // `
+        { 0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00 },  // a
+        { 0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00 },  // b
+        { 0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00 },  // c
+        { 0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00 },  // d
+        { 0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00 },  // e
+        { 0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00 },  // f
+        { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F },  // g
+        { 0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00 },  // h
+        { 0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },  // i
+        { 0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E },  // j
+        { 0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00 },  // k
+        { 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },  // l
+        { 0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00 },  // m
+        { 0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00 },  // n
+        { 0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00 },  // o
+        { 0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F },  // p
+        { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78 },  // q
+        { 0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00 },  // r
+        { 0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00 },  // s
+        { 0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00 },  // t
+        { 0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00 },  // u
+        { 0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },  // v
+        { 0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00 },  // w
+        { 0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00 },  // x
+        { 0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F },  // y
+        { 0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00 },  // z
+        { 0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00 },  // {
+        { 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00 },  // |
+        { 0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00 },  // }
+        { 0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // ~
+    };
+
+    FontAtlas buildFontAtlas(int px) {
+        FontAtlas atlas;
+        atlas.px = px = std::max(px, 1);
+        atlas.width = px * kAtlasColumns;
+        atlas.height = px * kAtlasRows;
+        atlas.rgba.assign((size_t)atlas.width * atlas.height * 4, 0);
+        for (int g = 0; g <= kFontSolid; ++g) {
+            int cx = g % kAtlasColumns * px, cy = g / kAtlasColumns * px;
+            for (int y = 0; y < px; ++y) {
+                uint8_t row = g == kFontSolid ? 0xFF : kFont8x8[g][y * 8 / px];
+                uint8_t* p = &atlas.rgba[((size_t)(cy + y) * atlas.width + cx) * 4];
+                for (int x = 0; x < px; ++x, p += 4) {
+                    p[0] = p[1] = p[2] = 0xFF;
+                    p[3] = (row >> (x * 8 / px)) & 1 ? 0xFF : 0;
+                }
+            }
+        }
+        return atlas;
+    }
+
+    namespace {
+
+        // Next code point of UTF-8 text as an atlas cell, -1 for a line
+        // break, -2 for characters not drawn at all
+        int nextGlyph(std::string_view text, size_t& i) {
+            unsigned char c = (unsigned char)text[i++];
+            if (c == '\n') return -1;
+            if (c == '\t') return 0;
+            if (c < 0x20 || c == 0x7F) return -2;
+            if (c < 0x80) return c - kFontFirst;
+            int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+            uint32_t cp = c & (0x3F >> extra);
+            for (; extra > 0 && i < text.size() && ((unsigned char)text[i] & 0xC0) == 0x80; --extra) {
+                cp = (cp << 6) | ((unsigned char)text[i++] & 0x3F);
+            }
+            switch (cp) {
+            case 0xA0: return 0;                        // no-break space
+            case 0x2018: case 0x2019: return '\'' - kFontFirst;
+            case 0x201C: case 0x201D: return '"' - kFontFirst;
+            case 0x2013: case 0x2014: return '-' - kFontFirst;
+            default: return '?' - kFontFirst;
+            }
+        }
+
+    } // namespace
+
+    TextLayout layoutText(std::string_view text, int px, int maxWidth) {
+        TextLayout layout;
+        px = std::max(px, 1);
+        layout.lineHeight = px + px / 4;
+        size_t columns = (size_t)std::max(1, maxWidth / px);
+
+        std::vector<int> line;  // glyphs of one paragraph
+        auto flush = [&] {
+            // Break before the last space that fits, or mid-word if there is none
+            size_t start = 0;
+            do {
+                size_t end = std::min(start + columns, line.size());
+                if (end < line.size() && line[end] != 0) {
+                    size_t space = end;
+                    while (space > start && line[space - 1] != 0) space--;
+                    if (space > start) end = space;
+                }
+                int y = layout.lines++ * layout.lineHeight;
+                for (size_t k = start; k < end; ++k) {
+                    if (line[k] != 0) layout.glyphs.push_back({ (int)(k - start) * px, y, line[k] });
+                }
+                start = end;
+                while (start < line.size() && line[start] == 0) start++;
+            } while (start < line.size());
+            line.clear();
+        };
+        for (size_t i = 0; i < text.size();) {
+            int g = nextGlyph(text, i);
+            if (g == -1) flush();
+            else if (g >= 0) line.push_back(g);
+        }
+        if (!line.empty()) flush();
+        return layout;
+    }
+
+} // namespace CRTZ
@@ -0,0 +1,410 @@
+// crtz_journal.cpp - append-only autosave journal with group commit
+#include "crtz_journal.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CRTZ_HAVE_FSYNC 1
+#endif
+
+namespace CRTZ {
+
+    namespace {
+
+        const char kJournalMagic[8] = { 'C', 'R', 'T', 'Z', 'W', 'A', 'L', '1' };
+        const char kSnapshotMagic[8] = { 'C', 'R', 'T', 'Z', 'S', 'N', 'P', '1' };
+        constexpr size_t kFrameHeader = 8;               // payload length, CRC
+        constexpr size_t kMaxPayload = size_t(1) << 30;
+
+        uint32_t crc32(const char* data, size_t n) {
+            static uint32_t table[256];
+            static bool ready = [] {
+                for (uint32_t i = 0; i < 256; ++i) {
+                    uint32_t c = i;
+                    for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                    table[i] = c;
+                }
+                return true;
+            }();
+            (void)ready;
+            uint32_t c = 0xFFFFFFFFu;
+            for (size_t i = 0; i < n; ++i) c = table[(c ^ (uint8_t)data[i]) & 0xFF] ^ (c >> 8);
+            return c ^ 0xFFFFFFFFu;
+        }
+
+        // Little-endian fields
+        void put32(std::string& out, uint32_t v) {
+            for (int i = 0; i < 4; ++i) out.push_back((char)(v >> (8 * i)));
+        }
+        void put64(std::string& out, uint64_t v) {
+            for (int i = 0; i < 8; ++i) out.push_back((char)(v >> (8 * i)));
+        }
+        void putBytes(std::string& out, std::string_view s) {
+            put32(out, (uint32_t)s.size());
+            out.append(s.data(), s.size());
+        }
+
+        // Bounds-checked reader; ok turns false past the end
+        struct Reader {
+            const char* p;
+            const char* end;
+            bool ok = true;
+
+            uint64_t get(int bytes) {
+                if (end - p < bytes) { ok = false; p = end; return 0; }
+                uint64_t v = 0;
+                for (int i = 0; i < bytes; ++i) v |= (uint64_t)(uint8_t)p[i] << (8 * i);
+                p += bytes;
+                return v;
+            }
+            std::string_view bytes() {
+                size_t n = (size_t)get(4);
+                if (!ok || (size_t)(end - p) < n) { ok = false; p = end; return {}; }
+                std::string_view s(p, n);
+                p += n;
+                return s;
+            }
+            bool done() const { return p == end; }
+        };
+
+#ifdef CRTZ_HAVE_FSYNC
+        bool writeAll(int fd, const std::string& data) {
+            for (size_t done = 0; done < data.size();) {
+                ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                done += (size_t)n;
+            }
+            return true;
+        }
+
+        bool syncData(int fd) {
+#if defined(__APPLE__)
+            return fsync(fd) == 0;
+#else
+            return fdatasync(fd) == 0;
+#endif
+        }
+
+        bool readAll(int fd, std::string& out) {
+            char buf[1 << 16];
+            ssize_t n;
+            while ((n = ::read(fd, buf, sizeof(buf))) != 0) {
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) return false;
+                out.append(buf, (size_t)n);
+            }
+            return true;
+        }
+
+        // Makes a rename in the file's directory durable
+        void syncDirectory(const std::string& path) {
+            size_t slash = path.find_last_of('/');
+            std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+            int fd = ::open(dir.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            fsync(fd);
+            ::close(fd);
+        }
+#endif
+
+    } // namespace
+
+    void JournalRecord::put(std::string_view key, std::string_view value) {
+        ops_.push_back('P');
+        putBytes(ops_, key);
+        putBytes(ops_, value);
+    }
+
+    void JournalRecord::erase(std::string_view key) {
+        ops_.push_back('E');
+        putBytes(ops_, key);
+    }
+
+    std::shared_ptr<Journal> Journal::open(const std::string& path, const JournalOptions& options) {
+#ifdef CRTZ_HAVE_FSYNC
+        std::shared_ptr<Journal> j(new Journal());
+        j->path_ = path;
+        j->options_ = options;
+
+        std::string snap;
+        int sfd = ::open((path + ".snap").c_str(), O_RDONLY);
+        if (sfd >= 0) {
+            bool read = readAll(sfd, snap);
+            ::close(sfd);
+            size_t n = snap.size();
+            if (!read || n < sizeof(kSnapshotMagic) + 4 || memcmp(snap.data(), kSnapshotMagic, sizeof(kSnapshotMagic)) != 0) {
+                std::cerr << "Journal: " << path << ".snap is not a snapshot\n";
+                return nullptr;
+            }
+            const char* body = snap.data() + sizeof(kSnapshotMagic);
+            size_t bodySize = n - sizeof(kSnapshotMagic) - 4;
+            Reader crc{ body + bodySize, snap.data() + n };
+            if (crc32(body, bodySize) != (uint32_t)crc.get(4)) {
+                std::cerr << "Journal: " << path << ".snap is damaged\n";
+                return nullptr;
+            }
+            Reader r{ body, body + bodySize };
+            j->lastSeq_ = r.get(8);
+            uint32_t sessions = (uint32_t)r.get(4);
+            for (uint32_t s = 0; s < sessions && r.ok; ++s) {
+                JournalImage& image = j->images_[std::string(r.bytes())];
+                uint32_t slots = (uint32_t)r.get(4);
+                for (uint32_t i = 0; i < slots && r.ok; ++i) {
+                    std::string_view key = r.bytes();
+                    image[std::string(key)] = std::string(r.bytes());
+                }
+            }
+            if (!r.ok) {
+                std::cerr << "Journal: " << path << ".snap is damaged\n";
+                return nullptr;
+            }
+        }
+
+        j->fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (j->fd_ < 0) {
+            std::cerr << "Journal: cannot open " << path << "\n";
+            return nullptr;
+        }
+        std::string data;
+        if (!readAll(j->fd_, data)) {
+            std::cerr << "Journal: cannot read " << path << "\n";
+            return nullptr;
+        }
+        if (data.size() < sizeof(kJournalMagic)) {
+            // New, or torn while writing the header
+            if (ftruncate(j->fd_, 0) != 0 || !writeAll(j->fd_, std::string(kJournalMagic, sizeof(kJournalMagic))) || !syncData(j->fd_)) {
+                std::cerr << "Journal: cannot initialize " << path << "\n";
+                return nullptr;
+            }
+            data.assign(kJournalMagic, sizeof(kJournalMagic));
+        } else if (memcmp(data.data(), kJournalMagic, sizeof(kJournalMagic)) != 0) {
+            std::cerr << "Journal: " << path << " is not a journal\n";
+            return nullptr;
+        }
+        size_t validEnd = 0;
+        j->replay(data, validEnd);
+        if (validEnd < data.size()) {
+            // A crash mid-write leaves a partial record; it was never acknowledged
+            std::cerr << "Journal: dropping " << data.size() - validEnd << " bytes of an incomplete record in " << path << "\n";
+            if (ftruncate(j->fd_, (off_t)validEnd) != 0 || !syncData(j->fd_)) {
+                std::cerr << "Journal: cannot repair " << path << "\n";
+                return nullptr;
+            }
+        }
+        j->journalBytes_ = validEnd;
+        j->durableSeq_ = j->lastSeq_;
+        return j;
+#else
+        (void)options;
+        std::cerr << "Journal: not supported on this platform (" << path << ")\n";
+        return nullptr;
+#endif
+    }
+
+    Journal::~Journal() {
+#ifdef CRTZ_HAVE_FSYNC
+        if (fd_ >= 0) ::close(fd_);
+#endif
+    }
+
+    bool Journal::replay(const std::string& data, size_t& validEnd) {
+        size_t pos = sizeof(kJournalMagic);
+        uint64_t snapshotSeq = lastSeq_;
+        while (data.size() - pos >= kFrameHeader) {
+            Reader h{ data.data() + pos, data.data() + pos + kFrameHeader };
+            size_t len = (size_t)h.get(4);
+            uint32_t crc = (uint32_t)h.get(4);
+            if (len > kMaxPayload || data.size() - pos - kFrameHeader < len) break;
+            const char* payload = data.data() + pos + kFrameHeader;
+            if (crc32(payload, len) != crc) break;
+            Reader r{ payload, payload + len };
+            uint64_t seq = r.get(8);
+            char kind = (char)r.get(1);
+            std::string id(r.bytes());
+            if (!r.ok) break;
+            // Records already folded into the snapshot are skipped
+            if (seq > snapshotSeq) apply(id, kind, std::string_view(r.p, (size_t)(r.end - r.p)));
+            if (seq > lastSeq_) lastSeq_ = seq;
+            pos += kFrameHeader + len;
+        }
+        validEnd = pos;
+        return pos == data.size();
+    }
+
+    void Journal::apply(const std::string& id, char kind, std::string_view ops) {
+        if (kind == 'D') {
+            images_.erase(id);
+            return;
+        }
+        JournalImage& image = images_[id];
+        Reader r{ ops.data(), ops.data() + ops.size() };
+        while (r.ok && !r.done()) {
+            char op = (char)r.get(1);
+            std::string_view key = r.bytes();
+            if (op == 'P') {
+                std::string_view value = r.bytes();
+                if (r.ok) image[std::string(key)].assign(value.data(), value.size());
+            } else if (r.ok) {
+                image.erase(std::string(key));
+            }
+        }
+    }
+
+    bool Journal::load(const std::string& id, JournalImage& out) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = images_.find(id);
+        if (it == images_.end()) return false;
+        out = it->second;
+        return true;
+    }
+
+    bool Journal::commit(const std::string& id, const JournalRecord& record) {
+        if (record.empty()) return true;
+        return append(id, 'R', record.ops_);
+    }
+
+    bool Journal::drop(const std::string& id) {
+        return append(id, 'D', {});
+    }
+
+    bool Journal::append(const std::string& id, char kind, std::string_view ops) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (failed_) return false;
+        uint64_t seq = ++lastSeq_;
+        std::string payload;
+        payload.reserve(8 + 1 + 4 + id.size() + ops.size());
+        put64(payload, seq);
+        payload.push_back(kind);
+        putBytes(payload, id);
+        payload.append(ops.data(), ops.size());
+        put32(pending_, (uint32_t)payload.size());
+        put32(pending_, crc32(payload.data(), payload.size()));
+        pending_ += payload;
+        apply(id, kind, ops);
+        stats_.records++;
+        stats_.bytes += kFrameHeader + payload.size();
+
+        // Group commit: the first committer to find no write in flight
+        // writes the whole queue; the rest wait for a batch that covers them
+        while (durableSeq_ < seq && !failed_) {
+            if (!flushing_) flush(lock);
+            else flushed_.wait(lock);
+        }
+        return !failed_;
+    }
+
+    bool Journal::flush(std::unique_lock<std::mutex>& lock) {
+#ifdef CRTZ_HAVE_FSYNC
+        flushing_ = true;
+        if (options_.commitDelayMicros) {
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::microseconds(options_.commitDelayMicros));
+            lock.lock();
+        }
+        std::string batch;
+        batch.swap(pending_);
+        uint64_t upTo = lastSeq_;
+        lock.unlock();
+        bool ok = writeAll(fd_, batch) && syncData(fd_);
+        lock.lock();
+        stats_.syncs++;
+        if (ok) {
+            durableSeq_ = std::max(durableSeq_, upTo);
+            journalBytes_ += batch.size();
+            if (journalBytes_ >= options_.compactBytes) ok = snapshot(lock);
+        } else {
+            std::cerr << "Journal: write to " << path_ << " failed\n";
+            failed_ = true;
+        }
+        flushing_ = false;
+        flushed_.notify_all();
+        return ok;
+#else
+        (void)lock;
+        return false;
+#endif
+    }
+
+    bool Journal::snapshot(std::unique_lock<std::mutex>& lock) {
+#ifdef CRTZ_HAVE_FSYNC
+        // Queued records are already in the images, so the snapshot covers
+        // them and they need not reach the journal
+        uint64_t seq = lastSeq_;
+        pending_.clear();
+        std::string body;
+        put64(body, seq);
+        put32(body, (uint32_t)images_.size());
+        for (auto& kv : images_) {
+            putBytes(body, kv.first);
+            put32(body, (uint32_t)kv.second.size());
+            for (auto& slot : kv.second) {
+                putBytes(body, slot.first);
+                putBytes(body, slot.second);
+            }
+        }
+        lock.unlock();
+
+        std::string snap(kSnapshotMagic, sizeof(kSnapshotMagic));
+        snap += body;
+        put32(snap, crc32(body.data(), body.size()));
+        std::string tmp = path_ + ".snap.tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd >= 0 && writeAll(fd, snap) && fsync(fd) == 0;
+        if (fd >= 0) ::close(fd);
+        ok = ok && std::rename(tmp.c_str(), (path_ + ".snap").c_str()) == 0;
+        if (ok) {
+            syncDirectory(path_);
+            // A crash before this truncation only replays records the
+            // snapshot already holds, which are skipped by sequence number
+            ok = ftruncate(fd_, (off_t)sizeof(kJournalMagic)) == 0 && syncData(fd_);
+        }
+
+        lock.lock();
+        if (!ok) {
+            std::cerr << "Journal: snapshot of " << path_ << " failed\n";
+            failed_ = true;
+            return false;
+        }
+        durableSeq_ = std::max(durableSeq_, seq);
+        journalBytes_ = sizeof(kJournalMagic);
+        stats_.compactions++;
+        return true;
+#else
+        (void)lock;
+        return false;
+#endif
+    }
+
+    bool Journal::compact() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (flushing_) flushed_.wait(lock);
+        if (failed_) return false;
+        flushing_ = true;
+        bool ok = snapshot(lock);
+        flushing_ = false;
+        flushed_.notify_all();
+        return ok;
+    }
+
+    Journal::Stats Journal::stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Stats s = stats_;
+        s.sessions = images_.size();
+        for (auto& kv : images_) {
+            s.imageBytes += kv.first.size();
+            for (auto& slot : kv.second) s.imageBytes += slot.first.size() + slot.second.size();
+        }
+        return s;
+    }
+
+} // namespace CRTZ
@@ -5,7 +5,17 @@
 #include <unordered_set>
 #include <cctype>
 #include "image_driver.hpp"
+#include "crtz_shm.hpp"
+#include "crtz_table.hpp"
+#include "crtz_text.hpp"
+#include "crtz_metrics.hpp"
+#include "crtz_profile.hpp"
+#include "crtz_test.hpp"
+#include "crtz_journal.hpp"
 #include <cstring>
+#include <climits>
+#include <charconv>
+#include <random>
 
 using namespace std;
 
@@ -105,6 +115,12 @@ struct Lexer {
             string num;
             if (peek() == '-') num.push_back(get());
             while (isdigit((unsigned char)peek())) num.push_back(get());
+            if (peek() == 'd' && i + 1 < src.size() && isdigit((unsigned char)src[i + 1])) {
+                // Dice literal such as 3d6, read as one word
+                num.push_back(get());
+                while (isdigit((unsigned char)peek())) num.push_back(get());
+                return Token(TK_IDENT, num, line);
+            }
             Token t(TK_NUMBER, num, line);
             try { t.number = stoi(num); }
             catch (...) { t.number = 0; }
@@ -139,6 +155,98 @@ struct Lexer {
     }
 };
 
+// ----------------------- Random numbers -----------------------
+
+// xoshiro256** seeded through splitmix64. Every session owns one, so its
+// rolls depend only on the seed and on what the script did: replays and
+// simulations come out the same each time.
+struct Rng {
+    uint64_t s[4];
+
+    explicit Rng(uint64_t seed = 0) { reseed(seed); }
+
+    void reseed(uint64_t seed) {
+        for (auto& w : s) {
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            w = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        uint64_t r = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return r;
+    }
+
+    // Uniform in [0, n), n > 0: multiply-shift, rejecting the few low
+    // products that would bias it
+    uint64_t below(uint64_t n) {
+        __uint128_t m = (__uint128_t)next() * n;
+        if ((uint64_t)m < n) {
+            uint64_t floor = -n % n;
+            while ((uint64_t)m < floor) m = (__uint128_t)next() * n;
+        }
+        return (uint64_t)(m >> 64);
+    }
+
+    // Uniform in [a, b], either order
+    long long range(long long a, long long b) {
+        if (a > b) swap(a, b);
+        uint64_t n = (uint64_t)b - (uint64_t)a + 1;
+        return (long long)((uint64_t)a + (n ? below(n) : next()));
+    }
+
+    // Sum of `count` rolls of a `sides`-sided die (at most kMaxDice dice)
+    static constexpr long long kMaxDice = 1000;
+    long long dice(long long count, long long sides) {
+        if (count <= 0 || sides <= 0) return 0;
+        count = min(count, kMaxDice);
+        long long sum = count;
+        for (long long i = 0; i < count; ++i) sum += (long long)below((uint64_t)sides);
+        return sum;
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
+// Decimal literal with an optional sign; false if it is not one or does not
+// fit a long long
+static bool parseNumber(string_view t, long long& out) {
+    if (t.size() > 1 && t[0] == '+') t.remove_prefix(1);
+    auto r = from_chars(t.data(), t.data() + t.size(), out);
+    return r.ec == errc() && r.ptr == t.data() + t.size();
+}
+
+// "3d6" tokens: dice count and sides, false for anything else. A count or
+// side count that does not fit leaves both 0 (no roll) and clears *fits.
+static bool parseDice(const string& t, long long& count, long long& sides, bool* fits = nullptr) {
+    size_t d = t.find('d');
+    if (d == string::npos || d == 0 || d + 1 >= t.size()) return false;
+    string_view v(t);
+    if (!parseNumber(v.substr(0, d), count) || !parseNumber(v.substr(d + 1), sides)) {
+        count = sides = 0;
+        if (fits) *fits = false;
+    }
+    return true;
+}
+
+// A number or dice literal as expressions evaluate it: 0 if it does not fit
+static bool literalFits(const string& t) {
+    long long count, sides, n;
+    bool fits = true;
+    if (parseDice(t, count, sides, &fits)) return fits;
+    return parseNumber(t, n);
+}
+
 // ----------------------- Expression Engine -----------------------
 
 int precedence(const string& op) {
@@ -153,35 +261,78 @@ bool isOperator(const string& s) {
     return ops.count(s);
 }
 
+// Function calls are emitted as "@name/argc" after their arguments.
+// Linked native calls use "#<index>" as the name (see linkProgram).
+static bool isCallToken(const string& t) { return t.size() > 1 && t[0] == '@'; }
+
 vector<string> infixToRPN(const vector<string>& tokens) {
     vector<string> out;
     vector<string> st;
+    vector<int> argCounts;
     for (size_t i = 0; i < tokens.size(); ++i) {
         const string& t = tokens[i];
         if (t.empty()) continue;
-        if (isOperator(t)) {
+        bool callee = (isalpha((unsigned char)t[0]) || t[0] == '_' || t[0] == '#') &&
+            i + 1 < tokens.size() && tokens[i + 1] == "(";
+        if (callee) {
+            st.push_back("@" + t);
+            st.push_back("(");
+            argCounts.push_back(i + 2 < tokens.size() && tokens[i + 2] == ")" ? 0 : 1);
+            ++i;
+        } else if (isOperator(t)) {
             while (!st.empty() && isOperator(st.back()) && precedence(st.back()) >= precedence(t)) {
                 out.push_back(st.back()); st.pop_back();
             }
             st.push_back(t);
         } else if (t == "(") {
             st.push_back(t);
+        } else if (t == ",") {
+            while (!st.empty() && st.back() != "(") {
+                out.push_back(st.back()); st.pop_back();
+            }
+            if (!argCounts.empty()) argCounts.back()++;
         } else if (t == ")") {
             while (!st.empty() && st.back() != "(") {
                 out.push_back(st.back()); st.pop_back();
             }
             if (!st.empty() && st.back() == "(") st.pop_back();
+            if (!st.empty() && isCallToken(st.back())) {
+                out.push_back(st.back() + "/" + to_string(argCounts.back()));
+                st.pop_back();
+                argCounts.pop_back();
+            }
         } else {
             out.push_back(t);
         }
     }
     while (!st.empty()) {
-        out.push_back(st.back()); st.pop_back();
+        if (st.back() != "(" && !isCallToken(st.back())) out.push_back(st.back());
+        st.pop_back();
     }
     return out;
 }
 
 struct Program;
+struct SessionState;
+
+// Brings a derived variable up to date if one of its inputs changed
+static void refreshIfDerived(SessionState& ss, const string& name);
+// Sum of a dice literal's rolls on the session's generator
+static long long rollDice(SessionState& ss, long long count, long long sides);
+// String variables (and currentRoom/inventory) read by expressions
+static bool readStringVar(const SessionState& ss, const string& name, CRTZ::Value& out);
+// Functions provided by the interpreter itself, bound to an id when an
+// expression is compiled
+enum BuiltinId : uint8_t {
+    NoBuiltin, PathTo, DistanceTo, HasItem, Carrying, Where,
+    TableGet, TableFind, TableSum, TableMin, TableMax, Rand, Chance, Len, Str, Substr
+};
+static BuiltinId builtinId(const string& name);
+// False if id is NoBuiltin; name is only used in messages
+static bool callBuiltin(BuiltinId id, const string& name, const CRTZ::Value* args, size_t argc,
+    SessionState* ss, CRTZ::Value& out);
+// Where runtime diagnostics of a session go (cerr without one)
+static ostream& diagnostics(const SessionState* ss);
 
 static pair<string, string> splitDot(const string& s) {
     size_t pos = s.find('.');
@@ -189,56 +340,216 @@ static pair<string, string> splitDot(const string& s) {
     return { s.substr(0, pos), s.substr(pos + 1) };
 }
 
-int evalRPN(const vector<string>& rpn,
-    unordered_map<string, int>& vars,
-    unordered_map<string, bool>& boolVars,
-    unordered_map<string, unordered_map<string, int>>& objects) {
-    vector<long long> st;
+// An expression in RPN with its tokens decoded: operators, constants and
+// names are resolved once, calls to host functions hold their binding and
+// built-ins their id, so evaluation does no parsing and no lookups by
+// function name.
+struct ExprOp {
+    enum Kind : uint8_t { Add, Sub, Mul, Div, Eq, Ne, Lt, Le, Gt, Ge, Number, Dice, Text, Variable, Field, Native, Builtin };
+    Kind kind = Number;
+    BuiltinId builtin = NoBuiltin;
+    long long num = 0;    // Number; Dice: count
+    long long sides = 0;  // Dice
+    size_t argc = 0;      // Native, Builtin
+    const CRTZ::NativeBinding* native = nullptr;
+    string name;          // Text: the literal; Variable; Field: instance; Builtin
+    string field;         // Field
+};
+
+struct CompiledExpr {
+    vector<ExprOp> ops;
+    size_t depth = 0;  // most values on the stack at once
+};
+
+// Decodes an RPN token list; "#i" calls bind to natives[i]
+static CompiledExpr compileRPN(const vector<string>& rpn, const vector<CRTZ::NativeBinding>* natives) {
+    static const unordered_map<string, ExprOp::Kind> operators = {
+        { "+", ExprOp::Add }, { "-", ExprOp::Sub }, { "*", ExprOp::Mul }, { "/", ExprOp::Div },
+        { "==", ExprOp::Eq }, { "!=", ExprOp::Ne }, { "<", ExprOp::Lt }, { "<=", ExprOp::Le }, { ">", ExprOp::Gt }, { ">=", ExprOp::Ge }
+    };
+    CompiledExpr e;
+    e.ops.reserve(rpn.size());
+    size_t sp = 0;
     for (auto& t : rpn) {
-        if (isOperator(t)) {
-            if (st.size() < 2) return 0;
-            long long b = st.back(); st.pop_back();
-            long long a = st.back(); st.pop_back();
-            long long r = 0;
-            if (t == "+") r = a + b;
-            else if (t == "-") r = a - b;
-            else if (t == "*") r = a * b;
-            else if (t == "/") r = b != 0 ? a / b : 0;
-            else if (t == "==") r = (a == b);
-            else if (t == "!=") r = (a != b);
-            else if (t == "<") r = (a < b);
-            else if (t == "<=") r = (a <= b);
-            else if (t == ">") r = (a > b);
-            else if (t == ">=") r = (a >= b);
-            st.push_back(r);
+        ExprOp op;
+        auto oit = operators.find(t);
+        if (oit != operators.end()) {
+            op.kind = oit->second;
+            if (sp >= 2) sp--;
+        } else if (isCallToken(t)) {
+            size_t slash = t.rfind('/');
+            op.name = t.substr(1, slash - 1);
+            op.argc = (size_t)stoi(t.substr(slash + 1));
+            op.kind = ExprOp::Builtin;
+            op.builtin = builtinId(op.name);
+            if (op.name[0] == '#' && natives) {
+                op.kind = ExprOp::Native;
+                op.native = &(*natives)[(size_t)stoi(op.name.substr(1))];
+            }
+            sp -= min(op.argc, sp);
+            e.depth = max(e.depth, ++sp);
         } else {
-            if (!t.empty() && (isdigit((unsigned char)t[0]) || ((t[0] == '-' || t[0] == '+') && t.size() > 1 && isdigit((unsigned char)t[1])))) {
-                st.push_back(stoll(t));
-            } else if (t == "true") {
-                st.push_back(1);
-            } else if (t == "false") {
-                st.push_back(0);
+            if (t[0] == '"') {
+                op.kind = ExprOp::Text;
+                op.name = t.substr(1);
+            } else if (isdigit((unsigned char)t[0]) || ((t[0] == '-' || t[0] == '+') && t.size() > 1 && isdigit((unsigned char)t[1]))) {
+                if (parseDice(t, op.num, op.sides)) op.kind = ExprOp::Dice;
+                else if (!parseNumber(t, op.num)) op.num = 0;  // reported by compileActions
+            } else if (t == "true" || t == "false") {
+                op.num = t == "true";
             } else {
                 auto pr = splitDot(t);
-                if (!pr.second.empty()) {
-                    string inst = pr.first;
-                    string field = pr.second;
-                    if (objects.count(inst) && objects[inst].count(field)) {
-                        st.push_back(objects[inst][field]);
-                    } else {
-                        st.push_back(0);
-                    }
-                } else {
-                    if (boolVars.count(t)) {
-                        st.push_back(boolVars[t] ? 1 : 0);
-                    } else {
-                        st.push_back(vars.count(t) ? vars[t] : 0);
-                    }
+                op.kind = pr.second.empty() ? ExprOp::Variable : ExprOp::Field;
+                op.name = move(pr.first);
+                op.field = move(pr.second);
+            }
+            e.depth = max(e.depth, ++sp);
+        }
+        e.ops.push_back(move(op));
+    }
+    return e;
+}
+
+static CRTZ::Value callFunction(const ExprOp& op, const CRTZ::Value* args, size_t argc, SessionState* ss) {
+    CRTZ::Value result;
+    if (op.kind == ExprOp::Native) {
+        const CRTZ::NativeBinding& b = *op.native;
+        if (argc == b.arity) result = b.thunk(b.fn.get(), args);
+        else diagnostics(ss) << "Runtime: '" << b.name << "' expects " << b.arity << " arguments\n";
+    } else if (!callBuiltin(op.builtin, op.name, args, argc, ss, result)) {
+        diagnostics(ss) << "Runtime: unknown function '" << op.name << "'\n";
+    }
+    return result;
+}
+
+// Values on the evaluation stack kept in the caller's frame; deeper
+// expressions use the heap
+constexpr size_t kExprStack = 8;
+
+static CRTZ::Value evalCompiled(const CompiledExpr& e,
+    unordered_map<string, int>& vars,
+    unordered_map<string, bool>& boolVars,
+    unordered_map<string, unordered_map<string, int>>& objects,
+    SessionState* ss) {
+    CRTZ::Value frame[kExprStack];
+    vector<CRTZ::Value> heap;
+    CRTZ::Value* st = frame;
+    if (e.depth > kExprStack) {
+        heap.resize(e.depth);
+        st = heap.data();
+    }
+    size_t sp = 0;
+    for (auto& op : e.ops) {
+        if (op.kind <= ExprOp::Ge) {
+            if (sp < 2) return CRTZ::Value();
+            CRTZ::Value& lhs = st[sp - 2];
+            CRTZ::Value& rhs = st[sp - 1];
+            sp--;
+            if (lhs.isString || rhs.isString) {
+                // + concatenates into the left operand in place, so a chain
+                // a + b + c grows one buffer; comparisons are lexicographic
+                if (!lhs.isString) lhs = CRTZ::Value(to_string(lhs.num));
+                if (op.kind == ExprOp::Add) {
+                    if (rhs.isString) lhs.str += rhs.str;
+                    else lhs.str += to_string(rhs.num);
+                    continue;
+                }
+                if (!rhs.isString) rhs.str = to_string(rhs.num);
+                int c = lhs.str.compare(rhs.str);
+                long long r = 0;
+                switch (op.kind) {
+                case ExprOp::Eq: r = (c == 0); break;
+                case ExprOp::Ne: r = (c != 0); break;
+                case ExprOp::Lt: r = (c < 0); break;
+                case ExprOp::Le: r = (c <= 0); break;
+                case ExprOp::Gt: r = (c > 0); break;
+                case ExprOp::Ge: r = (c >= 0); break;
+                default: break;
                 }
+                lhs = CRTZ::Value(r);
+                continue;
+            }
+            long long a = lhs.num, b = rhs.num;
+            long long r = 0;
+            switch (op.kind) {
+            case ExprOp::Add: r = a + b; break;
+            case ExprOp::Sub: r = a - b; break;
+            case ExprOp::Mul: r = a * b; break;
+            case ExprOp::Div: r = b != 0 ? a / b : 0; break;
+            case ExprOp::Eq: r = (a == b); break;
+            case ExprOp::Ne: r = (a != b); break;
+            case ExprOp::Lt: r = (a < b); break;
+            case ExprOp::Le: r = (a <= b); break;
+            case ExprOp::Gt: r = (a > b); break;
+            case ExprOp::Ge: r = (a >= b); break;
+            default: break;
+            }
+            lhs = CRTZ::Value(r);
+            continue;
+        }
+        CRTZ::Value& top = st[sp];
+        switch (op.kind) {
+        case ExprOp::Native:
+        case ExprOp::Builtin: {
+            size_t argc = min(op.argc, sp);
+            sp -= argc;
+            CRTZ::Value r = callFunction(op, st + sp, argc, ss);
+            st[sp] = move(r);
+            break;
+        }
+        case ExprOp::Text:
+            top = CRTZ::Value(op.name);
+            break;
+        case ExprOp::Number:
+            top = CRTZ::Value(op.num);
+            break;
+        case ExprOp::Dice:
+            top = CRTZ::Value(ss ? rollDice(*ss, op.num, op.sides) : 0);
+            break;
+        case ExprOp::Field: {
+            long long v = 0;
+            auto oit = objects.find(op.name);
+            if (oit != objects.end()) {
+                auto fit = oit->second.find(op.field);
+                if (fit != oit->second.end()) v = fit->second;
+            }
+            top = CRTZ::Value(v);
+            break;
+        }
+        default: {
+            if (ss) refreshIfDerived(*ss, op.name);
+            auto bit = boolVars.find(op.name);
+            if (bit != boolVars.end()) {
+                top = CRTZ::Value((long long)(bit->second ? 1 : 0));
+                break;
             }
+            auto vit = vars.find(op.name);
+            if (vit != vars.end()) top = CRTZ::Value((long long)vit->second);
+            else if (!ss || !readStringVar(*ss, op.name, top)) top = CRTZ::Value();
+            break;
+        }
         }
+        sp++;
     }
-    return st.empty() ? 0 : (int)st.back();
+    return sp ? move(st[sp - 1]) : CRTZ::Value();
+}
+
+CRTZ::Value evalRPNValue(const vector<string>& rpn,
+    unordered_map<string, int>& vars,
+    unordered_map<string, bool>& boolVars,
+    unordered_map<string, unordered_map<string, int>>& objects,
+    const vector<CRTZ::NativeBinding>* natives = nullptr,
+    SessionState* ss = nullptr) {
+    return evalCompiled(compileRPN(rpn, natives), vars, boolVars, objects, ss);
+}
+
+int evalRPN(const vector<string>& rpn,
+    unordered_map<string, int>& vars,
+    unordered_map<string, bool>& boolVars,
+    unordered_map<string, unordered_map<string, int>>& objects,
+    const vector<CRTZ::NativeBinding>* natives = nullptr,
+    SessionState* ss = nullptr) {
+    return (int)evalRPNValue(rpn, vars, boolVars, objects, natives, ss).num;
 }
 
 vector<string> tokenizeExpr(const string& s) {
@@ -253,17 +564,32 @@ vector<string> tokenizeExpr(const string& s) {
             }
         }
         char c = s[i];
-        if (strchr("+-*/()<>", c)) {
+        if (c == '"') {
+            // String literal, kept as a single token with a leading quote
+            string lit = "\"";
+            size_t j = i + 1;
+            while (j < s.size() && s[j] != '"') {
+                if (s[j] == '\\' && j + 1 < s.size()) ++j;
+                lit.push_back(s[j++]);
+            }
+            out.push_back(lit);
+            i = j + 1; continue;
+        }
+        if (strchr("+-*/()<>,", c)) {
             out.push_back(string(1, c));
             ++i; continue;
         }
         if (isdigit((unsigned char)c) || ((c == '-' || c == '+') && i + 1 < s.size() && isdigit((unsigned char)s[i + 1]))) {
             size_t j = i + 1;
             while (j < s.size() && isdigit((unsigned char)s[j])) j++;
+            if (j + 1 < s.size() && s[j] == 'd' && isdigit((unsigned char)s[j + 1])) {
+                j += 2;
+                while (j < s.size() && isdigit((unsigned char)s[j])) j++;
+            }
             out.push_back(s.substr(i, j - i));
             i = j; continue;
         }
-        if (isalpha((unsigned char)c) || c == '_') {
+        if (isalpha((unsigned char)c) || c == '_' || c == '#') {
             size_t j = i + 1;
             while (j < s.size() && (isalnum((unsigned char)s[j]) || s[j] == '_' || s[j] == '.')) j++;
             out.push_back(s.substr(i, j - i));
@@ -276,20 +602,82 @@ vector<string> tokenizeExpr(const string& s) {
 
 // ----------------------- AST / OOP structures -----------------------
 
-struct Choice { int id; string text; string target; };
+struct Choice { int id; string text; string target; int textId = -1; };
+// An action decoded at link time (see compileActions). The runtime
+// dispatches on op and takes its operands from here; Stmt actions (pictures,
+// display, inline new) are still read from the action's text.
+struct ActionCode {
+    enum Op : uint8_t { None, Stmt, Set, Append, Signal, If, Switch, Go, Take, Drop, Goto, End, Call, MethodCall, Print, Show };
+    Op op = None;
+    bool host = false;   // may reach outside the session (see compileAction)
+    string name;         // Set, Append, Signal: the variable; MethodCall: the instance
+    string inst, field;  // Set of "inst.field"
+    string method;       // MethodCall
+    string target;       // If, Goto
+    string elseTarget;   // If: empty without an else branch
+    int index = 0;       // Switch: prog.switches; Go: direction; Take, Drop: item
+    string literal;      // Print of a string literal
+    vector<CompiledExpr> exprs;  // the value, condition or call; Append: the terms; MethodCall: the arguments
+};
+
 struct Node {
     string name;
     string text;
     vector<Choice> choices;
     vector<string> actions;
+    vector<ActionCode> code;  // per action, filled by the linker
     int definitionLine = 0;
+    // String ids for translation (see assignStringIds): the line, and per
+    // action the id of its SHOW text or -1
+    int textId = -1;
+    vector<int> actionTextIds;
+    uint32_t profileId = 0;  // for CRTZ::scriptLocation
+};
+
+// switch (expr) { case 1, 2 -> a; case 7 -> b; default -> c; }
+// Cases map to indices into targets: through a table offset by lo when the
+// values are dense, otherwise by binary search over sorted (value, index).
+struct SwitchTable {
+    vector<string> targets;
+    int lo = 0;
+    vector<int> dense;               // -1: no case
+    vector<pair<int, int>> sparse;
+    int fallback = -1;               // default
+
+    // Index into targets for v, or -1 to fall through
+    int find(int v) const {
+        if (!dense.empty()) {
+            long long i = (long long)v - lo;
+            if (i >= 0 && i < (long long)dense.size() && dense[i] >= 0) return dense[i];
+        } else if (!sparse.empty()) {
+            auto it = lower_bound(sparse.begin(), sparse.end(), make_pair(v, INT_MIN));
+            if (it != sparse.end() && it->first == v) return it->second;
+        }
+        return fallback;
+    }
+};
+
+// Inverted index over the dialogue (see buildTextIndex): every word of a
+// node line, choice or show text -> where it occurs, as (string id, word
+// position). Terms are sorted; a term's postings are sorted by position.
+struct TextIndex {
+    struct Posting {
+        uint32_t text;
+        uint32_t pos;
+        bool operator<(const Posting& o) const { return text != o.text ? text < o.text : pos < o.pos; }
+    };
+    vector<string> terms;
+    vector<uint32_t> termStart;  // postings[termStart[t] .. termStart[t + 1])
+    vector<Posting> postings;
 };
 
 struct ClassDef {
     string name;
     unordered_map<string, int> fields;
     unordered_map<string, vector<string>> methods;
+    unordered_map<string, vector<ActionCode>> methodCode;  // per action, filled by the linker
     unordered_map<string, vector<string>> methodParams;
+    unordered_map<string, uint32_t> methodProfileIds;  // "Class.method" ids for the profiler
 };
 
 struct Room {
@@ -303,6 +691,15 @@ struct Room {
     Room(const string& n, const string& desc) : name(n), description(desc) {}
 };
 
+// derived int/match variable: recomputed from expr when one of its inputs changes
+struct DerivedVar {
+    string expr;
+    CompiledExpr code;  // filled by the linker
+    vector<string> inputs;
+    bool isBool = false;
+    bool host = false;  // calls a host function (see callsHost)
+};
+
 struct Program {
     string npc;
     string desc;
@@ -318,441 +715,1161 @@ struct Program {
 
     unordered_map<string, Room> rooms;
     string currentRoom;
-};
 
-// ----------------------- Debugger -----------------------
+    // Room graph built at link time: rooms and directions interned to dense
+    // ids, exits as a rooms x directions table, predecessors for path search
+    struct RoomLink { int room; int dir; };
+    vector<string> roomNames;
+    unordered_map<string, int> roomIndex;
+    vector<string> directionNames;
+    unordered_map<string, int> directionIndex;
+    vector<int> exitTable;        // [room * directions + dir] -> room, -1 for no exit
+    vector<int> predStart;        // preds[predStart[r] .. predStart[r + 1]) lead into r
+    vector<RoomLink> preds;
+    // All-pairs shortest paths, [target * rooms + from]: first direction to
+    // take (-1 if none) and number of steps. Only kept for worlds up to
+    // kMaxPathRooms rooms; larger ones search on demand.
+    vector<int16_t> pathNext;
+    vector<uint16_t> pathDist;
+    int startRoom = -1;
 
-class Debugger {
-public:
-    void addBreakpoint(int line) {
-        breakpoints.insert(line);
-    }
+    // Items interned at link time, with their initial placement as one
+    // bitset per room and the inverse, item -> rooms holding it (sorted)
+    vector<string> itemNames;
+    unordered_map<string, int> itemIndex;
+    size_t itemWords = 0;  // 64-bit words per item set
+    vector<uint64_t> roomItemsInit;
+    vector<vector<int>> itemRoomsInit;
 
-    void removeBreakpoint(int line) {
-        breakpoints.erase(line);
-    }
+    // "SWITCH <i> <expr>" actions index here
+    vector<SwitchTable> switches;
 
-    void step() {
-        stepping = true;
-    }
+    // Host functions this program was linked against; "#i(...)" calls index here
+    vector<CRTZ::NativeBinding> natives;
 
-    void continueExecution() {
-        stepping = false;
-    }
 
-    void check(int line, const Program& prog) {
-        if (stepping || breakpoints.count(line)) {
-            cout << "Breakpoint at line " << line << ". Type 'help' for commands. ;3" << endl;
-            string command;
-            while (true) {
-                cout << "[crtz | debug mode]$ ";
-                getline(cin, command);
-                if (command == "step" || command == "s") {
-                    step();
-                    break;
-                } else if (command == "continue" || command == "c") {
-                    continueExecution();
-                    break;
-                } else if (command.rfind("print", 0) == 0 || command.rfind("p", 0) == 0) {
-                    string var;
-                    size_t space_pos = command.find(' ');
-                    if (space_pos != string::npos) {
-                        var = command.substr(space_pos + 1);
-                        printVar(var, prog);
-                    } else {
-                        cout << "Usage: print <variable>" << endl;
-                    }
-                } else if (command == "help" || command == "h") {
-                    printHelp();
-                } else if (command == "breakpoints" || command == "b") {
-                    listBreakpoints();
-                } else if (command.rfind("break", 0) == 0 || command.rfind("b", 0) == 0) {
-                    string line_str;
-                    size_t space_pos = command.find(' ');
-                    if (space_pos != string::npos) {
-                        line_str = command.substr(space_pos + 1);
-                        try {
-                            int line_num = stoi(line_str);
-                            addBreakpoint(line_num);
-                            cout << "Breakpoint added at line " << line_num << endl;
-                        } catch (...) {
-                            cout << "Invalid line number" << endl;
-                        }
-                    } else {
-                        cout << "Usage: break <line>" << endl;
-                    }
-                } else if (command.rfind("delete", 0) == 0 || command.rfind("d", 0) == 0) {
-                    string line_str;
-                    size_t space_pos = command.find(' ');
-                    if (space_pos != string::npos) {
-                        line_str = command.substr(space_pos + 1);
-                        try {
-                            int line_num = stoi(line_str);
-                            removeBreakpoint(line_num);
-                            cout << "Breakpoint removed at line " << line_num << endl;
-                        } catch (...) {
-                            cout << "Invalid line number" << endl;
-                        }
-                    } else {
-                        cout << "Usage: delete <line>" << endl;
-                    }
-                } else if (command == "variables" || command == "v") {
-                    listVariables(prog);
-                } else if (command == "quit" || command == "q") {
-                    exit(0);
-                } else {
-                    cout << "Unknown command. Type 'help' for available commands." << endl;
-                }
+    unordered_map<string, DerivedVar> derived;
+    unordered_map<string, vector<string>> derivedDependents;  // input -> derived vars reading it
+
+    // Data tables; table_get/table_sum/... calls index `tables`
+    struct TableDecl { string name; string path; int line; };
+    vector<TableDecl> tableDecls;
+    vector<shared_ptr<const CRTZ::Table>> tables;
+    unordered_map<string, int> tableIndex;
+    string baseDir;  // relative table paths resolve against the script's directory
+    string name;     // the file, or "script <hash>" for source text; scopes profile ids
+
+    // Translatable text: stringKeys[id] names it in translation files,
+    // stringFingerprint identifies the whole key list
+    vector<string> stringKeys;
+    uint64_t stringFingerprint = 0;
+
+    // With text compression on, node lines, choice and show texts are
+    // cleared and live here instead, by string id
+    bool textCompressed = false;
+    CRTZ::TextStore textStore;
+
+    // Built at link time, before text compression; see searchText
+    TextIndex textIndex;
+};
+
+// Text for a string id: from the compressed store, or `source` as parsed
+static string storedText(const Program& prog, int id, string_view source, CRTZ::TextCache& cache) {
+    if (prog.textCompressed && id >= 0) return string(cache.get(prog.textStore, (size_t)id));
+    return string(source);
+}
+
+// Words for the text index, lowercased: runs of letters, digits and UTF-8
+// bytes. "${expr}" and "[@You]" count as one word that matches nothing, so
+// phrases do not run across an interpolation.
+template <typename F>
+static void forEachWord(string_view text, F&& word) {
+    uint32_t pos = 0;
+    string w;
+    for (size_t i = 0; i < text.size();) {
+        unsigned char c = (unsigned char)text[i];
+        if (isalnum(c) || c >= 0x80) {
+            w.clear();
+            while (i < text.size() && (isalnum((unsigned char)text[i]) || (unsigned char)text[i] >= 0x80)) {
+                w.push_back((char)tolower((unsigned char)text[i++]));
             }
+            word(w, pos++);
+        } else if (text.compare(i, 2, "${") == 0 || text.compare(i, 6, "[@You]") == 0) {
+            size_t end = text.find(text[i] == '$' ? '}' : ']', i);
+            i = end == string_view::npos ? text.size() : end + 1;
+            pos++;
+        } else {
+            i++;
         }
     }
+}
 
-private:
-    void printVar(const string& var, const Program& prog) {
-        if (prog.vars.count(var)) {
-            cout << var << " = " << prog.vars.at(var) << endl;
-        } else if (prog.boolVars.count(var)) {
-            cout << var << " = " << (prog.boolVars.at(var) ? "true" : "false") << endl;
-        } else if (prog.stringVars.count(var)) {
-            cout << var << " = " << prog.stringVars.at(var) << endl;
-        } else {
-            // Check if it's an object field
-            auto pr = splitDot(var);
-            if (!pr.second.empty() && prog.objects.count(pr.first) && prog.objects.at(pr.first).count(pr.second)) {
-                cout << var << " = " << prog.objects.at(pr.first).at(pr.second) << endl;
-            } else {
-                cout << "Variable not found." << endl;
-            }
+// Text of each string id as parsed; call before compressText
+static vector<string_view> parsedTexts(const Program& prog) {
+    vector<string_view> texts(prog.stringKeys.size());
+    for (auto& kv : prog.nodes) {
+        const Node& node = kv.second;
+        if (node.textId >= 0) texts[node.textId] = node.text;
+        for (auto& c : node.choices) texts[c.textId] = c.text;
+        for (size_t i = 0; i < node.actions.size(); ++i) {
+            if (node.actionTextIds[i] >= 0) texts[node.actionTextIds[i]] = string_view(node.actions[i]).substr(5);
         }
     }
+    return texts;
+}
 
-    void listVariables(const Program& prog) {
-        cout << "Integer variables:" << endl;
-        for (const auto& var : prog.vars) {
-            cout << "  " << var.first << " = " << var.second << endl;
-        }
-        
-        cout << "Boolean variables:" << endl;
-        for (const auto& var : prog.boolVars) {
-            cout << "  " << var.first << " = " << (var.second ? "true" : "false") << endl;
+static void buildTextIndex(Program& prog) {
+    vector<string_view> texts = parsedTexts(prog);
+    unordered_map<string, vector<TextIndex::Posting>> byTerm;
+    for (uint32_t id = 0; id < texts.size(); ++id) {
+        forEachWord(texts[id], [&](const string& w, uint32_t pos) { byTerm[w].push_back({ id, pos }); });
+    }
+    TextIndex& index = prog.textIndex;
+    index = TextIndex();
+    index.terms.reserve(byTerm.size());
+    for (auto& kv : byTerm) index.terms.push_back(kv.first);
+    sort(index.terms.begin(), index.terms.end());
+    index.termStart.reserve(index.terms.size() + 1);
+    for (auto& t : index.terms) {
+        index.termStart.push_back((uint32_t)index.postings.size());
+        auto& list = byTerm[t];
+        index.postings.insert(index.postings.end(), list.begin(), list.end());
+    }
+    index.termStart.push_back((uint32_t)index.postings.size());
+}
+
+// String ids whose text contains the words of query in a row, ignoring case
+// and punctuation; the last word may be the start of a longer one. Looks up
+// each word, then checks phrase positions starting from the rarest.
+static vector<int> searchText(const Program& prog, string_view query) {
+    const TextIndex& index = prog.textIndex;
+    vector<string> words;
+    forEachWord(query, [&](const string& w, uint32_t) { words.push_back(w); });
+    if (words.empty()) return {};
+    vector<vector<TextIndex::Posting>> lists(words.size());
+    for (size_t i = 0; i < words.size(); ++i) {
+        auto first = lower_bound(index.terms.begin(), index.terms.end(), words[i]);
+        auto last = first;
+        if (i + 1 < words.size()) {
+            if (last != index.terms.end() && *last == words[i]) ++last;
+        } else {
+            while (last != index.terms.end() && last->compare(0, words[i].size(), words[i]) == 0) ++last;
         }
-        
-        cout << "String variables:" << endl;
-        for (const auto& var : prog.stringVars) {
-            cout << "  " << var.first << " = " << var.second << endl;
+        size_t from = first - index.terms.begin(), to = last - index.terms.begin();
+        for (size_t t = from; t < to; ++t) {
+            lists[i].insert(lists[i].end(), index.postings.begin() + index.termStart[t], index.postings.begin() + index.termStart[t + 1]);
         }
-        
-        cout << "Object fields:" << endl;
-        for (const auto& obj : prog.objects) {
-            for (const auto& field : obj.second) {
-                cout << "  " << obj.first << "." << field.first << " = " << field.second << endl;
-            }
+        if (lists[i].empty()) return {};
+        if (to - from > 1) sort(lists[i].begin(), lists[i].end());
+    }
+    size_t rarest = 0;
+    for (size_t i = 1; i < lists.size(); ++i) {
+        if (lists[i].size() < lists[rarest].size()) rarest = i;
+    }
+    vector<int> found;
+    for (auto& p : lists[rarest]) {
+        if (p.pos < rarest || (!found.empty() && found.back() == (int)p.text)) continue;
+        uint32_t start = p.pos - (uint32_t)rarest;
+        bool all = true;
+        for (size_t i = 0; i < lists.size() && all; ++i) {
+            all = i == rarest || binary_search(lists[i].begin(), lists[i].end(), TextIndex::Posting{ p.text, start + (uint32_t)i });
         }
+        if (all) found.push_back((int)p.text);
     }
+    return found;
+}
 
-    void listBreakpoints() {
-        if (breakpoints.empty()) {
-            cout << "No breakpoints set." << endl;
-        } else {
-            cout << "Breakpoints at lines:";
-            for (int line : breakpoints) {
-                cout << " " << line;
-            }
-            cout << endl;
-        }
+// Where a string id's text lives, from its key ("node.line",
+// "node.choice.<id>", "node.show.<n>", see assignStringIds)
+struct TextSite {
+    const Node* node = nullptr;
+    string part;  // "line", "choice 2", "show 1"
+    string_view source;
+};
+
+static TextSite textSite(const Program& prog, int id) {
+    TextSite site;
+    const string& key = prog.stringKeys[id];
+    size_t dot = key.rfind('.');
+    bool line = key.compare(dot + 1, string::npos, "line") == 0;
+    size_t nameEnd = line ? dot : key.rfind('.', dot - 1);
+    auto it = prog.nodes.find(key.substr(0, nameEnd));
+    if (it == prog.nodes.end()) return site;
+    site.node = &it->second;
+    site.part = key.substr(nameEnd + 1);
+    replace(site.part.begin(), site.part.end(), '.', ' ');
+    if (site.node->textId == id) site.source = site.node->text;
+    for (auto& c : site.node->choices) {
+        if (c.textId == id) site.source = c.text;
+    }
+    for (size_t i = 0; i < site.node->actions.size(); ++i) {
+        if (site.node->actionTextIds[i] == id) site.source = string_view(site.node->actions[i]).substr(5);
     }
+    return site;
+}
 
-    void printHelp() {
-        cout << "Debugger commands:" << endl;
-        cout << "  step (s):           Execute the next line." << endl;
-        cout << "  continue (c):       Continue execution until the next breakpoint." << endl;
-        cout << "  print (p) <var>:    Print the value of a variable." << endl;
-        cout << "  variables (v):      List all variables." << endl;
-        cout << "  break (b) <line>:   Set a breakpoint at the specified line." << endl;
-        cout << "  delete (d) <line>:  Remove a breakpoint at the specified line." << endl;
-        cout << "  breakpoints (b):    List all breakpoints." << endl;
-        cout << "  quit (q):           Exit the program." << endl;
-        cout << "  help (h):           Show this help message." << endl;
+// searchText results with their sites, in script order
+static vector<pair<int, TextSite>> findText(const Program& prog, string_view query) {
+    vector<pair<int, TextSite>> found;
+    for (int id : searchText(prog, query)) {
+        TextSite site = textSite(prog, id);
+        if (site.node) found.emplace_back(id, move(site));
     }
+    stable_sort(found.begin(), found.end(), [](const pair<int, TextSite>& a, const pair<int, TextSite>& b) {
+        return a.second.node->definitionLine < b.second.node->definitionLine;
+    });
+    return found;
+}
 
-    unordered_set<int> breakpoints;
-    bool stepping = false;
+// Process-wide metrics kept by the interpreter (see CRTZ::Metrics). Work
+// done by speculative copies is counted when a copy is adopted.
+struct InterpreterMetrics {
+    CRTZ::Metrics& m = CRTZ::Metrics::global();
+    int sessions = m.counter("crtz_sessions_total", "Sessions started");
+    int nodes = m.counter("crtz_node_transitions_total", "Nodes entered");
+    int methods = m.counter("crtz_method_calls_total", "Script method calls");
+    int choices = m.counter("crtz_choices_total", "Choices made");
+    int choiceLatency = m.histogram("crtz_choice_latency_seconds", "Time from a choice to the end of the output it leads to", 1e-9);
+    int stepTime = m.histogram("crtz_step_seconds", "Time spent in one step()", 1e-9);
+    int imageLoad = m.histogram("crtz_image_load_seconds", "Time to load one picture folder", 1e-9);
 };
 
-// ----------------------- Parser -----------------------
+static InterpreterMetrics& metrics() {
+    static InterpreterMetrics im;
+    return im;
+}
 
-class Parser {
-    Lexer lex;
-    Token tk;
-    Program prog;
-public:
-    Parser(const string& src) : lex(src) { tk = lex.next(); }
-    Token peek() { return tk; }
-    Token consume() {
-        Token t = tk; tk = lex.next(); return t;
+static uint64_t nowNanos() {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Lets Engine::memoryStats find a live session and read it between steps:
+// step(), choose() and speculation hold `lock`, and the session clears
+// `state` under it when destroyed. Forks share their session's tracker.
+// Recursive, so a watcher or host function may ask for stats mid-step.
+struct SessionTracker {
+    recursive_mutex lock;
+    const SessionState* state = nullptr;
+};
+
+// Resources shared by every script and session created from one Engine
+struct EngineResources {
+    ImageDriver images;
+    bool imagesTried = false;
+    bool headless = false;  // see Engine::setHeadless
+    mutex imagesMutex;
+
+    // Optional shared-memory export (see Engine::enableStateExport)
+    shared_ptr<CRTZ::StateSegment> stateSegment;
+    vector<string> exportedVars;
+
+    // Budgets given to new sessions (see Engine::setLimits)
+    CRTZ::Limits limits;
+
+    // Translations mapped so far, by file; switching back is free
+    unordered_map<string, shared_ptr<const CRTZ::StringTable>> languages;
+    mutex languagesMutex;
+
+    // Autosave journal shared by every session (see Engine::enableJournal)
+    shared_ptr<CRTZ::Journal> journal;
+
+    // Scripts and sessions alive, for Engine::memoryStats. Expired entries
+    // are swept when a list doubles, so adding stays amortized O(1).
+    vector<weak_ptr<const Program>> programs;
+    vector<weak_ptr<SessionTracker>> sessions;
+    size_t programsSweep = 64, sessionsSweep = 64;
+    mutex trackMutex;
+
+    template <typename T>
+    void track(vector<weak_ptr<T>>& list, size_t& sweepAt, const shared_ptr<T>& p) {
+        lock_guard<mutex> lock(trackMutex);
+        if (list.size() >= sweepAt) {
+            list.erase(remove_if(list.begin(), list.end(), [](const weak_ptr<T>& w) { return w.expired(); }), list.end());
+            sweepAt = max<size_t>(64, list.size() * 2);
+        }
+        list.push_back(p);
     }
-    bool acceptIdent(const string& s) {
-        if (tk.kind == TK_IDENT && tk.text == s) { consume(); return true; }
-        return false;
+
+    // SDL is only brought up the first time a script touches images
+    ImageDriver* imageDriver() {
+        lock_guard<mutex> lock(imagesMutex);
+        if (headless) return nullptr;
+        if (!imagesTried) {
+            imagesTried = true;
+            if (!images.init()) {
+                cerr << "Warning: ImageDriver failed to initialize. Image commands will be disabled.\n";
+            }
+        }
+        return images.isInitialized() ? &images : nullptr;
     }
-    bool expectSym(const string& s) {
-        if (tk.kind == TK_SYM && tk.text == s) { consume(); return true; }
-        cerr << "Error at line " << tk.line << ": Expected symbol '" << s << "' but got '" << tk.text << "'\n";
+};
+
+class Debugger;
+
+// What a session last committed to the autosave journal, in the session's
+// own types so a step's changes are found without building any keys
+struct JournalShadow {
+    string node;
+    int room = -1;
+    int status = -1;
+    uint64_t steps = 0, nodeVisits = 0, choicesMade = 0;
+    uint64_t rng[4] = {};
+    unordered_map<string, int> vars;
+    unordered_map<string, bool> boolVars;
+    unordered_map<string, string> stringVars;
+    unordered_map<string, unordered_map<string, int>> objects;
+    unordered_map<string, string> instanceClass;
+    vector<uint64_t> roomItems;
+    vector<uint64_t> inventory;
+};
+
+// Story-graph traffic of one session (Session::recordGraph), by node
+// address until it is handed out as names
+struct GraphTrace {
+    struct Visits { uint64_t count = 0; uint64_t nanos = 0; };
+    unordered_map<const Node*, Visits> nodes;
+    map<tuple<const Node*, const Node*, bool>, uint64_t> edges;
+    const Node* last = nullptr;
+    bool viaChoice = false;  // the next entry follows a choice
+    bool timing = false;     // enteredAt is running, i.e. not waiting for input
+    uint64_t enteredAt = 0;
+
+    void enter(const Node* node, uint64_t now) {
+        if (last) {
+            if (timing) nodes[last].nanos += now - enteredAt;
+            edges[make_tuple(last, node, viaChoice)]++;
+        }
+        nodes[node].count++;
+        last = node;
+        viaChoice = false;
+        timing = true;
+        enteredAt = now;
+    }
+
+    void pause(uint64_t now) {
+        if (last && timing) nodes[last].nanos += now - enteredAt;
+        timing = false;
+    }
+};
+
+// Mutable state of one run; the Program it executes is shared and read-only
+struct SessionState {
+    shared_ptr<const Program> prog;
+    shared_ptr<EngineResources> resources;
+    string playerName;
+
+    string current;
+    unordered_map<string, int> vars;
+    unordered_map<string, bool> boolVars;
+    unordered_map<string, string> stringVars;
+    unordered_map<string, unordered_map<string, int>> objects;
+    unordered_map<string, string> instanceClass;
+    unordered_map<string, vector<int>> pictureArrays;
+    int room = -1;  // index into prog->roomNames
+    Rng rng;        // rand(), chance() and dice literals (see Session::seed)
+
+    // Active translation; text without one comes from the script
+    shared_ptr<const CRTZ::StringTable> language;
+    mutable CRTZ::TextCache textCache;
+    string localize(int id, string_view source) const {
+        if (language && id >= 0 && (size_t)id < language->size()) {
+            string_view t = language->at(id);
+            if (!t.empty()) return string(t);
+        }
+        return storedText(*prog, id, source, textCache);
+    }
+
+    // Items: per-room sets ([room * itemWords + word]), the player's
+    // inventory and item -> rooms, all kept in step by take/drop
+    vector<uint64_t> roomItems;
+    vector<uint64_t> inventory;
+    vector<vector<int>> itemRooms;
+
+    static bool hasBit(const uint64_t* set, int i) { return (set[i >> 6] >> (i & 63)) & 1; }
+    static void putBit(uint64_t* set, int i, bool on) {
+        if (on) set[i >> 6] |= uint64_t(1) << (i & 63);
+        else set[i >> 6] &= ~(uint64_t(1) << (i & 63));
+    }
+    const uint64_t* itemsIn(int r) const { return roomItems.data() + (size_t)r * prog->itemWords; }
+    uint64_t* itemsIn(int r) { return roomItems.data() + (size_t)r * prog->itemWords; }
+
+    CRTZ::Session::Status status = CRTZ::Session::Running;
+    vector<CRTZ::ChoiceInfo> choices;
+    bool started = false;
+    ostream* out = &cout;
+    ostream* err = &cerr;  // runtime diagnostics
+    shared_ptr<Debugger> debugger;
+
+    uint64_t steps = 0;
+    uint64_t nodeVisits = 0;
+    uint64_t choicesMade = 0;
+    uint64_t methodCalls = 0;
+    uint64_t choseAt = 0;  // nowNanos() of the choice the next step() answers
+
+    // Budgets. Fuel is refilled by every step() and burned by node visits
+    // (so every jump) and method calls; running dry suspends the session at
+    // the next node. The other limits fail the session outright.
+    CRTZ::Limits limits;
+    uint64_t fuel = 0;
+    unsigned callDepth = 0;
+    size_t stringBytes = 0;
+    string error;
+
+    void burnFuel() { if (fuel) --fuel; }
+
+    void fail(const string& why) {
+        if (status == CRTZ::Session::Failed) return;
+        status = CRTZ::Session::Failed;
+        error = why;
+    }
+
+    bool allowInstance(const string& inst) {
+        if (!limits.maxInstances || instanceClass.count(inst) || instanceClass.size() < limits.maxInstances) return true;
+        fail("instance limit of " + to_string(limits.maxInstances) + " reached creating '" + inst + "'");
         return false;
     }
-    void parse() {
-        while (tk.kind != TK_EOF) {
-            if (tk.kind == TK_IDENT) {
-                if (tk.text == "npc") { parseNpc(); }
-                else if (tk.text == "desc") { parseDesc(); }
-                else if (tk.text == "int" || tk.text == "string" || tk.text == "match") { parseVarDecl(); }
-                else if (tk.text == "node") { parseNode(); }
-                else if (tk.text == "class") { parseClass(); }
-                else if (tk.text == "new") { parseNewInstance(); }
-                else if (tk.text == "room") { parseRoom(); }
-                else {
-                    cerr << "Error at line " << tk.line << ": Unknown top-level keyword: " << tk.text << "\n";
-                    consume();
-                }
-            } else {
-                consume();
-            }
+
+    // Stores a string variable if the session's string budget allows it
+    bool setString(const string& name, string value) {
+        auto it = stringVars.find(name);
+        size_t old = it == stringVars.end() ? 0 : it->second.size();
+        size_t total = stringBytes - old + value.size();
+        if (limits.maxStringBytes && total > limits.maxStringBytes && value.size() > old) return false;
+        stringVars[name] = move(value);
+        stringBytes = total;
+        return true;
+    }
+
+    // Grows a string variable in place (amortized, no copy of the old text)
+    bool appendString(const string& name, string_view more) {
+        if (limits.maxStringBytes && stringBytes + more.size() > limits.maxStringBytes) return false;
+        stringVars[name].append(more);
+        stringBytes += more.size();
+        return true;
+    }
+
+    // Registration with the engine's memory accounting (see SessionTracker)
+    shared_ptr<SessionTracker> tracker;
+    unique_lock<recursive_mutex> pause() const {
+        return tracker ? unique_lock<recursive_mutex>(tracker->lock) : unique_lock<recursive_mutex>();
+    }
+
+    // Autosave (Session::autosave): changes since shadow are committed
+    // under journalId at the end of every step
+    shared_ptr<CRTZ::Journal> journal;
+    string journalId;
+    shared_ptr<JournalShadow> shadow;
+    bool resumed = false;  // restored at a menu: the next step() shows it again
+
+    shared_ptr<GraphTrace> graph;  // Session::recordGraph
+
+    // Slot in the engine's state segment, if exporting
+    shared_ptr<CRTZ::StateSegment> exportSegment;
+    CRTZ::StateSlot* exportSlot = nullptr;
+
+    // Variable observers (Session::watch). Writes mark watches dirty; the
+    // end of each step delivers every dirty watch whose value changed, once.
+    struct Watch {
+        string name;
+        CRTZ::Session::Watcher fn;
+        CRTZ::Value last;
+        bool dirty = false;
+    };
+    vector<Watch> watches;
+    unordered_map<string, vector<size_t>> watchIndex;
+    vector<size_t> dirtyWatches;
+
+    void markDirty(size_t i) {
+        if (!watches[i].dirty) {
+            watches[i].dirty = true;
+            dirtyWatches.push_back(i);
         }
     }
-    void parseRoom() {
-        consume();
-        if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": room expects a name\n"; return; }
-        string roomName = tk.text; consume();
 
-        if (!(tk.kind == TK_SYM && tk.text == "{")) { cerr << "Error at line " << tk.line << ": expected '{' after room name\n"; return; }
-        consume();
+    // Derived variables whose inputs were written since they were last computed
+    unordered_set<string> dirtyDerived;
 
-        Room room;
-        room.name = roomName;
+    void invalidateDerived(const string& name) {
+        if (dirtyDerived.insert(name).second) noteWrite(name);
+    }
 
-        while (!(tk.kind == TK_SYM && tk.text == "}") && tk.kind != TK_EOF) {
-            if (tk.kind == TK_IDENT) {
-                if (tk.text == "desc") {
-                    consume();
-                    if (tk.kind == TK_STRING) {
-                        room.description = tk.text; consume();
-                        expectSym(";");
-                    }
-                } else if (tk.text == "exit") {
-                    consume();
-                    if (tk.kind == TK_IDENT) {
-                        string dir = tk.text; consume();
-                        if (tk.kind == TK_IDENT) {
-                            string target = tk.text; consume();
-                            room.exits[dir] = target;
-                            expectSym(";");
-                        }
-                    }
-                } else if (tk.text == "item") {
-                    consume();
-                    if (tk.kind == TK_IDENT) {
-                        room.items.push_back(tk.text); consume();
-                        expectSym(";");
-                    }
-                } else if (tk.text == "npc") {
-                    consume();
-                    if (tk.kind == TK_IDENT) {
-                        room.npcs.push_back(tk.text); consume();
-                        expectSym(";");
-                    }
-                } else {
-                    consume();
-                }
-            } else {
-                consume();
+    // Write barrier for a single variable or "inst.field"
+    void noteWrite(const string& name) {
+        if (!prog->derivedDependents.empty()) {
+            auto dit = prog->derivedDependents.find(name);
+            if (dit != prog->derivedDependents.end()) {
+                for (auto& d : dit->second) invalidateDerived(d);
             }
         }
-        expectSym("}");
-        prog.rooms[roomName] = room;
-        if (prog.currentRoom.empty()) prog.currentRoom = roomName;
+        if (watchIndex.empty()) return;
+        auto it = watchIndex.find(name);
+        if (it == watchIndex.end()) return;
+        for (size_t i : it->second) markDirty(i);
     }
 
-    void parseNpc() {
-        consume();
-        if (tk.kind == TK_STRING) {
-            prog.npc = tk.text; consume();
-            expectSym(";");
-        } else { cerr << "Error at line " << tk.line << ": npc requires string\n"; }
+    // Write barrier for one object field (method write-back, inline new)
+    void noteFieldWrite(const string& inst, const string& field) {
+        if (prog->derivedDependents.empty() && watchIndex.empty()) return;
+        noteWrite(inst + "." + field);
     }
-    void parseDesc() {
-        consume();
-        if (tk.kind == TK_STRING) {
-            prog.desc = tk.text; consume();
-            expectSym(";");
-        } else { cerr << "Error at line " << tk.line << ": desc requires string\n"; }
+
+    // Speculative runs of each choice target, made while the player reads the
+    // menu (see speculate). A fork never owns an export slot, observers, a
+    // debugger or a real output stream, and gives up before touching the host.
+    // Forks share cancelSpeculation with the session: choose() sets it so
+    // runs still going stop at their next node, and step() starts the next
+    // menu with a fresh flag. Forks run without the session's lock; anything
+    // that changes what they were forked from calls dropSpeculations, and
+    // speculate only keeps its results if the epoch is unchanged.
+    struct Speculation {
+        int choiceId = 0;
+        shared_ptr<SessionState> state;
+        string output;
+        string errors;
+    };
+    vector<Speculation> speculations;
+    uint64_t speculationEpoch = 0;
+    bool speculative = false;
+    bool speculationAborted = false;
+    shared_ptr<atomic<bool>> cancelSpeculation = make_shared<atomic<bool>>(false);
+
+    void dropSpeculations() {
+        speculations.clear();
+        speculationEpoch++;
     }
+    bool precomputed = false;  // the next step() only replays precomputedOutput
+    string precomputedOutput;
+    string precomputedErrors;
 
-    void parseVarDecl() {
-        string type = tk.text;
-        consume();
+    shared_ptr<SessionState> fork() const {
+        shared_ptr<SessionState> f(new SessionState(*this));
+        f->exportSegment.reset();
+        f->exportSlot = nullptr;
+        f->watches.clear();
+        f->watchIndex.clear();
+        f->dirtyWatches.clear();
+        f->debugger.reset();
+        f->out = nullptr;
+        f->err = nullptr;
+        f->speculations.clear();
+        f->graph.reset();
+        f->speculative = true;
+        return f;
+    }
 
-        if (tk.kind == TK_IDENT) {
-            string name = tk.text; consume();
-            if (tk.kind == TK_SYM && tk.text == "=") {
-                consume();
-                if (type == "string") {
-                    if (tk.kind == TK_STRING_DEC || tk.kind == TK_STRING) {
-                        string value = tk.text; consume();
-                        expectSym(";");
-                        prog.stringVars[name] = value;
-                    } else {
-                        cerr << "Error at line " << tk.line << ": String variable requires string literal\n";
-                    }
-                } else if (type == "match") {
-                    if (tk.kind == TK_TRUE || tk.kind == TK_FALSE) {
-                        bool value = (tk.kind == TK_TRUE);
-                        consume();
-                        expectSym(";");
-                        prog.boolVars[name] = value;
-                    } else {
-                        cerr << "Error at line " << tk.line << ": Boolean variable requires true or false\n";
-                    }
-                } else {
-                    string expr;
-                    while (!(tk.kind == TK_SYM && tk.text == ";") && tk.kind != TK_EOF) {
-                        expr += tk.text;
-                        consume();
-                    }
-                    expectSym(";");
-                    auto tokens = tokenizeExpr(expr);
-                    auto rpn = infixToRPN(tokens);
-                    unordered_map<string, unordered_map<string, int>> emptyobjs;
-                    int val = evalRPN(rpn, prog.vars, prog.boolVars, emptyobjs);
-                    prog.vars[name] = val;
+    SessionState(const SessionState&) = default;
+    SessionState& operator=(SessionState&&) = default;
+
+    SessionState(shared_ptr<const Program> p, shared_ptr<EngineResources> r, const string& player)
+        : prog(move(p)), resources(move(r)), playerName(player),
+          current(prog->entry), vars(prog->vars), boolVars(prog->boolVars), stringVars(prog->stringVars),
+          objects(prog->objects), instanceClass(prog->instanceClass), room(prog->startRoom),
+          roomItems(prog->roomItemsInit), inventory(prog->itemWords, 0), itemRooms(prog->itemRoomsInit) {
+        for (auto& kv : prog->derived) dirtyDerived.insert(kv.first);
+        for (auto& kv : stringVars) stringBytes += kv.second.size();
+        metrics().m.add(metrics().sessions);
+        if (resources) {
+            limits = resources->limits;
+            tracker = make_shared<SessionTracker>();
+            tracker->state = this;
+            resources->track(resources->sessions, resources->sessionsSweep, tracker);
+        }
+        if (resources && resources->stateSegment) {
+            exportSegment = resources->stateSegment;
+            exportSlot = exportSegment->acquireSlot();
+            if (exportSlot) {
+                CRTZ::beginWrite(*exportSlot);
+                CRTZ::copyField(exportSlot->player, sizeof(exportSlot->player), playerName);
+                size_t n = min(resources->exportedVars.size(), CRTZ::kStateMaxVars);
+                for (size_t i = 0; i < n; ++i) {
+                    CRTZ::copyField(exportSlot->vars[i].name, sizeof(exportSlot->vars[i].name), resources->exportedVars[i]);
+                    exportSlot->vars[i].value = 0;
                 }
-            } else {
-                if (type == "string") prog.stringVars[name] = "";
-                else if (type == "match") prog.boolVars[name] = false;
-                else prog.vars[name] = 0;
-                expectSym(";");
+                exportSlot->varCount = (uint32_t)n;
+                CRTZ::endWrite(*exportSlot);
             }
-        } else {
-            cerr << "Error at line " << tk.line << ": " << type << " expects identifier\n";
         }
     }
 
-    void parseClass() {
-        consume();
-        if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": class expects a name\n"; return; }
-        string className = tk.text; consume();
-        if (!(tk.kind == TK_SYM && tk.text == "{")) { cerr << "Error at line " << tk.line << ": expected '{' after class name\n"; return; }
-        consume();
-        ClassDef cdef; cdef.name = className;
+    ~SessionState() {
+        if (exportSlot) exportSegment->releaseSlot(exportSlot);
+        if (tracker && tracker->state == this) {
+            lock_guard<recursive_mutex> lock(tracker->lock);
+            tracker->state = nullptr;
+        }
+    }
 
-        while (!(tk.kind == TK_SYM && tk.text == "}") && tk.kind != TK_EOF) {
-            if (tk.kind == TK_IDENT) {
-                if (tk.text == "int") {
-                    consume();
-                    if (tk.kind == TK_IDENT) {
-                        string fname = tk.text; consume();
-                        int fval = 0;
-                        if (tk.kind == TK_SYM && tk.text == "=") {
-                            consume();
-                            string expr;
-                            while (!(tk.kind == TK_SYM && tk.text == ";") && tk.kind != TK_EOF) {
-                                expr += tk.text; consume();
-                            }
-                            expectSym(";");
-                            unordered_map<string, unordered_map<string, int>> emptyobjs;
-                            auto tokens = tokenizeExpr(expr);
-                            auto rpn = infixToRPN(tokens);
-                            fval = evalRPN(rpn, prog.vars, prog.boolVars, emptyobjs);
-                        } else {
-                            expectSym(";");
-                        }
-                        cdef.fields[fname] = fval;
-                    } else {
-                        cerr << "Error at line " << tk.line << ": field expects identifier\n"; consume();
-                    }
-                } else if (tk.text == "void") {
-                    consume();
-                    if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": method expects a name\n"; continue; }
-                    string mname = tk.text; consume();
-                    vector<string> params;
-                    if (!(tk.kind == TK_SYM && tk.text == "(")) { cerr << "Error at line " << tk.line << ": expected '(' after method name\n"; }
-                    consume();
-                    while (!(tk.kind == TK_SYM && tk.text == ")") && tk.kind != TK_EOF) {
-                        if (tk.kind == TK_IDENT) {
-                            string pname = tk.text;
-                            params.push_back(pname);
-                            consume();
-                            if (tk.kind == TK_SYM && tk.text == ",") { consume(); continue; }
-                        } else if (tk.kind == TK_SYM && tk.text == ",") { consume(); continue; }
-                        else { consume(); }
+    ImageDriver* images() { return resources ? resources->imageDriver() : nullptr; }
+    bool headless() const { return resources && resources->headless; }
+};
+
+static void refreshDerived(SessionState& ss, const string& name);
+
+static ostream& diagnostics(const SessionState* ss) { return ss && ss->err ? *ss->err : cerr; }
+
+static void refreshIfDerived(SessionState& ss, const string& name) {
+    if (!ss.dirtyDerived.empty() && ss.dirtyDerived.count(name)) refreshDerived(ss, name);
+}
+
+// ----------------------- Debugger -----------------------
+
+class Debugger {
+public:
+    void addBreakpoint(int line) {
+        breakpoints.insert(line);
+    }
+
+    void removeBreakpoint(int line) {
+        breakpoints.erase(line);
+    }
+
+    void step() {
+        stepping = true;
+    }
+
+    void continueExecution() {
+        stepping = false;
+    }
+
+    void check(int line, const SessionState& prog) {
+        if (stepping || breakpoints.count(line)) {
+            cout << "Breakpoint at line " << line << ". Type 'help' for commands. ;3" << endl;
+            string command;
+            while (true) {
+                cout << "[crtz | debug mode]$ ";
+                getline(cin, command);
+                if (command == "step" || command == "s") {
+                    step();
+                    break;
+                } else if (command == "continue" || command == "c") {
+                    continueExecution();
+                    break;
+                } else if (command.rfind("find", 0) == 0 || command.rfind("f ", 0) == 0) {
+                    size_t space_pos = command.find(' ');
+                    find(space_pos == string::npos ? "" : command.substr(space_pos + 1), prog);
+                } else if (command.rfind("jump", 0) == 0 || command.rfind("j ", 0) == 0) {
+                    size_t space_pos = command.find(' ');
+                    if (space_pos == string::npos) {
+                        cout << "Usage: jump <match number | node>" << endl;
+                    } else if (jump(command.substr(space_pos + 1), prog)) {
+                        break;
                     }
-                    expectSym(")");
-                    if (!(tk.kind == TK_SYM && tk.text == "{")) { cerr << "Error at line " << tk.line << ": expected '{' for method body\n"; continue; }
-                    consume();
-                    vector<string> methodActions;
-                    while (!(tk.kind == TK_SYM && tk.text == "}") && tk.kind != TK_EOF) {
-                        string stmt;
-                        while (!(tk.kind == TK_SYM && tk.text == ";") && !(tk.kind == TK_SYM && tk.text == "}") && tk.kind != TK_EOF) {
-                            stmt += tk.text;
-                            consume();
+                } else if (command.rfind("print", 0) == 0 || command.rfind("p", 0) == 0) {
+                    string var;
+                    size_t space_pos = command.find(' ');
+                    if (space_pos != string::npos) {
+                        var = command.substr(space_pos + 1);
+                        printVar(var, prog);
+                    } else {
+                        cout << "Usage: print <variable>" << endl;
+                    }
+                } else if (command == "help" || command == "h") {
+                    printHelp();
+                } else if (command == "breakpoints" || command == "b") {
+                    listBreakpoints();
+                } else if (command.rfind("break", 0) == 0 || command.rfind("b", 0) == 0) {
+                    string line_str;
+                    size_t space_pos = command.find(' ');
+                    if (space_pos != string::npos) {
+                        line_str = command.substr(space_pos + 1);
+                        try {
+                            int line_num = stoi(line_str);
+                            addBreakpoint(line_num);
+                            cout << "Breakpoint added at line " << line_num << endl;
+                        } catch (...) {
+                            cout << "Invalid line number" << endl;
                         }
-                        if (tk.kind == TK_SYM && tk.text == ";") {
-                            string s = trim(stmt);
-                            if (!s.empty()) methodActions.push_back(string("STMT ") + s);
-                            consume();
-                        } else {
-                            string s = trim(stmt);
-                            if (!s.empty()) methodActions.push_back(string("STMT ") + s);
+                    } else {
+                        cout << "Usage: break <line>" << endl;
+                    }
+                } else if (command.rfind("delete", 0) == 0 || command.rfind("d", 0) == 0) {
+                    string line_str;
+                    size_t space_pos = command.find(' ');
+                    if (space_pos != string::npos) {
+                        line_str = command.substr(space_pos + 1);
+                        try {
+                            int line_num = stoi(line_str);
+                            removeBreakpoint(line_num);
+                            cout << "Breakpoint removed at line " << line_num << endl;
+                        } catch (...) {
+                            cout << "Invalid line number" << endl;
                         }
+                    } else {
+                        cout << "Usage: delete <line>" << endl;
                     }
-                    expectSym("}");
-                    cdef.methods[mname] = methodActions;
-                    cdef.methodParams[mname] = params;
+                } else if (command == "variables" || command == "v") {
+                    listVariables(prog);
+                } else if (command == "quit" || command == "q") {
+                    exit(0);
                 } else {
-                    cerr << "Error at line " << tk.line << ": Unknown class member: " << tk.text << "\n";
-                    consume();
+                    cout << "Unknown command. Type 'help' for available commands." << endl;
                 }
+            }
+        }
+    }
+
+    // Node to continue at instead of the one being checked (set by jump)
+    string jumpTo;
+
+private:
+    // Lists the text that contains query (from the program's text index)
+    // and breaks at the nodes of the matches listed
+    void find(string query, const SessionState& prog) {
+        while (!query.empty() && isspace((unsigned char)query.back())) query.pop_back();
+        size_t start = query.find_first_not_of(" \t");
+        query = start == string::npos ? "" : query.substr(start);
+        if (query.size() >= 2 && query.front() == '"' && query.back() == '"') query = query.substr(1, query.size() - 2);
+        if (query.empty()) {
+            cout << "Usage: find \"text\"" << endl;
+            return;
+        }
+        const Program& program = *prog.prog;
+        auto began = chrono::steady_clock::now();
+        vector<pair<int, TextSite>> found = findText(program, query);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - began).count();
+        matches.clear();
+        CRTZ::TextCache cache;
+        size_t added = 0;
+        for (auto& [id, site] : found) {
+            matches.push_back(site.node->name);
+            if (matches.size() > kFindListed) continue;
+            added += breakpoints.insert(site.node->definitionLine).second;
+            string text = storedText(program, id, site.source, cache);
+            if (text.size() > 60) text = text.substr(0, 57) + "...";
+            cout << "  [" << matches.size() << "] " << site.node->name << " (line " << site.node->definitionLine << ", "
+                 << site.part << "): " << text << endl;
+        }
+        if (matches.size() > kFindListed) cout << "  ... " << matches.size() - kFindListed << " more (no breakpoints; narrow the search)" << endl;
+        cout << matches.size() << " match" << (matches.size() == 1 ? "" : "es") << " in " << ms << " ms";
+        if (!matches.empty()) cout << "; " << added << " breakpoint" << (added == 1 ? "" : "s") << " added, 'jump <n>' goes to a match now";
+        cout << endl;
+    }
+
+    // Continues at match n of the last find, or at a node by name
+    bool jump(const string& target, const SessionState& prog) {
+        string node = target;
+        if (!target.empty() && isdigit((unsigned char)target[0])) {
+            size_t n = (size_t)atoi(target.c_str());
+            if (n < 1 || n > matches.size()) {
+                cout << "No match " << target << "; run find first" << endl;
+                return false;
+            }
+            node = matches[n - 1];
+        }
+        if (!prog.prog->nodes.count(node)) {
+            cout << "Unknown node: " << node << endl;
+            return false;
+        }
+        jumpTo = node;
+        return true;
+    }
+
+    void printVar(const string& var, const SessionState& prog) {
+        if (prog.vars.count(var)) {
+            cout << var << " = " << prog.vars.at(var) << endl;
+        } else if (prog.boolVars.count(var)) {
+            cout << var << " = " << (prog.boolVars.at(var) ? "true" : "false") << endl;
+        } else if (prog.stringVars.count(var)) {
+            cout << var << " = " << prog.stringVars.at(var) << endl;
+        } else {
+            // Check if it's an object field
+            auto pr = splitDot(var);
+            if (!pr.second.empty() && prog.objects.count(pr.first) && prog.objects.at(pr.first).count(pr.second)) {
+                cout << var << " = " << prog.objects.at(pr.first).at(pr.second) << endl;
             } else {
-                consume();
+                cout << "Variable not found." << endl;
             }
         }
+    }
 
-        expectSym("}");
-        prog.classes[className] = cdef;
+    void listVariables(const SessionState& prog) {
+        cout << "Integer variables:" << endl;
+        for (const auto& var : prog.vars) {
+            cout << "  " << var.first << " = " << var.second << endl;
+        }
+        
+        cout << "Boolean variables:" << endl;
+        for (const auto& var : prog.boolVars) {
+            cout << "  " << var.first << " = " << (var.second ? "true" : "false") << endl;
+        }
+        
+        cout << "String variables:" << endl;
+        for (const auto& var : prog.stringVars) {
+            cout << "  " << var.first << " = " << var.second << endl;
+        }
+        
+        cout << "Object fields:" << endl;
+        for (const auto& obj : prog.objects) {
+            for (const auto& field : obj.second) {
+                cout << "  " << obj.first << "." << field.first << " = " << field.second << endl;
+            }
+        }
     }
 
-    void parseNewInstance() {
-        consume();
-        if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": new expects class name\n"; return; }
-        string className = tk.text; consume();
-        if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": new expects instance name\n"; return; }
-        string instName = tk.text; consume();
-        expectSym(";");
-        if (!prog.classes.count(className)) {
-            cerr << "Error at line " << tk.line << ": Unknown class " << className << " for new\n";
+    void listBreakpoints() {
+        if (breakpoints.empty()) {
+            cout << "No breakpoints set." << endl;
         } else {
-            prog.objects[instName] = prog.classes[className].fields;
-            prog.instanceClass[instName] = className;
+            cout << "Breakpoints at lines:";
+            for (int line : breakpoints) {
+                cout << " " << line;
+            }
+            cout << endl;
         }
     }
 
-    void parseNode() {
-        int nodeLine = tk.line;
-        consume();
-        if (tk.kind == TK_IDENT) {
-            string nodename = tk.text; consume();
-            if (prog.entry.empty()) prog.entry = nodename;
-            if (!(tk.kind == TK_SYM && tk.text == "{")) {
-                cerr << "Error at line " << tk.line << ": expected '{' after node name\n";
-                return;
+    void printHelp() {
+        cout << "Debugger commands:" << endl;
+        cout << "  step (s):           Execute the next line." << endl;
+        cout << "  continue (c):       Continue execution until the next breakpoint." << endl;
+        cout << "  print (p) <var>:    Print the value of a variable." << endl;
+        cout << "  variables (v):      List all variables." << endl;
+        cout << "  break (b) <line>:   Set a breakpoint at the specified line." << endl;
+        cout << "  delete (d) <line>:  Remove a breakpoint at the specified line." << endl;
+        cout << "  find (f) \"text\":    List dialogue containing text; break at the first 20." << endl;
+        cout << "  jump (j) <n|node>:  Continue at match n of the last find, or at a node." << endl;
+        cout << "  breakpoints (b):    List all breakpoints." << endl;
+        cout << "  quit (q):           Exit the program." << endl;
+        cout << "  help (h):           Show this help message." << endl;
+    }
+
+    unordered_set<int> breakpoints;
+    bool stepping = false;
+    vector<string> matches;  // nodes of the last find, by match number
+    static constexpr size_t kFindListed = 20;  // matches shown and broken at
+};
+
+// ----------------------- Parser -----------------------
+
+class Parser {
+    Lexer lex;
+    Token tk;
+    Program prog;
+public:
+    Parser(const string& src) : lex(src) { tk = lex.next(); }
+    Token peek() { return tk; }
+    Token consume() {
+        Token t = tk; tk = lex.next(); return t;
+    }
+    bool acceptIdent(const string& s) {
+        if (tk.kind == TK_IDENT && tk.text == s) { consume(); return true; }
+        return false;
+    }
+    bool expectSym(const string& s) {
+        if (tk.kind == TK_SYM && tk.text == s) { consume(); return true; }
+        cerr << "Error at line " << tk.line << ": Expected symbol '" << s << "' but got '" << tk.text << "'\n";
+        return false;
+    }
+    void parse() {
+        while (tk.kind != TK_EOF) {
+            if (tk.kind == TK_IDENT) {
+                if (tk.text == "npc") { parseNpc(); }
+                else if (tk.text == "desc") { parseDesc(); }
+                else if (tk.text == "int" || tk.text == "string" || tk.text == "match") { parseVarDecl(); }
+                else if (tk.text == "derived") { parseDerived(); }
+                else if (tk.text == "table") { parseTable(); }
+                else if (tk.text == "node") { parseNode(); }
+                else if (tk.text == "class") { parseClass(); }
+                else if (tk.text == "new") { parseNewInstance(); }
+                else if (tk.text == "room") { parseRoom(); }
+                else {
+                    cerr << "Error at line " << tk.line << ": Unknown top-level keyword: " << tk.text << "\n";
+                    consume();
+                }
+            } else {
+                consume();
             }
-            consume();
-            Node node; node.name = nodename; node.definitionLine = nodeLine;
-            while (!(tk.kind == TK_SYM && tk.text == "}") && tk.kind != TK_EOF) {
-                if (tk.kind == TK_IDENT) {
-                    string kw = tk.text;
-                    if (kw == "line") {
-                        consume();
-                        if (tk.kind == TK_STRING) { node.text = tk.text; consume(); }
+        }
+    }
+    void parseRoom() {
+        consume();
+        if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": room expects a name\n"; return; }
+        string roomName = tk.text; consume();
+
+        if (!(tk.kind == TK_SYM && tk.text == "{")) { cerr << "Error at line " << tk.line << ": expected '{' after room name\n"; return; }
+        consume();
+
+        Room room;
+        room.name = roomName;
+
+        while (!(tk.kind == TK_SYM && tk.text == "}") && tk.kind != TK_EOF) {
+            if (tk.kind == TK_IDENT) {
+                if (tk.text == "desc") {
+                    consume();
+                    if (tk.kind == TK_STRING) {
+                        room.description = tk.text; consume();
+                        expectSym(";");
+                    }
+                } else if (tk.text == "exit") {
+                    consume();
+                    if (tk.kind == TK_IDENT) {
+                        string dir = tk.text; consume();
+                        if (tk.kind == TK_IDENT) {
+                            string target = tk.text; consume();
+                            room.exits[dir] = target;
+                            expectSym(";");
+                        }
+                    }
+                } else if (tk.text == "item") {
+                    consume();
+                    if (tk.kind == TK_IDENT) {
+                        room.items.push_back(tk.text); consume();
+                        expectSym(";");
+                    }
+                } else if (tk.text == "npc") {
+                    consume();
+                    if (tk.kind == TK_IDENT) {
+                        room.npcs.push_back(tk.text); consume();
+                        expectSym(";");
+                    }
+                } else {
+                    consume();
+                }
+            } else {
+                consume();
+            }
+        }
+        expectSym("}");
+        prog.rooms[roomName] = room;
+        if (prog.currentRoom.empty()) prog.currentRoom = roomName;
+    }
+
+    void parseNpc() {
+        consume();
+        if (tk.kind == TK_STRING) {
+            prog.npc = tk.text; consume();
+            expectSym(";");
+        } else { cerr << "Error at line " << tk.line << ": npc requires string\n"; }
+    }
+    void parseDesc() {
+        consume();
+        if (tk.kind == TK_STRING) {
+            prog.desc = tk.text; consume();
+            expectSym(";");
+        } else { cerr << "Error at line " << tk.line << ": desc requires string\n"; }
+    }
+
+    void parseVarDecl() {
+        string type = tk.text;
+        consume();
+
+        if (tk.kind == TK_IDENT) {
+            string name = tk.text; consume();
+            if (tk.kind == TK_SYM && tk.text == "=") {
+                consume();
+                if (type == "string") {
+                    if (tk.kind == TK_STRING_DEC || tk.kind == TK_STRING) {
+                        string value = tk.text; consume();
+                        expectSym(";");
+                        prog.stringVars[name] = value;
+                    } else {
+                        cerr << "Error at line " << tk.line << ": String variable requires string literal\n";
+                    }
+                } else if (type == "match") {
+                    if (tk.kind == TK_TRUE || tk.kind == TK_FALSE) {
+                        bool value = (tk.kind == TK_TRUE);
+                        consume();
+                        expectSym(";");
+                        prog.boolVars[name] = value;
+                    } else {
+                        cerr << "Error at line " << tk.line << ": Boolean variable requires true or false\n";
+                    }
+                } else {
+                    string expr;
+                    while (!(tk.kind == TK_SYM && tk.text == ";") && tk.kind != TK_EOF) {
+                        appendToken(expr, tk);
+                        consume();
+                    }
+                    expectSym(";");
+                    auto tokens = tokenizeExpr(expr);
+                    auto rpn = infixToRPN(tokens);
+                    unordered_map<string, unordered_map<string, int>> emptyobjs;
+                    int val = evalRPN(rpn, prog.vars, prog.boolVars, emptyobjs);
+                    prog.vars[name] = val;
+                }
+            } else {
+                if (type == "string") prog.stringVars[name] = "";
+                else if (type == "match") prog.boolVars[name] = false;
+                else prog.vars[name] = 0;
+                expectSym(";");
+            }
+        } else {
+            cerr << "Error at line " << tk.line << ": " << type << " expects identifier\n";
+        }
+    }
+
+    // derived int power = strength * level + bonus;
+    void parseDerived() {
+        consume();
+        string type = tk.text;
+        if (tk.kind != TK_IDENT || (type != "int" && type != "match")) {
+            cerr << "Error at line " << tk.line << ": derived expects int or match\n";
+            return;
+        }
+        consume();
+        if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": derived expects identifier\n"; return; }
+        string name = tk.text; consume();
+        if (!expectSym("=")) return;
+
+        DerivedVar d;
+        d.isBool = (type == "match");
+        while (!(tk.kind == TK_SYM && tk.text == ";") && tk.kind != TK_EOF) {
+            appendToken(d.expr, tk);
+            consume();
+        }
+        expectSym(";");
+
+        // Inputs are the variables and fields the expression reads
+        auto tokens = tokenizeExpr(d.expr);
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            const string& t = tokens[i];
+            if (!(isalpha((unsigned char)t[0]) || t[0] == '_') || t == "true" || t == "false") continue;
+            if (i + 1 < tokens.size() && tokens[i + 1] == "(") continue;
+            if (find(d.inputs.begin(), d.inputs.end(), t) != d.inputs.end()) continue;
+            d.inputs.push_back(t);
+            prog.derivedDependents[t].push_back(name);
+        }
+
+        if (d.isBool) prog.boolVars[name] = false;
+        else prog.vars[name] = 0;
+        prog.derived[name] = d;
+    }
+
+    // table weapons = load_table("weapons.tsv");
+    void parseTable() {
+        int line = tk.line;
+        consume();
+        if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": table expects identifier\n"; return; }
+        string name = tk.text; consume();
+        if (!expectSym("=")) return;
+        if (!acceptIdent("load_table") || !expectSym("(")) {
+            cerr << "Error at line " << tk.line << ": table expects load_table(\"file\")\n";
+            return;
+        }
+        if (tk.kind != TK_STRING) { cerr << "Error at line " << tk.line << ": load_table requires string\n"; return; }
+        string path = tk.text; consume();
+        expectSym(")");
+        expectSym(";");
+        prog.tableDecls.push_back({ name, path, line });
+    }
+
+    void parseClass() {
+        consume();
+        if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": class expects a name\n"; return; }
+        string className = tk.text; consume();
+        if (!(tk.kind == TK_SYM && tk.text == "{")) { cerr << "Error at line " << tk.line << ": expected '{' after class name\n"; return; }
+        consume();
+        ClassDef cdef; cdef.name = className;
+
+        while (!(tk.kind == TK_SYM && tk.text == "}") && tk.kind != TK_EOF) {
+            if (tk.kind == TK_IDENT) {
+                if (tk.text == "int") {
+                    consume();
+                    if (tk.kind == TK_IDENT) {
+                        string fname = tk.text; consume();
+                        int fval = 0;
+                        if (tk.kind == TK_SYM && tk.text == "=") {
+                            consume();
+                            string expr;
+                            while (!(tk.kind == TK_SYM && tk.text == ";") && tk.kind != TK_EOF) {
+                                appendToken(expr, tk); consume();
+                            }
+                            expectSym(";");
+                            unordered_map<string, unordered_map<string, int>> emptyobjs;
+                            auto tokens = tokenizeExpr(expr);
+                            auto rpn = infixToRPN(tokens);
+                            fval = evalRPN(rpn, prog.vars, prog.boolVars, emptyobjs);
+                        } else {
+                            expectSym(";");
+                        }
+                        cdef.fields[fname] = fval;
+                    } else {
+                        cerr << "Error at line " << tk.line << ": field expects identifier\n"; consume();
+                    }
+                } else if (tk.text == "void") {
+                    consume();
+                    if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": method expects a name\n"; continue; }
+                    string mname = tk.text; consume();
+                    vector<string> params;
+                    if (!(tk.kind == TK_SYM && tk.text == "(")) { cerr << "Error at line " << tk.line << ": expected '(' after method name\n"; }
+                    consume();
+                    while (!(tk.kind == TK_SYM && tk.text == ")") && tk.kind != TK_EOF) {
+                        if (tk.kind == TK_IDENT) {
+                            string pname = tk.text;
+                            params.push_back(pname);
+                            consume();
+                            if (tk.kind == TK_SYM && tk.text == ",") { consume(); continue; }
+                        } else if (tk.kind == TK_SYM && tk.text == ",") { consume(); continue; }
+                        else { consume(); }
+                    }
+                    expectSym(")");
+                    if (!(tk.kind == TK_SYM && tk.text == "{")) { cerr << "Error at line " << tk.line << ": expected '{' for method body\n"; continue; }
+                    consume();
+                    vector<string> methodActions;
+                    while (!(tk.kind == TK_SYM && tk.text == "}") && tk.kind != TK_EOF) {
+                        string stmt;
+                        while (!(tk.kind == TK_SYM && tk.text == ";") && !(tk.kind == TK_SYM && tk.text == "}") && tk.kind != TK_EOF) {
+                            appendToken(stmt, tk);
+                            consume();
+                        }
+                        if (tk.kind == TK_SYM && tk.text == ";") {
+                            string s = trim(stmt);
+                            if (!s.empty()) methodActions.push_back(string("STMT ") + s);
+                            consume();
+                        } else {
+                            string s = trim(stmt);
+                            if (!s.empty()) methodActions.push_back(string("STMT ") + s);
+                        }
+                    }
+                    expectSym("}");
+                    cdef.methods[mname] = methodActions;
+                    cdef.methodParams[mname] = params;
+                } else {
+                    cerr << "Error at line " << tk.line << ": Unknown class member: " << tk.text << "\n";
+                    consume();
+                }
+            } else {
+                consume();
+            }
+        }
+
+        expectSym("}");
+        prog.classes[className] = cdef;
+    }
+
+    void parseNewInstance() {
+        consume();
+        if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": new expects class name\n"; return; }
+        string className = tk.text; consume();
+        if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": new expects instance name\n"; return; }
+        string instName = tk.text; consume();
+        expectSym(";");
+        if (!prog.classes.count(className)) {
+            cerr << "Error at line " << tk.line << ": Unknown class " << className << " for new\n";
+        } else {
+            prog.objects[instName] = prog.classes[className].fields;
+            prog.instanceClass[instName] = className;
+        }
+    }
+
+    void parseNode() {
+        int nodeLine = tk.line;
+        consume();
+        if (tk.kind == TK_IDENT) {
+            string nodename = tk.text; consume();
+            if (prog.entry.empty()) prog.entry = nodename;
+            if (!(tk.kind == TK_SYM && tk.text == "{")) {
+                cerr << "Error at line " << tk.line << ": expected '{' after node name\n";
+                return;
+            }
+            consume();
+            Node node; node.name = nodename; node.definitionLine = nodeLine;
+            while (!(tk.kind == TK_SYM && tk.text == "}") && tk.kind != TK_EOF) {
+                if (tk.kind == TK_IDENT) {
+                    string kw = tk.text;
+                    if (kw == "line") {
+                        consume();
+                        if (tk.kind == TK_STRING) { node.text = tk.text; consume(); }
                         expectSym(";");
                     } else if (kw == "show") {
                         consume();
@@ -814,7 +1931,7 @@ public:
                         }
                         string expr;
                         while (!(tk.kind == TK_SYM && tk.text == ";") && tk.kind != TK_EOF) {
-                            expr += tk.text; consume();
+                            appendToken(expr, tk); consume();
                         }
                         expectSym(";");
                         node.actions.push_back("SET " + name + " " + expr);
@@ -825,7 +1942,7 @@ public:
                             if (tk.kind == TK_SYM && tk.text == "=") consume();
                             string expr;
                             while (!(tk.kind == TK_SYM && tk.text == ";") && tk.kind != TK_EOF) {
-                                expr += tk.text; consume();
+                                appendToken(expr, tk); consume();
                             }
                             expectSym(";");
                             node.actions.push_back("SIGNAL " + name + " " + expr);
@@ -840,15 +1957,18 @@ public:
         consume();
     }
     string cond;
-    while (!(tk.kind == TK_SYM && tk.text == ")") && tk.kind != TK_EOF) { 
-        cond += tk.text; 
+    int depth = 0;  // calls inside the condition carry their own parentheses
+    while (!(tk.kind == TK_SYM && tk.text == ")" && depth == 0) && tk.kind != TK_EOF) { 
+        if (tk.kind == TK_SYM && tk.text == "(") depth++;
+        else if (tk.kind == TK_SYM && tk.text == ")") depth--;
+        appendToken(cond, tk);
         consume(); 
     }
     expectSym(")");
     
     // Check for optional 'goto' keyword
     bool hasGoto = false;
-    if (tk.kind == TK_IDENT) {
+    if (tk.kind == TK_IDENT && tk.text != "goto") {
     string target = tk.text; 
     consume();
     string elseTarget;
@@ -867,757 +1987,3666 @@ public:
             cerr << "Error at line " << tk.line << ": else expects a target\n";
         }
     }
-    expectSym(";");
-    node.actions.push_back("IF " + cond + " GOTO " + target + (elseTarget.empty() ? "" : " ELSE " + elseTarget));
-} else if (tk.kind == TK_IDENT && tk.text == "goto") {  // Add this condition
-    consume();
-    if (tk.kind == TK_IDENT) {
-        string target = tk.text; 
-        consume();
-        string elseTarget;
-        if (tk.kind == TK_IDENT && tk.text == "else") {
-            consume();
-            // Check for optional 'goto' after else
-            bool elseHasGoto = false;
-            if (tk.kind == TK_IDENT && tk.text == "goto") {
-                consume();
-                elseHasGoto = true;
+    expectSym(";");
+    node.actions.push_back("IF " + cond + " GOTO " + target + (elseTarget.empty() ? "" : " ELSE " + elseTarget));
+} else if (tk.kind == TK_IDENT && tk.text == "goto") {  // Add this condition
+    consume();
+    if (tk.kind == TK_IDENT) {
+        string target = tk.text; 
+        consume();
+        string elseTarget;
+        if (tk.kind == TK_IDENT && tk.text == "else") {
+            consume();
+            // Check for optional 'goto' after else
+            bool elseHasGoto = false;
+            if (tk.kind == TK_IDENT && tk.text == "goto") {
+                consume();
+                elseHasGoto = true;
+            }
+            if (tk.kind == TK_IDENT) {
+                elseTarget = tk.text; 
+                consume();
+            } else {
+                cerr << "Error at line " << tk.line << ": else expects a target\n";
+            }
+        }
+        expectSym(";");
+        node.actions.push_back("IF " + cond + " GOTO " + target + (elseTarget.empty() ? "" : " ELSE " + elseTarget));
+    } else {
+        cerr << "Error at line " << tk.line << ": goto expects a target\n";
+    }
+ } else if (tk.kind == TK_IDENT && tk.text == "goto") {
+    // 'goto' written but no identifier target follows
+    cerr << "Error at line " << tk.line << ": goto expects a target\n";
+    consume(); // consume 'goto' to avoid infinite loop
+}
+} else if (kw == "switch") {
+                        parseSwitch(node);
+                    } else if (kw == "goto") {
+                        consume();
+                        if (tk.kind == TK_IDENT) {
+                            string target = tk.text; consume();
+                            expectSym(";");
+                            node.actions.push_back("GOTO " + target);
+                        } else { cerr << "Error at line " << tk.line << ": goto target expected\n"; }
+                    } else if (kw == "end") {
+                        consume(); expectSym(";"); node.actions.push_back("END");
+                    } else {
+                        string stmt;
+                        while (!(tk.kind == TK_SYM && tk.text == ";") && tk.kind != TK_EOF) {
+                            appendToken(stmt, tk);
+                            consume();
+                        }
+                        if (tk.kind == TK_SYM && tk.text == ";") { consume(); }
+                        string s = trim(stmt);
+                        if (!s.empty()) node.actions.push_back(string("STMT ") + s);
+                    }
+                } else {
+                    consume();
+                }
+            }
+            expectSym("}");
+            prog.nodes[nodename] = node;
+        } else {
+            cerr << "Error at line " << tk.line << ": node expects name\n"; consume();
+        }
+    }
+
+    // switch (expr) { case 1, 2 -> a; default -> b; }
+    void parseSwitch(Node& node) {
+        consume();
+        if (!expectSym("(")) return;
+        string expr;
+        int depth = 0;
+        while (!(tk.kind == TK_SYM && tk.text == ")" && depth == 0) && tk.kind != TK_EOF) {
+            if (tk.kind == TK_SYM && tk.text == "(") depth++;
+            else if (tk.kind == TK_SYM && tk.text == ")") depth--;
+            appendToken(expr, tk);
+            consume();
+        }
+        expectSym(")");
+        if (!expectSym("{")) return;
+
+        SwitchTable sw;
+        vector<pair<int, int>> cases;
+        while (!(tk.kind == TK_SYM && tk.text == "}") && tk.kind != TK_EOF) {
+            bool isDefault = tk.kind == TK_IDENT && tk.text == "default";
+            if (!isDefault && !(tk.kind == TK_IDENT && tk.text == "case")) {
+                cerr << "Error at line " << tk.line << ": switch expects case or default\n";
+                consume();
+                continue;
+            }
+            consume();
+            vector<int> values;
+            while (!isDefault && tk.kind == TK_NUMBER) {
+                values.push_back(tk.number);
+                consume();
+                if (!(tk.kind == TK_SYM && tk.text == ",")) break;
+                consume();
+            }
+            if (!isDefault && values.empty()) { cerr << "Error at line " << tk.line << ": case expects a number\n"; }
+            if (tk.kind == TK_SYM && (tk.text == "->" || tk.text == ":")) consume();
+            else cerr << "Error at line " << tk.line << ": expected '->' in switch\n";
+            if (tk.kind != TK_IDENT) { cerr << "Error at line " << tk.line << ": switch case expects a target\n"; continue; }
+            int target = (int)sw.targets.size();
+            sw.targets.push_back(tk.text);
+            consume();
+            expectSym(";");
+            if (isDefault) {
+                if (sw.fallback >= 0) cerr << "Error at line " << tk.line << ": switch has two defaults\n";
+                sw.fallback = target;
+            }
+            for (int v : values) cases.push_back({ v, target });
+        }
+        expectSym("}");
+
+        sort(cases.begin(), cases.end());
+        for (size_t i = 1; i < cases.size(); ++i) {
+            if (cases[i].first == cases[i - 1].first) cerr << "Error at line " << tk.line << ": duplicate case " << cases[i].first << "\n";
+        }
+        // A table when at most about half of it would be holes
+        long long span = cases.empty() ? 0 : (long long)cases.back().first - cases.front().first + 1;
+        if (!cases.empty() && span <= 2 * (long long)cases.size() + 8) {
+            sw.lo = cases.front().first;
+            sw.dense.assign((size_t)span, -1);
+            for (auto& c : cases) if (sw.dense[c.first - sw.lo] < 0) sw.dense[c.first - sw.lo] = c.second;
+        } else {
+            sw.sparse = cases;
+        }
+        node.actions.push_back("SWITCH " + to_string(prog.switches.size()) + " " + expr);
+        prog.switches.push_back(move(sw));
+    }
+
+    Program& getProgram() { return prog; }
+
+private:
+    // Appends a token to raw statement/expression text that the runtime
+    // re-tokenizes: string literals stay quoted, adjacent words stay apart.
+    static void appendToken(string& out, const Token& t) {
+        bool word = t.kind == TK_IDENT || t.kind == TK_NUMBER || t.kind == TK_TRUE || t.kind == TK_FALSE ||
+            t.kind == TK_STRING || t.kind == TK_STRING_DEC;
+        if (word && !out.empty() && (isalnum((unsigned char)out.back()) || out.back() == '_' || out.back() == '"')) {
+            out.push_back(' ');
+        }
+        if (t.kind == TK_STRING || t.kind == TK_STRING_DEC) {
+            out.push_back('"');
+            for (char c : t.text) {
+                if (c == '"' || c == '\\') out.push_back('\\');
+                out.push_back(c);
+            }
+            out.push_back('"');
+        } else {
+            out += t.text;
+        }
+    }
+
+    static string trim(const string& s) {
+        size_t a = 0;
+        while (a < s.size() && isspace((unsigned char)s[a])) ++a;
+        size_t b = s.size();
+        while (b > a && isspace((unsigned char)s[b - 1])) --b;
+        return s.substr(a, b - a);
+    }
+};
+
+// ----------------------- Runtime helpers -----------------------
+
+// Puts the thread's script location (see CRTZ::Profiler) back as it was
+// when a run returns to the host
+struct LocationScope {
+    uint32_t node = CRTZ::scriptLocation.node;
+    uint32_t action = CRTZ::scriptLocation.action;
+    uint32_t method = CRTZ::scriptLocation.method;
+    ~LocationScope() {
+        CRTZ::scriptLocation.node = node;
+        CRTZ::scriptLocation.action = action;
+        CRTZ::scriptLocation.method = method;
+    }
+};
+
+// Actions evaluate the forms the linker compiled (ActionCode::exprs); this
+// is for expression text met at run time
+static int evalExpressionString(const string& expr,
+    unordered_map<string, int>& vars,
+    unordered_map<string, bool>& boolVars,
+    unordered_map<string, unordered_map<string, int>>& objects,
+    const vector<CRTZ::NativeBinding>* natives = nullptr,
+    SessionState* ss = nullptr) {
+    return evalRPN(infixToRPN(tokenizeExpr(expr)), vars, boolVars, objects, natives, ss);
+}
+
+static int evalInt(const CompiledExpr& e,
+    unordered_map<string, int>& vars,
+    unordered_map<string, bool>& boolVars,
+    unordered_map<string, unordered_map<string, int>>& objects,
+    SessionState& ss) {
+    return (int)evalCompiled(e, vars, boolVars, objects, &ss).num;
+}
+
+// The terms of "a + b + ..." at the top level, compiled separately
+static vector<CompiledExpr> compileSumTerms(const string& expr, const vector<CRTZ::NativeBinding>* natives) {
+    vector<string> tokens = tokenizeExpr(expr);
+    vector<CompiledExpr> terms;
+    vector<string> term;
+    int depth = 0;
+    for (size_t i = 0; i <= tokens.size(); ++i) {
+        if (i < tokens.size()) {
+            const string& t = tokens[i];
+            if (t == "(") depth++;
+            else if (t == ")") depth--;
+            if (depth > 0 || t != "+") { term.push_back(t); continue; }
+        }
+        terms.push_back(compileRPN(infixToRPN(term), natives));
+        term.clear();
+    }
+    return terms;
+}
+
+// "APPEND s a + b" (see linkStringAppend): appends a, then b, to s
+static bool appendTerms(SessionState& ss, const ActionCode& code,
+    unordered_map<string, int>& vars,
+    unordered_map<string, bool>& boolVars,
+    unordered_map<string, unordered_map<string, int>>& objects) {
+    for (auto& term : code.exprs) {
+        CRTZ::Value v = evalCompiled(term, vars, boolVars, objects, &ss);
+        if (!ss.appendString(code.name, v.isString ? v.str : to_string(v.num))) return false;
+    }
+    ss.noteWrite(code.name);
+    return true;
+}
+
+// Comma-separated names of the items in an item set
+static string itemList(const Program& prog, const uint64_t* set) {
+    string out;
+    for (size_t w = 0; w < prog.itemWords; ++w) {
+        for (uint64_t bits = set[w]; bits; bits &= bits - 1) {
+            if (!out.empty()) out += ", ";
+            out += prog.itemNames[w * 64 + __builtin_ctzll(bits)];
+        }
+    }
+    return out;
+}
+
+// ${currentRoom}, ${currentRoom.description}, ${currentRoom.items}, ${inventory}
+static bool roomText(const SessionState& ss, const string& name, string& out) {
+    if (name == "inventory") {
+        out = itemList(*ss.prog, ss.inventory.data());
+        return true;
+    }
+    if (name != "currentRoom" && name != "currentRoom.description" && name != "currentRoom.items") return false;
+    out.clear();
+    if (ss.room < 0) return true;
+    const string& r = ss.prog->roomNames[ss.room];
+    if (name == "currentRoom") out = r;
+    else if (name == "currentRoom.items") out = itemList(*ss.prog, ss.itemsIn(ss.room));
+    else out = ss.prog->rooms.at(r).description;
+    return true;
+}
+
+// take/drop: moves an item between the current room and the inventory
+static void moveItem(SessionState& ss, int item, bool take) {
+    const Program& prog = *ss.prog;
+    const string& name = prog.itemNames[item];
+    if (ss.room < 0) return;
+    uint64_t* here = ss.itemsIn(ss.room);
+    vector<int>& rooms = ss.itemRooms[item];
+    auto pos = lower_bound(rooms.begin(), rooms.end(), ss.room);
+    if (take) {
+        if (!SessionState::hasBit(here, item)) { *ss.out << "There is no " << name << " here.\n"; return; }
+        SessionState::putBit(here, item, false);
+        SessionState::putBit(ss.inventory.data(), item, true);
+        rooms.erase(pos);
+    } else {
+        if (!SessionState::hasBit(ss.inventory.data(), item)) { *ss.out << "You don't have " << name << ".\n"; return; }
+        SessionState::putBit(ss.inventory.data(), item, false);
+        SessionState::putBit(here, item, true);
+        if (pos == rooms.end() || *pos != ss.room) rooms.insert(pos, ss.room);
+    }
+    ss.noteWrite("inventory");
+    ss.noteWrite("currentRoom.items");
+}
+
+// Moves the session through an exit of the current room
+static void goDirection(SessionState& ss, int dir) {
+    const Program& prog = *ss.prog;
+    int next = ss.room < 0 ? -1 : prog.exitTable[(size_t)ss.room * prog.directionNames.size() + dir];
+    if (next < 0) {
+        *ss.out << "You can't go " << prog.directionNames[dir] << " from here.\n";
+        return;
+    }
+    ss.room = next;
+    ss.noteWrite("currentRoom");
+}
+
+// Recomputes a dirty derived variable; derived inputs are refreshed on the way
+static void refreshDerived(SessionState& ss, const string& name) {
+    ss.dirtyDerived.erase(name);
+    auto it = ss.prog->derived.find(name);
+    if (it == ss.prog->derived.end()) return;
+    const DerivedVar& d = it->second;
+    if (ss.speculative && d.host) {
+        ss.speculationAborted = true;
+        return;
+    }
+    int val = evalInt(d.code, ss.vars, ss.boolVars, ss.objects, ss);
+    if (d.isBool) ss.boolVars[name] = (val != 0);
+    else ss.vars[name] = val;
+}
+
+// True if evaluating the expression calls a host function
+static bool callsHost(const CompiledExpr& e) {
+    for (auto& op : e.ops) {
+        if (op.kind == ExprOp::Native) return true;
+    }
+    return false;
+}
+
+static void refreshAllDerived(SessionState& ss) {
+    while (!ss.dirtyDerived.empty()) {
+        string name = *ss.dirtyDerived.begin();  // refreshDerived erases the set's copy
+        refreshDerived(ss, name);
+    }
+}
+
+static vector<string> splitArgs(const string& s) {
+    vector<string> out;
+    string cur;
+    int depth = 0;
+    bool quoted = false;
+    for (size_t i = 0; i < s.size(); ++i) {
+        char c = s[i];
+        if (quoted || c == '"') {
+            if (c == '\\' && i + 1 < s.size()) { cur.push_back(c); c = s[++i]; }
+            else if (c == '"') quoted = !quoted;
+            cur.push_back(c);
+        }
+        else if (c == '(') { depth++; cur.push_back(c); }
+        else if (c == ')') { depth--; cur.push_back(c); }
+        else if (c == ',' && depth == 0) {
+            string t = cur;
+            size_t a = 0; while (a < t.size() && isspace((unsigned char)t[a])) ++a;
+            size_t b = t.size(); while (b > a && isspace((unsigned char)t[b - 1])) --b;
+            out.push_back(t.substr(a, b - a));
+            cur.clear();
+        } else {
+            cur.push_back(c);
+        }
+    }
+    if (!cur.empty()) {
+        string t = cur;
+        size_t a = 0; while (a < t.size() && isspace((unsigned char)t[a])) ++a;
+        size_t b = t.size(); while (b > a && isspace((unsigned char)t[b - 1])) --b;
+        out.push_back(t.substr(a, b - a));
+    }
+    vector<string> cleaned;
+    for (auto& x : out) if (!x.empty()) cleaned.push_back(x);
+    return cleaned;
+}
+
+static void executeMethod(SessionState& ss,
+    const string& instanceName,
+    const string& methodName,
+    const vector<int>& argValues,
+    const vector<string>& argNames);
+
+static bool executeActionsWithContext(const vector<string>& actions,
+    const vector<ActionCode>& codes,
+    SessionState& ss,
+    unordered_map<string, int>& vars,
+    unordered_map<string, bool>& boolVars,
+    unordered_map<string, unordered_map<string, int>>& objects,
+    const string& thisInstance,
+    string& current_jump_target,
+    bool& jumped,
+    vector<pair<string, string>>& fieldWrites) {
+    const Program& prog = *ss.prog;
+    ostream& out = *ss.out;
+    for (size_t i = 0; i < actions.size(); ++i) {
+        const string& act = actions[i];
+        const ActionCode& code = codes[i];
+        if (ss.status == CRTZ::Session::Failed || ss.speculationAborted) return false;
+        if (ss.speculative && code.host) {
+            ss.speculationAborted = true;
+            return false;
+        }
+        if (code.op == ActionCode::Set) {
+            const string& name = code.name;
+            if (!code.field.empty()) {
+                objects[code.inst][code.field] = evalInt(code.exprs[0], vars, boolVars, objects, ss);
+                fieldWrites.emplace_back(code.inst, code.field);
+            } else {
+                if (!thisInstance.empty() && objects.count(thisInstance) && objects[thisInstance].count(name)) {
+                    int val = evalInt(code.exprs[0], vars, boolVars, objects, ss);
+                    objects[thisInstance][name] = val;
+                    fieldWrites.emplace_back(thisInstance, name);
+                } else if (ss.stringVars.count(name)) {
+                    CRTZ::Value v = evalCompiled(code.exprs[0], vars, boolVars, objects, &ss);
+                    if (!ss.setString(name, v.isString ? move(v.str) : to_string(v.num))) {
+                        ss.fail("string limit of " + to_string(ss.limits.maxStringBytes) + " bytes exceeded setting '" + name + "'");
+                    }
+                } else if (boolVars.count(name)) {
+                    int val = evalInt(code.exprs[0], vars, boolVars, objects, ss);
+                    boolVars[name] = (val != 0);
+                } else {
+                    int val = evalInt(code.exprs[0], vars, boolVars, objects, ss);
+                    vars[name] = val;
+                }
+            }
+        } else if (code.op == ActionCode::Signal) {
+            int val = evalInt(code.exprs[0], vars, boolVars, objects, ss);
+            out << "[SIGNAL] " << code.name << " = " << val << "\n";
+        } else if (code.op == ActionCode::If) {
+            if (evalInt(code.exprs[0], vars, boolVars, objects, ss)) {
+                current_jump_target = code.target;
+                jumped = true;
+                break;
+            } else if (!code.elseTarget.empty()) {
+                current_jump_target = code.elseTarget;
+                jumped = true;
+                break;
+            }
+        } else if (code.op == ActionCode::Go) {
+            goDirection(ss, code.index);
+        } else if (code.op == ActionCode::Take || code.op == ActionCode::Drop) {
+            moveItem(ss, code.index, code.op == ActionCode::Take);
+        } else if (code.op == ActionCode::Goto) {
+            current_jump_target = code.target;
+            jumped = true;
+            break;
+        } else if (code.op == ActionCode::End) {
+            out << "[Dialogue ended]\n";
+            return false;
+        } else if (code.op == ActionCode::Call) {
+            evalCompiled(code.exprs[0], vars, boolVars, objects, &ss);
+        } else if (code.op == ActionCode::MethodCall) {
+            vector<int> argVals;
+            argVals.reserve(code.exprs.size());
+            for (auto& e : code.exprs) argVals.push_back(evalInt(e, vars, boolVars, objects, ss));
+            executeMethod(ss, code.name, code.method, argVals, vector<string>{});
+        } else if (code.op == ActionCode::Print) {
+            if (code.exprs.empty()) out << code.literal << "\n";
+            else out << (evalInt(code.exprs[0], vars, boolVars, objects, ss) ? "true" : "false") << "\n";
+        } else if (code.op == ActionCode::Stmt) {
+            // Only print statements written as "print ..." are handled inside methods
+            string s = trim(act.substr(5));
+            if (s.rfind("print", 0) == 0) {
+                size_t p = s.find('(');
+                size_t q = s.rfind(')');
+                if (p != string::npos && q != string::npos && q > p) {
+                    string inner = s.substr(p + 1, q - p - 1);
+                    if (inner.size() >= 2 && inner.front() == '"' && inner.back() == '"') {
+                        out << inner.substr(1, inner.size() - 2) << "\n";
+                    } else {
+                        int val = evalExpressionString(inner, vars, boolVars, objects, &prog.natives, &ss);
+                        out << (val ? "true" : "false") << "\n";
+                    }
+                }
+            }
+        } else if (act.rfind("SHOW ", 0) == 0) {
+            string text = act.substr(5);
+            size_t pos = 0;
+            // Handle variable substitutions
+            while ((pos = text.find("${", pos)) != string::npos) {
+                size_t end = text.find("}", pos + 2);
+                if (end == string::npos) break;
+
+                string varName = text.substr(pos + 2, end - pos - 2);
+                string value;
+
+                if (roomText(ss, varName, value)) {
+                } else if (ss.stringVars.count(varName)) {
+                    value = ss.stringVars[varName];
+                } else if (boolVars.count(varName)) {
+                    value = boolVars[varName] ? "true" : "false";
+                } else if (vars.count(varName)) {
+                    value = to_string(vars[varName]);
+                } else {
+                    auto pr = splitDot(varName);
+                    if (!pr.second.empty() && objects.count(pr.first) && objects[pr.first].count(pr.second)) {
+                        value = to_string(objects[pr.first][pr.second]);
+                    } else {
+                        value = "0";
+                    }
+                }
+
+                text.replace(pos, end - pos + 1, value);
+                pos += value.length();
+            }
+
+            // Output the text
+            out << text << "\n";
+        }
+    }
+    return true;
+}
+
+static void executeMethod(SessionState& ss,
+    const string& instanceName,
+    const string& methodName,
+    const vector<int>& argValues,
+    const vector<string>& argNames) {
+    const Program& prog = *ss.prog;
+    if (ss.status == CRTZ::Session::Failed) return;
+    if (ss.limits.maxCallDepth && ss.callDepth >= ss.limits.maxCallDepth) {
+        ss.fail("call depth limit of " + to_string(ss.limits.maxCallDepth) + " exceeded calling " + instanceName + "." + methodName);
+        return;
+    }
+    ss.burnFuel();
+    ss.methodCalls++;
+    if (!ss.speculative) metrics().m.add(metrics().methods);
+    if (!ss.instanceClass.count(instanceName)) {
+        *ss.err << "Runtime: unknown instance '" << instanceName << "'\n";
+        return;
+    }
+    string cls = ss.instanceClass[instanceName];
+    auto cit = prog.classes.find(cls);
+    if (cit == prog.classes.end()) {
+        *ss.err << "Runtime: unknown class '" << cls << "' for instance '" << instanceName << "'\n";
+        return;
+    }
+    const ClassDef& cdef = cit->second;
+    auto mit = cdef.methods.find(methodName);
+    if (mit == cdef.methods.end()) {
+        *ss.err << "Runtime: class '" << cls << "' has no method '" << methodName << "'\n";
+        return;
+    }
+    LocationScope frame;
+    auto pit = cdef.methodProfileIds.find(methodName);
+    CRTZ::scriptLocation.method = pit == cdef.methodProfileIds.end() ? 0 : pit->second;
+
+    // The method works on a copy of the variables, so derived values must be current
+    refreshAllDerived(ss);
+    unordered_map<string, int> localVars;
+    unordered_map<string, bool> localBoolVars;
+    for (auto& kv : ss.vars) localVars[kv.first] = kv.second;
+    for (auto& kv : ss.boolVars) localBoolVars[kv.first] = kv.second;
+
+    vector<string> paramNames;
+    if (cdef.methodParams.count(methodName)) paramNames = cdef.methodParams.at(methodName);
+
+    for (size_t i = 0; i < argValues.size() && i < paramNames.size(); ++i) {
+        localVars[paramNames[i]] = argValues[i];
+    }
+
+    const vector<string>& actions = mit->second;
+
+    unordered_map<string, unordered_map<string, int>> objects = ss.objects;
+    if (!objects.count(instanceName)) objects[instanceName] = cdef.fields;
+
+    unordered_map<string, int> instanceFieldCopy = objects[instanceName];
+    for (auto& kv : instanceFieldCopy) {
+        if (!localVars.count(kv.first)) localVars[kv.first] = kv.second;
+    }
+
+    string jump_target;
+    bool jumped = false;
+    vector<pair<string, string>> fieldWrites;
+    ss.callDepth++;
+    executeActionsWithContext(actions, cdef.methodCode.at(methodName), ss, localVars, localBoolVars, objects, instanceName, jump_target, jumped, fieldWrites);
+    ss.callDepth--;
+
+    // Take the method's object view first so field writes below are not lost.
+    // Only the fields the method wrote, or whose write-back changed them, are
+    // marked for watches and derived variables.
+    ss.objects = objects;
+    auto& instance = ss.objects[instanceName];
+    for (auto& f : cdef.fields) {
+        auto lit = localVars.find(f.first);
+        if (lit == localVars.end()) continue;
+        int& field = instance[f.first];
+        if (field != lit->second) {
+            field = lit->second;
+            fieldWrites.emplace_back(instanceName, f.first);
+        }
+    }
+    for (auto& w : fieldWrites) ss.noteFieldWrite(w.first, w.second);
+    for (auto& kv : ss.vars) {
+        if (localVars.count(kv.first) && kv.second != localVars[kv.first]) {
+            kv.second = localVars[kv.first];
+            ss.noteWrite(kv.first);
+        }
+    }
+    for (auto& kv : ss.boolVars) {
+        if (localBoolVars.count(kv.first) && kv.second != localBoolVars[kv.first]) {
+            kv.second = localBoolVars[kv.first];
+            ss.noteWrite(kv.first);
+        }
+    }
+}
+
+// ----------------------- Linker -----------------------
+
+// Index of the ')' matching the '(' at open, skipping string literals
+static size_t matchParen(const string& code, size_t open) {
+    int depth = 0;
+    for (size_t i = open; i < code.size(); ++i) {
+        char c = code[i];
+        if (c == '"') {
+            for (++i; i < code.size() && code[i] != '"'; ++i) if (code[i] == '\\') ++i;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            return i;
+        }
+    }
+    return string::npos;
+}
+
+// Rewrites calls to bound host functions from "name(" to "#index(" so the
+// runtime jumps straight to prog.natives[index] without a name lookup.
+static string linkCalls(const string& code, const unordered_map<string, size_t>& index,
+    const vector<CRTZ::NativeBinding>& natives) {
+    string out;
+    size_t i = 0;
+    while (i < code.size()) {
+        char c = code[i];
+        if (c == '"') {
+            size_t j = i + 1;
+            while (j < code.size() && code[j] != '"') j += (code[j] == '\\') ? 2 : 1;
+            out.append(code, i, j + 1 - i);
+            i = j + 1;
+            continue;
+        }
+        if (isalpha((unsigned char)c) || c == '_') {
+            size_t j = i;
+            while (j < code.size() && (isalnum((unsigned char)code[j]) || code[j] == '_' || code[j] == '.')) j++;
+            string word = code.substr(i, j - i);
+            size_t k = j;
+            while (k < code.size() && isspace((unsigned char)code[k])) k++;
+            auto it = index.find(word);
+            if (it != index.end() && k < code.size() && code[k] == '(') {
+                size_t close = matchParen(code, k);
+                size_t argc = close == string::npos ? 0 : splitArgs(code.substr(k + 1, close - k - 1)).size();
+                const CRTZ::NativeBinding& b = natives[it->second];
+                if (argc == b.arity) {
+                    out += "#" + to_string(it->second);
+                } else {
+                    cerr << "Link error: '" << word << "' expects " << b.arity << " arguments but got " << argc << "\n";
+                    out += word;
+                }
+            } else {
+                out += word;
+            }
+            i = j;
+            continue;
+        }
+        out.push_back(c);
+        ++i;
+    }
+    return out;
+}
+
+static void linkAction(string& act, const unordered_map<string, size_t>& index,
+    const vector<CRTZ::NativeBinding>& natives) {
+    if (act.rfind("SET ", 0) == 0 || act.rfind("SIGNAL ", 0) == 0 || act.rfind("SWITCH ", 0) == 0) {
+        size_t sp = act.find(' ', act.find(' ') + 1);
+        if (sp != string::npos) act = act.substr(0, sp + 1) + linkCalls(act.substr(sp + 1), index, natives);
+    } else if (act.rfind("IF ", 0) == 0) {
+        size_t gpos = act.find(" GOTO ");
+        if (gpos != string::npos) act = "IF " + linkCalls(act.substr(3, gpos - 3), index, natives) + act.substr(gpos);
+    } else if (act.rfind("STMT ", 0) == 0) {
+        string s = linkCalls(act.substr(5), index, natives);
+        // A bare call statement becomes a CALL action evaluated for its side effects
+        size_t paren = s.find('(');
+        if (s[0] == '#' && paren != string::npos && matchParen(s, paren) == s.size() - 1) act = "CALL " + s;
+        else act = "STMT " + s;
+    }
+}
+
+static const size_t kMaxPathRooms = 2048;
+
+// Breadth-first search backwards from target: for every room, the first
+// direction of a shortest path to target and its length (0xFFFF: unreachable)
+static void roomBFS(const Program& prog, int target, int16_t* next, uint16_t* dist) {
+    size_t rooms = prog.roomNames.size();
+    fill(next, next + rooms, (int16_t)-1);
+    fill(dist, dist + rooms, (uint16_t)0xFFFF);
+    vector<int> queue;
+    queue.reserve(rooms);
+    dist[target] = 0;
+    queue.push_back(target);
+    for (size_t qi = 0; qi < queue.size(); ++qi) {
+        int u = queue[qi];
+        for (int k = prog.predStart[u]; k < prog.predStart[u + 1]; ++k) {
+            const Program::RoomLink& p = prog.preds[k];
+            if (dist[p.room] != 0xFFFF) continue;
+            dist[p.room] = (uint16_t)(dist[u] + 1);
+            next[p.room] = (int16_t)p.dir;
+            queue.push_back(p.room);
+        }
+    }
+}
+
+// Interns rooms and directions (sorted, so ids are stable) and precomputes
+// shortest paths
+static void buildRoomGraph(Program& prog) {
+    for (auto& kv : prog.rooms) prog.roomNames.push_back(kv.first);
+    sort(prog.roomNames.begin(), prog.roomNames.end());
+    for (size_t i = 0; i < prog.roomNames.size(); ++i) prog.roomIndex[prog.roomNames[i]] = (int)i;
+    for (auto& kv : prog.rooms) {
+        for (auto& e : kv.second.exits) {
+            if (!prog.directionIndex.count(e.first)) {
+                prog.directionIndex[e.first] = 0;
+                prog.directionNames.push_back(e.first);
+            }
+        }
+    }
+    sort(prog.directionNames.begin(), prog.directionNames.end());
+    for (size_t i = 0; i < prog.directionNames.size(); ++i) prog.directionIndex[prog.directionNames[i]] = (int)i;
+
+    size_t rooms = prog.roomNames.size();
+    size_t dirs = prog.directionNames.size();
+    prog.exitTable.assign(rooms * dirs, -1);
+    vector<int> predCount(rooms + 1, 0);
+    for (size_t r = 0; r < rooms; ++r) {
+        for (auto& e : prog.rooms.at(prog.roomNames[r]).exits) {
+            auto it = prog.roomIndex.find(e.second);
+            if (it == prog.roomIndex.end()) {
+                cerr << "Link error: exit " << e.first << " of room '" << prog.roomNames[r] << "' leads to unknown room '" << e.second << "'\n";
+                continue;
+            }
+            prog.exitTable[r * dirs + prog.directionIndex[e.first]] = it->second;
+            predCount[it->second]++;
+        }
+    }
+    prog.predStart.assign(rooms + 1, 0);
+    for (size_t r = 0; r < rooms; ++r) prog.predStart[r + 1] = prog.predStart[r] + predCount[r];
+    prog.preds.resize(prog.predStart[rooms]);
+    vector<int> fillPos(prog.predStart.begin(), prog.predStart.end() - 1);
+    for (size_t r = 0; r < rooms; ++r) {
+        for (size_t d = 0; d < dirs; ++d) {
+            int to = prog.exitTable[r * dirs + d];
+            if (to >= 0) prog.preds[fillPos[to]++] = { (int)r, (int)d };
+        }
+    }
+
+    auto sit = prog.roomIndex.find(prog.currentRoom);
+    prog.startRoom = sit == prog.roomIndex.end() ? -1 : sit->second;
+
+    for (auto& kv : prog.rooms) {
+        for (auto& item : kv.second.items) prog.itemNames.push_back(item);
+    }
+    sort(prog.itemNames.begin(), prog.itemNames.end());
+    prog.itemNames.erase(unique(prog.itemNames.begin(), prog.itemNames.end()), prog.itemNames.end());
+    for (size_t i = 0; i < prog.itemNames.size(); ++i) prog.itemIndex[prog.itemNames[i]] = (int)i;
+    prog.itemWords = (prog.itemNames.size() + 63) / 64;
+    prog.roomItemsInit.assign(rooms * prog.itemWords, 0);
+    prog.itemRoomsInit.assign(prog.itemNames.size(), {});
+    for (size_t r = 0; r < rooms; ++r) {
+        for (auto& item : prog.rooms.at(prog.roomNames[r]).items) {
+            int id = prog.itemIndex[item];
+            SessionState::putBit(&prog.roomItemsInit[r * prog.itemWords], id, true);
+            vector<int>& at = prog.itemRoomsInit[id];
+            if (at.empty() || at.back() != (int)r) at.push_back((int)r);
+        }
+    }
+
+    if (rooms <= kMaxPathRooms) {
+        prog.pathNext.resize(rooms * rooms);
+        prog.pathDist.resize(rooms * rooms);
+        for (size_t t = 0; t < rooms; ++t) roomBFS(prog, (int)t, &prog.pathNext[t * rooms], &prog.pathDist[t * rooms]);
+    }
+}
+
+// "go north" becomes "GO <direction id>", "take sword" "TAKE <item id>".
+// The room argument of path_to/distance_to and the item argument of
+// hasItem/carrying/where become ids (one past the last id when unknown).
+static string linkRoomCalls(const Program& prog, const string& code) {
+    string out;
+    size_t i = 0;
+    while (i < code.size()) {
+        char c = code[i];
+        if (c == '"') {
+            size_t j = i + 1;
+            while (j < code.size() && code[j] != '"') j += (code[j] == '\\') ? 2 : 1;
+            out.append(code, i, j + 1 - i);
+            i = j + 1;
+            continue;
+        }
+        if (isalpha((unsigned char)c) || c == '_' || c == '#') {
+            size_t j = i;
+            while (j < code.size() && (isalnum((unsigned char)code[j]) || code[j] == '_' || code[j] == '.' || code[j] == '#')) j++;
+            string word = code.substr(i, j - i);
+            size_t k = j;
+            while (k < code.size() && isspace((unsigned char)code[k])) k++;
+            size_t close = (k < code.size() && code[k] == '(') ? matchParen(code, k) : string::npos;
+            string fn = word == "currentRoom.hasItem" ? "hasItem" : word;
+            bool roomArg = fn == "path_to" || fn == "distance_to";
+            bool itemArg = fn == "hasItem" || fn == "carrying" || fn == "where";
+            if ((roomArg || itemArg) && close != string::npos) {
+                string arg = trim(code.substr(k + 1, close - k - 1));
+                if (arg.size() >= 2 && arg.front() == '"' && arg.back() == '"') arg = arg.substr(1, arg.size() - 2);
+                const unordered_map<string, int>& ids = roomArg ? prog.roomIndex : prog.itemIndex;
+                auto it = ids.find(arg);
+                if (it == ids.end()) cerr << "Link error: unknown " << (roomArg ? "room" : "item") << " '" << arg << "' in " << fn << "\n";
+                out += fn + "(" + to_string(it == ids.end() ? ids.size() : (size_t)it->second) + ")";
+                i = close + 1;
+                continue;
+            }
+            out += word;
+            i = j;
+            continue;
+        }
+        out.push_back(c);
+        ++i;
+    }
+    return out;
+}
+
+static void linkRoomAction(const Program& prog, string& act) {
+    if (act.rfind("STMT go ", 0) == 0) {
+        string dir = trim(act.substr(8));
+        auto it = prog.directionIndex.find(dir);
+        if (it == prog.directionIndex.end()) cerr << "Link error: no room has an exit '" << dir << "'\n";
+        else act = "GO " + to_string(it->second);
+    } else if (act.rfind("STMT take ", 0) == 0 || act.rfind("STMT drop ", 0) == 0) {
+        string item = trim(act.substr(10));
+        auto it = prog.itemIndex.find(item);
+        if (it == prog.itemIndex.end()) cerr << "Link error: unknown item '" << item << "'\n";
+        else act = (act[5] == 't' ? "TAKE " : "DROP ") + to_string(it->second);
+    } else if (act.rfind("SHOW ", 0) != 0 && act.find('(') != string::npos) {
+        act = linkRoomCalls(prog, act);
+    }
+}
+
+// Loads every `table` declaration, compiling its source first if needed
+static void loadTables(Program& prog) {
+    for (auto& d : prog.tableDecls) {
+        string path = d.path;
+        if (!prog.baseDir.empty() && !path.empty() && path[0] != '/') path = prog.baseDir + "/" + path;
+        auto table = CRTZ::Table::load(path);
+        if (!table) {
+            cerr << "Link error: could not load table '" << d.name << "' from " << path << " (line " << d.line << ")\n";
+            continue;
+        }
+        prog.tableIndex[d.name] = (int)prog.tables.size();
+        prog.tables.push_back(table);
+    }
+}
+
+// "weapons.damage" -> "T,C" for a loaded table and existing column, else ""
+static string tableColumnRef(const Program& prog, const string& ref) {
+    auto pr = splitDot(ref);
+    auto it = prog.tableIndex.find(pr.first);
+    if (it == prog.tableIndex.end() || pr.second.empty()) return "";
+    int col = prog.tables[it->second]->column(pr.second);
+    if (col < 0) {
+        cerr << "Link error: table '" << pr.first << "' has no column '" << pr.second << "'\n";
+        return "";
+    }
+    return to_string(it->second) + "," + to_string(col);
+}
+
+// Lowers table access to built-in calls on table/column ids:
+//   weapons[id].damage      -> table_get(T,C,id)
+//   weapons.count           -> row count
+//   sum/min/max(weapons.x)  -> table_sum/table_min/table_max(T,C)
+//   find(weapons.name, v)   -> table_find(T,C,v), the id of the first match or -1
+static string linkTableRefs(const Program& prog, const string& code) {
+    string out;
+    size_t i = 0;
+    while (i < code.size()) {
+        char c = code[i];
+        if (c == '"') {
+            size_t j = i + 1;
+            while (j < code.size() && code[j] != '"') j += (code[j] == '\\') ? 2 : 1;
+            out.append(code, i, j + 1 - i);
+            i = j + 1;
+            continue;
+        }
+        if (!(isalpha((unsigned char)c) || c == '_')) {
+            out.push_back(c);
+            ++i;
+            continue;
+        }
+        size_t j = i;
+        while (j < code.size() && (isalnum((unsigned char)code[j]) || code[j] == '_' || code[j] == '.')) j++;
+        string word = code.substr(i, j - i);
+        size_t k = j;
+        while (k < code.size() && isspace((unsigned char)code[k])) k++;
+        auto pr = splitDot(word);
+        auto tit = prog.tableIndex.find(pr.first);
+
+        if (tit != prog.tableIndex.end() && pr.second.empty() && k < code.size() && code[k] == '[') {
+            size_t close = k;
+            for (int depth = 0; close < code.size(); ++close) {
+                if (code[close] == '[') depth++;
+                else if (code[close] == ']' && --depth == 0) break;
+            }
+            size_t f = close + 1;
+            size_t e = f + 1;
+            while (e < code.size() && (isalnum((unsigned char)code[e]) || code[e] == '_')) e++;
+            if (close >= code.size() || f >= code.size() || code[f] != '.' || e == f + 1) {
+                cerr << "Link error: expected " << word << "[id].column\n";
+                out += "0";
+                i = close < code.size() ? close + 1 : code.size();
+                continue;
+            }
+            string ref = tableColumnRef(prog, word + code.substr(f, e - f));
+            string key = linkTableRefs(prog, code.substr(k + 1, close - k - 1));
+            out += ref.empty() ? string("0") : "table_get(" + ref + "," + key + ")";
+            i = e;
+            continue;
+        }
+        if (tit != prog.tableIndex.end() && pr.second == "count") {
+            out += to_string(prog.tables[tit->second]->rows());
+            i = j;
+            continue;
+        }
+        bool aggregate = word == "sum" || word == "min" || word == "max" || word == "find";
+        size_t close = (aggregate && k < code.size() && code[k] == '(') ? matchParen(code, k) : string::npos;
+        if (close != string::npos) {
+            vector<string> args = splitArgs(code.substr(k + 1, close - k - 1));
+            auto ait = args.empty() ? prog.tableIndex.end() : prog.tableIndex.find(splitDot(args[0]).first);
+            if (ait != prog.tableIndex.end()) {
+                string ref = tableColumnRef(prog, args[0]);
+                size_t want = word == "find" ? 2 : 1;
+                if (ref.empty() || args.size() != want) {
+                    if (!ref.empty()) cerr << "Link error: '" << word << "' expects " << want << " arguments\n";
+                    out += word == "find" ? "-1" : "0";
+                } else if (word == "find") {
+                    out += "table_find(" + ref + "," + linkTableRefs(prog, args[1]) + ")";
+                } else {
+                    if (prog.tables[ait->second]->isString(prog.tables[ait->second]->column(splitDot(args[0]).second))) {
+                        cerr << "Link error: '" << word << "' needs a numeric column, '" << args[0] << "' holds text\n";
+                    }
+                    out += "table_" + word + "(" + ref + ")";
+                }
+                i = close + 1;
+                continue;
+            }
+        }
+        out += word;
+        i = j;
+    }
+    return out;
+}
+
+// Numbers every translatable text: per node (by name) its line, choices and
+// show texts, keyed "node.line", "node.choice.<id>" and "node.show.<n>"
+static void assignStringIds(Program& prog) {
+    vector<string> names;
+    for (auto& kv : prog.nodes) names.push_back(kv.first);
+    sort(names.begin(), names.end());
+    for (auto& name : names) {
+        Node& node = prog.nodes[name];
+        if (!node.text.empty()) {
+            node.textId = (int)prog.stringKeys.size();
+            prog.stringKeys.push_back(name + ".line");
+        }
+        for (auto& c : node.choices) {
+            c.textId = (int)prog.stringKeys.size();
+            prog.stringKeys.push_back(name + ".choice." + to_string(c.id));
+        }
+        node.actionTextIds.assign(node.actions.size(), -1);
+        int shows = 0;
+        for (size_t i = 0; i < node.actions.size(); ++i) {
+            if (node.actions[i].rfind("SHOW ", 0) != 0) continue;
+            node.actionTextIds[i] = (int)prog.stringKeys.size();
+            prog.stringKeys.push_back(name + ".show." + to_string(shows++));
+        }
+    }
+    uint64_t h = 1469598103934665603ull;  // FNV-1a
+    for (auto& k : prog.stringKeys) {
+        for (char c : k) h = (h ^ (unsigned char)c) * 1099511628211ull;
+        h = (h ^ '\n') * 1099511628211ull;
+    }
+    prog.stringFingerprint = h;
+}
+
+// Moves all translatable text into the compressed store, leaving the
+// program's copies empty (SHOW actions keep only their "SHOW " tag)
+static void compressText(Program& prog) {
+    vector<string_view> texts = parsedTexts(prog);
+    prog.textStore = CRTZ::TextStore::build(texts);
+    prog.textCompressed = true;
+    for (auto& kv : prog.nodes) {
+        Node& node = kv.second;
+        string().swap(node.text);
+        for (auto& c : node.choices) string().swap(c.text);
+        for (size_t i = 0; i < node.actions.size(); ++i) {
+            if (node.actionTextIds[i] >= 0) string("SHOW ").swap(node.actions[i]);
+        }
+    }
+}
+
+// set s = s + a + b on a string variable becomes "APPEND s a + b", which
+// appends a and b to s's buffer instead of copying s for each statement, so
+// text built up in a loop costs linear time. Only sums at the top level are
+// lowered; s + a - b and comparisons keep their usual meaning.
+static void linkStringAppend(const Program& prog, string& act) {
+    if (act.rfind("SET ", 0) != 0) return;
+    size_t sp = act.find(' ', 4);
+    if (sp == string::npos || !prog.stringVars.count(act.substr(4, sp - 4))) return;
+    string expr = act.substr(sp + 1);
+    vector<string> tokens = tokenizeExpr(expr);
+    if (tokens.size() < 3 || tokens[0] != act.substr(4, sp - 4) || tokens[1] != "+") return;
+    int depth = 0;
+    for (size_t i = 2; i < tokens.size(); ++i) {
+        const string& t = tokens[i];
+        if (t == "(") depth++;
+        else if (t == ")") depth--;
+        else if (depth == 0 && isOperator(t) && t != "+" && t != "*" && t != "/") return;
+    }
+    size_t rest = expr.find_first_not_of(" \t", expr.find('+') + 1);
+    act = "APPEND " + act.substr(4, sp - 4) + " " + expr.substr(rest);
+}
+
+// Number and dice literals too large for the interpreter evaluate to 0
+static void checkLiterals(const string& expr, const string& where) {
+    for (auto& t : tokenizeExpr(expr)) {
+        bool literal = !t.empty() && (isdigit((unsigned char)t[0]) || ((t[0] == '-' || t[0] == '+') && t.size() > 1 && isdigit((unsigned char)t[1])));
+        if (literal && !literalFits(t)) {
+            cerr << "Link error: number out of range '" << t << "' in " << where << "\n";
+        }
+    }
+}
+
+// Decodes every action of the linked program once and compiles its
+// expressions, so running it does not cut, tokenize or look up anything
+static ActionCode compileAction(const string& act, const string& where, const vector<CRTZ::NativeBinding>* natives) {
+    ActionCode code;
+    auto expr = [&](const string& t) {
+        checkLiterals(t, where);
+        code.exprs.push_back(compileRPN(infixToRPN(tokenizeExpr(t)), natives));
+        code.host = code.host || callsHost(code.exprs.back());
+    };
+    if (act.rfind("SET ", 0) == 0 || act.rfind("SIGNAL ", 0) == 0) {
+        code.op = act[1] == 'E' ? ActionCode::Set : ActionCode::Signal;
+        string rest = act.substr(act.find(' ') + 1);
+        size_t p = 0;
+        while (p < rest.size() && !isspace((unsigned char)rest[p])) code.name.push_back(rest[p++]);
+        while (p < rest.size() && isspace((unsigned char)rest[p])) p++;
+        auto pr = splitDot(code.name);
+        if (!pr.second.empty()) {
+            code.inst = pr.first;
+            code.field = pr.second;
+        }
+        expr(rest.substr(p));
+    } else if (act.rfind("APPEND ", 0) == 0) {
+        code.op = ActionCode::Append;
+        size_t sp = act.find(' ', 7);
+        code.name = act.substr(7, sp - 7);
+        string terms = act.substr(sp + 1);
+        checkLiterals(terms, where);
+        code.exprs = compileSumTerms(terms, natives);
+        for (auto& e : code.exprs) code.host = code.host || callsHost(e);
+    } else if (act.rfind("IF ", 0) == 0) {
+        size_t gpos = act.find(" GOTO ");
+        if (gpos == string::npos) return code;
+        code.op = ActionCode::If;
+        string rest = act.substr(gpos + 6);
+        size_t epos = rest.find(" ELSE ");
+        code.target = rest.substr(0, epos);
+        if (epos != string::npos) code.elseTarget = rest.substr(epos + 6);
+        expr(act.substr(3, gpos - 3));
+    } else if (act.rfind("SWITCH ", 0) == 0) {
+        code.op = ActionCode::Switch;
+        size_t sp = act.find(' ', 7);
+        code.index = stoi(act.substr(7, sp - 7));
+        expr(act.substr(sp + 1));
+    } else if (act.rfind("GO ", 0) == 0) {
+        code.op = ActionCode::Go;
+        code.index = stoi(act.substr(3));
+    } else if (act.rfind("TAKE ", 0) == 0 || act.rfind("DROP ", 0) == 0) {
+        code.op = act[0] == 'T' ? ActionCode::Take : ActionCode::Drop;
+        code.index = stoi(act.substr(5));
+    } else if (act.rfind("GOTO ", 0) == 0) {
+        code.op = ActionCode::Goto;
+        code.target = act.substr(5);
+    } else if (act == "END") {
+        code.op = ActionCode::End;
+    } else if (act.rfind("CALL ", 0) == 0) {
+        code.op = ActionCode::Call;
+        expr(act.substr(5));
+    } else if (act.rfind("SHOW ", 0) == 0) {
+        code.op = ActionCode::Show;
+    } else if (act.rfind("STMT ", 0) == 0) {
+        code.op = ActionCode::Stmt;
+        string s = trim(act.substr(5));
+        // Image loading and display reach the host's driver
+        if (s.rfind("picture ", 0) == 0 || s.rfind("display(", 0) == 0) {
+            code.host = true;
+            return code;
+        }
+        size_t dotp = s.find('.');
+        size_t paren = s.find('(');
+        if (dotp != string::npos && paren != string::npos && paren > dotp) {
+            code.op = ActionCode::MethodCall;
+            code.name = s.substr(0, dotp);
+            code.method = s.substr(dotp + 1, paren - (dotp + 1));
+            size_t rparen = s.rfind(')');
+            string argsraw = rparen != string::npos && rparen > paren ? s.substr(paren + 1, rparen - paren - 1) : s.substr(paren + 1);
+            for (auto& ae : splitArgs(argsraw)) expr(ae);
+        } else if (s.rfind("print(", 0) == 0) {
+            size_t q = s.rfind(')');
+            if (q == string::npos || q <= 5) {
+                code.op = ActionCode::None;
+                return code;
+            }
+            code.op = ActionCode::Print;
+            string inner = s.substr(6, q - 6);
+            if (inner.size() >= 2 && inner.front() == '"' && inner.back() == '"') code.literal = inner.substr(1, inner.size() - 2);
+            else expr(inner);
+        }
+    }
+    return code;
+}
+
+static void compileActions(Program& prog) {
+    for (auto& kv : prog.nodes) {
+        auto& node = kv.second;
+        node.code.clear();
+        node.code.reserve(node.actions.size());
+        for (size_t i = 0; i < node.actions.size(); ++i) {
+            node.code.push_back(compileAction(node.actions[i], "node '" + kv.first + "', action " + to_string(i + 1), &prog.natives));
+        }
+    }
+    for (auto& kv : prog.classes) {
+        for (auto& m : kv.second.methods) {
+            auto& code = kv.second.methodCode[m.first];
+            code.clear();
+            for (size_t i = 0; i < m.second.size(); ++i) {
+                code.push_back(compileAction(m.second[i], "method " + kv.first + "." + m.first + ", action " + to_string(i + 1), &prog.natives));
+            }
+        }
+    }
+    for (auto& kv : prog.derived) {
+        const string& t = kv.second.expr;
+        checkLiterals(t, "derived variable '" + kv.first + "'");
+        kv.second.code = compileRPN(infixToRPN(tokenizeExpr(t)), &prog.natives);
+        kv.second.host = callsHost(kv.second.code);
+    }
+}
+
+// Loads data tables, resolves host function calls against the given bindings,
+// builds the room graph and numbers translatable text. Runs once per parsed program, before it is executed.
+static void linkProgram(Program& prog, const vector<CRTZ::NativeBinding>& natives) {
+    loadTables(prog);
+    if (!prog.tables.empty()) {
+        auto lower = [&prog](string& act) {
+            if (act.rfind("SHOW ", 0) != 0) act = linkTableRefs(prog, act);
+        };
+        for (auto& kv : prog.nodes) {
+            for (auto& act : kv.second.actions) lower(act);
+        }
+        for (auto& kv : prog.classes) {
+            for (auto& m : kv.second.methods) {
+                for (auto& act : m.second) lower(act);
+            }
+        }
+        for (auto& kv : prog.derived) lower(kv.second.expr);
+    }
+
+    prog.natives = natives;
+    if (!natives.empty()) {
+        unordered_map<string, size_t> index;
+        for (size_t i = 0; i < natives.size(); ++i) index[natives[i].name] = i;
+
+        for (auto& kv : prog.nodes) {
+            for (auto& act : kv.second.actions) linkAction(act, index, natives);
+        }
+        for (auto& kv : prog.classes) {
+            for (auto& m : kv.second.methods) {
+                for (auto& act : m.second) linkAction(act, index, natives);
+            }
+        }
+        for (auto& kv : prog.derived) kv.second.expr = linkCalls(kv.second.expr, index, natives);
+    }
+
+    // Host bindings take precedence, so room built-ins are linked afterwards
+    buildRoomGraph(prog);
+    for (auto& kv : prog.nodes) {
+        for (auto& act : kv.second.actions) linkRoomAction(prog, act);
+    }
+    for (auto& kv : prog.classes) {
+        for (auto& m : kv.second.methods) {
+            for (auto& act : m.second) linkRoomAction(prog, act);
+        }
+    }
+    for (auto& kv : prog.derived) {
+        if (kv.second.expr.find('(') != string::npos) kv.second.expr = linkRoomCalls(prog, kv.second.expr);
+    }
+    if (!prog.stringVars.empty()) {
+        for (auto& kv : prog.nodes) {
+            for (auto& act : kv.second.actions) linkStringAppend(prog, act);
+        }
+    }
+    compileActions(prog);
+    assignStringIds(prog);
+    buildTextIndex(prog);
+
+    for (auto& kv : prog.nodes) kv.second.profileId = CRTZ::profileId(prog.name, kv.first);
+    for (auto& kv : prog.classes) {
+        for (auto& m : kv.second.methods) kv.second.methodProfileIds[m.first] = CRTZ::profileId(prog.name, kv.first + "." + m.first);
+    }
+}
+
+// ----------------------- Runtime / Runner -----------------------
+
+static long long rollDice(SessionState& ss, long long count, long long sides) {
+    return ss.rng.dice(count, sides);
+}
+
+static bool readStringVar(const SessionState& ss, const string& name, CRTZ::Value& out) {
+    auto it = ss.stringVars.find(name);
+    if (it != ss.stringVars.end()) { out = CRTZ::Value(it->second); return true; }
+    string room;
+    if (!roomText(ss, name, room)) return false;
+    out = CRTZ::Value(move(room));
+    return true;
+}
+
+// Current value of a variable or "inst.field"; false if it does not exist
+static bool lookupVar(const SessionState& ss, const string& name, CRTZ::Value& out) {
+    string roomName;
+    if (roomText(ss, name, roomName)) { out = CRTZ::Value(roomName); return true; }
+    auto pr = splitDot(name);
+    if (!pr.second.empty()) {
+        auto oit = ss.objects.find(pr.first);
+        if (oit == ss.objects.end()) return false;
+        auto fit = oit->second.find(pr.second);
+        if (fit == oit->second.end()) return false;
+        out = CRTZ::Value((long long)fit->second);
+        return true;
+    }
+    auto sit = ss.stringVars.find(name);
+    if (sit != ss.stringVars.end()) { out = CRTZ::Value(sit->second); return true; }
+    auto bit = ss.boolVars.find(name);
+    if (bit != ss.boolVars.end()) { out = CRTZ::Value((long long)(bit->second ? 1 : 0)); return true; }
+    auto vit = ss.vars.find(name);
+    if (vit != ss.vars.end()) { out = CRTZ::Value((long long)vit->second); return true; }
+    return false;
+}
+
+// Steps from room `from` to `target` (-1 if unreachable); dir is set to the
+// first direction to take
+static int roomRoute(const Program& prog, int from, int target, int& dir) {
+    dir = -1;
+    size_t rooms = prog.roomNames.size();
+    if (from < 0 || target < 0 || (size_t)target >= rooms) return -1;
+    uint16_t dist;
+    if (!prog.pathNext.empty()) {
+        size_t i = (size_t)target * rooms + from;
+        dir = prog.pathNext[i];
+        dist = prog.pathDist[i];
+    } else {
+        vector<int16_t> next(rooms);
+        vector<uint16_t> dists(rooms);
+        roomBFS(prog, target, next.data(), dists.data());
+        dir = next[from];
+        dist = dists[from];
+    }
+    return dist == 0xFFFF ? -1 : dist;
+}
+
+static BuiltinId builtinId(const string& name) {
+    static const unordered_map<string, BuiltinId> ids = {
+        { "path_to", PathTo }, { "distance_to", DistanceTo }, { "hasItem", HasItem }, { "carrying", Carrying },
+        { "where", Where }, { "table_get", TableGet }, { "table_find", TableFind }, { "table_sum", TableSum },
+        { "table_min", TableMin }, { "table_max", TableMax }, { "rand", Rand }, { "chance", Chance },
+        { "len", Len }, { "str", Str }, { "substr", Substr }
+    };
+    auto it = ids.find(name);
+    if (it != ids.end()) return it->second;
+    return name.rfind("table_", 0) == 0 ? TableMax : NoBuiltin;  // other table_ scans take the largest
+}
+
+static bool callBuiltin(BuiltinId id, const string& name, const CRTZ::Value* args, size_t argc,
+    SessionState* ss, CRTZ::Value& out) {
+    switch (id) {
+    case NoBuiltin:
+        return false;
+    case PathTo:
+    case DistanceTo: {
+        if (argc != 1) {
+            diagnostics(ss) << "Runtime: '" << name << "' expects 1 argument\n";
+            return true;
+        }
+        if (!ss) return true;
+        const Program& prog = *ss->prog;
+        int dir;
+        int target = args[0].num >= 0 && args[0].num < (long long)prog.roomNames.size() ? (int)args[0].num : -1;
+        int steps = roomRoute(prog, ss->room, target, dir);
+        if (id == DistanceTo) out = CRTZ::Value((long long)steps);
+        else out = CRTZ::Value(dir >= 0 ? prog.directionNames[dir] : string());
+        return true;
+    }
+    case HasItem:
+    case Carrying:
+    case Where: {
+        if (argc != 1) {
+            diagnostics(ss) << "Runtime: '" << name << "' expects 1 argument\n";
+            return true;
+        }
+        if (!ss) return true;
+        const Program& prog = *ss->prog;
+        if (args[0].num < 0 || args[0].num >= (long long)prog.itemNames.size()) {
+            if (id == Where) out = CRTZ::Value(string());
+            return true;
+        }
+        int item = (int)args[0].num;
+        if (id == HasItem) {
+            out = CRTZ::Value((long long)(ss->room >= 0 && SessionState::hasBit(ss->itemsIn(ss->room), item)));
+        } else if (id == Carrying) {
+            out = CRTZ::Value((long long)SessionState::hasBit(ss->inventory.data(), item));
+        } else {
+            // Inventory first, then the first room holding it
+            const vector<int>& rooms = ss->itemRooms[item];
+            if (SessionState::hasBit(ss->inventory.data(), item)) out = CRTZ::Value(string("inventory"));
+            else out = CRTZ::Value(rooms.empty() ? string() : prog.roomNames[rooms.front()]);
+        }
+        return true;
+    }
+    case TableGet:
+    case TableFind:
+    case TableSum:
+    case TableMin:
+    case TableMax: {
+        const Program* prog = ss ? ss->prog.get() : nullptr;
+        size_t want = id == TableGet || id == TableFind ? 3 : 2;
+        if (argc != want || !prog || args[0].num < 0 || args[0].num >= (long long)prog->tables.size()) return true;
+        const CRTZ::Table& t = *prog->tables[args[0].num];
+        if (args[1].num < 0 || args[1].num >= (long long)t.cols()) return true;
+        int col = (int)args[1].num;
+        if (id == TableGet) {
+            long long row = t.findRow(args[2].num);
+            if (t.isString(col)) out = CRTZ::Value(row < 0 ? string() : string(t.stringAt(col, (size_t)row)));
+            else out = CRTZ::Value(row < 0 ? 0LL : (long long)t.intAt(col, (size_t)row));
+        } else if (id == TableFind) {
+            out = CRTZ::Value(-1LL);
+            string key = args[2].isString ? args[2].str : to_string(args[2].num);
+            for (size_t r = 0; r < t.rows(); ++r) {
+                if (t.isString(col) ? t.stringAt(col, r) == key : t.intAt(col, r) == args[2].num) {
+                    out = CRTZ::Value(t.rowId(r));
+                    break;
+                }
+            }
+        } else if (!t.isString(col)) {
+            // Column scans run over the mapped int64 array directly
+            long long acc = 0;
+            for (size_t r = 0; r < t.rows(); ++r) {
+                long long v = t.intAt(col, r);
+                if (id == TableSum) acc += v;
+                else if (r == 0 || (id == TableMin ? v < acc : v > acc)) acc = v;
+            }
+            out = CRTZ::Value(acc);
+        }
+        return true;
+    }
+    case Rand:
+    case Chance: {
+        // rand(a, b): uniform in [a, b]; chance(p): true p percent of the time
+        size_t want = id == Rand ? 2 : 1;
+        if (argc != want) {
+            diagnostics(ss) << "Runtime: '" << name << "' expects " << want << " arguments\n";
+            return true;
+        }
+        if (!ss) return true;
+        if (id == Rand) out = CRTZ::Value(ss->rng.range(args[0].num, args[1].num));
+        else out = CRTZ::Value((long long)((long long)ss->rng.below(100) < args[0].num));
+        return true;
+    }
+    case Len:
+    case Str:
+    case Substr: {
+        size_t want = id == Substr ? 3 : 1;
+        if (argc != want && !(id == Substr && argc == 2)) {
+            diagnostics(ss) << "Runtime: '" << name << "' expects " << want << " arguments\n";
+            return true;
+        }
+        string s = args[0].isString ? args[0].str : to_string(args[0].num);
+        if (id == Len) {
+            out = CRTZ::Value((long long)s.size());
+        } else if (id == Str) {
+            out = CRTZ::Value(move(s));
+        } else {
+            // substr(s, start[, count]), clamped to the string
+            long long start = min(max(args[1].num, 0LL), (long long)s.size());
+            long long count = argc == 3 ? max(args[2].num, 0LL) : (long long)s.size();
+            out = CRTZ::Value(s.substr((size_t)start, (size_t)count));
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+// Runs observers for watches written during the step whose value changed.
+// Cost is proportional to the number of writes, not the number of watches.
+static void deliverWatches(SessionState& ss) {
+    vector<size_t> pending;
+    pending.swap(ss.dirtyWatches);
+    for (size_t i : pending) {
+        SessionState::Watch& w = ss.watches[i];
+        w.dirty = false;
+        if (!w.fn) continue;
+        CRTZ::Value v;
+        refreshIfDerived(ss, w.name);
+        lookupVar(ss, w.name, v);
+        if (v.num == w.last.num && v.isString == w.last.isString && v.str == w.last.str) continue;
+        w.last = v;
+        // The callback may add watches and move ss.watches: copy what it gets
+        CRTZ::Session::Watcher fn = w.fn;
+        string name = w.name;
+        fn(name, v);
+    }
+}
+
+// Copies node, counters and exported variables into the session's
+// shared-memory slot. Values (derived ones included) are computed first, so
+// the seqlock is only held for plain stores and readers rarely retry.
+static void publishState(SessionState& ss) {
+    CRTZ::StateSlot* slot = ss.exportSlot;
+    if (!slot) return;
+    const vector<string>& names = ss.resources->exportedVars;
+    uint32_t count = slot->varCount;
+    int64_t values[CRTZ::kStateMaxVars];
+    for (uint32_t i = 0; i < count; ++i) {
+        CRTZ::Value v;
+        refreshIfDerived(ss, names[i]);
+        lookupVar(ss, names[i], v);
+        values[i] = v.num;
+    }
+    CRTZ::beginWrite(*slot);
+    slot->status = (uint32_t)ss.status;
+    slot->steps = ss.steps;
+    slot->nodeVisits = ss.nodeVisits;
+    slot->choices = ss.choicesMade;
+    CRTZ::copyField(slot->node, sizeof(slot->node), ss.current);
+    for (uint32_t i = 0; i < count; ++i) slot->vars[i].value = values[i];
+    CRTZ::endWrite(*slot);
+}
+
+// Menu text of a choice as shown to the player
+static string choiceText(const SessionState& ss, const Choice& c) {
+    string text = ss.localize(c.textId, c.text);
+    size_t pos = 0;
+    while ((pos = text.find("[@You]", pos)) != string::npos) {
+        text.replace(pos, 6, "[" + ss.playerName + "]");
+        pos += ss.playerName.size() + 2;
+    }
+    return text;
+}
+
+// Runs the session from its current node until it needs a choice or ends
+static CRTZ::Session::Status runUntilInput(SessionState& ss) {
+    LocationScope location;
+    const Program& prog = *ss.prog;
+    ostream& out = *ss.out;
+    string& current = ss.current;
+    const string& playerName = ss.playerName;
+    unordered_map<string, int>& vars = ss.vars;
+    unordered_map<string, bool>& boolVars = ss.boolVars;
+    unordered_map<string, unordered_map<string, int>>& objects = ss.objects;
+
+    // picture arrays map (CRTZ picture arrays -> ImageDriver indices)
+    unordered_map<string, vector<int>>& pictureArrays = ss.pictureArrays;
+
+    ss.choices.clear();
+    if (ss.status == CRTZ::Session::Finished || ss.status == CRTZ::Session::Failed) return ss.status;
+    ss.status = CRTZ::Session::Running;
+    ss.error.clear();
+    ss.fuel = ss.limits.fuel;
+
+    if (!ss.started) {
+        ss.started = true;
+        if (!prog.npc.empty()) {
+            out << "Npc: " << prog.npc << "\n";
+        }
+        if (!prog.desc.empty()) {
+            out << "Description: " << prog.desc << "\n\n";
+        }
+    }
+
+    while (true) {
+        auto nit = prog.nodes.find(current);
+        if (nit == prog.nodes.end()) {
+            *ss.err << "Unknown node: " << current << "\n";
+            return ss.status = CRTZ::Session::Finished;
+        }
+        const Node& node = nit->second;
+        if (ss.speculative && *ss.cancelSpeculation) {
+            ss.speculationAborted = true;
+            return ss.status;
+        }
+        if (ss.limits.fuel) {
+            if (!ss.fuel) {
+                ss.error = "fuel exhausted before node '" + current + "'";
+                return ss.status = CRTZ::Session::Suspended;
+            }
+            ss.fuel--;
+        }
+        ss.nodeVisits++;
+        if (!ss.speculative) metrics().m.add(metrics().nodes);
+        if (ss.graph) ss.graph->enter(&node, nowNanos());
+        CRTZ::scriptLocation.node = node.profileId;
+        CRTZ::scriptLocation.action = 0;
+        publishState(ss);
+
+        if (ss.debugger) {
+            refreshAllDerived(ss);
+            ss.debugger->check(node.definitionLine, ss);
+            if (!ss.debugger->jumpTo.empty()) {
+                current = move(ss.debugger->jumpTo);
+                ss.debugger->jumpTo.clear();
+                continue;
+            }
+        }
+
+        if (node.textId >= 0) {
+            string text = ss.localize(node.textId, node.text);
+            size_t pos = 0;
+            while ((pos = text.find("[@You]", pos)) != string::npos) {
+                text.replace(pos, 6, "[" + playerName + "]");
+                pos += playerName.size() + 2;
+            }
+            size_t p = 0;
+            while ((p = text.find("${", p)) != string::npos) {
+                size_t q = text.find("}", p + 2);
+                if (q == string::npos) break;
+                string varname = text.substr(p + 2, q - (p + 2));
+                string val;
+                auto pr = splitDot(varname);
+                if (roomText(ss, varname, val)) {
+                } else if (!pr.second.empty()) {
+                    if (objects.count(pr.first) && objects[pr.first].count(pr.second)) {
+                        val = to_string(objects[pr.first][pr.second]);
+                    } else {
+                        val = "0";
+                    }
+                } else {
+                    refreshIfDerived(ss, varname);
+                    if (ss.stringVars.count(varname)) {
+                        val = ss.stringVars[varname];
+                    } else if (boolVars.count(varname)) {
+                        val = boolVars[varname] ? "true" : "false";
+                    } else if (vars.count(varname)) {
+                        val = to_string(vars[varname]);
+                    } else {
+                        val = "0";
+                    }
+                }
+                text.replace(p, q - p + 1, val);
+                p += 1;
+            }
+
+            out << text << "\n";
+        }
+
+        // A node with choices offers them and waits for the host to pick one;
+        // its other actions are not run
+        if (!node.choices.empty()) {
+            for (auto& c : node.choices) {
+                string text = choiceText(ss, c);
+                out << "[" << c.id << "] " << text << "\n";
+                ss.choices.push_back({ c.id, text });
+            }
+            return ss.status = CRTZ::Session::WaitingForChoice;
+        }
+
+        bool jumped = false;
+        string jump_target;
+        for (size_t i = 0; i < node.actions.size(); ++i) {
+            const string& act = node.actions[i];
+            const ActionCode& code = node.code[i];
+            CRTZ::scriptLocation.action = (uint32_t)i;
+            if (ss.status == CRTZ::Session::Failed || ss.speculationAborted) return ss.status;
+            if (ss.speculative && code.host) {
+                ss.speculationAborted = true;
+                return ss.status;
+            }
+            if (code.op == ActionCode::Set) {
+                const string& name = code.name;
+                if (!prog.derived.empty() && prog.derived.count(name)) {
+                    *ss.err << "Runtime: cannot set derived variable '" << name << "'\n";
+                    continue;
+                }
+                if (!code.field.empty()) {
+                    objects[code.inst][code.field] = evalInt(code.exprs[0], vars, boolVars, objects, ss);
+                } else {
+                    if (ss.stringVars.count(name)) {
+                        CRTZ::Value v = evalCompiled(code.exprs[0], vars, boolVars, objects, &ss);
+                        if (!ss.setString(name, v.isString ? move(v.str) : to_string(v.num))) {
+                            ss.fail("string limit of " + to_string(ss.limits.maxStringBytes) + " bytes exceeded setting '" + name + "'");
+                        }
+                    } else if (boolVars.count(name)) {
+                        int val = evalInt(code.exprs[0], vars, boolVars, objects, ss);
+                        boolVars[name] = (val != 0);
+                    } else {
+                        int val = evalInt(code.exprs[0], vars, boolVars, objects, ss);
+                        vars[name] = val;
+                    }
+                }
+                ss.noteWrite(name);
+            } else if (code.op == ActionCode::If) {
+                if (evalInt(code.exprs[0], vars, boolVars, objects, ss)) {
+                    current = code.target;
+                    jumped = true;
+                    break;
+                } else if (!code.elseTarget.empty()) {
+                    current = code.elseTarget;
+                    jumped = true;
+                    break;
+                }
+            } else if (code.op == ActionCode::Goto) {
+                current = code.target;
+                jumped = true;
+                break;
+            } else if (code.op == ActionCode::Append) {
+                if (!appendTerms(ss, code, vars, boolVars, objects)) {
+                    ss.fail("string limit of " + to_string(ss.limits.maxStringBytes) + " bytes exceeded appending to '" + code.name + "'");
+                }
+            } else if (code.op == ActionCode::Signal) {
+                int val = evalInt(code.exprs[0], vars, boolVars, objects, ss);
+                out << "[SIGNAL] " << code.name << " = " << (val ? "true" : "false") << "\n";
+            } else if (code.op == ActionCode::Switch) {
+                // One evaluation, then a table or binary-search lookup
+                const SwitchTable& sw = prog.switches[code.index];
+                int c = sw.find(evalInt(code.exprs[0], vars, boolVars, objects, ss));
+                if (c >= 0) {
+                    current = sw.targets[c];
+                    jumped = true;
+                    break;
+                }
+            } else if (code.op == ActionCode::Go) {
+                goDirection(ss, code.index);
+            } else if (code.op == ActionCode::Take || code.op == ActionCode::Drop) {
+                moveItem(ss, code.index, code.op == ActionCode::Take);
+            } else if (code.op == ActionCode::End) {
+                out << "[Dialogue ended]\n";
+                return ss.status = CRTZ::Session::Finished;
+            } else if (code.op == ActionCode::Call) {
+                evalCompiled(code.exprs[0], vars, boolVars, objects, &ss);
+            } else if (code.op == ActionCode::MethodCall) {
+                vector<int> argVals;
+                argVals.reserve(code.exprs.size());
+                for (auto& e : code.exprs) argVals.push_back(evalInt(e, vars, boolVars, objects, ss));
+                executeMethod(ss, code.name, code.method, argVals, vector<string>{});
+            } else if (code.op == ActionCode::Print) {
+                if (code.exprs.empty()) out << code.literal << "\n";
+                else out << (evalInt(code.exprs[0], vars, boolVars, objects, ss) ? "true" : "false") << "\n";
+            } else if (code.op == ActionCode::Stmt) {
+                string stmt = act.substr(5);
+                string s = trim(stmt);
+
+                // ---- NEW: handle picture array loading: picture img[SIZE] = load("folder")
+                if (s.rfind("picture ", 0) == 0) {
+                    // minimal parser: picture <name>[<size>] = load("folder")
+                    string rest = trim(s.substr(8));
+                    size_t br = rest.find('[');
+                    string arrName;
+                    if (br != string::npos) arrName = trim(rest.substr(0, br));
+                    else {
+                        *ss.err << "Invalid picture declaration: missing array name\n";
+                        continue;
+                    }
+                    size_t eq = rest.find('=');
+                    if (eq == string::npos) {
+                        *ss.err << "Invalid picture declaration: missing '='\n";
+                        continue;
+                    }
+                    string rhs = trim(rest.substr(eq + 1));
+                    // expect load("...") form
+                    if (rhs.rfind("load(", 0) == 0) {
+                        size_t q1 = rhs.find('"');
+                        size_t q2 = rhs.rfind('"');
+                        if (q1 != string::npos && q2 != string::npos && q2 > q1) {
+                            string folder = rhs.substr(q1 + 1, q2 - q1 - 1);
+                            ImageDriver* imgDrv = ss.images();
+                            if (!imgDrv) {
+                                if (!ss.headless()) *ss.err << "ImageDriver not available: cannot load pictures\n";
+                            } else {
+                                uint64_t start = nowNanos();
+                                vector<int> indices = imgDrv->loadFolder(folder);
+                                metrics().m.record(metrics().imageLoad, nowNanos() - start);
+                                pictureArrays[arrName] = indices;
+                                out << "Loaded " << indices.size() << " images into " << arrName << "\n";
+                            }
+                        } else {
+                            *ss.err << "Invalid load() folder string\n";
+                        }
+                    } else {
+                        *ss.err << "Unsupported picture initializer: " << rhs << "\n";
+                    }
+                    continue; // next action
+                } else if (s.rfind("display(", 0) == 0) {
+                    size_t p = s.find('(');
+                    size_t q = s.rfind(')');
+                    if (p == string::npos || q == string::npos || q <= p) {
+                        *ss.err << "Invalid display(...) statement\n";
+                        continue;
+                    }
+                    string inner = trim(s.substr(p + 1, q - p - 1));
+                    
+                    size_t b = inner.find('[');
+    size_t rb = inner.rfind(']');
+    if (b != string::npos && rb != string::npos && rb > b) {
+        string arrName = trim(inner.substr(0, b));
+        string idxStr = trim(inner.substr(b + 1, rb - b - 1));
+        int idx = 0;
+        try { idx = stoi(idxStr); }
+        catch (...) { 
+            *ss.err << "display: invalid index: " << idxStr << "\n"; 
+            continue; 
+        }
+        if (pictureArrays.count(arrName) == 0) {
+            *ss.err << "display: unknown picture array: " << arrName << "\n";
+        } else {
+            auto &vec = pictureArrays[arrName];
+            if (idx < 0 || idx >= (int)vec.size()) {
+                *ss.err << "display: index out of range: " << idx << "\n";
+            } else {
+                int driverIndex = vec[idx];
+                ImageDriver* imgDrv = ss.images();
+                if (!imgDrv) { 
+                    if (!ss.headless()) *ss.err << "ImageDriver not available: display failed\n"; 
+                } else {
+                    imgDrv->displayByIndex(driverIndex);
+                }
+            }
+        }
+    } else {
+        // If it's not an array index, treat it as a path
+        if (inner.size() >= 2 && inner.front() == '"' && inner.back() == '"') inner = inner.substr(1, inner.size() - 2);
+        ImageDriver* imgDrv = ss.images();
+        if (!imgDrv) {
+            if (!ss.headless()) *ss.err << "ImageDriver not available: display failed\n";
+        } else {
+            imgDrv->display(inner);
+        }
+    }
+                    continue;
+                }
+
+                // ---- existing inline-new handling ----
+                if (s.rfind("new ", 0) == 0) {
+                    string rest = s.substr(4);
+                    istringstream iss(rest);
+                    string className, instName;
+                    iss >> className >> instName;
+                    auto cit = prog.classes.find(className);
+                    if (cit != prog.classes.end()) {
+                        if (!ss.allowInstance(instName)) continue;
+                        objects[instName] = cit->second.fields;
+                        ss.instanceClass[instName] = className;
+                        for (auto& f : cit->second.fields) ss.noteFieldWrite(instName, f.first);
+                    } else {
+                        *ss.err << "Unknown class in inline new: " << className << "\n";
+                    }
+                }
+            } else if (code.op == ActionCode::Show) {
+                // ... (unchanged SHOW handling)
+                string text = ss.localize(node.actionTextIds[i], string_view(act).substr(5));
+                size_t pos = 0;
+                // Handle variable substitutions
+                while ((pos = text.find("${", pos)) != string::npos) {
+                    size_t end = text.find("}", pos + 2);
+                    if (end == string::npos) break;
+
+                    string varName = text.substr(pos + 2, end - pos - 2);
+                    string value;
+
+                    refreshIfDerived(ss, varName);
+                    if (roomText(ss, varName, value)) {
+                    } else if (ss.stringVars.count(varName)) {
+                        value = ss.stringVars[varName];
+                    } else if (boolVars.count(varName)) {
+                        value = boolVars[varName] ? "true" : "false";
+                    } else if (vars.count(varName)) {
+                        value = to_string(vars[varName]);
+                    } else {
+                        auto pr = splitDot(varName);
+                        if (!pr.second.empty() && objects.count(pr.first) && objects[pr.first].count(pr.second)) {
+                            value = to_string(objects[pr.first][pr.second]);
+                        } else {
+                            value = "0";
+                        }
+                    }
+
+                    text.replace(pos, end - pos + 1, value);
+                    pos += value.length();
+                }
+
+                // Output the text
+                out << text << "\n";
+            }
+        }
+
+        if (ss.status == CRTZ::Session::Failed || ss.speculationAborted) return ss.status;
+        if (jumped) continue;
+
+        out << "[End of Conversation]\n";
+        return ss.status = CRTZ::Session::Finished;
+    }
+}
+
+// Node visits a speculative run may take when the session sets no smaller
+// fuel limit; a branch that needs more is left to the real run
+constexpr uint64_t kSpeculationFuel = 100000;
+
+// Runs every choice of the current menu ahead of time on forks of the
+// session, keeping the ones that stayed inside the interpreter and finished
+// within their fuel. The forks are taken under the session's lock and run
+// without it, so the host can still step, choose or read the session.
+static void speculate(SessionState& ss) {
+    vector<pair<int, shared_ptr<SessionState>>> forks;
+    shared_ptr<atomic<bool>> cancel;
+    uint64_t epoch;
+    uint64_t fuel;
+    {
+        auto paused = ss.pause();
+        ss.dropSpeculations();
+        if (ss.status != CRTZ::Session::WaitingForChoice || ss.debugger || ss.graph) return;
+        auto nit = ss.prog->nodes.find(ss.current);
+        if (nit == ss.prog->nodes.end()) return;
+        cancel = ss.cancelSpeculation;
+        epoch = ss.speculationEpoch;
+        fuel = ss.limits.fuel && ss.limits.fuel <= kSpeculationFuel ? ss.limits.fuel : kSpeculationFuel;
+        for (auto& c : nit->second.choices) {
+            shared_ptr<SessionState> f = ss.fork();
+            f->limits.fuel = fuel;
+            f->current = c.target;
+            f->status = CRTZ::Session::Running;
+            f->choicesMade++;
+            forks.emplace_back(c.id, move(f));
+        }
+    }
+
+    vector<SessionState::Speculation> done;
+    for (auto& fk : forks) {
+        if (*cancel) return;
+        SessionState& f = *fk.second;
+        ostringstream buf, errs;
+        f.out = &buf;
+        f.err = &errs;
+        runUntilInput(f);
+        f.out = nullptr;
+        f.err = nullptr;
+        if (f.speculationAborted) continue;
+        // Out of the speculation's own fuel: the real run would go on
+        if (f.status == CRTZ::Session::Suspended && fuel != ss.limits.fuel) continue;
+        done.push_back({ fk.first, move(fk.second), buf.str(), errs.str() });
+    }
+
+    auto paused = ss.pause();
+    // The session moved on (a step, a choice, a write) while the forks ran
+    if (*cancel || ss.speculationEpoch != epoch || ss.cancelSpeculation != cancel) return;
+    ss.speculations = move(done);
+}
+
+// Makes a speculative run the live state. The session keeps its own output,
+// export slot, observers and debugger; every observer is re-checked at the
+// end of the next step since the fork's writes were not tracked.
+static bool commitSpeculation(SessionState& ss, int choiceId) {
+    shared_ptr<SessionState> spec;
+    string output, errors;
+    for (auto& sp : ss.speculations) {
+        if (sp.choiceId == choiceId) { spec = sp.state; output = move(sp.output); errors = move(sp.errors); break; }
+    }
+    ss.dropSpeculations();
+    if (!spec) return false;
+
+    ostream* out = ss.out;
+    ostream* err = ss.err;
+    shared_ptr<CRTZ::StateSegment> segment = move(ss.exportSegment);
+    CRTZ::StateSlot* slot = ss.exportSlot;
+    vector<SessionState::Watch> watches = move(ss.watches);
+    unordered_map<string, vector<size_t>> watchIndex = move(ss.watchIndex);
+    shared_ptr<Debugger> debugger = move(ss.debugger);
+    CRTZ::Limits limits = ss.limits;
+    uint64_t steps = ss.steps;
+    metrics().m.add(metrics().nodes, spec->nodeVisits - ss.nodeVisits);
+    metrics().m.add(metrics().methods, spec->methodCalls - ss.methodCalls);
+
+    ss.exportSlot = nullptr;
+    ss = move(*spec);
+    ss.out = out;
+    ss.err = err;
+    ss.exportSegment = move(segment);
+    ss.exportSlot = slot;
+    ss.watches = move(watches);
+    ss.watchIndex = move(watchIndex);
+    ss.dirtyWatches.clear();
+    for (size_t i = 0; i < ss.watches.size(); ++i) {
+        ss.watches[i].dirty = false;
+        if (ss.watches[i].fn) ss.markDirty(i);
+    }
+    ss.debugger = move(debugger);
+    ss.limits = limits;
+    ss.steps = steps;
+    ss.speculative = false;
+    ss.precomputed = true;
+    ss.precomputedOutput = move(output);
+    ss.precomputedErrors = move(errors);
+    return true;
+}
+
+// ----------------------- Autosave -----------------------
+
+// Slot keys: "@..." for the position, counters and generator, then
+// "v:", "b:", "s:" variables, "o:inst.field", "c:inst" (class) and
+// "ri:i" / "in:i" item bitset words. Values are decimal text, strings raw.
+static string slotText(int v) { return to_string(v); }
+static string slotText(bool v) { return v ? "1" : "0"; }
+static const string& slotText(const string& v) { return v; }
+
+template <typename V, typename Key>
+static void diffSlots(CRTZ::JournalRecord& rec, const unordered_map<string, V>& now, unordered_map<string, V>& saved, Key key) {
+    for (auto& kv : now) {
+        auto it = saved.find(kv.first);
+        if (it == saved.end()) saved.emplace(kv.first, kv.second);
+        else if (it->second == kv.second) continue;
+        else it->second = kv.second;
+        rec.put(key(kv.first), slotText(kv.second));
+    }
+    if (saved.size() == now.size()) return;
+    for (auto it = saved.begin(); it != saved.end();) {
+        if (now.count(it->first)) { ++it; continue; }
+        rec.erase(key(it->first));
+        it = saved.erase(it);
+    }
+}
+
+static void diffWords(CRTZ::JournalRecord& rec, const char* prefix, const vector<uint64_t>& now, vector<uint64_t>& saved) {
+    size_t known = saved.size();
+    saved.resize(now.size());
+    for (size_t i = 0; i < now.size(); ++i) {
+        if (i < known && now[i] == saved[i]) continue;
+        saved[i] = now[i];
+        rec.put(prefix + to_string(i), to_string(now[i]));
+    }
+}
+
+template <typename T>
+static void diffValue(CRTZ::JournalRecord& rec, const char* key, const T& now, T& saved) {
+    if (now == saved) return;
+    saved = now;
+    rec.put(key, to_string(now));
+}
+
+// Records every slot that differs from the shadow and updates the shadow
+static void collectChanges(SessionState& ss, CRTZ::JournalRecord& rec) {
+    JournalShadow& sh = *ss.shadow;
+    if (ss.current != sh.node) {
+        sh.node = ss.current;
+        rec.put("@node", ss.current);
+    }
+    diffValue(rec, "@room", ss.room, sh.room);
+    diffValue(rec, "@status", (int)ss.status, sh.status);
+    diffValue(rec, "@steps", ss.steps, sh.steps);
+    diffValue(rec, "@visits", ss.nodeVisits, sh.nodeVisits);
+    diffValue(rec, "@choices", ss.choicesMade, sh.choicesMade);
+    if (memcmp(ss.rng.s, sh.rng, sizeof(sh.rng)) != 0) {
+        memcpy(sh.rng, ss.rng.s, sizeof(sh.rng));
+        rec.put("@rng", to_string(sh.rng[0]) + " " + to_string(sh.rng[1]) + " " + to_string(sh.rng[2]) + " " + to_string(sh.rng[3]));
+    }
+    diffSlots(rec, ss.vars, sh.vars, [](const string& n) { return "v:" + n; });
+    diffSlots(rec, ss.boolVars, sh.boolVars, [](const string& n) { return "b:" + n; });
+    diffSlots(rec, ss.stringVars, sh.stringVars, [](const string& n) { return "s:" + n; });
+    diffSlots(rec, ss.instanceClass, sh.instanceClass, [](const string& n) { return "c:" + n; });
+    for (auto& inst : ss.objects) {
+        auto key = [&](const string& f) { return "o:" + inst.first + "." + f; };
+        diffSlots(rec, inst.second, sh.objects[inst.first], key);
+    }
+    if (sh.objects.size() != ss.objects.size()) {
+        for (auto it = sh.objects.begin(); it != sh.objects.end();) {
+            if (ss.objects.count(it->first)) { ++it; continue; }
+            for (auto& f : it->second) rec.erase("o:" + it->first + "." + f.first);
+            it = sh.objects.erase(it);
+        }
+    }
+    diffWords(rec, "ri:", ss.roomItems, sh.roomItems);
+    diffWords(rec, "in:", ss.inventory, sh.inventory);
+}
+
+// Commits what the last step changed; a finished or failed session is
+// dropped from the journal instead
+static void journalStep(SessionState& ss) {
+    if (ss.status == CRTZ::Session::Finished || ss.status == CRTZ::Session::Failed) {
+        if (!ss.journal->drop(ss.journalId)) cerr << "Runtime: autosave of '" << ss.journalId << "' failed\n";
+        ss.journal.reset();
+        ss.shadow.reset();
+        return;
+    }
+    CRTZ::JournalRecord rec;
+    collectChanges(ss, rec);
+    if (!rec.empty() && !ss.journal->commit(ss.journalId, rec)) {
+        cerr << "Runtime: autosave of '" << ss.journalId << "' failed\n";
+    }
+}
+
+// Puts a session back where its journal left it. A session saved at a menu
+// rebuilds the menu without re-running the node (see Session::step).
+static void restoreSession(SessionState& ss, const CRTZ::JournalImage& image) {
+    auto num = [](const string& v) { return strtoll(v.c_str(), nullptr, 10); };
+    for (auto& kv : image) {
+        const string& key = kv.first;
+        const string& v = kv.second;
+        string name = key.substr(key.find(':') + 1);
+        if (key == "@node") ss.current = v;
+        else if (key == "@room") ss.room = (int)num(v);
+        else if (key == "@status") ss.status = (CRTZ::Session::Status)num(v);
+        else if (key == "@steps") ss.steps = (uint64_t)num(v);
+        else if (key == "@visits") ss.nodeVisits = (uint64_t)num(v);
+        else if (key == "@choices") ss.choicesMade = (uint64_t)num(v);
+        else if (key == "@rng") {
+            istringstream words(v);
+            for (auto& w : ss.rng.s) words >> w;
+        }
+        else if (key.rfind("v:", 0) == 0) ss.vars[name] = (int)num(v);
+        else if (key.rfind("b:", 0) == 0) ss.boolVars[name] = v == "1";
+        else if (key.rfind("s:", 0) == 0) ss.stringVars[name] = v;
+        else if (key.rfind("c:", 0) == 0) { ss.instanceClass[name] = v; ss.objects[name]; }
+        else if (key.rfind("o:", 0) == 0) {
+            auto pr = splitDot(name);
+            ss.objects[pr.first][pr.second] = (int)num(v);
+        }
+        else if (key.rfind("ri:", 0) == 0 || key.rfind("in:", 0) == 0) {
+            vector<uint64_t>& words = key[0] == 'r' ? ss.roomItems : ss.inventory;
+            size_t i = (size_t)num(name);
+            if (i < words.size()) words[i] = strtoull(v.c_str(), nullptr, 10);
+        }
+    }
+    ss.stringBytes = 0;
+    for (auto& kv : ss.stringVars) ss.stringBytes += kv.second.size();
+    const Program& prog = *ss.prog;
+    for (auto& rooms : ss.itemRooms) rooms.clear();
+    for (size_t r = 0; prog.itemWords && r < prog.roomNames.size(); ++r) {
+        for (size_t item = 0; item < ss.itemRooms.size(); ++item) {
+            if (SessionState::hasBit(ss.itemsIn((int)r), (int)item)) ss.itemRooms[item].push_back((int)r);
+        }
+    }
+    for (auto& kv : prog.derived) ss.dirtyDerived.insert(kv.first);
+    ss.started = true;
+    ss.choices.clear();
+    auto nit = prog.nodes.find(ss.current);
+    if (ss.status == CRTZ::Session::WaitingForChoice && nit != prog.nodes.end()) {
+        for (auto& c : nit->second.choices) ss.choices.push_back({ c.id, choiceText(ss, c) });
+        ss.resumed = true;
+    } else if (ss.status == CRTZ::Session::WaitingForChoice) {
+        ss.status = CRTZ::Session::Running;
+    }
+}
+
+// ----------------------- Batch (lane-parallel) execution -----------------------
+
+// Lanes per block. Every per-lane loop below runs over a fixed-size block
+// with no branches on lane data, so the compiler turns it into SSE/AVX code.
+static const size_t kBatchLanes = 16;
+
+enum BatchOpCode : uint8_t {
+    B_CONST, B_VAR, B_ADD, B_SUB, B_MUL, B_DIV,
+    B_EQ, B_NE, B_LT, B_LE, B_GT, B_GE,
+    B_TRUNC,  // value as stored in an int variable
+    B_BOOL,   // value as stored in a match variable
+    B_RAND,   // rand(a, b)
+    B_CHANCE, // chance(p)
+    B_DICE    // dice literal, arg = count << 32 | sides
+};
+
+struct BatchOp {
+    BatchOpCode code;
+    int64_t arg;  // constant or variable slot
+};
+
+struct BatchExpr {
+    vector<BatchOp> ops;
+    size_t depth = 0;
+};
+
+struct BatchAction {
+    enum Kind { Set, If, Goto, End, Switch, Skip } kind = Skip;
+    int slot = -1;
+    bool toBool = false;
+    BatchExpr expr;
+    int target = -1;      // node index, -1 for an unknown node
+    int elseTarget = -2;  // -2: no else branch
+    SwitchTable cases;
+    vector<int> caseTargets;  // node index per cases.targets entry
+};
+
+struct BatchNode {
+    vector<BatchAction> actions;
+    vector<CRTZ::ChoiceInfo> choices;
+    vector<int> choiceTargets;
+};
+
+// A Program lowered to variable slots and node indices
+struct BatchProgram {
+    vector<string> slotNames;
+    unordered_map<string, int> slotIndex;
+    vector<bool> slotIsBool;
+    vector<int32_t> initial;
+    vector<string> nodeNames;
+    unordered_map<string, int> nodeIndex;
+    vector<BatchNode> nodes;
+    int entry = -1;
+    size_t maxDepth = 1;
+    string error;  // why the program cannot be batched
+};
+
+static int batchSlot(BatchProgram& bp, const string& name, bool isBool) {
+    auto it = bp.slotIndex.find(name);
+    if (it != bp.slotIndex.end()) return it->second;
+    int slot = (int)bp.slotNames.size();
+    bp.slotIndex[name] = slot;
+    bp.slotNames.push_back(name);
+    bp.slotIsBool.push_back(isBool);
+    bp.initial.push_back(0);
+    return slot;
+}
+
+static bool compileBatchExpr(const Program& prog, BatchProgram& bp, const string& expr,
+    vector<BatchOp>& ops, int inlineDepth) {
+    vector<string> rpn = infixToRPN(tokenizeExpr(expr));
+    for (auto& t : rpn) {
+        if (isOperator(t)) {
+            static const unordered_map<string, BatchOpCode> codes = {
+                { "+", B_ADD }, { "-", B_SUB }, { "*", B_MUL }, { "/", B_DIV },
+                { "==", B_EQ }, { "!=", B_NE }, { "<", B_LT }, { "<=", B_LE }, { ">", B_GT }, { ">=", B_GE }
+            };
+            auto cit = codes.find(t);
+            if (cit == codes.end()) return false;
+            ops.push_back({ cit->second, 0 });
+        } else if (t == "@rand/2" || t == "@chance/1") {
+            ops.push_back({ t == "@rand/2" ? B_RAND : B_CHANCE, 0 });
+        } else if (isCallToken(t) || t[0] == '"' || t.find('.') != string::npos) {
+            bp.error = "expression '" + expr + "' uses calls, strings or object fields";
+            return false;
+        } else if (isdigit((unsigned char)t[0]) || ((t[0] == '-' || t[0] == '+') && t.size() > 1 && isdigit((unsigned char)t[1]))) {
+            long long count, sides;
+            long long n;
+            if (!parseDice(t, count, sides)) ops.push_back({ B_CONST, parseNumber(t, n) ? n : 0 });
+            else if (count <= 0 || sides <= 0) ops.push_back({ B_CONST, 0 });
+            else ops.push_back({ B_DICE, (int64_t)min(count, Rng::kMaxDice) << 32 | min(sides, 0x7fffffffLL) });
+        } else if (t == "true" || t == "false") {
+            ops.push_back({ B_CONST, t == "true" ? 1 : 0 });
+        } else {
+            auto dit = prog.derived.find(t);
+            if (dit != prog.derived.end()) {
+                // Derived variables are inlined; every read sees current inputs
+                if (inlineDepth > 16) { bp.error = "derived variable '" + t + "' is defined in terms of itself"; return false; }
+                if (!compileBatchExpr(prog, bp, dit->second.expr, ops, inlineDepth + 1)) return false;
+                ops.push_back({ dit->second.isBool ? B_BOOL : B_TRUNC, 0 });
+            } else {
+                ops.push_back({ B_VAR, batchSlot(bp, t, false) });
+            }
+        }
+    }
+    return true;
+}
+
+// Checks the stack discipline; malformed expressions evaluate to 0 like evalRPN
+static BatchExpr finishBatchExpr(vector<BatchOp> ops) {
+    BatchExpr e;
+    size_t sp = 0;
+    for (auto& op : ops) {
+        if (op.code == B_CONST || op.code == B_VAR || op.code == B_DICE) e.depth = max(e.depth, ++sp);
+        else if (op.code == B_TRUNC || op.code == B_BOOL || op.code == B_CHANCE) { if (sp < 1) { sp = 0; break; } }
+        else if (sp < 2) { sp = 0; break; }
+        else --sp;
+    }
+    if (sp == 0) {
+        e.ops = { { B_CONST, 0 } };
+        e.depth = 1;
+    } else {
+        e.ops = move(ops);
+    }
+    return e;
+}
+
+static shared_ptr<BatchProgram> compileBatch(const Program& prog) {
+    CRTZ::TextCache texts;
+    auto bp = make_shared<BatchProgram>();
+    for (auto& kv : prog.vars) {
+        if (prog.derived.count(kv.first)) continue;
+        bp->initial[batchSlot(*bp, kv.first, false)] = kv.second;
+    }
+    for (auto& kv : prog.boolVars) {
+        if (prog.derived.count(kv.first)) continue;
+        bp->initial[batchSlot(*bp, kv.first, true)] = kv.second ? 1 : 0;
+    }
+    for (auto& kv : prog.nodes) {
+        bp->nodeIndex[kv.first] = (int)bp->nodeNames.size();
+        bp->nodeNames.push_back(kv.first);
+    }
+    auto nodeOf = [&](const string& name) {
+        auto it = bp->nodeIndex.find(name);
+        return it == bp->nodeIndex.end() ? -1 : it->second;
+    };
+    bp->entry = nodeOf(prog.entry);
+    bp->nodes.resize(bp->nodeNames.size());
+
+    for (size_t n = 0; n < bp->nodeNames.size(); ++n) {
+        const Node& node = prog.nodes.at(bp->nodeNames[n]);
+        BatchNode& bn = bp->nodes[n];
+        for (auto& act : node.actions) {
+            BatchAction ba;
+            vector<BatchOp> ops;
+            bool ok = true;
+            if (act.rfind("SET ", 0) == 0) {
+                string rest = act.substr(4);
+                size_t sp = rest.find(' ');
+                string name = rest.substr(0, sp);
+                string expr = sp == string::npos ? "" : rest.substr(sp + 1);
+                if (name.find('.') != string::npos) {
+                    bp->error = "set " + name + " writes an object field";
+                    ok = false;
+                } else if (prog.stringVars.count(name)) {
+                    bp->error = "set " + name + " writes a string variable";
+                    ok = false;
+                } else if (!prog.derived.count(name)) {
+                    ba.kind = BatchAction::Set;
+                    ba.slot = batchSlot(*bp, name, false);
+                    ba.toBool = bp->slotIsBool[ba.slot];
+                    ok = compileBatchExpr(prog, *bp, expr, ops, 0);
+                }
+            } else if (act.rfind("IF ", 0) == 0) {
+                size_t gpos = act.find(" GOTO ");
+                if (gpos == string::npos) continue;
+                string rest = act.substr(gpos + 6);
+                size_t epos = rest.find(" ELSE ");
+                ba.kind = BatchAction::If;
+                ba.target = nodeOf(epos == string::npos ? rest : rest.substr(0, epos));
+                if (epos != string::npos) ba.elseTarget = nodeOf(rest.substr(epos + 6));
+                ok = compileBatchExpr(prog, *bp, act.substr(3, gpos - 3), ops, 0);
+            } else if (act.rfind("SWITCH ", 0) == 0) {
+                size_t sp = act.find(' ', 7);
+                ba.kind = BatchAction::Switch;
+                ba.cases = prog.switches[stoi(act.substr(7, sp - 7))];
+                for (auto& t : ba.cases.targets) ba.caseTargets.push_back(nodeOf(t));
+                ok = compileBatchExpr(prog, *bp, act.substr(sp + 1), ops, 0);
+            } else if (act.rfind("GOTO ", 0) == 0) {
+                ba.kind = BatchAction::Goto;
+                ba.target = nodeOf(act.substr(5));
+            } else if (act == "END") {
+                ba.kind = BatchAction::End;
+            } else if (act.rfind("SIGNAL ", 0) == 0 || act.rfind("SHOW ", 0) == 0) {
+                if (act.find('#') != string::npos) {
+                    bp->error = "'" + act + "' calls a host function";
+                    ok = false;
+                }
+            } else {
+                bp->error = "'" + act + "' cannot run in batch mode";
+                ok = false;
+            }
+            if (!ok) {
+                if (bp->error.empty()) bp->error = "unsupported expression in '" + act + "'";
+                bp->error = "node '" + bp->nodeNames[n] + "': " + bp->error;
+                return bp;
+            }
+            ba.expr = finishBatchExpr(move(ops));
+            bp->maxDepth = max(bp->maxDepth, ba.expr.depth);
+            bn.actions.push_back(move(ba));
+        }
+        for (auto& c : node.choices) {
+            bn.choices.push_back({ c.id, storedText(prog, c.textId, c.text, texts) });
+            bn.choiceTargets.push_back(nodeOf(c.target));
+        }
+    }
+    return bp;
+}
+
+struct BatchState {
+    shared_ptr<const BatchProgram> bp;
+    size_t lanes = 0;
+    size_t slots = 0;
+    vector<int32_t> vars;       // [block][slot][lane]
+    vector<int> node;           // per lane; index into bp->nodes
+    vector<uint8_t> status;     // per lane CRTZ::Session::Status
+    vector<uint64_t> visits;
+    vector<Rng> rng;            // per lane
+    vector<int64_t> stack;      // [depth][lane] scratch for one block
+
+    int32_t* blockVars(size_t block) { return vars.data() + block * slots * kBatchLanes; }
+};
+
+// Evaluates e for all lanes of one block into result. Random draws are only
+// taken for lanes in mask, so each lane's stream matches a lone session.
+static void evalBatchExpr(const BatchExpr& e, const int32_t* bv, int64_t* st, int64_t* result,
+    Rng* rng, const uint8_t* mask) {
+    size_t sp = 0;
+    for (const BatchOp& op : e.ops) {
+        if (op.code == B_CONST || op.code == B_VAR || op.code == B_DICE) {
+            int64_t* top = st + sp * kBatchLanes;
+            if (op.code == B_CONST) {
+                for (size_t l = 0; l < kBatchLanes; ++l) top[l] = op.arg;
+            } else if (op.code == B_DICE) {
+                for (size_t l = 0; l < kBatchLanes; ++l) top[l] = mask[l] ? rng[l].dice(op.arg >> 32, op.arg & 0xffffffff) : 0;
+            } else {
+                const int32_t* v = bv + op.arg * kBatchLanes;
+                for (size_t l = 0; l < kBatchLanes; ++l) top[l] = v[l];
+            }
+            ++sp;
+            continue;
+        }
+        int64_t* b = st + (sp - 1) * kBatchLanes;
+        if (op.code == B_TRUNC) {
+            for (size_t l = 0; l < kBatchLanes; ++l) b[l] = (int32_t)b[l];
+            continue;
+        }
+        if (op.code == B_BOOL) {
+            for (size_t l = 0; l < kBatchLanes; ++l) b[l] = b[l] != 0;
+            continue;
+        }
+        if (op.code == B_CHANCE) {
+            for (size_t l = 0; l < kBatchLanes; ++l) b[l] = mask[l] && (int64_t)rng[l].below(100) < b[l];
+            continue;
+        }
+        int64_t* a = b - kBatchLanes;
+        switch (op.code) {
+        case B_RAND: for (size_t l = 0; l < kBatchLanes; ++l) a[l] = mask[l] ? rng[l].range(a[l], b[l]) : 0; break;
+        case B_ADD: for (size_t l = 0; l < kBatchLanes; ++l) a[l] = a[l] + b[l]; break;
+        case B_SUB: for (size_t l = 0; l < kBatchLanes; ++l) a[l] = a[l] - b[l]; break;
+        case B_MUL: for (size_t l = 0; l < kBatchLanes; ++l) a[l] = a[l] * b[l]; break;
+        case B_DIV: for (size_t l = 0; l < kBatchLanes; ++l) a[l] = b[l] != 0 ? a[l] / b[l] : 0; break;
+        case B_EQ: for (size_t l = 0; l < kBatchLanes; ++l) a[l] = a[l] == b[l]; break;
+        case B_NE: for (size_t l = 0; l < kBatchLanes; ++l) a[l] = a[l] != b[l]; break;
+        case B_LT: for (size_t l = 0; l < kBatchLanes; ++l) a[l] = a[l] < b[l]; break;
+        case B_LE: for (size_t l = 0; l < kBatchLanes; ++l) a[l] = a[l] <= b[l]; break;
+        case B_GT: for (size_t l = 0; l < kBatchLanes; ++l) a[l] = a[l] > b[l]; break;
+        case B_GE: for (size_t l = 0; l < kBatchLanes; ++l) a[l] = a[l] >= b[l]; break;
+        default: break;
+        }
+        --sp;
+    }
+    for (size_t l = 0; l < kBatchLanes; ++l) result[l] = st[l];
+}
+
+// Runs node n for the lanes of block `block` selected by mask
+static void runBatchNode(BatchState& bs, size_t block, int n, uint8_t* mask,
+    const CRTZ::Batch::Chooser& chooser) {
+    const BatchNode& node = bs.bp->nodes[n];
+    int32_t* bv = bs.blockVars(block);
+    size_t base = block * kBatchLanes;
+    int* laneNode = bs.node.data() + base;
+    uint8_t* laneStatus = bs.status.data() + base;
+    Rng* laneRng = bs.rng.data() + base;
+    int64_t r[kBatchLanes];
+
+    auto jump = [&](size_t l, int target) {
+        laneNode[l] = target;
+        if (target < 0) laneStatus[l] = CRTZ::Session::Finished;
+        mask[l] = 0;
+    };
+
+    for (const BatchAction& act : node.actions) {
+        switch (act.kind) {
+        case BatchAction::Set: {
+            evalBatchExpr(act.expr, bv, bs.stack.data(), r, laneRng, mask);
+            int32_t* v = bv + act.slot * kBatchLanes;
+            if (act.toBool) {
+                for (size_t l = 0; l < kBatchLanes; ++l) v[l] = mask[l] ? (int32_t)((int32_t)r[l] != 0) : v[l];
+            } else {
+                for (size_t l = 0; l < kBatchLanes; ++l) v[l] = mask[l] ? (int32_t)r[l] : v[l];
+            }
+            break;
+        }
+        case BatchAction::If:
+            evalBatchExpr(act.expr, bv, bs.stack.data(), r, laneRng, mask);
+            for (size_t l = 0; l < kBatchLanes; ++l) {
+                if (!mask[l]) continue;
+                if ((int32_t)r[l]) jump(l, act.target);
+                else if (act.elseTarget != -2) jump(l, act.elseTarget);
+            }
+            break;
+        case BatchAction::Goto:
+            for (size_t l = 0; l < kBatchLanes; ++l) if (mask[l]) jump(l, act.target);
+            break;
+        case BatchAction::Switch:
+            evalBatchExpr(act.expr, bv, bs.stack.data(), r, laneRng, mask);
+            for (size_t l = 0; l < kBatchLanes; ++l) {
+                if (!mask[l]) continue;
+                int c = act.cases.find((int32_t)r[l]);
+                if (c >= 0) jump(l, act.caseTargets[c]);
+            }
+            break;
+        case BatchAction::End:
+            for (size_t l = 0; l < kBatchLanes; ++l) {
+                if (mask[l]) { laneStatus[l] = CRTZ::Session::Finished; mask[l] = 0; }
+            }
+            break;
+        case BatchAction::Skip:
+            break;
+        }
+        bool any = false;
+        for (size_t l = 0; l < kBatchLanes; ++l) any |= mask[l] != 0;
+        if (!any) return;
+    }
+
+    for (size_t l = 0; l < kBatchLanes; ++l) {
+        if (!mask[l]) continue;
+        int target = -1;
+        if (!node.choices.empty() && chooser) {
+            int id = chooser(base + l, node.choices);
+            for (size_t c = 0; c < node.choices.size(); ++c) {
+                if (node.choices[c].id == id) { target = node.choiceTargets[c]; break; }
+            }
+        }
+        jump(l, target);
+    }
+}
+
+static void runBatch(BatchState& bs, const CRTZ::Batch::Chooser& chooser, uint64_t maxNodeVisits) {
+    size_t blocks = bs.node.size() / kBatchLanes;
+    uint8_t mask[kBatchLanes];
+    for (size_t block = 0; block < blocks; ++block) {
+        size_t base = block * kBatchLanes;
+        while (true) {
+            // Regroup: run the node of the first live lane for every lane at it
+            int n = -1;
+            for (size_t l = 0; l < kBatchLanes; ++l) {
+                size_t lane = base + l;
+                if (lane >= bs.lanes || bs.status[lane] != CRTZ::Session::Running) continue;
+                if (maxNodeVisits && bs.visits[lane] >= maxNodeVisits) {
+                    bs.status[lane] = CRTZ::Session::Suspended;
+                    continue;
+                }
+                if (n < 0) n = bs.node[lane];
+            }
+            if (n < 0) break;
+            for (size_t l = 0; l < kBatchLanes; ++l) {
+                size_t lane = base + l;
+                mask[l] = lane < bs.lanes && bs.status[lane] == CRTZ::Session::Running && bs.node[lane] == n;
+                bs.visits[lane] += mask[l];
+            }
+            runBatchNode(bs, block, n, mask, chooser);
+        }
+    }
+}
+
+// ----------------------- Memory accounting -----------------------
+
+// Heap estimates for Engine::memoryStats: the storage a container owns
+// plus what its elements own. Hash containers are charged their bucket
+// array and one node (element, next pointer, cached hash) per element.
+static size_t heapBytes(const string& s);
+static size_t heapBytes(const CRTZ::Value& v);
+static size_t heapBytes(const Choice& c);
+static size_t heapBytes(const Node& n);
+static size_t heapBytes(const ClassDef& c);
+static size_t heapBytes(const Room& r);
+static size_t heapBytes(const SwitchTable& t);
+static size_t heapBytes(const DerivedVar& d);
+static size_t heapBytes(const CRTZ::NativeBinding& b);
+static size_t heapBytes(const Program::TableDecl& t);
+static size_t heapBytes(const CRTZ::ChoiceInfo& c);
+static size_t heapBytes(const SessionState::Watch& w);
+template <typename T> static size_t heapBytes(const vector<T>& v);
+template <typename K, typename V> static size_t heapBytes(const unordered_map<K, V>& m);
+template <typename T> static size_t heapBytes(const unordered_set<T>& s);
+template <typename T>
+static typename enable_if<is_trivially_copyable<T>::value, size_t>::type heapBytes(const T&) { return 0; }
+template <typename A, typename B>
+static size_t heapBytes(const pair<A, B>& p) { return heapBytes(p.first) + heapBytes(p.second); }
+
+template <typename T>
+static size_t heapBytes(const vector<T>& v) {
+    size_t n = v.capacity() * sizeof(T);
+    if (!is_trivially_copyable<T>::value) {
+        for (auto& e : v) n += heapBytes(e);
+    }
+    return n;
+}
+
+template <typename C>
+static size_t hashedBytes(const C& c) {
+    size_t n = c.bucket_count() * sizeof(void*) + c.size() * (sizeof(typename C::value_type) + 2 * sizeof(void*));
+    for (auto& e : c) n += heapBytes(e);
+    return n;
+}
+template <typename K, typename V>
+static size_t heapBytes(const unordered_map<K, V>& m) { return hashedBytes(m); }
+template <typename T>
+static size_t heapBytes(const unordered_set<T>& s) { return hashedBytes(s); }
+
+static size_t heapBytes(const string& s) {
+    // Short strings live inside the object itself
+    const char* p = s.data();
+    const char* self = reinterpret_cast<const char*>(&s);
+    return p >= self && p < self + sizeof(s) ? 0 : s.capacity() + 1;
+}
+static size_t heapBytes(const CRTZ::Value& v) { return heapBytes(v.str); }
+static size_t heapBytes(const Choice& c) { return heapBytes(c.text) + heapBytes(c.target); }
+static size_t heapBytes(const Node& n) {
+    return heapBytes(n.name) + heapBytes(n.text) + heapBytes(n.choices) + heapBytes(n.actions) + heapBytes(n.actionTextIds);
+}
+static size_t heapBytes(const ClassDef& c) {
+    return heapBytes(c.name) + heapBytes(c.fields) + heapBytes(c.methods) + heapBytes(c.methodParams) + heapBytes(c.methodProfileIds);
+}
+static size_t heapBytes(const Room& r) {
+    return heapBytes(r.name) + heapBytes(r.description) + heapBytes(r.exits) + heapBytes(r.items) + heapBytes(r.npcs);
+}
+static size_t heapBytes(const SwitchTable& t) { return heapBytes(t.targets) + heapBytes(t.dense) + heapBytes(t.sparse); }
+static size_t heapBytes(const DerivedVar& d) { return heapBytes(d.expr) + heapBytes(d.inputs); }
+static size_t heapBytes(const CRTZ::NativeBinding& b) { return heapBytes(b.name); }
+static size_t heapBytes(const Program::TableDecl& t) { return heapBytes(t.name) + heapBytes(t.path); }
+static size_t heapBytes(const CRTZ::ChoiceInfo& c) { return heapBytes(c.text); }
+static size_t heapBytes(const SessionState::Watch& w) { return heapBytes(w.name) + heapBytes(w.last); }
+
+// Node lines, choice and show texts as parsed (empty once compressed)
+static size_t nodeTextBytes(const Program& p) {
+    size_t n = 0;
+    for (auto& kv : p.nodes) {
+        const Node& node = kv.second;
+        n += heapBytes(node.text);
+        for (auto& c : node.choices) n += heapBytes(c.text);
+        for (size_t i = 0; i < node.actions.size(); ++i) {
+            if (node.actionTextIds[i] >= 0) n += heapBytes(node.actions[i]);
+        }
+    }
+    return n;
+}
+
+// Dialogue text of a program, compressed or not, and its translation keys
+static size_t textBytes(const Program& p) {
+    return nodeTextBytes(p) + p.textStore.compressedBytes() + heapBytes(p.stringKeys) +
+           heapBytes(p.textIndex.terms) + heapBytes(p.textIndex.termStart) + heapBytes(p.textIndex.postings);
+}
+
+// Everything else the program holds
+static size_t structureBytes(const Program& p) {
+    size_t n = sizeof(Program) + heapBytes(p.npc) + heapBytes(p.desc) + heapBytes(p.vars) + heapBytes(p.boolVars) +
+        heapBytes(p.stringVars) + heapBytes(p.nodes) + heapBytes(p.entry) + heapBytes(p.classes) + heapBytes(p.objects) +
+        heapBytes(p.instanceClass) + heapBytes(p.rooms) + heapBytes(p.currentRoom) + heapBytes(p.roomNames) +
+        heapBytes(p.roomIndex) + heapBytes(p.directionNames) + heapBytes(p.directionIndex) + heapBytes(p.exitTable) +
+        heapBytes(p.predStart) + heapBytes(p.preds) + heapBytes(p.pathNext) + heapBytes(p.pathDist) +
+        heapBytes(p.itemNames) + heapBytes(p.itemIndex) + heapBytes(p.roomItemsInit) + heapBytes(p.itemRoomsInit) +
+        heapBytes(p.switches) + heapBytes(p.natives) + heapBytes(p.derived) + heapBytes(p.derivedDependents) +
+        heapBytes(p.tableDecls) + p.tables.capacity() * sizeof(p.tables[0]) +
+        heapBytes(p.tableIndex) + heapBytes(p.baseDir) + heapBytes(p.name);
+    return n - nodeTextBytes(p);
+}
+
+struct SessionMemory {
+    size_t state = 0;    // variables, items, choices, observers
+    size_t objects = 0;  // instance fields
+    size_t caches = 0;   // decoded text, speculative runs, replayed output
+};
+
+static void measureSession(const SessionState& ss, SessionMemory& m) {
+    m.state += sizeof(SessionState) + heapBytes(ss.playerName) + heapBytes(ss.current) + heapBytes(ss.vars) +
+        heapBytes(ss.boolVars) + heapBytes(ss.stringVars) + heapBytes(ss.instanceClass) + heapBytes(ss.pictureArrays) +
+        heapBytes(ss.roomItems) + heapBytes(ss.inventory) + heapBytes(ss.itemRooms) + heapBytes(ss.choices) +
+        heapBytes(ss.error) + heapBytes(ss.watches) + heapBytes(ss.watchIndex) + heapBytes(ss.dirtyWatches) +
+        heapBytes(ss.dirtyDerived);
+    m.objects += heapBytes(ss.objects);
+    if (ss.shadow && !ss.speculative) {
+        const JournalShadow& sh = *ss.shadow;
+        m.caches += sizeof(sh) + heapBytes(sh.node) + heapBytes(sh.vars) + heapBytes(sh.boolVars) + heapBytes(sh.stringVars) +
+            heapBytes(sh.objects) + heapBytes(sh.instanceClass) + heapBytes(sh.roomItems) + heapBytes(sh.inventory);
+    }
+    m.caches += ss.textCache.bytes() + heapBytes(ss.precomputedOutput) + ss.speculations.capacity() * sizeof(SessionState::Speculation);
+    for (auto& sp : ss.speculations) {
+        SessionMemory fork;
+        measureSession(*sp.state, fork);
+        m.caches += heapBytes(sp.output) + fork.state + fork.objects + fork.caches;
+    }
+}
+
+// ----------------------- Story graph export -----------------------
+
+// An edge of the story graph as the script defines it
+struct StoryEdge {
+    string from;
+    string to;
+    bool choice;   // a menu choice; otherwise GOTO, IF/ELSE or a switch case
+    string label;  // choice texts, " / "-joined when several lead to `to`
+};
+
+// Nodes in definition order
+static vector<const Node*> storyNodes(const Program& prog) {
+    vector<const Node*> nodes;
+    nodes.reserve(prog.nodes.size());
+    for (auto& kv : prog.nodes) nodes.push_back(&kv.second);
+    sort(nodes.begin(), nodes.end(), [](const Node* a, const Node* b) {
+        return a->definitionLine != b->definitionLine ? a->definitionLine < b->definitionLine : a->name < b->name;
+    });
+    return nodes;
+}
+
+static vector<StoryEdge> storyEdges(const Program& prog, const vector<const Node*>& nodes) {
+    vector<StoryEdge> edges;
+    CRTZ::TextCache cache;
+    for (const Node* node : nodes) {
+        size_t first = edges.size();
+        auto add = [&](const string& to, bool choice, const string& label) {
+            for (size_t i = first; i < edges.size(); ++i) {
+                if (edges[i].to != to || edges[i].choice != choice) continue;
+                if (!label.empty()) edges[i].label += (edges[i].label.empty() ? "" : " / ") + label;
+                return;
+            }
+            edges.push_back({ node->name, to, choice, label });
+        };
+        for (auto& c : node->choices) add(c.target, true, storedText(prog, c.textId, c.text, cache));
+        for (auto& act : node->actions) {
+            if (act.rfind("GOTO ", 0) == 0) {
+                add(act.substr(5), false, "");
+            } else if (act.rfind("IF ", 0) == 0) {
+                size_t gpos = act.find(" GOTO ");
+                if (gpos == string::npos) continue;
+                string rest = act.substr(gpos + 6);
+                size_t epos = rest.find(" ELSE ");
+                add(rest.substr(0, epos), false, "");
+                if (epos != string::npos) add(rest.substr(epos + 6), false, "");
+            } else if (act.rfind("SWITCH ", 0) == 0) {
+                size_t sp = act.find(' ', 7);
+                for (auto& t : prog.switches[stoi(act.substr(7, sp - 7))].targets) add(t, false, "");
+            }
+        }
+    }
+    return edges;
+}
+
+static string dotQuote(string_view s) {
+    string q = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') q.push_back('\\');
+        if (c == '\n') q += "\\n";
+        else q.push_back(c);
+    }
+    return q + "\"";
+}
+
+static string jsonQuote(string_view s) {
+    string q = "\"";
+    char buf[8];
+    for (unsigned char c : s) {
+        switch (c) {
+        case '"': q += "\\\""; break;
+        case '\\': q += "\\\\"; break;
+        case '\n': q += "\\n"; break;
+        case '\t': q += "\\t"; break;
+        case '\r': q += "\\r"; break;
+        default:
+            if (c < 0x20) {
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                q += buf;
+            } else {
+                q.push_back((char)c);
+            }
+        }
+    }
+    return q + "\"";
+}
+
+static void writeGraphDot(ostream& out, const Program& prog, const vector<const Node*>& nodes,
+                          const vector<StoryEdge>& edges, const CRTZ::GraphStats* stats) {
+    uint64_t maxNanos = 0, maxCount = 0;
+    if (stats) {
+        for (auto& kv : stats->nodes) maxNanos = max(maxNanos, kv.second.nanos);
+        for (auto& kv : stats->edges) maxCount = max(maxCount, kv.second);
+    }
+    out << "digraph story {\n";
+    out << "    node [shape=box, style=\"rounded,filled\", fillcolor=white, fontname=Helvetica];\n";
+    out << "    edge [fontname=Helvetica, fontsize=10];\n";
+    if (stats) out << "    label=" << dotQuote(to_string(stats->runs) + (stats->runs == 1 ? " run" : " runs")) << ";\n";
+    char buf[96];
+    for (const Node* node : nodes) {
+        string label = node->name + "\nline " + to_string(node->definitionLine);
+        string attrs;
+        if (stats) {
+            auto it = stats->nodes.find(node->name);
+            if (it == stats->nodes.end() || !it->second.visits) {
+                attrs = ", fillcolor=gray90, fontcolor=gray50, color=gray60";
+            } else {
+                const CRTZ::GraphStats::NodeStats& n = it->second;
+                snprintf(buf, sizeof(buf), "\n%llu visits, %.3f ms", (unsigned long long)n.visits, n.nanos / 1e6);
+                label += buf;
+                // White to red by share of the hottest node's time
+                double heat = maxNanos ? (double)n.nanos / maxNanos : 0;
+                snprintf(buf, sizeof(buf), ", fillcolor=\"0.000 %.3f 1.000\"", heat * 0.75);
+                attrs = buf;
             }
-            if (tk.kind == TK_IDENT) {
-                elseTarget = tk.text; 
-                consume();
+        }
+        if (node->name == prog.entry) attrs += ", peripheries=2";
+        out << "    " << dotQuote(node->name) << " [label=" << dotQuote(label) << attrs << "];\n";
+    }
+    auto writeEdge = [&](const string& from, const string& to, bool choice, const string& text, bool defined) {
+        string label = text;
+        string attrs;
+        // Dotted: taken at run time but not written in the script
+        if (!defined) attrs += ", style=dotted";
+        else if (!choice) attrs += ", style=dashed";
+        if (stats) {
+            auto it = stats->edges.find(make_tuple(from, to, choice));
+            uint64_t count = it == stats->edges.end() ? 0 : it->second;
+            if (count) {
+                label += (label.empty() ? "" : " ") + string("(") + to_string(count) + ")";
+                snprintf(buf, sizeof(buf), ", penwidth=%.2f", 1 + 4.0 * count / maxCount);
+                attrs += buf;
             } else {
-                cerr << "Error at line " << tk.line << ": else expects a target\n";
+                attrs += ", color=gray60, fontcolor=gray50";
             }
         }
-        expectSym(";");
-        node.actions.push_back("IF " + cond + " GOTO " + target + (elseTarget.empty() ? "" : " ELSE " + elseTarget));
-    } else {
-        cerr << "Error at line " << tk.line << ": goto expects a target\n";
+        out << "    " << dotQuote(from) << " -> " << dotQuote(to);
+        if (!label.empty()) out << " [label=" << dotQuote(label) << attrs << "];\n";
+        else if (!attrs.empty()) out << " [" << attrs.substr(2) << "];\n";
+        else out << ";\n";
+    };
+    set<tuple<string, string, bool>> defined;
+    for (auto& e : edges) {
+        defined.insert(make_tuple(e.from, e.to, e.choice));
+        writeEdge(e.from, e.to, e.choice, e.label, true);
     }
- } else if (tk.kind == TK_IDENT && tk.text == "goto") {
-    // 'goto' written but no identifier target follows
-    cerr << "Error at line " << tk.line << ": goto expects a target\n";
-    consume(); // consume 'goto' to avoid infinite loop
+    if (stats) {
+        for (auto& kv : stats->edges) {
+            if (!defined.count(kv.first)) writeEdge(get<0>(kv.first), get<1>(kv.first), get<2>(kv.first), "", false);
+        }
+    }
+    out << "}\n";
 }
-} else if (kw == "goto") {
-                        consume();
-                        if (tk.kind == TK_IDENT) {
-                            string target = tk.text; consume();
-                            expectSym(";");
-                            node.actions.push_back("GOTO " + target);
-                        } else { cerr << "Error at line " << tk.line << ": goto target expected\n"; }
-                    } else if (kw == "end") {
-                        consume(); expectSym(";"); node.actions.push_back("END");
-                    } else {
-                        string stmt;
-                        while (!(tk.kind == TK_SYM && tk.text == ";") && tk.kind != TK_EOF) {
-                            stmt += tk.text;
-                            consume();
-                        }
-                        if (tk.kind == TK_SYM && tk.text == ";") { consume(); }
-                        string s = trim(stmt);
-                        if (!s.empty()) node.actions.push_back(string("STMT ") + s);
-                    }
-                } else {
-                    consume();
-                }
-            }
-            expectSym("}");
-            prog.nodes[nodename] = node;
-        } else {
-            cerr << "Error at line " << tk.line << ": node expects name\n"; consume();
+
+static void writeGraphJson(ostream& out, const Program& prog, const vector<const Node*>& nodes,
+                           const vector<StoryEdge>& edges, const CRTZ::GraphStats* stats) {
+    out << "{\n  \"entry\": " << jsonQuote(prog.entry) << ",\n";
+    if (stats) out << "  \"runs\": " << stats->runs << ",\n";
+    out << "  \"nodes\": [";
+    const char* sep = "\n";
+    for (const Node* node : nodes) {
+        out << sep << "    {\"name\": " << jsonQuote(node->name) << ", \"line\": " << node->definitionLine;
+        if (stats) {
+            auto it = stats->nodes.find(node->name);
+            CRTZ::GraphStats::NodeStats n = it == stats->nodes.end() ? CRTZ::GraphStats::NodeStats{} : it->second;
+            out << ", \"visits\": " << n.visits << ", \"timeNs\": " << n.nanos;
+        }
+        out << "}";
+        sep = ",\n";
+    }
+    out << "\n  ],\n  \"edges\": [";
+    sep = "\n";
+    auto writeEdge = [&](const string& from, const string& to, bool choice, const string& label, bool defined) {
+        out << sep << "    {\"from\": " << jsonQuote(from) << ", \"to\": " << jsonQuote(to)
+            << ", \"kind\": \"" << (choice ? "choice" : "goto") << "\"";
+        if (!label.empty()) out << ", \"label\": " << jsonQuote(label);
+        if (!defined) out << ", \"runtime\": true";
+        if (stats) {
+            auto it = stats->edges.find(make_tuple(from, to, choice));
+            out << ", \"count\": " << (it == stats->edges.end() ? 0 : it->second);
+        }
+        out << "}";
+        sep = ",\n";
+    };
+    set<tuple<string, string, bool>> defined;
+    for (auto& e : edges) {
+        defined.insert(make_tuple(e.from, e.to, e.choice));
+        writeEdge(e.from, e.to, e.choice, e.label, true);
+    }
+    if (stats) {
+        for (auto& kv : stats->edges) {
+            if (!defined.count(kv.first)) writeEdge(get<0>(kv.first), get<1>(kv.first), get<2>(kv.first), "", false);
         }
     }
+    out << "\n  ]\n}\n";
+}
 
-    Program& getProgram() { return prog; }
+// ----------------------- Dialogue window -----------------------
 
-private:
-    static string trim(const string& s) {
-        size_t a = 0;
-        while (a < s.size() && isspace((unsigned char)s[a])) ++a;
-        size_t b = s.size();
-        while (b > a && isspace((unsigned char)s[b - 1])) --b;
-        return s.substr(a, b - a);
+// Copies everything a session prints into the window's text box as well
+class WindowTextBuf : public streambuf {
+public:
+    WindowTextBuf(streambuf* terminal, ImageDriver& images) : terminal_(terminal), images_(images) {}
+
+protected:
+    int overflow(int c) override {
+        if (c == EOF) return 0;
+        char ch = (char)c;
+        images_.appendText(string_view(&ch, 1));
+        return terminal_ ? terminal_->sputc(ch) : c;
     }
-};
+    streamsize xsputn(const char* s, streamsize n) override {
+        images_.appendText(string_view(s, (size_t)n));
+        return terminal_ ? terminal_->sputn(s, n) : n;
+    }
+    int sync() override { return terminal_ ? terminal_->pubsync() : 0; }
 
-// ----------------------- Runtime helpers -----------------------
+private:
+    streambuf* terminal_;
+    ImageDriver& images_;
+};
 
-static int evalExpressionString(const string& expr,
-    unordered_map<string, int>& vars,
-    unordered_map<string, bool>& boolVars,
-    unordered_map<string, unordered_map<string, int>>& objects) {
-    auto tokens = tokenizeExpr(expr);
-    auto rpn = infixToRPN(tokens);
-    return evalRPN(rpn, vars, boolVars, objects);
+// Reads a choice id from number keys in the window: returns it once the
+// digits typed name exactly one choice (or on Enter), -1 if the window closes
+static int readWindowChoice(ImageDriver& images, const vector<CRTZ::ChoiceInfo>& choices) {
+    string typed;
+    while (true) {
+        int key = images.waitForKey();
+        if (key < 0) return -1;
+        if (key == '\b') {
+            if (!typed.empty()) typed.pop_back();
+            continue;
+        }
+        if (key == '\r') {
+            if (!typed.empty()) return atoi(typed.c_str());
+            continue;
+        }
+        if (key < '0' || key > '9') continue;
+        typed.push_back((char)key);
+        int exact = -1, longer = 0;
+        for (auto& c : choices) {
+            string id = to_string(c.id);
+            if (id == typed) exact = c.id;
+            else if (id.compare(0, typed.size(), typed) == 0) longer++;
+        }
+        if (exact >= 0 && !longer) return exact;
+        if (exact < 0 && !longer) typed.clear();  // names nothing: start over
+    }
 }
 
-static vector<string> splitArgs(const string& s) {
-    vector<string> out;
-    string cur;
-    int depth = 0;
-    for (size_t i = 0; i < s.size(); ++i) {
-        char c = s[i];
-        if (c == '(') { depth++; cur.push_back(c); }
-        else if (c == ')') { depth--; cur.push_back(c); }
-        else if (c == ',' && depth == 0) {
-            string t = cur;
-            size_t a = 0; while (a < t.size() && isspace((unsigned char)t[a])) ++a;
-            size_t b = t.size(); while (b > a && isspace((unsigned char)t[b - 1])) --b;
-            out.push_back(t.substr(a, b - a));
-            cur.clear();
+// ----------------------- Library Wrapper APIs -----------------------
+
+namespace CRTZ {
+
+    // ---- Session ----
+
+    Session::Session(std::unique_ptr<SessionState> state) : state_(std::move(state)) {}
+    Session::Session(Session&&) noexcept = default;
+    Session& Session::operator=(Session&&) noexcept = default;
+    Session::~Session() = default;
+
+    Session::Status Session::step() {
+        auto paused = state_->pause();
+        if (state_->resumed) {
+            // Restored at a menu: show it again rather than re-run the node
+            state_->resumed = false;
+            for (auto& c : state_->choices) *state_->out << "[" << c.id << "] " << c.text << "\n";
+            return state_->status;
+        }
+        uint64_t start = nowNanos();
+        state_->steps++;
+        // Speculation still running for the last menu stops, keeping the
+        // old flag; its results will not be published
+        auto& cancel = state_->cancelSpeculation;
+        if (*cancel || cancel.use_count() > 1) {
+            cancel->store(true);
+            cancel = std::make_shared<std::atomic<bool>>(false);
+        }
+        Status st;
+        if (state_->precomputed) {
+            state_->precomputed = false;
+            *state_->out << state_->precomputedOutput;
+            *state_->err << state_->precomputedErrors;
+            state_->precomputedOutput.clear();
+            state_->precomputedErrors.clear();
+            st = state_->status;
         } else {
-            cur.push_back(c);
+            st = runUntilInput(*state_);
         }
+        publishState(*state_);
+        if (!state_->dirtyWatches.empty()) deliverWatches(*state_);
+        if (state_->journal) journalStep(*state_);
+        uint64_t end = nowNanos();
+        if (state_->graph) state_->graph->pause(end);
+        metrics().m.record(metrics().stepTime, end - start);
+        if (state_->choseAt) {
+            metrics().m.record(metrics().choiceLatency, end - state_->choseAt);
+            state_->choseAt = 0;
+        }
+        return st;
     }
-    if (!cur.empty()) {
-        string t = cur;
-        size_t a = 0; while (a < t.size() && isspace((unsigned char)t[a])) ++a;
-        size_t b = t.size(); while (b > a && isspace((unsigned char)t[b - 1])) --b;
-        out.push_back(t.substr(a, b - a));
-    }
-    vector<string> cleaned;
-    for (auto& x : out) if (!x.empty()) cleaned.push_back(x);
-    return cleaned;
-}
 
-static void executeMethod(Program& prog,
-    const string& instanceName,
-    const string& methodName,
-    const vector<int>& argValues,
-    const vector<string>& argNames,
-    string& playerName);
+    bool Session::choose(int id) {
+        SessionState& ss = *state_;
+        if (ss.status != WaitingForChoice) return false;
+        // Stop speculation still running before waiting for it
+        for (auto& c : ss.choices) {
+            if (c.id == id) ss.cancelSpeculation->store(true);
+        }
+        auto paused = ss.pause();
+        uint64_t at = nowNanos();
+        bool chosen = !ss.speculations.empty() && commitSpeculation(ss, id);
+        auto nit = chosen ? ss.prog->nodes.end() : ss.prog->nodes.find(ss.current);
+        if (nit != ss.prog->nodes.end()) {
+            for (auto& c : nit->second.choices) {
+                if (c.id == id) {
+                    ss.current = c.target;
+                    ss.choices.clear();
+                    ss.status = Running;
+                    ss.choicesMade++;
+                    chosen = true;
+                    break;
+                }
+            }
+        }
+        if (!chosen) return false;
+        if (ss.graph) ss.graph->viaChoice = true;
+        ss.choseAt = at;
+        metrics().m.add(metrics().choices);
+        return true;
+    }
 
-static bool executeActionsWithContext(vector<string>& actions,
-    Program& prog,
-    unordered_map<string, int>& vars,
-    unordered_map<string, bool>& boolVars,
-    unordered_map<string, unordered_map<string, int>>& objects,
-    const string& thisInstance,
-    string& playerName,
-    string& current_jump_target,
-    bool& jumped) {
-    for (auto& act : actions) {
-        if (act.rfind("SET ", 0) == 0) {
-            string rest = act.substr(4);
-            size_t p = 0;
-            string name;
-            while (p < rest.size() && !isspace((unsigned char)rest[p])) name.push_back(rest[p++]);
-            while (p < rest.size() && isspace((unsigned char)rest[p])) p++;
-            string expr = rest.substr(p);
+    void Session::run() { run(std::cin); }
 
-            auto pr = splitDot(name);
-            if (!pr.second.empty()) {
-                string inst = pr.first;
-                string field = pr.second;
-                int val = evalExpressionString(expr, vars, boolVars, objects);
-                objects[inst][field] = val;
-            } else {
-                if (!thisInstance.empty() && objects.count(thisInstance) && objects[thisInstance].count(name)) {
-                    int val = evalExpressionString(expr, vars, boolVars, objects);
-                    objects[thisInstance][name] = val;
-                } else if (boolVars.count(name)) {
-                    int val = evalExpressionString(expr, vars, boolVars, objects);
-                    boolVars[name] = (val != 0);
-                } else {
-                    int val = evalExpressionString(expr, vars, boolVars, objects);
-                    vars[name] = val;
+    void Session::run(std::istream& input) {
+        std::ostream& out = *state_->out;
+        Status st;
+        while ((st = step()) == WaitingForChoice) {
+            // Work out every outcome while the player is reading the menu
+            std::thread ahead([this] { ::speculate(*state_); });
+            int sel = -1;
+            bool eof = false;
+            while (true) {
+                out << "Choose: ";
+                out.flush();
+                if (!(input >> sel)) {
+                    if (input.eof()) { eof = true; break; }
+                    input.clear(); input.ignore(1024, '\n'); out << "Invalid\n"; continue;
                 }
+                if (choose(sel)) break;
+                out << "Invalid choice\n";
             }
-        } else if (act.rfind("SIGNAL ", 0) == 0) {
-            string rest = act.substr(7);
-            string name;
-            size_t p = 0;
-            while (p < rest.size() && !isspace((unsigned char)rest[p])) name.push_back(rest[p++]);
-            while (p < rest.size() && isspace((unsigned char)rest[p])) p++;
-            string expr = rest.substr(p);
-            int val = evalExpressionString(expr, vars, boolVars, objects);
-            cout << "[SIGNAL] " << name << " = " << val << "\n";
-        } else if (act.rfind("IF ", 0) == 0) {
-            size_t gpos = act.find(" GOTO ");
-            if (gpos == string::npos) continue;
-            string cond = act.substr(3, gpos - 3);
-            string rest = act.substr(gpos + 6);
-            size_t epos = rest.find(" ELSE ");
-            string target = rest;
-            string elseTarget;
-            if (epos != string::npos) {
-                target = rest.substr(0, epos);
-                elseTarget = rest.substr(epos + 6);
-            }
-            int res = evalExpressionString(cond, vars, boolVars, objects);
-            if (res) {
-                current_jump_target = target;
-                jumped = true;
-                break;
-            } else if (!elseTarget.empty()) {
-                current_jump_target = elseTarget;
-                jumped = true;
-                break;
-            }
-        } else if (act.rfind("GOTO ", 0) == 0) {
-            string target = act.substr(5);
-            current_jump_target = target;
-            jumped = true;
-            break;
-        } else if (act == "END") {
-            cout << "[Dialogue ended]\n";
+            if (eof) state_->cancelSpeculation->store(true);
+            ahead.join();
+            if (eof) return;
+        }
+        if (st == Suspended || st == Failed) {
+            *state_->err << "Runtime: session " << (st == Failed ? "failed" : "suspended") << ": " << state_->error << "\n";
+        }
+    }
+
+    void Session::runInWindow(int textSize) {
+        ImageDriver* images = state_->images();
+        if (!images) {
+            run();
+            return;
+        }
+        std::ostream* terminal = state_->out;
+        WindowTextBuf buf(terminal->rdbuf(), *images);
+        std::ostream both(&buf);
+        state_->out = &both;
+        images->setTextSize(textSize);
+        images->setTextMode(true);
+        Status st;
+        while (true) {
+            images->setText("");  // one step's text at a time
+            if ((st = step()) != WaitingForChoice) break;
+            // Work out every outcome while the player is reading the menu
+            std::thread ahead([this] { ::speculate(*state_); });
+            int sel;
+            do {
+                sel = readWindowChoice(*images, state_->choices);
+            } while (sel >= 0 && !choose(sel));
+            if (sel < 0) state_->cancelSpeculation->store(true);
+            ahead.join();
+            if (sel < 0) break;
+        }
+        if (st == Finished) images->waitForKey();  // let the ending be read
+        images->setTextMode(false);
+        state_->out = terminal;
+        if (st == Suspended || st == Failed) {
+            *state_->err << "Runtime: session " << (st == Failed ? "failed" : "suspended") << ": " << state_->error << "\n";
+        }
+    }
+
+    Session::Status Session::status() const { return state_->status; }
+    const std::vector<ChoiceInfo>& Session::choices() const { return state_->choices; }
+    const std::string& Session::currentNode() const { return state_->current; }
+    const std::string& Session::error() const { return state_->error; }
+
+    void Session::setLimits(const Limits& limits) { state_->limits = limits; }
+
+    void Session::seed(uint64_t seed) {
+        auto paused = state_->pause();
+        state_->dropSpeculations();  // worked out with the old stream
+        state_->rng.reseed(seed);
+    }
+
+    void Session::speculate() { ::speculate(*state_); }
+
+    bool Session::autosave(const std::string& id) {
+        SessionState& ss = *state_;
+        auto paused = ss.pause();
+        if (!ss.resources || !ss.resources->journal) {
+            *ss.err << "Runtime: autosave needs Engine::enableJournal\n";
             return false;
-        } else if (act.rfind("STMT ", 0) == 0) {
-            string stmt = act.substr(5);
-            string s = trim(stmt);
-            size_t dotp = s.find('.');
-            size_t paren = s.find('(');
-            if (dotp != string::npos && paren != string::npos && paren > dotp) {
-                string inst = s.substr(0, dotp);
-                string method = s.substr(dotp + 1, paren - (dotp + 1));
-                size_t rparen = s.rfind(')');
-                string argsraw;
-                if (rparen != string::npos && rparen > paren) argsraw = s.substr(paren + 1, rparen - paren - 1);
-                else argsraw = s.substr(paren + 1);
-                vector<string> argExprs = splitArgs(argsraw);
-                vector<int> argVals;
-                for (auto& ae : argExprs) {
-                    int v = evalExpressionString(ae, vars, boolVars, objects);
-                    argVals.push_back(v);
-                }
-                executeMethod(prog, inst, method, argVals, vector<string>{}, playerName);
-            } else {
-                if (s.rfind("print", 0) == 0) {
-                    size_t p = s.find('(');
-                    size_t q = s.rfind(')');
-                    if (p != string::npos && q != string::npos && q > p) {
-                        string inner = s.substr(p + 1, q - p - 1);
-                        if (inner.size() >= 2 && inner.front() == '"' && inner.back() == '"') {
-                            cout << inner.substr(1, inner.size() - 2) << "\n";
-                        } else {
-                            int val = evalExpressionString(inner, vars, boolVars, objects);
-                            cout << (val ? "true" : "false") << "\n";
-                        }
-                    }
-                }
-            }
-        } else if (act.rfind("SHOW ", 0) == 0) {
-            string text = act.substr(5);
-            size_t pos = 0;
-            // Handle variable substitutions
-            while ((pos = text.find("${", pos)) != string::npos) {
-                size_t end = text.find("}", pos + 2);
-                if (end == string::npos) break;
+        }
+        ss.dropSpeculations();
+        ss.journal = ss.resources->journal;
+        ss.journalId = id;
+        ss.shadow = std::make_shared<JournalShadow>();
+        JournalImage image;
+        if (!ss.journal->load(id, image)) return false;
+        if (ss.steps || ss.started) {
+            // Already under way: its own state replaces what was saved
+            ss.journal->drop(id);
+            return false;
+        }
+        restoreSession(ss, image);
+        JournalRecord known;
+        collectChanges(ss, known);  // the shadow now matches the journal
+        return true;
+    }
 
-                string varName = text.substr(pos + 2, end - pos - 2);
-                string value;
+    void Session::recordGraph(bool on) {
+        SessionState& ss = *state_;
+        auto paused = ss.pause();
+        if (!on) {
+            ss.graph.reset();
+            return;
+        }
+        ss.dropSpeculations();
+        if (!ss.graph) ss.graph = std::make_shared<GraphTrace>();
+    }
 
-                if (prog.stringVars.count(varName)) {
-                    value = prog.stringVars[varName];
-                } else if (prog.boolVars.count(varName)) {
-                    value = prog.boolVars[varName] ? "true" : "false";
-                } else if (vars.count(varName)) {
-                    value = to_string(vars[varName]);
-                } else {
-                    auto pr = splitDot(varName);
-                    if (!pr.second.empty() && objects.count(pr.first) && objects[pr.first].count(pr.second)) {
-                        value = to_string(objects[pr.first][pr.second]);
-                    } else {
-                        value = "0";
-                    }
-                }
+    GraphStats Session::graphStats() const {
+        auto paused = state_->pause();
+        GraphStats stats;
+        const GraphTrace* trace = state_->graph.get();
+        if (!trace) return stats;
+        stats.runs = 1;
+        for (auto& kv : trace->nodes) stats.nodes[kv.first->name] = { kv.second.count, kv.second.nanos };
+        for (auto& kv : trace->edges) {
+            stats.edges[std::make_tuple(std::get<0>(kv.first)->name, std::get<1>(kv.first)->name, std::get<2>(kv.first))] += kv.second;
+        }
+        return stats;
+    }
 
-                text.replace(pos, end - pos + 1, value);
-                pos += value.length();
-            }
+    bool Session::setLanguage(const std::string& file) {
+        SessionState& ss = *state_;
+        auto paused = ss.pause();
+        ss.dropSpeculations();
+        if (file.empty()) {
+            ss.language.reset();
+            return true;
+        }
+        EngineResources& res = *ss.resources;
+        std::lock_guard<std::mutex> lock(res.languagesMutex);
+        auto& cached = res.languages[file + "\n" + std::to_string(ss.prog->stringFingerprint)];
+        if (!cached) cached = StringTable::load(file, ss.prog->stringKeys, ss.prog->stringFingerprint);
+        if (!cached) return false;
+        ss.language = cached;
+        return true;
+    }
 
-            // Output the text
-            cout << text << "\n";
+    void Session::setOutput(std::ostream* out) { state_->out = out ? out : &std::cout; }
+    void Session::setErrorOutput(std::ostream* err) { state_->err = err ? err : &std::cerr; }
+
+    void Session::setDebug(bool debug) {
+        if (debug) {
+            state_->debugger = std::make_shared<Debugger>();
+            state_->debugger->step();
+        } else {
+            state_->debugger.reset();
         }
     }
-    return true;
-}
 
-static void executeMethod(Program& prog,
-    const string& instanceName,
-    const string& methodName,
-    const vector<int>& argValues,
-    const vector<string>& argNames,
-    string& playerName) {
-    if (!prog.instanceClass.count(instanceName)) {
-        cerr << "Runtime: unknown instance '" << instanceName << "'\n";
-        return;
+    bool Session::getVar(const std::string& name, Value& out) const {
+        refreshIfDerived(*state_, name);
+        return lookupVar(*state_, name, out);
+    }
+
+    bool Session::setVar(const std::string& name, const Value& value) {
+        SessionState& ss = *state_;
+        if (ss.prog->derived.count(name)) return false;
+        auto paused = ss.pause();
+        ss.dropSpeculations();
+        if (name == "currentRoom") {
+            auto it = ss.prog->roomIndex.find(value.isString ? value.str : std::to_string(value.num));
+            if (it == ss.prog->roomIndex.end()) return false;
+            ss.room = it->second;
+            ss.noteWrite(name);
+            return true;
+        }
+        auto pr = splitDot(name);
+        if (!pr.second.empty()) {
+            if (!ss.objects.count(pr.first)) return false;
+            ss.objects[pr.first][pr.second] = (int)value.num;
+        } else if (value.isString || ss.stringVars.count(name)) {
+            if (!ss.setString(name, value.isString ? value.str : std::to_string(value.num))) return false;
+        } else if (ss.boolVars.count(name)) {
+            ss.boolVars[name] = value.num != 0;
+        } else {
+            ss.vars[name] = (int)value.num;
+        }
+        ss.noteWrite(name);
+        return true;
+    }
+
+    int Session::watch(const std::string& name, Watcher fn) {
+        SessionState& ss = *state_;
+        SessionState::Watch w;
+        w.name = name;
+        w.fn = std::move(fn);
+        refreshIfDerived(ss, name);
+        lookupVar(ss, name, w.last);
+        ss.watches.push_back(std::move(w));
+        ss.watchIndex[name].push_back(ss.watches.size() - 1);
+        return (int)ss.watches.size() - 1;
+    }
+
+    void Session::unwatch(int id) {
+        SessionState& ss = *state_;
+        if (id < 0 || id >= (int)ss.watches.size() || !ss.watches[id].fn) return;
+        SessionState::Watch& w = ss.watches[id];
+        w.fn = nullptr;
+        auto& ids = ss.watchIndex[w.name];
+        ids.erase(std::remove(ids.begin(), ids.end(), (size_t)id), ids.end());
+        if (ids.empty()) ss.watchIndex.erase(w.name);
+    }
+
+    // ---- Memory ----
+
+    size_t MemoryStats::totalBytes() const {
+        size_t n = 0;
+        for (auto& c : categories) n += c.bytes;
+        return n;
+    }
+
+    void MemoryStats::print(std::ostream& out) const {
+        char line[96];
+        for (auto& c : categories) {
+            std::snprintf(line, sizeof(line), "%-14s %12zu B %10.1f KiB %8zu\n", c.name.c_str(), c.bytes, c.bytes / 1024.0, c.count);
+            out << line;
+        }
+        std::snprintf(line, sizeof(line), "%-14s %12zu B %10.1f KiB\n", "total", totalBytes(), totalBytes() / 1024.0);
+        out << line;
+    }
+
+    void GraphStats::merge(const GraphStats& other) {
+        for (auto& kv : other.nodes) {
+            NodeStats& n = nodes[kv.first];
+            n.visits += kv.second.visits;
+            n.nanos += kv.second.nanos;
+        }
+        for (auto& kv : other.edges) edges[kv.first] += kv.second;
+        runs += other.runs;
+    }
+
+    // ---- Script ----
+
+    Session Script::newSession(const std::string& playerName) const {
+        std::shared_ptr<const Program> prog = prog_ ? prog_ : std::make_shared<Program>();
+        return Session(std::make_unique<SessionState>(prog, resources_, playerName));
+    }
+
+    bool Script::valid() const { return prog_ && !prog_->entry.empty(); }
+
+    void Script::writeStrings(std::ostream& out) const {
+        if (!prog_) return;
+        std::vector<const std::string*> text(prog_->stringKeys.size());
+        for (auto& kv : prog_->nodes) {
+            const Node& node = kv.second;
+            if (node.textId >= 0) text[node.textId] = &node.text;
+            for (auto& c : node.choices) text[c.textId] = &c.text;
+            for (size_t i = 0; i < node.actions.size(); ++i) {
+                if (node.actionTextIds[i] >= 0) text[node.actionTextIds[i]] = &node.actions[i];
+            }
+        }
+        TextCache cache;
+        for (size_t id = 0; id < text.size(); ++id) {
+            std::string_view t = *text[id];
+            if (t.rfind("SHOW ", 0) == 0) t.remove_prefix(5);
+            out << prog_->stringKeys[id] << "\t" << StringTable::escape(storedText(*prog_, (int)id, t, cache)) << "\n";
+        }
     }
-    string cls = prog.instanceClass[instanceName];
-    if (!prog.classes.count(cls)) {
-        cerr << "Runtime: unknown class '" << cls << "' for instance '" << instanceName << "'\n";
-        return;
+
+    std::vector<TextMatch> Script::find(const std::string& text) const {
+        std::vector<TextMatch> found;
+        if (!prog_) return found;
+        TextCache cache;
+        for (auto& [id, site] : findText(*prog_, text)) {
+            found.push_back({ site.node->name, site.node->definitionLine, site.part, storedText(*prog_, id, site.source, cache) });
+        }
+        return found;
     }
-    ClassDef& cdef = prog.classes[cls];
-    if (!cdef.methods.count(methodName)) {
-        cerr << "Runtime: class '" << cls << "' has no method '" << methodName << "'\n";
-        return;
+
+    void Script::writeGraph(std::ostream& out, GraphFormat format, const GraphStats* stats) const {
+        Program empty;
+        const Program& prog = prog_ ? *prog_ : empty;
+        std::vector<const Node*> nodes = storyNodes(prog);
+        std::vector<StoryEdge> edges = storyEdges(prog, nodes);
+        if (format == GraphFormat::Dot) writeGraphDot(out, prog, nodes, edges, stats);
+        else writeGraphJson(out, prog, nodes, edges, stats);
     }
-    unordered_map<string, int> localVars;
-    unordered_map<string, bool> localBoolVars;
-    for (auto& kv : prog.vars) localVars[kv.first] = kv.second;
-    for (auto& kv : prog.boolVars) localBoolVars[kv.first] = kv.second;
 
-    vector<string> paramNames;
-    if (cdef.methodParams.count(methodName)) paramNames = cdef.methodParams[methodName];
+    // ---- Batch ----
 
-    for (size_t i = 0; i < argValues.size() && i < paramNames.size(); ++i) {
-        localVars[paramNames[i]] = argValues[i];
+    Batch::Batch(std::unique_ptr<BatchState> state) : state_(std::move(state)) {}
+    Batch::Batch(Batch&&) noexcept = default;
+    Batch& Batch::operator=(Batch&&) noexcept = default;
+    Batch::~Batch() = default;
+
+    Batch Script::newBatch(size_t lanes) const {
+        auto bs = std::make_unique<BatchState>();
+        std::shared_ptr<BatchProgram> bp = compileBatch(prog_ ? *prog_ : Program());
+        if (!bp->error.empty()) {
+            std::cerr << "Batch: " << bp->error << "\n";
+            return Batch(std::move(bs));
+        }
+        size_t blocks = (lanes + kBatchLanes - 1) / kBatchLanes;
+        bs->bp = bp;
+        bs->lanes = lanes;
+        bs->slots = bp->slotNames.size();
+        bs->vars.resize(blocks * bs->slots * kBatchLanes);
+        for (size_t b = 0; b < blocks; ++b) {
+            int32_t* bv = bs->blockVars(b);
+            for (size_t s = 0; s < bs->slots; ++s) {
+                for (size_t l = 0; l < kBatchLanes; ++l) bv[s * kBatchLanes + l] = bp->initial[s];
+            }
+        }
+        bs->node.assign(blocks * kBatchLanes, bp->entry);
+        bs->status.assign(blocks * kBatchLanes, bp->entry < 0 ? Session::Finished : Session::Running);
+        bs->visits.assign(blocks * kBatchLanes, 0);
+        bs->rng.resize(blocks * kBatchLanes);
+        for (size_t l = 0; l < bs->rng.size(); ++l) bs->rng[l].reseed(l);
+        bs->stack.resize(bp->maxDepth * kBatchLanes);
+        return Batch(std::move(bs));
     }
 
-    vector<string> actions = cdef.methods[methodName];
+    bool Batch::valid() const { return state_->bp != nullptr; }
+    size_t Batch::lanes() const { return state_->lanes; }
 
-    unordered_map<string, unordered_map<string, int>> objects = prog.objects;
-    if (!objects.count(instanceName)) objects[instanceName] = prog.classes[cls].fields;
+    void Batch::run(const Chooser& chooser, uint64_t maxNodeVisits) {
+        if (state_->bp) runBatch(*state_, chooser, maxNodeVisits);
+    }
 
-    unordered_map<string, int> instanceFieldCopy = objects[instanceName];
-    for (auto& kv : instanceFieldCopy) {
-        if (!localVars.count(kv.first)) localVars[kv.first] = kv.second;
+    void Batch::seed(uint64_t seed) {
+        for (size_t l = 0; l < state_->rng.size(); ++l) state_->rng[l].reseed(seed + l);
     }
 
-    string jump_target;
-    bool jumped = false;
-    bool cont = executeActionsWithContext(actions, prog, localVars, localBoolVars, objects, instanceName, playerName, jump_target, jumped);
-    for (auto& f : cdef.fields) {
-        if (localVars.count(f.first)) {
-            prog.objects[instanceName][f.first] = localVars[f.first];
-        }
+    Session::Status Batch::status(size_t lane) const {
+        return lane < state_->lanes ? (Session::Status)state_->status[lane] : Session::Finished;
     }
-    for (auto& kv : prog.vars) {
-        if (localVars.count(kv.first)) {
-            prog.vars[kv.first] = localVars[kv.first];
-        }
+
+    std::string Batch::currentNode(size_t lane) const {
+        if (lane >= state_->lanes || state_->node[lane] < 0) return "";
+        return state_->bp->nodeNames[state_->node[lane]];
     }
-    for (auto& kv : prog.boolVars) {
-        if (localBoolVars.count(kv.first)) {
-            prog.boolVars[kv.first] = localBoolVars[kv.first];
-        }
+
+    bool Batch::getVar(size_t lane, const std::string& name, long long& out) const {
+        const BatchState& bs = *state_;
+        if (!bs.bp || lane >= bs.lanes) return false;
+        auto it = bs.bp->slotIndex.find(name);
+        if (it == bs.bp->slotIndex.end()) return false;
+        size_t block = lane / kBatchLanes;
+        out = bs.vars[(block * bs.slots + it->second) * kBatchLanes + lane % kBatchLanes];
+        return true;
     }
 
-    prog.objects = objects;
-}
+    bool Batch::setVar(size_t lane, const std::string& name, long long value) {
+        BatchState& bs = *state_;
+        if (!bs.bp || lane >= bs.lanes) return false;
+        auto it = bs.bp->slotIndex.find(name);
+        if (it == bs.bp->slotIndex.end()) return false;
+        size_t block = lane / kBatchLanes;
+        int32_t v = bs.bp->slotIsBool[it->second] ? value != 0 : (int32_t)value;
+        bs.vars[(block * bs.slots + it->second) * kBatchLanes + lane % kBatchLanes] = v;
+        return true;
+    }
 
-// ----------------------- Runtime / Runner -----------------------
+    // ---- Engine ----
 
-void runProgram(Program& prog, string& playerName, Debugger& debugger, ImageDriver* imgDrv) {
-    string current = prog.entry;
-    unordered_map<string, int> vars = prog.vars;
-    unordered_map<string, bool> boolVars = prog.boolVars;
-    unordered_map<string, unordered_map<string, int>>& objects = prog.objects;
+    Engine::Engine() : resources_(std::make_shared<EngineResources>()) {}
+    Engine::~Engine() = default;
 
-    // NEW: picture arrays map (CRTZ picture arrays -> ImageDriver indices)
-    unordered_map<string, vector<int>> pictureArrays;
-    
+    void Engine::setLimits(const Limits& limits) { resources_->limits = limits; }
 
-    if (!prog.npc.empty()) {
-        cout << "Npc: " << prog.npc << "\n";
+    bool Engine::enableJournal(const std::string& path, unsigned commitDelayMicros, size_t compactBytes) {
+        JournalOptions options;
+        options.commitDelayMicros = commitDelayMicros;
+        options.compactBytes = compactBytes;
+        resources_->journal = Journal::open(path, options);
+        return resources_->journal != nullptr;
     }
-    if (!prog.desc.empty()) {
-        cout << "Description: " << prog.desc << "\n\n";
+
+    void Engine::setHeadless(bool on) {
+        std::lock_guard<std::mutex> lock(resources_->imagesMutex);
+        resources_->headless = on;
     }
 
-    while (true) {
-        if (!prog.nodes.count(current)) {
-            cerr << "Unknown node: " << current << "\n";
-            break;
+    void Engine::addNative(NativeBinding binding) {
+        for (auto& b : natives_) {
+            if (b.name == binding.name) { b = std::move(binding); return; }
         }
-        Node& node = prog.nodes[current];
-
-        debugger.check(node.definitionLine, prog);
+        natives_.push_back(std::move(binding));
+    }
 
-        if (!node.text.empty()) {
-            string out = node.text;
-            size_t pos = 0;
-            while ((pos = out.find("[@You]", pos)) != string::npos) {
-                out.replace(pos, 6, "[" + playerName + "]");
-                pos += playerName.size() + 2;
-            }
-            size_t p = 0;
-            while ((p = out.find("${", p)) != string::npos) {
-                size_t q = out.find("}", p + 2);
-                if (q == string::npos) break;
-                string varname = out.substr(p + 2, q - (p + 2));
-                string val;
-                auto pr = splitDot(varname);
-                if (!pr.second.empty()) {
-                    if (objects.count(pr.first) && objects[pr.first].count(pr.second)) {
-                        val = to_string(objects[pr.first][pr.second]);
-                    } else {
-                        val = "0";
-                    }
-                } else {
-                    if (boolVars.count(varname)) {
-                        val = boolVars[varname] ? "true" : "false";
-                    } else if (vars.count(varname)) {
-                        val = to_string(vars[varname]);
-                    } else {
-                        val = "0";
-                    }
-                }
-                out.replace(p, q - p + 1, val);
-                p += 1;
-            }
+    bool Engine::enableStateExport(const std::string& name, unsigned maxSessions, std::vector<std::string> variables) {
+        resources_->stateSegment = StateSegment::create(name, maxSessions);
+        resources_->exportedVars = std::move(variables);
+        return resources_->stateSegment != nullptr;
+    }
 
-            cout << out << "\n";
-        }
+    static std::shared_ptr<Program> buildProgram(const std::string& source, const std::string& name, const std::string& baseDir,
+        const std::vector<NativeBinding>& natives, bool compress) {
+        Parser parser(source);
+        parser.parse();
+        auto prog = std::make_shared<Program>(std::move(parser.getProgram()));
+        prog->baseDir = baseDir;
+        prog->name = name;
+        linkProgram(*prog, natives);
+        if (compress) compressText(*prog);
+        return prog;
+    }
 
-        if (!node.choices.empty()) {
-            for (auto& c : node.choices) {
-                string text = c.text;
-                size_t pos = 0;
-                while ((pos = text.find("[@You]", pos)) != string::npos) {
-                    text.replace(pos, 6, "[" + playerName + "]");
-                    pos += playerName.size() + 2;
-                }
-                cout << "[" << c.id << "] " << text << "\n";
+    MemoryStats Engine::memoryStats() const {
+        EngineResources& res = *resources_;
+        std::vector<std::shared_ptr<const Program>> programs;
+        std::vector<std::shared_ptr<SessionTracker>> sessions;
+        {
+            std::lock_guard<std::mutex> lock(res.trackMutex);
+            for (auto& w : res.programs) {
+                if (auto p = w.lock()) programs.push_back(std::move(p));
             }
-            int sel = -1;
-            while (true) {
-                cout << "Choose: ";
-                if (!(cin >> sel)) { cin.clear(); cin.ignore(1024, '\n'); cout << "Invalid\n"; continue; }
-                bool ok = false;
-                for (auto& c : node.choices) if (c.id == sel) { ok = true; current = c.target; break; }
-                if (ok) break;
-                cout << "Invalid choice\n";
+            for (auto& w : res.sessions) {
+                if (auto t = w.lock()) sessions.push_back(std::move(t));
             }
-            continue;
         }
 
-        bool jumped = false;
-        string jump_target;
-        for (auto& act : node.actions) {
-            if (act.rfind("SET ", 0) == 0) {
-                // ... (unchanged SET handling)
-                string rest = act.substr(4);
-                string name;
-                size_t p = 0;
-                while (p < rest.size() && !isspace((unsigned char)rest[p])) name.push_back(rest[p++]);
-                while (p < rest.size() && isspace((unsigned char)rest[p])) p++;
-                string expr = rest.substr(p);
-                auto pr = splitDot(name);
-                if (!pr.second.empty()) {
-                    string inst = pr.first;
-                    string field = pr.second;
-                    int val = evalExpressionString(expr, vars, boolVars, objects);
-                    objects[inst][field] = val;
-                } else {
-                    if (boolVars.count(name)) {
-                        int val = evalExpressionString(expr, vars, boolVars, objects);
-                        boolVars[name] = (val != 0);
-                    } else {
-                        int val = evalExpressionString(expr, vars, boolVars, objects);
-                        vars[name] = val;
-                    }
-                }
-            } else if (act.rfind("SIGNAL ", 0) == 0) {
-                // ... (unchanged SIGNAL handling)
-                string rest = act.substr(7);
-                string name;
-                size_t p = 0;
-                while (p < rest.size() && !isspace((unsigned char)rest[p])) name.push_back(rest[p++]);
-                while (p < rest.size() && isspace((unsigned char)rest[p])) p++;
-                string expr = rest.substr(p);
-                int val = evalExpressionString(expr, vars, boolVars, objects);
-                cout << "[SIGNAL] " << name << " = " << (val ? "true" : "false") << "\n";
-            } else if (act.rfind("IF ", 0) == 0) {
-                // ... (unchanged IF handling)
-                size_t gpos = act.find(" GOTO ");
-                if (gpos == string::npos) continue;
-                string cond = act.substr(3, gpos - 3);
-                string rest = act.substr(gpos + 6);
-                size_t epos = rest.find(" ELSE ");
-                string target = rest;
-                string elseTarget;
-                if (epos != string::npos) {
-                    target = rest.substr(0, epos);
-                    elseTarget = rest.substr(epos + 6);
-                }
-                int res = evalExpressionString(cond, vars, boolVars, objects);
-                if (res) {
-                    current = target;
-                    jumped = true;
-                    break;
-                } else if (!elseTarget.empty()) {
-                    current = elseTarget;
-                    jumped = true;
-                    break;
-                }
-            } else if (act.rfind("GOTO ", 0) == 0) {
-                // ... (unchanged GOTO)
-                string target = act.substr(5);
-                current = target;
-                jumped = true;
-                break;
-            } else if (act == "END") {
-                cout << "[Dialogue ended]\n";
-                return;
-            } else if (act.rfind("STMT ", 0) == 0) {
-                string stmt = act.substr(5);
-                string s = trim(stmt);
+        MemoryStats stats;
+        stats.categories = { { "program" }, { "strings" }, { "tables" }, { "translations" },
+            { "sessions" }, { "objects" }, { "pictures" }, { "caches" }, { "journal" } };
+        MemoryStats::Category& program = stats.categories[0];
+        MemoryStats::Category& strings = stats.categories[1];
+        MemoryStats::Category& tables = stats.categories[2];
+        MemoryStats::Category& translations = stats.categories[3];
+        MemoryStats::Category& live = stats.categories[4];
+        MemoryStats::Category& objects = stats.categories[5];
+        MemoryStats::Category& pictures = stats.categories[6];
+        MemoryStats::Category& caches = stats.categories[7];
+        MemoryStats::Category& journal = stats.categories[8];
 
-                // ---- NEW: handle picture array loading: picture img[SIZE] = load("folder")
-                if (s.rfind("picture ", 0) == 0) {
-                    // minimal parser: picture <name>[<size>] = load("folder")
-                    string rest = trim(s.substr(8));
-                    size_t br = rest.find('[');
-                    string arrName;
-                    if (br != string::npos) arrName = trim(rest.substr(0, br));
-                    else {
-                        cerr << "Invalid picture declaration: missing array name\n";
-                        continue;
-                    }
-                    size_t eq = rest.find('=');
-                    if (eq == string::npos) {
-                        cerr << "Invalid picture declaration: missing '='\n";
-                        continue;
-                    }
-                    string rhs = trim(rest.substr(eq + 1));
-                    // expect load("...") form
-                    if (rhs.rfind("load(", 0) == 0) {
-                        size_t q1 = rhs.find('"');
-                        size_t q2 = rhs.rfind('"');
-                        if (q1 != string::npos && q2 != string::npos && q2 > q1) {
-                            string folder = rhs.substr(q1 + 1, q2 - q1 - 1);
-                            if (!imgDrv) {
-                                cerr << "ImageDriver not available: cannot load pictures\n";
-                            } else {
-                                vector<int> indices = imgDrv->loadFolder(folder);
-                                pictureArrays[arrName] = indices;
-                                cout << "Loaded " << indices.size() << " images into " << arrName << "\n";
-                            }
-                        } else {
-                            cerr << "Invalid load() folder string\n";
-                        }
-                    } else {
-                        cerr << "Unsupported picture initializer: " << rhs << "\n";
-                    }
-                    continue; // next action
-                } else if (s.rfind("display(", 0) == 0) {
-                    size_t p = s.find('(');
-                    size_t q = s.rfind(')');
-                    if (p == string::npos || q == string::npos || q <= p) {
-                        cerr << "Invalid display(...) statement\n";
-                        continue;
-                    }
-                    string inner = trim(s.substr(p + 1, q - p - 1));
-                    
-                    size_t b = inner.find('[');
-    size_t rb = inner.rfind(']');
-    if (b != string::npos && rb != string::npos && rb > b) {
-        string arrName = trim(inner.substr(0, b));
-        string idxStr = trim(inner.substr(b + 1, rb - b - 1));
-        int idx = 0;
-        try { idx = stoi(idxStr); }
-        catch (...) { 
-            cerr << "display: invalid index: " << idxStr << "\n"; 
-            continue; 
-        }
-        if (pictureArrays.count(arrName) == 0) {
-            cerr << "display: unknown picture array: " << arrName << "\n";
-        } else {
-            auto &vec = pictureArrays[arrName];
-            if (idx < 0 || idx >= (int)vec.size()) {
-                cerr << "display: index out of range: " << idx << "\n";
-            } else {
-                int driverIndex = vec[idx];
-                if (!imgDrv) { 
-                    cerr << "ImageDriver not available: display failed\n"; 
-                } else {
-                    imgDrv->displayByIndex(driverIndex);
+        std::unordered_set<const Table*> seenTables;
+        for (auto& p : programs) {
+            program.bytes += structureBytes(*p);
+            program.count++;
+            strings.bytes += textBytes(*p);
+            strings.count += p->stringKeys.size();
+            for (auto& t : p->tables) {
+                if (t && seenTables.insert(t.get()).second) {
+                    tables.bytes += t->mappedBytes();
+                    tables.count++;
                 }
             }
         }
-    } else {
-        // If it's not an array index, treat it as a path
-        // The lexer has already stripped quotes, so we use the inner content directly
-        if (!imgDrv) {
-            cerr << "ImageDriver not available: display failed\n";
-        } else {
-            imgDrv->display(inner);
+        {
+            std::lock_guard<std::mutex> lock(res.languagesMutex);
+            for (auto& kv : res.languages) {
+                if (!kv.second) continue;
+                translations.bytes += kv.second->mappedBytes();
+                translations.count++;
+            }
         }
+        for (auto& t : sessions) {
+            std::lock_guard<std::recursive_mutex> lock(t->lock);
+            if (!t->state) continue;
+            SessionMemory m;
+            measureSession(*t->state, m);
+            live.bytes += m.state;
+            live.count++;
+            objects.bytes += m.objects;
+            objects.count += t->state->objects.size();
+            caches.bytes += m.caches;
+            caches.count += t->state->speculations.size();
+        }
+        pictures.bytes = res.images.textureBytes();
+        pictures.count = res.images.textureCount();
+        if (res.journal) {
+            Journal::Stats js = res.journal->stats();
+            journal.bytes += js.imageBytes;
+            journal.count = js.sessions;
+        }
+        return stats;
     }
-                    continue;
-                }
-
-                // ---- existing inline-new and print handling ----
-                size_t dotp = s.find('.');
-                size_t paren = s.find('(');
-                if (dotp != string::npos && paren != string::npos && paren > dotp) {
-                    string inst = s.substr(0, dotp);
-                    string method = s.substr(dotp + 1, paren - (dotp + 1));
-                    size_t rparen = s.rfind(')');
-                    string argsraw;
-                    if (rparen != string::npos && rparen > paren) argsraw = s.substr(paren + 1, rparen - paren - 1);
-                    else argsraw = s.substr(paren + 1);
-                    vector<string> argExprs = splitArgs(argsraw);
-                    vector<int> argVals;
-                    for (auto& ae : argExprs) {
-                        int v = evalExpressionString(ae, vars, boolVars, objects);
-                        argVals.push_back(v);
-                    }
-                    executeMethod(prog, inst, method, argVals, vector<string>{}, playerName);
-                } else {
-                    if (s.rfind("new ", 0) == 0) {
-                        string rest = s.substr(4);
-                        istringstream iss(rest);
-                        string className, instName;
-                        iss >> className >> instName;
-                        if (prog.classes.count(className)) {
-                            prog.objects[instName] = prog.classes[className].fields;
-                            prog.instanceClass[instName] = className;
-                        } else {
-                            cerr << "Unknown class in inline new: " << className << "\n";
-                        }
-                    } else if (s.rfind("print(", 0) == 0) {
-                        size_t p = s.find('(');
-                        size_t q = s.rfind(')');
-                        if (p != string::npos && q != string::npos && q > p) {
-                            string inner = s.substr(p + 1, q - p - 1);
-                            if (inner.size() >= 2 && inner.front() == '"' && inner.back() == '"') {
-                                cout << inner.substr(1, inner.size() - 2) << "\n";
-                            } else {
-                                int val = evalExpressionString(inner, vars, boolVars, objects);
-                                cout << (val ? "true" : "false") << "\n";
-                            }
-                        }
-                    }
-                }
-            } else if (act.rfind("SHOW ", 0) == 0) {
-                // ... (unchanged SHOW handling)
-                string text = act.substr(5);
-                size_t pos = 0;
-                // Handle variable substitutions
-                while ((pos = text.find("${", pos)) != string::npos) {
-                    size_t end = text.find("}", pos + 2);
-                    if (end == string::npos) break;
-
-                    string varName = text.substr(pos + 2, end - pos - 2);
-                    string value;
-
-                    if (prog.stringVars.count(varName)) {
-                        value = prog.stringVars[varName];
-                    } else if (prog.boolVars.count(varName)) {
-                        value = prog.boolVars[varName] ? "true" : "false";
-                    } else if (vars.count(varName)) {
-                        value = to_string(vars[varName]);
-                    } else {
-                        auto pr = splitDot(varName);
-                        if (!pr.second.empty() && objects.count(pr.first) && objects[pr.first].count(pr.second)) {
-                            value = to_string(objects[pr.first][pr.second]);
-                        } else {
-                            value = "0";
-                        }
-                    }
 
-                    text.replace(pos, end - pos + 1, value);
-                    pos += value.length();
-                }
+    Script Engine::compile(const std::string& source) const {
+        Script script;
+        // Named by content, so compiling the same text again reuses its profile ids
+        char name[32];
+        std::snprintf(name, sizeof(name), "script %08zx", std::hash<std::string>()(source) & 0xFFFFFFFF);
+        script.prog_ = buildProgram(source, name, "", natives_, compressText_);
+        script.resources_ = resources_;
+        resources_->track(resources_->programs, resources_->programsSweep, script.prog_);
+        return script;
+    }
 
-                // Output the text
-                cout << text << "\n";
-            }
+    Script Engine::compileFile(const std::string& filename) const {
+        std::ifstream file(filename);
+        if (!file.is_open()) {
+            std::cerr << "Could not open " << filename << std::endl;
+            return Script();
         }
-
-        if (jumped) continue;
-        cout << "[End of Conversation]\n";
-        return;
+        std::string source((std::istreambuf_iterator<char>(file)),
+            std::istreambuf_iterator<char>());
+        size_t slash = filename.find_last_of('/');
+        Script script;
+        script.prog_ = buildProgram(source, filename, slash == std::string::npos ? "" : filename.substr(0, slash), natives_, compressText_);
+        script.resources_ = resources_;
+        resources_->track(resources_->programs, resources_->programsSweep, script.prog_);
+        return script;
     }
-}
 
-// ----------------------- Library Wrapper APIs -----------------------
+    void Engine::runSource(const std::string& source, const std::string& playerName, bool debug) {
+        Session session = compile(source).newSession(playerName);
+        session.setDebug(debug);
+        session.run();
+    }
 
-namespace CRTZ {
+    void Engine::runScript(const std::string& filename, const std::string& playerName, bool debug) {
+        Script script = compileFile(filename);
+        if (!script.prog_) return;
+        Session session = script.newSession(playerName);
+        session.setDebug(debug);
+        session.run();
+    }
 
-   void runSource(const std::string& source, const std::string& playerName, bool debug) {
-    Parser parser(source);
-    parser.parse();
-    Program prog = parser.getProgram();
-    string player = playerName;
-    Debugger debugger;
-    if (debug) {
-        debugger.step();
+    void runSource(const std::string& source, const std::string& playerName, bool debug) {
+        Engine engine;
+        engine.runSource(source, playerName, debug);
     }
 
-    // ImageDriver for display(...) and picture arrays
-    ImageDriver imgDrv;
-    bool imgOk = imgDrv.init();
-    if (!imgOk) {
-        std::cerr << "Warning: ImageDriver failed to initialize. Image commands will be disabled.\n";
+    void runScript(const std::string& filename, const std::string& playerName, bool debug) {
+        Engine engine;
+        engine.runScript(filename, playerName, debug);
     }
 
-    // Pass imgDrv pointer (or nullptr if init failed)
-    runProgram(prog, player, debugger, imgOk ? &imgDrv : nullptr);
+} // namespace CRTZ
 
+// ----------------------- main (CLI) -----------------------
 
-    // cleanup
-    imgDrv.shutdown();
+// Embedders define CRTZ_NO_MAIN and provide their own main()
+#ifndef CRTZ_NO_MAIN
+// Prints every active slot of a state segment once
+static int dumpState(const string& name) {
+    auto seg = CRTZ::StateSegment::open(name);
+    if (!seg) return 1;
+    for (uint32_t i = 0; i < seg->slotCount(); ++i) {
+        const CRTZ::StateSlot& slot = seg->slot(i);
+        if (!slot.inUse.load(memory_order_acquire)) continue;
+        CRTZ::StateSnapshot snap;
+        if (!CRTZ::readSlot(slot, snap)) { cout << "slot " << i << ": busy\n"; continue; }
+        cout << "slot " << i << ": player=" << snap.player << " node=" << snap.node
+             << " status=" << snap.status << " steps=" << snap.steps
+             << " visits=" << snap.nodeVisits << " choices=" << snap.choices;
+        for (uint32_t v = 0; v < snap.varCount; ++v) cout << " " << snap.vars[v].name << "=" << snap.vars[v].value;
+        cout << "\n";
+    }
+    return 0;
 }
 
-    void runScript(const std::string& filename, const std::string& playerName, bool debug) {
-        std::ifstream file(filename);
-        if (!file.is_open()) {
-            std::cerr << "Could not open " << filename << std::endl;
-            return;
-        }
+// crtz test [-j n] [--update] [--seed n] [--fuel n] dir/
+static int testCommand(int argc, char** argv) {
+    CRTZ::TestOptions options;
+    string dir;
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc) options.jobs = (unsigned)atoi(argv[++i]);
+        else if (arg == "--update") options.update = true;
+        else if (arg == "--seed" && i + 1 < argc) options.seed = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--fuel" && i + 1 < argc) options.fuel = strtoull(argv[++i], nullptr, 10);
+        else dir = arg;
+    }
+    if (dir.empty()) {
+        cerr << "Usage: " << argv[0] << " test [-j n] [--update] [--seed n] [--fuel n] dir\n";
+        return 2;
+    }
+    int failed = CRTZ::runTests(dir, options, cout);
+    return failed == 0 ? 0 : 1;
+}
 
-        std::string source((std::istreambuf_iterator<char>(file)),
-            std::istreambuf_iterator<char>());
+static CRTZ::GraphFormat graphFormatFor(const string& path) {
+    return path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0 ? CRTZ::GraphFormat::Json : CRTZ::GraphFormat::Dot;
+}
 
-        runSource(source, playerName, debug);
+// crtz graph [--format dot|json] [--simulate n] [--seed n] [-j n] [-o file] script.crtz
+// With --simulate, n headless playthroughs pick choices at random and the
+// graph carries their combined traffic.
+static int graphCommand(int argc, char** argv) {
+    string filename, outFile, format;
+    unsigned runs = 0, jobs = 0;
+    uint64_t seed = 0;
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--format" && i + 1 < argc) format = argv[++i];
+        else if (arg == "--simulate" && i + 1 < argc) runs = (unsigned)atoi(argv[++i]);
+        else if (arg == "--seed" && i + 1 < argc) seed = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "-j" && i + 1 < argc) jobs = (unsigned)atoi(argv[++i]);
+        else if (arg == "-o" && i + 1 < argc) outFile = argv[++i];
+        else filename = arg;
     }
+    if (filename.empty() || (!format.empty() && format != "dot" && format != "json")) {
+        cerr << "Usage: " << argv[0] << " graph [--format dot|json] [--simulate n] [--seed n] [-j n] [-o file] script.crtz\n";
+        return 2;
+    }
+    if (!ifstream(filename)) { cerr << "Couldn't open file\n"; return 1; }
 
-} // namespace CRTZ
+    CRTZ::Engine engine;
+    engine.setHeadless(true);
+    CRTZ::Script script = engine.compileFile(filename);
+    if (!script.valid()) return 1;
 
-// ----------------------- main (CLI) -----------------------
+    CRTZ::GraphStats stats;
+    if (runs) {
+        // A playthrough ends when it finishes, fails, runs out of fuel in one
+        // step (a loop without choices) or reaches maxTurns choices
+        const unsigned maxTurns = 10000;
+        CRTZ::Limits limits;
+        limits.fuel = 1000000;
+        jobs = jobs ? jobs : max(1u, thread::hardware_concurrency());
+        jobs = min(jobs, runs);
+        vector<CRTZ::GraphStats> partial(jobs);
+        atomic<unsigned> next{ 0 };
+        auto worker = [&](CRTZ::GraphStats& into) {
+            ostream sink(nullptr);  // discards the dialogue
+            for (unsigned r; (r = next.fetch_add(1)) < runs;) {
+                CRTZ::Session session = script.newSession("Scott");
+                session.setOutput(&sink);
+                session.setLimits(limits);
+                session.seed(seed + r);
+                session.recordGraph(true);
+                mt19937_64 pick(seed + r);
+                for (unsigned turn = 0; turn < maxTurns; ++turn) {
+                    if (session.step() != CRTZ::Session::WaitingForChoice || session.choices().empty()) break;
+                    const vector<CRTZ::ChoiceInfo>& choices = session.choices();
+                    session.choose(choices[pick() % choices.size()].id);
+                }
+                into.merge(session.graphStats());
+            }
+        };
+        vector<thread> pool;
+        for (unsigned j = 1; j < jobs; ++j) pool.emplace_back(worker, ref(partial[j]));
+        worker(partial[0]);
+        for (auto& t : pool) t.join();
+        for (auto& p : partial) stats.merge(p);
+    }
+
+    CRTZ::GraphFormat kind = format.empty() ? graphFormatFor(outFile) : format == "json" ? CRTZ::GraphFormat::Json : CRTZ::GraphFormat::Dot;
+    if (outFile.empty()) {
+        script.writeGraph(cout, kind, runs ? &stats : nullptr);
+        return 0;
+    }
+    ofstream out(outFile);
+    script.writeGraph(out, kind, runs ? &stats : nullptr);
+    if (!out) { cerr << "Couldn't write " << outFile << "\n"; return 1; }
+    return 0;
+}
 
 int main(int argc, char** argv) {
+    if (argc >= 2 && string(argv[1]) == "test") return testCommand(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "graph") return graphCommand(argc, argv);
     if (argc < 2) {
-        cout << "Usage: " << argv[0] << " [--debug] script.crtz\n";
+        cout << "Usage: " << argv[0] << " [--debug] [--lang file.tsv] [--compress-text] [--seed n] [--metrics file.prom] [--metrics-port n] [--profile file] [--mem-report]\n"
+             << "       [--journal save.wal] [--graph-out story.dot|story.json] [--window [--text-size px]]\n"
+             << "       [--export-state /name [--export-vars a,b]] script.crtz\n";
+        cout << "       " << argv[0] << " --state-dump /name\n";
+        cout << "       " << argv[0] << " --compile-table data.tsv\n";
+        cout << "       " << argv[0] << " test [-j n] [--update] [--seed n] dir/   (golden transcripts)\n";
+        cout << "       " << argv[0] << " graph [--format dot|json] [--simulate n] [--seed n] [-j n] [-o file] script.crtz\n";
+        cout << "       " << argv[0] << " --extract-strings script.crtz > script.fr.tsv   (then --lang script.fr.tsv)\n";
+        cout << "       " << argv[0] << " --find \"some words\" script.crtz   (dialogue containing them)\n";
         return 1;
     }
 
     bool debug = false;
     string filename;
+    string exportName;
+    vector<string> exportVars;
+    string language;
+    bool extractStrings = false;
+    bool compress = false;
+    uint64_t seed = random_device()();
+    bool seeded = false;
+    string metricsFile;
+    string profileFile;
+    bool memReport = false;
+    string journalFile;
+    string graphFile;
+    string findText;
+    bool window = false;
+    int textSize = 16;
 
-    if (argc == 3 && string(argv[1]) == "--debug") {
-        debug = true;
-        filename = argv[2];
-    } else {
-        filename = argv[1];
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--debug") {
+            debug = true;
+        } else if (arg == "--export-state" && i + 1 < argc) {
+            exportName = argv[++i];
+        } else if (arg == "--export-vars" && i + 1 < argc) {
+            stringstream ss(argv[++i]);
+            string v;
+            while (getline(ss, v, ',')) if (!v.empty()) exportVars.push_back(v);
+        } else if (arg == "--state-dump" && i + 1 < argc) {
+            return dumpState(argv[++i]);
+        } else if (arg == "--lang" && i + 1 < argc) {
+            language = argv[++i];
+        } else if (arg == "--compress-text") {
+            compress = true;
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profileFile = argv[++i];
+        } else if (arg == "--journal" && i + 1 < argc) {
+            journalFile = argv[++i];
+        } else if (arg == "--window") {
+            window = true;
+        } else if (arg == "--text-size" && i + 1 < argc) {
+            textSize = atoi(argv[++i]);
+        } else if (arg == "--find" && i + 1 < argc) {
+            findText = argv[++i];
+        } else if (arg == "--graph-out" && i + 1 < argc) {
+            graphFile = argv[++i];
+        } else if (arg == "--mem-report") {
+            memReport = true;
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            if (!CRTZ::Metrics::global().serve((uint16_t)atoi(argv[++i]))) return 1;
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+            seeded = true;
+        } else if (arg == "--extract-strings") {
+            extractStrings = true;
+        } else if (arg == "--compile-table" && i + 1 < argc) {
+            string src = argv[++i];
+            return CRTZ::Table::compile(src, src + ".crtzt") ? 0 : 1;
+        } else {
+            filename = arg;
+        }
     }
 
-    ifstream in(filename);
-    if (!in) { cerr << "Couldn't open file\n"; return 1; }
-    string content((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
-
-    Parser p(content);
-    p.parse();
-    Program prog = p.getProgram();
-    string player = "Scott";
+    if (!ifstream(filename)) { cerr << "Couldn't open file\n"; return 1; }
 
-    Debugger debugger;
-    if (debug) {
-        debugger.step();
+    CRTZ::Engine engine;
+    if (!exportName.empty() && !engine.enableStateExport(exportName, 64, exportVars)) return 1;
+    engine.setTextCompression(compress);
+    if (!journalFile.empty() && !engine.enableJournal(journalFile)) return 1;
+    CRTZ::Script script = engine.compileFile(filename);
+    if (extractStrings) {
+        script.writeStrings(cout);
+        return 0;
     }
-
-    if (debug) {
-        debugger.step();
+    if (!findText.empty()) {
+        // file:line: node part: text, one per match, like grep -n
+        vector<CRTZ::TextMatch> found = script.find(findText);
+        for (auto& m : found) cout << filename << ":" << m.line << ": " << m.node << " " << m.part << ": " << m.text << "\n";
+        return found.empty() ? 1 : 0;
     }
-
-    // ---------- ImageDriver integration ----------
-    ImageDriver imgDrv;
-    if (!imgDrv.init()) {
-        cerr << "Warning: ImageDriver failed to initialize. Image commands will error.\n";
-        // proceed without images or exit depending on your preference
+    CRTZ::Session session = script.newSession("Scott");
+    if (!language.empty() && !session.setLanguage(language)) {
+        cerr << "Couldn't load translation " << language << "\n";
+        return 1;
     }
-
-    // Pass the driver to the runtime so actions can call it
-    runProgram(prog, player, debugger, imgDrv.isInitialized() ? &imgDrv : nullptr);
-
-    // cleanup
-    imgDrv.shutdown();
+    session.seed(seed);
+    if (debug && !seeded) cout << "[Seed " << seed << "]\n";  // --seed to replay
+    if (!journalFile.empty() && session.autosave(filename)) cerr << "[Resumed from " << journalFile << "]\n";
+    session.setDebug(debug);
+    if (!graphFile.empty()) session.recordGraph(true);
+    if (!profileFile.empty() && !CRTZ::Profiler::start(1000)) return 1;
+    if (window) session.runInWindow(textSize);
+    else session.run();
+    if (!profileFile.empty()) {
+        CRTZ::Profiler::stop();
+        ofstream report(profileFile);
+        CRTZ::Profiler::report(report);
+    }
+    if (!graphFile.empty()) {
+        CRTZ::GraphStats stats = session.graphStats();
+        ofstream graph(graphFile);
+        script.writeGraph(graph, graphFormatFor(graphFile), &stats);
+        if (!graph) { cerr << "Couldn't write " << graphFile << "\n"; return 1; }
+    }
+    if (memReport) engine.memoryStats().print(cerr);  // stdout is the dialogue
+    if (!metricsFile.empty() && !CRTZ::Metrics::global().writeFile(metricsFile)) return 1;
 
     return 0;
-}
\ No newline at end of file
+}
+#endif // CRTZ_NO_MAIN
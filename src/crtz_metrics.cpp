@@ -0,0 +1,260 @@
+// crtz_metrics.cpp - per-thread counters and histograms, Prometheus export
+#include "crtz_metrics.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <chrono>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define CRTZ_HAVE_SOCKETS 1
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // Apple: SO_NOSIGPIPE on each connection instead
+#endif
+#endif
+
+namespace CRTZ {
+
+    thread_local MetricsShard* Metrics::local_ = nullptr;
+
+    namespace {
+
+        void bump(std::atomic<uint64_t>& a, uint64_t n) {
+            a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        // Returns the thread's shard to the registry when the thread exits
+        struct ShardRelease {
+            std::vector<MetricsShard*>* idle = nullptr;
+            std::mutex* mutex = nullptr;
+            MetricsShard* shard = nullptr;
+            ~ShardRelease() {
+                if (!shard) return;
+                std::lock_guard<std::mutex> lock(*mutex);
+                idle->push_back(shard);
+            }
+        };
+
+    } // namespace
+
+    uint64_t histogramBucketMax(size_t b) {
+        const size_t sub = size_t(1) << kHistogramSubBits;
+        if (b < sub) return b;
+        unsigned shift = (unsigned)(b >> kHistogramSubBits) - 1;
+        uint64_t lo = (uint64_t)(sub + (b & (sub - 1))) << shift;
+        return lo + ((uint64_t(1) << shift) - 1);
+    }
+
+    uint64_t HistogramSnapshot::quantile(double q) const {
+        if (!count) return 0;
+        uint64_t rank = (uint64_t)std::ceil(q * (double)count);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (size_t b = 0; b < buckets.size(); ++b) {
+            seen += buckets[b];
+            if (seen >= rank) return std::min(histogramBucketMax(b), max);
+        }
+        return max;
+    }
+
+    Metrics& Metrics::global() {
+        // Never destroyed: threads may still record during static destruction
+        static Metrics* m = new Metrics();
+        return *m;
+    }
+
+    int Metrics::define(std::vector<Def>& defs, size_t limit, const std::string& name, const std::string& help, double scale) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < defs.size(); ++i) {
+            if (defs[i].name == name) return (int)i;
+        }
+        if (defs.size() >= limit) {
+            std::cerr << "Metrics: no room for " << name << "\n";
+            return -1;
+        }
+        defs.push_back({ name, help, scale });
+        return (int)defs.size() - 1;
+    }
+
+    int Metrics::counter(const std::string& name, const std::string& help) {
+        return define(counters_, kMetricsMaxCounters, name, help, 1.0);
+    }
+
+    int Metrics::histogram(const std::string& name, const std::string& help, double scale) {
+        return define(histograms_, kMetricsMaxHistograms, name, help, scale);
+    }
+
+    MetricsShard* Metrics::attach() {
+        static thread_local ShardRelease release;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!idle_.empty()) {
+            local_ = idle_.back();
+            idle_.pop_back();
+        } else {
+            local_ = new MetricsShard();
+            shards_.push_back(local_);
+        }
+        release.idle = &idle_;
+        release.mutex = &mutex_;
+        release.shard = local_;
+        return local_;
+    }
+
+    void Metrics::record(int histogram, uint64_t value) {
+        if (histogram < 0) return;
+        MetricsShard::Histogram* h = shard()->histograms[histogram].load(std::memory_order_relaxed);
+        if (!h) {
+            h = new MetricsShard::Histogram();
+            local_->histograms[histogram].store(h, std::memory_order_release);
+        }
+        bump(h->buckets[histogramBucket(value)], 1);
+        bump(h->sum, value);
+        if (value > h->max.load(std::memory_order_relaxed)) h->max.store(value, std::memory_order_relaxed);
+    }
+
+    uint64_t Metrics::count(int counter) const {
+        if (counter < 0) return 0;
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t total = 0;
+        for (MetricsShard* s : shards_) total += s->counters[counter].load(std::memory_order_relaxed);
+        return total;
+    }
+
+    HistogramSnapshot Metrics::snapshot(int histogram) const {
+        HistogramSnapshot snap;
+        if (histogram < 0) return snap;
+        snap.buckets.assign(kHistogramBuckets, 0);
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (MetricsShard* s : shards_) {
+            const MetricsShard::Histogram* h = s->histograms[histogram].load(std::memory_order_acquire);
+            if (!h) continue;
+            for (size_t b = 0; b < kHistogramBuckets; ++b) {
+                uint64_t n = h->buckets[b].load(std::memory_order_relaxed);
+                snap.buckets[b] += n;
+                snap.count += n;
+            }
+            snap.sum += h->sum.load(std::memory_order_relaxed);
+            snap.max = std::max(snap.max, h->max.load(std::memory_order_relaxed));
+        }
+        return snap;
+    }
+
+    void Metrics::writePrometheus(std::ostream& out) const {
+        std::vector<Def> counters, histograms;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            counters = counters_;
+            histograms = histograms_;
+        }
+        for (size_t i = 0; i < counters.size(); ++i) {
+            out << "# HELP " << counters[i].name << " " << counters[i].help << "\n";
+            out << "# TYPE " << counters[i].name << " counter\n";
+            out << counters[i].name << " " << count((int)i) << "\n";
+        }
+        static const char* const kQuantiles[] = { "0.5", "0.99", "0.999" };
+        for (size_t i = 0; i < histograms.size(); ++i) {
+            const Def& d = histograms[i];
+            HistogramSnapshot snap = snapshot((int)i);
+            out << "# HELP " << d.name << " " << d.help << "\n";
+            out << "# TYPE " << d.name << " summary\n";
+            for (const char* q : kQuantiles) {
+                out << d.name << "{quantile=\"" << q << "\"} " << (double)snap.quantile(std::stod(q)) * d.scale << "\n";
+            }
+            out << d.name << "_sum " << (double)snap.sum * d.scale << "\n";
+            out << d.name << "_count " << snap.count << "\n";
+        }
+    }
+
+    bool Metrics::writeFile(const std::string& path) const {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            if (!out) {
+                std::cerr << "Metrics: cannot write " << tmp << "\n";
+                return false;
+            }
+            writePrometheus(out);
+            if (!out.flush()) return false;
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::cerr << "Metrics: cannot replace " << path << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool Metrics::serve(uint16_t port, bool allInterfaces) {
+#ifdef CRTZ_HAVE_SOCKETS
+        if (serving_.exchange(true)) return true;
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            std::cerr << "Metrics: socket failed\n";
+            serving_ = false;
+            return false;
+        }
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(allInterfaces ? INADDR_ANY : INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+            std::cerr << "Metrics: cannot listen on port " << port << "\n";
+            close(fd);
+            serving_ = false;
+            return false;
+        }
+        // Every connection gets the current metrics, whatever it asked for
+        std::thread([this, fd] {
+            char request[2048];
+            while (true) {
+                int c = accept(fd, nullptr, nullptr);
+                if (c < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                        // Out of descriptors or memory: wait for some to be freed
+                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                        continue;
+                    }
+                    std::cerr << "Metrics: accept failed, no longer serving\n";
+                    close(fd);
+                    serving_ = false;
+                    return;
+                }
+#ifdef SO_NOSIGPIPE
+                int on = 1;
+                setsockopt(c, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+                pollfd p{ c, POLLIN, 0 };
+                if (poll(&p, 1, 1000) > 0) (void)!read(c, request, sizeof(request));
+                std::ostringstream body;
+                writePrometheus(body);
+                std::string text = body.str();
+                std::string reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                    std::to_string(text.size()) + "\r\nConnection: close\r\n\r\n" + text;
+                for (size_t sent = 0; sent < reply.size();) {
+                    // A scraper that hangs up early must not raise SIGPIPE in the host
+                    ssize_t n = send(c, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+                    if (n <= 0) break;
+                    sent += (size_t)n;
+                }
+                close(c);
+            }
+        }).detach();
+        return true;
+#else
+        (void)port;
+        std::cerr << "Metrics: serving is not supported on this platform\n";
+        return false;
+#endif
+    }
+
+} // namespace CRTZ
@@ -0,0 +1,203 @@
+// crtz_profile.cpp - SIGPROF sampling of script locations
+#include "crtz_profile.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <sys/time.h>
+#define CRTZ_HAVE_SIGPROF 1
+#endif
+
+namespace CRTZ {
+
+    thread_local ScriptLocation scriptLocation CRTZ_TLS_INITIAL_EXEC;
+
+    namespace {
+
+        std::mutex namesMutex;
+        struct Name {
+            std::string script;
+            std::string name;
+        };
+        std::unordered_map<std::string, uint32_t> nameIds;  // by script + '\0' + name
+        std::vector<Name> names(1);  // id 0 is "none"
+
+        // Sample counts by packed location, filled in by the signal handler:
+        // open addressing, keys claimed with compare-exchange, never removed
+        constexpr size_t kSlotBits = 14;
+        constexpr size_t kSlots = size_t(1) << kSlotBits;
+        constexpr size_t kMaxProbes = 64;
+        struct Slot {
+            std::atomic<uint64_t> key;
+            std::atomic<uint64_t> count;
+        };
+        Slot table[kSlots];
+        std::atomic<uint64_t> samples{ 0 };
+        std::atomic<uint64_t> outside{ 0 };  // thread was not in a script
+        std::atomic<uint64_t> dropped{ 0 };  // table full
+        std::atomic<bool> active{ false };
+        bool installed = false;
+        unsigned rate = 0;
+
+        // node:20 | method:20 | action:24, never 0 for a script location
+        uint64_t pack(uint32_t node, uint32_t action, uint32_t method) {
+            return (uint64_t)node << 44 | (uint64_t)method << 24 | std::min<uint32_t>(action, 0xFFFFFF);
+        }
+
+        void onSample(int) {
+            if (!active.load(std::memory_order_relaxed)) return;
+            int savedErrno = errno;
+            samples.fetch_add(1, std::memory_order_relaxed);
+            uint32_t node = scriptLocation.node;
+            uint32_t method = scriptLocation.method;
+            if (!node && !method) {
+                outside.fetch_add(1, std::memory_order_relaxed);
+                errno = savedErrno;
+                return;
+            }
+            uint64_t key = pack(node, scriptLocation.action, method);
+            size_t h = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - kSlotBits));
+            for (size_t probe = 0; probe < kMaxProbes; ++probe) {
+                Slot& s = table[(h + probe) & (kSlots - 1)];
+                uint64_t k = s.key.load(std::memory_order_relaxed);
+                if (k == 0 && s.key.compare_exchange_strong(k, key, std::memory_order_relaxed)) k = key;
+                if (k == key) {
+                    s.count.fetch_add(1, std::memory_order_relaxed);
+                    errno = savedErrno;
+                    return;
+                }
+            }
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            errno = savedErrno;
+        }
+
+        void printRow(std::ostream& out, uint64_t n, uint64_t total, const std::string& what) {
+            char buf[48];
+            std::snprintf(buf, sizeof(buf), "%10llu %6.1f%%  ", (unsigned long long)n, total ? 100.0 * n / total : 0.0);
+            out << buf << what << "\n";
+        }
+
+    } // namespace
+
+    uint32_t profileId(const std::string& script, const std::string& name) {
+        std::string key = script;
+        key.push_back('\0');
+        key += name;
+        std::lock_guard<std::mutex> lock(namesMutex);
+        auto it = nameIds.find(key);
+        if (it != nameIds.end()) return it->second;
+        if (names.size() >= kProfileMaxIds) return 0;
+        uint32_t id = (uint32_t)names.size();
+        names.push_back({ script, name });
+        nameIds.emplace(std::move(key), id);
+        return id;
+    }
+
+    bool Profiler::start(unsigned hz) {
+#ifdef CRTZ_HAVE_SIGPROF
+        if (hz == 0) hz = 100;
+        if (!installed) {
+            // The handler stays installed: a SIGPROF still pending after
+            // stop() must not hit the default action, which ends the process
+            struct sigaction sa {};
+            sa.sa_handler = onSample;
+            sa.sa_flags = SA_RESTART;
+            sigemptyset(&sa.sa_mask);
+            if (sigaction(SIGPROF, &sa, nullptr) != 0) {
+                std::cerr << "Profiler: cannot install the SIGPROF handler\n";
+                return false;
+            }
+            installed = true;
+        }
+        struct itimerval tv {};
+        tv.it_interval.tv_sec = 0;
+        tv.it_interval.tv_usec = hz >= 1000000 ? 1 : (suseconds_t)(1000000 / hz);
+        tv.it_value = tv.it_interval;
+        rate = hz;
+        active.store(true);
+        if (setitimer(ITIMER_PROF, &tv, nullptr) != 0) {
+            active.store(false);
+            std::cerr << "Profiler: cannot start the profiling timer\n";
+            return false;
+        }
+        return true;
+#else
+        (void)hz;
+        std::cerr << "Profiler: not supported on this platform\n";
+        return false;
+#endif
+    }
+
+    void Profiler::stop() {
+#ifdef CRTZ_HAVE_SIGPROF
+        struct itimerval tv {};
+        setitimer(ITIMER_PROF, &tv, nullptr);
+#endif
+        active.store(false);
+    }
+
+    bool Profiler::running() { return active.load(); }
+
+    void Profiler::reset() {
+        for (Slot& s : table) {
+            s.count.store(0, std::memory_order_relaxed);
+        }
+        samples.store(0);
+        outside.store(0);
+        dropped.store(0);
+    }
+
+    void Profiler::report(std::ostream& out, size_t top) {
+        struct Row {
+            uint64_t key;
+            uint64_t count;
+        };
+        std::vector<Row> rows;
+        for (Slot& s : table) {
+            uint64_t n = s.count.load(std::memory_order_relaxed);
+            if (n) rows.push_back({ s.key.load(std::memory_order_relaxed), n });
+        }
+        std::unordered_map<uint32_t, uint64_t> byNode;
+        for (const Row& r : rows) byNode[(uint32_t)(r.key >> 44)] += r.count;
+        std::vector<std::pair<uint32_t, uint64_t>> nodes(byNode.begin(), byNode.end());
+        auto hotter = [](const auto& a, const auto& b) { return a.second > b.second; };
+        std::sort(nodes.begin(), nodes.end(), hotter);
+        std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return a.count > b.count; });
+
+        uint64_t total = samples.load();
+        out << "Samples: " << total;
+        if (rate) out << " (timer at " << rate << " Hz of CPU time)";
+        out << ", outside scripts: " << outside.load() << ", dropped: " << dropped.load() << "\n";
+
+        std::lock_guard<std::mutex> lock(namesMutex);
+        auto nameOf = [](uint32_t id, const std::string& within = std::string()) {
+            if (id >= names.size()) return std::string("?");
+            const Name& n = names[id];
+            return n.script.empty() || n.script == within ? n.name : n.script + ": " + n.name;
+        };
+        out << "\n   samples      %  node\n";
+        for (size_t i = 0; i < nodes.size() && i < top; ++i) {
+            printRow(out, nodes[i].second, total, nodes[i].first ? nameOf(nodes[i].first) : std::string("(method called by the host)"));
+        }
+        out << "\n   samples      %  location\n";
+        for (size_t i = 0; i < rows.size() && i < top; ++i) {
+            uint32_t node = (uint32_t)(rows[i].key >> 44);
+            uint32_t method = (uint32_t)(rows[i].key >> 24) & (kProfileMaxIds - 1);
+            uint32_t action = (uint32_t)rows[i].key & 0xFFFFFF;
+            std::string where;
+            if (node) where = nameOf(node) + " action " + std::to_string(action);
+            // A method of the node's own script is shown without the script again
+            if (method) where += (where.empty() ? "" : " > ") + nameOf(method, node && node < names.size() ? names[node].script : std::string());
+            printRow(out, rows[i].count, total, where);
+        }
+    }
+
+} // namespace CRTZ
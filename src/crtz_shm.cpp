@@ -0,0 +1,129 @@
+// crtz_shm.cpp - shared-memory state segment
+#include "crtz_shm.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CRTZ_HAVE_SHM 1
+#endif
+
+namespace CRTZ {
+
+    StateSegment::~StateSegment() {
+#ifdef CRTZ_HAVE_SHM
+        if (base_) munmap(base_, size_);
+        if (owner_) shm_unlink(name_.c_str());
+#endif
+    }
+
+    std::shared_ptr<StateSegment> StateSegment::create(const std::string& name, uint32_t slotCount) {
+#ifdef CRTZ_HAVE_SHM
+        size_t size = sizeof(StateHeader) + alignof(StateSlot) + sizeof(StateSlot) * slotCount;
+        // Never take over a segment another process may still be exporting to
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0) {
+            if (errno == EEXIST) {
+                std::cerr << "State export: segment " << name << " already exists; another process is exporting to it, "
+                    "or it was left behind by one that crashed (remove it, e.g. /dev/shm" << name << ")\n";
+            } else {
+                std::cerr << "State export: shm_open(" << name << ") failed: " << std::strerror(errno) << "\n";
+            }
+            return nullptr;
+        }
+        if (ftruncate(fd, (off_t)size) != 0) {
+            std::cerr << "State export: could not size " << name << "\n";
+            close(fd);
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+        void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            std::cerr << "State export: mmap failed for " << name << "\n";
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+
+        std::shared_ptr<StateSegment> seg(new StateSegment());
+        seg->name_ = name;
+        seg->owner_ = true;
+        seg->base_ = base;
+        seg->size_ = size;
+        seg->header_ = static_cast<StateHeader*>(base);
+        seg->slots_ = reinterpret_cast<StateSlot*>(static_cast<char*>(base) + alignof(StateSlot));
+        for (uint32_t i = 0; i < slotCount; ++i) new (&seg->slots_[i]) StateSlot();
+        seg->header_->slotCount = slotCount;
+        seg->header_->slotSize = sizeof(StateSlot);
+        seg->header_->version = kStateVersion;
+        std::atomic_thread_fence(std::memory_order_release);
+        seg->header_->magic = kStateMagic;
+        return seg;
+#else
+        (void)slotCount;
+        std::cerr << "State export: shared memory is not supported on this platform (" << name << ")\n";
+        return nullptr;
+#endif
+    }
+
+    std::shared_ptr<StateSegment> StateSegment::open(const std::string& name) {
+#ifdef CRTZ_HAVE_SHM
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            std::cerr << "State export: no segment named " << name << "\n";
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(StateHeader) + alignof(StateSlot)) {
+            close(fd);
+            return nullptr;
+        }
+        void* base = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) return nullptr;
+
+        std::shared_ptr<StateSegment> seg(new StateSegment());
+        seg->name_ = name;
+        seg->base_ = base;
+        seg->size_ = (size_t)st.st_size;
+        seg->header_ = static_cast<StateHeader*>(base);
+        seg->slots_ = reinterpret_cast<StateSlot*>(static_cast<char*>(base) + alignof(StateSlot));
+        const StateHeader& h = *seg->header_;
+        size_t needed = sizeof(StateHeader) + alignof(StateSlot) + (size_t)h.slotSize * h.slotCount;
+        if (h.magic != kStateMagic || h.version != kStateVersion || h.slotSize != sizeof(StateSlot) || needed > seg->size_) {
+            std::cerr << "State export: " << name << " has an incompatible layout\n";
+            return nullptr;
+        }
+        return seg;
+#else
+        std::cerr << "State export: shared memory is not supported on this platform (" << name << ")\n";
+        return nullptr;
+#endif
+    }
+
+    StateSlot* StateSegment::acquireSlot() {
+        if (!owner_) return nullptr;
+        for (uint32_t i = 0; i < header_->slotCount; ++i) {
+            uint32_t expected = 0;
+            if (slots_[i].inUse.compare_exchange_strong(expected, 1)) return &slots_[i];
+        }
+        return nullptr;
+    }
+
+    void StateSegment::releaseSlot(StateSlot* slot) {
+        if (!slot) return;
+        beginWrite(*slot);
+        slot->node[0] = '\0';
+        slot->player[0] = '\0';
+        slot->varCount = 0;
+        endWrite(*slot);
+        slot->inUse.store(0, std::memory_order_release);
+    }
+
+} // namespace CRTZ
@@ -0,0 +1,426 @@
+// crtz_table.cpp - compiled, memory-mapped data and string tables
+#include "crtz_table.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <unordered_map>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CRTZ_HAVE_MMAP 1
+#endif
+
+namespace CRTZ {
+
+    namespace {
+
+        const char kTableMagic[8] = { 'C', 'R', 'T', 'Z', 'T', 'B', 'L', '1' };
+        const char kStringsMagic[8] = { 'C', 'R', 'T', 'Z', 'S', 'T', 'R', '1' };
+
+        // One record; handles "quoted, fields" with "" escapes for CSV
+        bool readRecord(std::istream& in, char delim, std::vector<std::string>& fields) {
+            fields.clear();
+            std::string line;
+            if (!std::getline(in, line)) return false;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            std::string cur;
+            bool quoted = false;
+            for (size_t i = 0; i < line.size(); ++i) {
+                char c = line[i];
+                if (quoted) {
+                    if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') { cur.push_back('"'); ++i; }
+                    else if (c == '"') quoted = false;
+                    else cur.push_back(c);
+                } else if (c == '"' && cur.empty() && delim == ',') {
+                    quoted = true;
+                } else if (c == delim) {
+                    fields.push_back(cur);
+                    cur.clear();
+                } else {
+                    cur.push_back(c);
+                }
+            }
+            fields.push_back(cur);
+            return true;
+        }
+
+        bool parseInt(const std::string& s, int64_t& out) {
+            if (s.empty()) { out = 0; return true; }
+            char* end = nullptr;
+            errno = 0;
+            long long v = std::strtoll(s.c_str(), &end, 10);
+            if (errno != 0 || end == s.c_str() || *end != '\0') return false;
+            out = v;
+            return true;
+        }
+
+        size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+        // Binaries are written next to their final name and renamed over it
+        // once complete, so a reader never maps a half-written file
+        std::string tempPath(const std::string& binary) {
+#ifdef CRTZ_HAVE_MMAP
+            return binary + ".tmp" + std::to_string(getpid());
+#else
+            return binary + ".tmp";
+#endif
+        }
+
+        bool replaceWith(std::ofstream& out, const std::string& temp, const std::string& binary) {
+            out.close();
+            std::error_code ec;
+            if (!out || (std::filesystem::rename(temp, binary, ec), ec)) {
+                std::filesystem::remove(temp, ec);
+                return false;
+            }
+            return true;
+        }
+
+        // `rows + 1` ascending string offsets from 0, the last within `bytes`
+        bool validOffsets(const uint32_t* offs, size_t rows, size_t bytes) {
+            if (offs[0] != 0) return false;
+            for (size_t r = 0; r < rows; ++r) {
+                if (offs[r + 1] < offs[r]) return false;
+            }
+            return offs[rows] <= bytes;
+        }
+
+    } // namespace
+
+    MappedFile::~MappedFile() {
+#ifdef CRTZ_HAVE_MMAP
+        if (mapped_ && base_) munmap(base_, size_);
+#endif
+    }
+
+    bool MappedFile::open(const std::string& path) {
+#ifdef CRTZ_HAVE_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* base = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) return false;
+        base_ = base;
+        size_ = (size_t)st.st_size;
+        mapped_ = true;
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return false;
+        heap_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        base_ = heap_.data();
+        size_ = heap_.size();
+#endif
+        return size_ > 0;
+    }
+
+    bool needsRebuild(const std::string& source, const std::string& binary) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        if (!fs::exists(binary, ec)) return true;
+        return fs::exists(source, ec) && fs::last_write_time(binary, ec) < fs::last_write_time(source, ec);
+    }
+
+    bool Table::compile(const std::string& source, const std::string& binary) {
+        std::ifstream in(source);
+        if (!in) {
+            std::cerr << "Table: cannot read " << source << "\n";
+            return false;
+        }
+        std::string ext = std::filesystem::path(source).extension().string();
+        char delim = ext == ".csv" ? ',' : '\t';
+
+        std::vector<std::string> names;
+        if (!readRecord(in, delim, names)) {
+            std::cerr << "Table: " << source << " is empty\n";
+            return false;
+        }
+        size_t cols = names.size();
+        std::vector<std::vector<std::string>> cells(cols);
+        std::vector<std::string> fields;
+        while (readRecord(in, delim, fields)) {
+            if (fields.size() == 1 && fields[0].empty()) continue;
+            fields.resize(cols);
+            for (size_t c = 0; c < cols; ++c) cells[c].push_back(std::move(fields[c]));
+        }
+        size_t rows = cols ? cells[0].size() : 0;
+
+        std::vector<bool> isInt(cols, true);
+        std::vector<std::vector<int64_t>> ints(cols);
+        for (size_t c = 0; c < cols; ++c) {
+            ints[c].resize(rows);
+            for (size_t r = 0; r < rows && isInt[c]; ++r) isInt[c] = parseInt(cells[c][r], ints[c][r]);
+        }
+
+        // Sorted by id so lookups can binary search
+        std::vector<size_t> order(rows);
+        std::iota(order.begin(), order.end(), 0);
+        auto idIt = std::find(names.begin(), names.end(), "id");
+        if (idIt != names.end() && isInt[idIt - names.begin()]) {
+            const std::vector<int64_t>& ids = ints[idIt - names.begin()];
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return ids[a] < ids[b]; });
+        }
+
+        std::vector<TableColumn> desc(cols);
+        size_t offset = align8(sizeof(TableHeader) + sizeof(TableColumn) * cols);
+        for (size_t c = 0; c < cols; ++c) {
+            std::memset(&desc[c], 0, sizeof(TableColumn));
+            std::strncpy(desc[c].name, names[c].c_str(), sizeof(desc[c].name) - 1);
+            desc[c].type = isInt[c] ? TableInt : TableString;
+            desc[c].offset = offset;
+            if (isInt[c]) {
+                desc[c].size = rows * sizeof(int64_t);
+            } else {
+                size_t bytes = 0;
+                for (auto& s : cells[c]) bytes += s.size();
+                if (bytes > UINT32_MAX) {
+                    std::cerr << "Table: column " << names[c] << " of " << source << " is too large\n";
+                    return false;
+                }
+                desc[c].size = (rows + 1) * sizeof(uint32_t) + bytes;
+            }
+            offset = align8(offset + desc[c].size);
+        }
+
+        std::string temp = tempPath(binary);
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "Table: cannot write " << binary << "\n";
+            return false;
+        }
+        TableHeader h;
+        std::memcpy(h.magic, kTableMagic, sizeof(h.magic));
+        h.version = kTableVersion;
+        h.cols = (uint32_t)cols;
+        h.rows = rows;
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        out.write(reinterpret_cast<const char*>(desc.data()), sizeof(TableColumn) * cols);
+        auto pad = [&out]() {
+            static const char zeros[8] = {};
+            size_t at = (size_t)out.tellp();
+            out.write(zeros, align8(at) - at);
+        };
+        for (size_t c = 0; c < cols; ++c) {
+            pad();
+            if (isInt[c]) {
+                for (size_t r : order) out.write(reinterpret_cast<const char*>(&ints[c][r]), sizeof(int64_t));
+            } else {
+                uint32_t at = 0;
+                out.write(reinterpret_cast<const char*>(&at), sizeof(at));
+                for (size_t r : order) {
+                    at += (uint32_t)cells[c][r].size();
+                    out.write(reinterpret_cast<const char*>(&at), sizeof(at));
+                }
+                for (size_t r : order) out.write(cells[c][r].data(), cells[c][r].size());
+            }
+        }
+        pad();
+        if (!replaceWith(out, temp, binary)) {
+            std::cerr << "Table: cannot write " << binary << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    std::shared_ptr<Table> Table::load(const std::string& source) {
+        std::string binary = source + ".crtzt";
+        if (needsRebuild(source, binary)) {
+            std::error_code ec;
+            if (!std::filesystem::exists(source, ec)) {
+                std::cerr << "Table: " << source << " not found\n";
+                return nullptr;
+            }
+            if (!compile(source, binary)) return nullptr;
+        }
+        return open(binary);
+    }
+
+    std::shared_ptr<Table> Table::open(const std::string& binary) {
+        std::shared_ptr<Table> t(new Table());
+        if (!t->file_.open(binary)) {
+            std::cerr << "Table: cannot map " << binary << "\n";
+            return nullptr;
+        }
+        size_t size = t->file_.size();
+        if (size < sizeof(TableHeader)) return nullptr;
+        t->header_ = reinterpret_cast<const TableHeader*>(t->file_.data());
+        t->columns_ = reinterpret_cast<const TableColumn*>(t->file_.data() + sizeof(TableHeader));
+        const TableHeader& h = *t->header_;
+        if (std::memcmp(h.magic, kTableMagic, sizeof(h.magic)) != 0 || h.version != kTableVersion ||
+            sizeof(TableHeader) + sizeof(TableColumn) * (size_t)h.cols > size) {
+            std::cerr << "Table: " << binary << " is not a compatible table\n";
+            return nullptr;
+        }
+        // Everything a lookup reads must lie inside the file: columns
+        // after the descriptors, int columns exactly `rows` values, string
+        // offsets ascending and within their column
+        size_t data = sizeof(TableHeader) + sizeof(TableColumn) * (size_t)h.cols;
+        for (uint32_t c = 0; c < h.cols; ++c) {
+            const TableColumn& col = t->columns_[c];
+            bool ok = std::memchr(col.name, '\0', sizeof(col.name)) != nullptr &&
+                col.offset % 8 == 0 && col.offset >= data && col.offset <= size && col.size <= size - col.offset;
+            if (ok && col.type == TableInt) {
+                ok = h.rows <= col.size / sizeof(int64_t) && col.size == h.rows * sizeof(int64_t);
+            } else if (ok && col.type == TableString) {
+                const uint32_t* offs = reinterpret_cast<const uint32_t*>(t->file_.data() + col.offset);
+                ok = h.rows < col.size / sizeof(uint32_t) &&
+                    validOffsets(offs, (size_t)h.rows, col.size - (h.rows + 1) * sizeof(uint32_t));
+            } else {
+                ok = false;
+            }
+            if (!ok) {
+                std::cerr << "Table: " << binary << " is corrupt (column " << c << ")\n";
+                return nullptr;
+            }
+        }
+        int id = t->column("id");
+        if (id >= 0 && !t->isString(id)) t->idColumn_ = id;
+        return t;
+    }
+
+    int Table::column(const std::string& name) const {
+        for (uint32_t c = 0; c < header_->cols; ++c) {
+            if (name == columns_[c].name) return (int)c;
+        }
+        return -1;
+    }
+
+    long long Table::findRow(long long id) const {
+        if (idColumn_ < 0) return id >= 0 && (size_t)id < rows() ? id : -1;
+        const int64_t* ids = reinterpret_cast<const int64_t*>(file_.data() + columns_[idColumn_].offset);
+        const int64_t* end = ids + rows();
+        const int64_t* it = std::lower_bound(ids, end, (int64_t)id);
+        return it != end && *it == id ? (long long)(it - ids) : -1;
+    }
+
+    std::string StringTable::escape(std::string_view text) {
+        std::string out;
+        out.reserve(text.size());
+        for (char c : text) {
+            if (c == '\\') out += "\\\\";
+            else if (c == '\n') out += "\\n";
+            else if (c == '\t') out += "\\t";
+            else out.push_back(c);
+        }
+        return out;
+    }
+
+    std::string StringTable::unescape(std::string_view text) {
+        std::string out;
+        out.reserve(text.size());
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] != '\\' || i + 1 == text.size()) { out.push_back(text[i]); continue; }
+            char c = text[++i];
+            out.push_back(c == 'n' ? '\n' : c == 't' ? '\t' : c);
+        }
+        return out;
+    }
+
+    bool StringTable::compile(const std::string& source, const std::string& binary,
+        const std::vector<std::string>& keys, uint64_t fingerprint) {
+        std::ifstream in(source);
+        if (!in) {
+            std::cerr << "Strings: cannot read " << source << "\n";
+            return false;
+        }
+        std::unordered_map<std::string, size_t> index;
+        for (size_t i = 0; i < keys.size(); ++i) index[keys[i]] = i;
+        std::vector<std::string> text(keys.size());
+        std::string line;
+        size_t unknown = 0;
+        while (std::getline(in, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            size_t tab = line.find('\t');
+            if (line.empty() || line[0] == '#' || tab == std::string::npos) continue;
+            auto it = index.find(line.substr(0, tab));
+            if (it == index.end()) { unknown++; continue; }
+            text[it->second] = unescape(std::string_view(line).substr(tab + 1));
+        }
+        if (unknown) std::cerr << "Strings: " << source << " has " << unknown << " keys the script does not use\n";
+
+        std::string temp = tempPath(binary);
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "Strings: cannot write " << binary << "\n";
+            return false;
+        }
+        StringTableHeader h;
+        std::memcpy(h.magic, kStringsMagic, sizeof(h.magic));
+        h.version = kTableVersion;
+        h.count = (uint32_t)keys.size();
+        h.fingerprint = fingerprint;
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        uint32_t at = 0;
+        out.write(reinterpret_cast<const char*>(&at), sizeof(at));
+        for (auto& t : text) {
+            at += (uint32_t)t.size();
+            out.write(reinterpret_cast<const char*>(&at), sizeof(at));
+        }
+        for (auto& t : text) out.write(t.data(), t.size());
+        if (!replaceWith(out, temp, binary)) {
+            std::cerr << "Strings: cannot write " << binary << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    std::shared_ptr<StringTable> StringTable::load(const std::string& source,
+        const std::vector<std::string>& keys, uint64_t fingerprint) {
+        std::string ext = std::filesystem::path(source).extension().string();
+        if (ext == ".crtzl") {
+            auto t = open(source, fingerprint);
+            if (!t) std::cerr << "Strings: " << source << " does not match this script; rebuild it from its source\n";
+            return t;
+        }
+        std::string binary = source + ".crtzl";
+        if (!needsRebuild(source, binary)) {
+            auto t = open(binary, fingerprint);
+            if (t) return t;
+        }
+        std::error_code ec;
+        if (!std::filesystem::exists(source, ec)) {
+            std::cerr << "Strings: " << source << " not found\n";
+            return nullptr;
+        }
+        if (!compile(source, binary, keys, fingerprint)) return nullptr;
+        return open(binary, fingerprint);
+    }
+
+    std::shared_ptr<StringTable> StringTable::open(const std::string& binary, uint64_t fingerprint) {
+        std::shared_ptr<StringTable> t(new StringTable());
+        if (!t->file_.open(binary) || t->file_.size() < sizeof(StringTableHeader)) {
+            std::cerr << "Strings: cannot map " << binary << "\n";
+            return nullptr;
+        }
+        const StringTableHeader& h = *reinterpret_cast<const StringTableHeader*>(t->file_.data());
+        if (std::memcmp(h.magic, kStringsMagic, sizeof(h.magic)) != 0 || h.version != kTableVersion ||
+            sizeof(StringTableHeader) + (h.count + 1ull) * sizeof(uint32_t) > t->file_.size()) {
+            std::cerr << "Strings: " << binary << " is not a compatible string table\n";
+            return nullptr;
+        }
+        if (h.fingerprint != fingerprint) return nullptr;  // built for another version of the script
+        t->header_ = &h;
+        t->offsets_ = reinterpret_cast<const uint32_t*>(t->file_.data() + sizeof(StringTableHeader));
+        t->bytes_ = reinterpret_cast<const char*>(t->offsets_ + h.count + 1);
+        size_t text = t->file_.size() - sizeof(StringTableHeader) - (h.count + 1ull) * sizeof(uint32_t);
+        if (!validOffsets(t->offsets_, h.count, text)) {
+            std::cerr << "Strings: " << binary << " is corrupt\n";
+            return nullptr;
+        }
+        return t;
+    }
+
+} // namespace CRTZ
@@ -0,0 +1,202 @@
+// crtz_test.cpp - parallel golden-transcript runner for script directories
+#include "crtz_test.hpp"
+#include "crtz_lang.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace CRTZ {
+
+    namespace {
+
+        struct TestCase {
+            std::string name;  // script path relative to the directory, without .crtz
+            std::string script;
+            std::string choices;   // empty: no input
+            std::string expected;
+            std::string error;     // empty: the session must not stop early
+        };
+
+        struct TestResult {
+            bool compiled = false;
+            bool passed = false;
+            std::string stopped;   // why the session was suspended or failed
+            std::string errors;    // runtime messages of the session
+            std::string actual;
+            std::string expected;
+            double ms = 0;
+        };
+
+        bool readFile(const std::string& path, std::string& out) {
+            std::ifstream in(path, std::ios::binary);
+            if (!in) return false;
+            std::ostringstream buf;
+            buf << in.rdbuf();
+            out = buf.str();
+            return true;
+        }
+
+        std::vector<std::string> splitLines(const std::string& text) {
+            std::vector<std::string> lines;
+            size_t start = 0;
+            while (start < text.size()) {
+                size_t nl = text.find('\n', start);
+                if (nl == std::string::npos) nl = text.size();
+                lines.push_back(text.substr(start, nl - start));
+                start = nl + 1;
+            }
+            return lines;
+        }
+
+        // The differing middle of two transcripts, after their common first
+        // and last lines: "-" expected, "+" actual
+        void writeDiff(std::ostream& out, const std::string& expected, const std::string& actual, size_t maxLines) {
+            std::vector<std::string> a = splitLines(expected), b = splitLines(actual);
+            size_t head = 0;
+            while (head < a.size() && head < b.size() && a[head] == b[head]) head++;
+            size_t tail = 0;
+            while (tail < a.size() - head && tail < b.size() - head && a[a.size() - 1 - tail] == b[b.size() - 1 - tail]) tail++;
+            out << "      at line " << head + 1 << ":\n";
+            auto side = [&](const std::vector<std::string>& lines, const char* mark) {
+                size_t end = lines.size() - tail;
+                for (size_t i = head; i < end && i < head + maxLines; ++i) out << "      " << mark << " " << lines[i] << "\n";
+                if (end > head + maxLines) out << "      " << mark << " ... " << end - head - maxLines << " more\n";
+            };
+            side(a, "-");
+            side(b, "+");
+            if (a.size() == b.size() && head == a.size() && expected != actual) {
+                out << "      (the transcripts differ only in the final newline)\n";
+            }
+        }
+
+        std::vector<TestCase> discover(const std::string& dir, bool update, std::error_code& ec) {
+            namespace fs = std::filesystem;
+            std::vector<TestCase> tests;
+            for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+                if (!it->is_regular_file() || it->path().extension() != ".crtz") continue;
+                fs::path base = it->path();
+                base.replace_extension();
+                TestCase t;
+                t.script = it->path().string();
+                t.expected = base.string() + ".expected";
+                if (fs::exists(base.string() + ".choices")) t.choices = base.string() + ".choices";
+                if (fs::exists(base.string() + ".error")) t.error = base.string() + ".error";
+                // Scripts without a transcript are imports or work in progress;
+                // --update records one for every script that has choices
+                if (!fs::exists(t.expected) && !(update && !t.choices.empty())) continue;
+                t.name = fs::relative(base, dir, ec).generic_string();
+                if (ec) t.name = base.generic_string();
+                ec.clear();
+                tests.push_back(std::move(t));
+            }
+            std::sort(tests.begin(), tests.end(), [](const TestCase& a, const TestCase& b) { return a.name < b.name; });
+            return tests;
+        }
+
+        void runOne(const Engine& engine, const TestCase& t, const TestOptions& options, TestResult& r) {
+            auto start = std::chrono::steady_clock::now();
+            Script script = engine.compileFile(t.script);
+            r.compiled = script.valid();
+            if (r.compiled) {
+                std::ostringstream out, errors;
+                std::ifstream file;
+                std::istringstream none;
+                std::istream* input = &none;
+                if (!t.choices.empty()) {
+                    file.open(t.choices);
+                    input = &file;
+                }
+                Session session = script.newSession(options.playerName);
+                session.setOutput(&out);
+                session.setErrorOutput(&errors);
+                Limits limits;
+                limits.fuel = options.fuel;
+                limits.maxCallDepth = options.maxCallDepth;
+                session.setLimits(limits);
+                session.seed(options.seed);
+                session.run(*input);
+                r.actual = out.str();
+                r.errors = errors.str();
+                if (session.status() == Session::Suspended) r.stopped = "suspended: " + session.error();
+                else if (session.status() == Session::Failed) r.stopped = "failed: " + session.error();
+            }
+            r.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (!r.compiled) return;
+            std::string reason;
+            if (!t.error.empty()) {
+                readFile(t.error, reason);
+                while (!reason.empty() && (reason.back() == '\n' || reason.back() == '\r')) reason.pop_back();
+                if (r.stopped.empty()) r.stopped = "ran to the end, expected it to stop: " + reason;
+                else if (r.stopped == reason) r.stopped.clear();
+                else r.stopped += " (expected " + reason + ")";
+            }
+            if (!r.stopped.empty()) return;
+            if (options.update) {
+                std::ofstream out(t.expected, std::ios::binary | std::ios::trunc);
+                r.passed = (bool)(out << r.actual);
+            } else {
+                r.passed = readFile(t.expected, r.expected) && r.expected == r.actual;
+            }
+        }
+
+    } // namespace
+
+    int runTests(const std::string& dir, const TestOptions& options, std::ostream& report) {
+        std::error_code ec;
+        std::vector<TestCase> tests = discover(dir, options.update, ec);
+        if (ec) {
+            std::cerr << "Test: cannot read " << dir << ": " << ec.message() << "\n";
+            return -1;
+        }
+
+        Engine engine;
+        engine.setHeadless(true);
+        std::vector<TestResult> results(tests.size());
+        unsigned jobs = options.jobs ? options.jobs : std::max(1u, std::thread::hardware_concurrency());
+        jobs = (unsigned)std::min<size_t>(jobs, std::max<size_t>(tests.size(), 1));
+
+        auto start = std::chrono::steady_clock::now();
+        std::atomic<size_t> next{ 0 };
+        auto worker = [&] {
+            for (size_t i; (i = next.fetch_add(1)) < tests.size();) runOne(engine, tests[i], options, results[i]);
+        };
+        std::vector<std::thread> pool;
+        for (unsigned j = 1; j < jobs; ++j) pool.emplace_back(worker);
+        worker();
+        for (auto& t : pool) t.join();
+        double wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        int failed = 0;
+        char line[64];
+        for (size_t i = 0; i < tests.size(); ++i) {
+            const TestResult& r = results[i];
+            const char* verdict = !r.compiled ? "ERROR" : !r.stopped.empty() ? "FAIL " : options.update ? (r.passed ? "WROTE" : "ERROR") : r.passed ? "PASS " : "FAIL ";
+            std::snprintf(line, sizeof(line), "%s %9.2f ms  ", verdict, r.ms);
+            report << line << tests[i].name << "\n";
+            if (!r.compiled) report << "      does not compile\n";
+            else if (!r.stopped.empty()) report << "      session " << r.stopped << "\n";
+            else if (options.update && !r.passed) report << "      cannot write " << tests[i].expected << "\n";
+            else if (!r.passed) writeDiff(report, r.expected, r.actual, options.diffLines);
+            if (!r.passed && !r.errors.empty()) {
+                std::vector<std::string> lines = splitLines(r.errors);
+                for (size_t k = 0; k < lines.size() && k < options.diffLines; ++k) report << "      ! " << lines[k] << "\n";
+                if (lines.size() > options.diffLines) report << "      ! ... " << lines.size() - options.diffLines << " more\n";
+            }
+            if (!r.passed) failed++;
+        }
+        std::snprintf(line, sizeof(line), "%.1f ms", wall);
+        report << tests.size() - failed << " " << (options.update ? "written" : "passed") << ", " << failed << " failed ("
+               << tests.size() << " tests, " << jobs << " threads, " << line << ")\n";
+        return failed;
+    }
+
+} // namespace CRTZ
@@ -0,0 +1,321 @@
+// crtz_text.cpp - dictionary-compressed text blocks
+#include "crtz_text.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace CRTZ {
+
+    namespace {
+
+        const size_t kMinMatch = 4;
+        const size_t kMaxOffset = 0xFFFF;
+        const size_t kGram = 8;
+        const size_t kTrainSample = 2 * 1024 * 1024;
+
+        // Frequent phrases of the corpus: 8-byte grams seen at least three
+        // times, each grown to the right while the following grams are
+        // frequent too, most frequent first
+        std::string trainDictionary(const std::string& corpus) {
+            std::string_view sample(corpus.data(), std::min(corpus.size(), kTrainSample));
+            if (sample.size() < kGram) return std::string();
+            std::unordered_map<std::string_view, std::pair<uint32_t, uint32_t>> grams;  // count, first position
+            for (size_t i = 0; i + kGram <= sample.size(); ++i) {
+                auto& g = grams.try_emplace(sample.substr(i, kGram), 0u, (uint32_t)i).first->second;
+                g.first++;
+            }
+            std::vector<std::pair<uint32_t, uint32_t>> ranked;
+            for (auto& kv : grams) {
+                if (kv.second.first >= 3) ranked.push_back(kv.second);
+            }
+            std::sort(ranked.begin(), ranked.end(), [](auto& a, auto& b) {
+                return a.first != b.first ? a.first > b.first : a.second < b.second;
+            });
+
+            std::string dict;
+            std::unordered_set<std::string_view> covered;
+            for (auto& r : ranked) {
+                if (dict.size() >= kTextDictSize) break;
+                size_t start = r.second;
+                if (covered.count(sample.substr(start, kGram))) continue;
+                size_t end = start + kGram;
+                while (end < sample.size() && end - start < 64) {
+                    auto it = grams.find(sample.substr(end + 1 - kGram, kGram));
+                    if (it == grams.end() || it->second.first < 3) break;
+                    end++;
+                }
+                end = std::min(end, start + (kTextDictSize - dict.size()));
+                for (size_t i = start; i + kGram <= end; ++i) covered.insert(sample.substr(i, kGram));
+                dict.append(sample.substr(start, end - start));
+            }
+            return dict;
+        }
+
+        void putLength(std::vector<uint8_t>& out, size_t n) {
+            for (; n >= 255; n -= 255) out.push_back(255);
+            out.push_back((uint8_t)n);
+        }
+
+        size_t getLength(const uint8_t*& p) {
+            size_t n = 0;
+            uint8_t b;
+            do { b = *p++; n += b; } while (b == 255);
+            return n;
+        }
+
+        // LZ77 with the dictionary as history. Sequences are a token (high
+        // nibble literal count, low nibble match length - 4, 15 = more bytes
+        // follow), the literals, then a 2-byte offset; the last sequence has
+        // literals only.
+        void compressBlock(const std::string& dict, std::string_view block, std::vector<uint8_t>& out) {
+            std::string hist = dict;
+            hist.append(block);
+            const size_t kHashBits = 14;
+            const int kChain = 16;
+            std::vector<int32_t> head(size_t(1) << kHashBits, -1);
+            std::vector<int32_t> prev(hist.size(), -1);
+            auto hash = [&hist](size_t i) {
+                uint32_t v;
+                std::memcpy(&v, hist.data() + i, 4);
+                return (v * 2654435761u) >> (32 - kHashBits);
+            };
+            auto insert = [&](size_t i) {
+                if (i + kMinMatch > hist.size()) return;
+                uint32_t h = hash(i);
+                prev[i] = head[h];
+                head[h] = (int32_t)i;
+            };
+            for (size_t i = 0; i < dict.size(); ++i) insert(i);
+
+            size_t litStart = dict.size();
+            size_t i = dict.size();
+            auto emit = [&](size_t litEnd, size_t matchLen, size_t offset) {
+                size_t lits = litEnd - litStart;
+                size_t ml = matchLen ? matchLen - kMinMatch : 0;
+                out.push_back((uint8_t)((std::min<size_t>(lits, 15) << 4) | std::min<size_t>(ml, 15)));
+                if (lits >= 15) putLength(out, lits - 15);
+                out.insert(out.end(), hist.begin() + litStart, hist.begin() + litEnd);
+                if (!matchLen) return;
+                out.push_back((uint8_t)(offset & 0xFF));
+                out.push_back((uint8_t)(offset >> 8));
+                if (ml >= 15) putLength(out, ml - 15);
+            };
+            while (i + kMinMatch <= hist.size()) {
+                size_t bestLen = 0, bestOff = 0;
+                int32_t cand = head[hash(i)];
+                for (int n = 0; cand >= 0 && n < kChain; ++n, cand = prev[cand]) {
+                    size_t off = i - (size_t)cand;
+                    if (off > kMaxOffset) break;
+                    size_t len = 0;
+                    while (i + len < hist.size() && hist[cand + len] == hist[i + len]) len++;
+                    if (len > bestLen) { bestLen = len; bestOff = off; }
+                }
+                if (bestLen < kMinMatch) {
+                    insert(i++);
+                    continue;
+                }
+                emit(i, bestLen, bestOff);
+                for (size_t k = 0; k < bestLen; ++k) insert(i + k);
+                i += bestLen;
+                litStart = i;
+            }
+            emit(hist.size(), 0, 0);
+        }
+
+        // Code lengths (at most maxBits) for byte frequencies; frequencies
+        // are flattened and the tree rebuilt until it fits
+        std::vector<uint8_t> huffmanLengths(std::vector<uint64_t> freq, unsigned maxBits) {
+            std::vector<uint8_t> lengths(256, 0);
+            for (;;) {
+                struct Item { uint64_t freq; int node; };
+                auto cmp = [](const Item& a, const Item& b) { return a.freq > b.freq; };
+                std::priority_queue<Item, std::vector<Item>, decltype(cmp)> heap(cmp);
+                std::vector<int> parent(512, -1);
+                int next = 256;
+                for (int sym = 0; sym < 256; ++sym) {
+                    if (freq[sym]) heap.push({ freq[sym], sym });
+                }
+                if (heap.size() == 1) { lengths[heap.top().node] = 1; return lengths; }
+                while (heap.size() > 1) {
+                    Item a = heap.top(); heap.pop();
+                    Item b = heap.top(); heap.pop();
+                    parent[a.node] = parent[b.node] = next;
+                    heap.push({ a.freq + b.freq, next++ });
+                }
+                unsigned longest = 0;
+                for (int sym = 0; sym < 256; ++sym) {
+                    unsigned depth = 0;
+                    for (int n = sym; freq[sym] && parent[n] >= 0; n = parent[n]) depth++;
+                    lengths[sym] = (uint8_t)depth;
+                    longest = std::max(longest, depth);
+                }
+                if (longest <= maxBits) return lengths;
+                for (auto& f : freq) if (f) f = (f >> 1) | 1;
+            }
+        }
+
+        // Canonical codes: shorter codes first, ties by symbol
+        std::vector<uint32_t> canonicalCodes(const std::vector<uint8_t>& lengths) {
+            std::vector<int> order;
+            for (int sym = 0; sym < 256; ++sym) if (lengths[sym]) order.push_back(sym);
+            std::sort(order.begin(), order.end(), [&](int a, int b) {
+                return lengths[a] != lengths[b] ? lengths[a] < lengths[b] : a < b;
+            });
+            std::vector<uint32_t> codes(256, 0);
+            uint32_t code = 0;
+            unsigned len = order.empty() ? 0 : lengths[order[0]];
+            for (int sym : order) {
+                code <<= lengths[sym] - len;
+                len = lengths[sym];
+                codes[sym] = code++;
+            }
+            return codes;
+        }
+
+    } // namespace
+
+    TextStore TextStore::build(const std::vector<std::string_view>& texts) {
+        TextStore store;
+        std::string corpus;
+        for (auto t : texts) corpus.append(t);
+        store.originalBytes_ = corpus.size();
+        store.dict_ = trainDictionary(corpus);
+
+        // LZ pass: blocks of whole strings
+        std::vector<std::vector<uint8_t>> lz;
+        std::vector<uint64_t> freq(256, 0);
+        store.start_.resize(texts.size());
+        std::string block;
+        bool open = false;
+        auto flush = [&]() {
+            lz.emplace_back();
+            compressBlock(store.dict_, block, lz.back());
+            for (uint8_t b : lz.back()) freq[b]++;
+            store.blockSize_.push_back((uint32_t)block.size());
+            store.blockLz_.push_back((uint32_t)lz.back().size());
+            block.clear();
+            open = false;
+        };
+        for (size_t id = 0; id < texts.size(); ++id) {
+            if (!block.empty() && block.size() + texts[id].size() > kTextBlockSize) flush();
+            if (!open) {
+                store.blockFirstId_.push_back((uint32_t)id);
+                open = true;
+            }
+            store.start_[id] = (uint32_t)block.size();
+            block.append(texts[id]);
+        }
+        if (open) flush();
+
+        // Entropy pass: one Huffman table for all blocks, MSB-first bits
+        std::vector<uint8_t> lengths = huffmanLengths(freq, kCodeBits);
+        std::vector<uint32_t> codes = canonicalCodes(lengths);
+        store.decode_.assign(size_t(1) << kCodeBits, 0);
+        for (int sym = 0; sym < 256; ++sym) {
+            if (!lengths[sym]) continue;
+            unsigned shift = kCodeBits - lengths[sym];
+            for (uint32_t k = codes[sym] << shift; k < (codes[sym] + 1) << shift; ++k) {
+                store.decode_[k] = (uint16_t)(sym << 4 | lengths[sym]);
+            }
+        }
+        store.blockStart_.push_back(0);
+        for (auto& stream : lz) {
+            uint64_t acc = 0;
+            unsigned bits = 0;
+            for (uint8_t b : stream) {
+                acc = (acc << lengths[b]) | codes[b];
+                bits += lengths[b];
+                while (bits >= 8) store.data_.push_back((uint8_t)(acc >> (bits -= 8)));
+            }
+            if (bits) store.data_.push_back((uint8_t)(acc << (8 - bits)));
+            store.blockStart_.push_back((uint32_t)store.data_.size());
+        }
+        store.data_.shrink_to_fit();
+        return store;
+    }
+
+    size_t TextStore::compressedBytes() const {
+        return dict_.size() + data_.size() + decode_.size() * sizeof(uint16_t) +
+            (blockStart_.size() + blockSize_.size() + blockLz_.size() + blockFirstId_.size() + start_.size()) * sizeof(uint32_t);
+    }
+
+    size_t TextStore::blockOf(size_t id) const {
+        return (size_t)(std::upper_bound(blockFirstId_.begin(), blockFirstId_.end(), (uint32_t)id) - blockFirstId_.begin()) - 1;
+    }
+
+    void TextStore::decodeBlock(size_t block, std::string& out) const {
+        // Huffman -> LZ stream
+        thread_local std::vector<uint8_t> stream;
+        stream.resize(blockLz_[block]);
+        const uint8_t* in = data_.data() + blockStart_[block];
+        const uint8_t* inEnd = data_.data() + blockStart_[block + 1];
+        uint64_t buf = 0;
+        int have = 0;
+        for (auto& sym : stream) {
+            while (have <= 56) {
+                buf |= uint64_t(in < inEnd ? *in++ : 0) << (56 - have);
+                have += 8;
+            }
+            uint16_t e = decode_[buf >> (64 - kCodeBits)];
+            sym = (uint8_t)(e >> 4);
+            buf <<= (e & 15);
+            have -= (e & 15);
+        }
+
+        // LZ stream -> text
+        out.clear();
+        out.reserve(blockSize_[block]);
+        const uint8_t* p = stream.data();
+        const uint8_t* end = p + stream.size();
+        size_t dictSize = dict_.size();
+        while (p < end) {
+            uint8_t token = *p++;
+            size_t lits = token >> 4;
+            if (lits == 15) lits += getLength(p);
+            out.append(reinterpret_cast<const char*>(p), lits);
+            p += lits;
+            if (p >= end) break;
+            size_t offset = p[0] | (size_t(p[1]) << 8);
+            p += 2;
+            size_t len = token & 15;
+            if (len == 15) len += getLength(p);
+            len += kMinMatch;
+            // Source position in dictionary + output; may overlap the output
+            size_t from = dictSize + out.size() - offset;
+            if (from + len <= dictSize) {
+                out.append(dict_, from, len);
+            } else if (from >= dictSize && offset >= len) {
+                out.append(out.data() + (from - dictSize), len);  // capacity reserved, no reallocation
+            } else {
+                for (size_t k = 0; k < len; ++k, ++from) {
+                    out.push_back(from < dictSize ? dict_[from] : out[from - dictSize]);
+                }
+            }
+        }
+    }
+
+    std::string_view TextCache::get(const TextStore& store, size_t id) {
+        size_t block = store.blockOf(id);
+        size_t hit = 0;
+        while (hit < kSlots && slots_[hit].block != (long long)block) hit++;
+        if (hit == kSlots) {
+            hit = kSlots - 1;
+            store.decodeBlock(block, slots_[hit].text);
+            slots_[hit].block = (long long)block;
+        }
+        std::rotate(slots_, slots_ + hit, slots_ + hit + 1);
+        size_t begin = store.start_[id];
+        size_t end = id + 1 < store.start_.size() && store.blockOf(id + 1) == block ? store.start_[id + 1] : store.blockSize_[block];
+        return std::string_view(slots_[0].text).substr(begin, end - begin);
+    }
+
+    size_t TextCache::bytes() const {
+        size_t n = 0;
+        for (const Slot& s : slots_) n += s.text.capacity();
+        return n;
+    }
+
+} // namespace CRTZ